@@ -30,6 +30,7 @@
 #include "gdbstub/enums.h"
 #include "system/kvm_int.h"
 #include "system/runstate.h"
+#include "system/system.h"
 #include "system/cpus.h"
 #include "system/accel-blocker.h"
 #include "qemu/bswap.h"
@@ -52,6 +53,7 @@
 
 #include "hw/boards.h"
 #include "system/stats.h"
+#include "block/thread-pool.h"
 
 /* This check must be after config-host.h is included */
 #ifdef CONFIG_EVENTFD
@@ -781,9 +783,13 @@ static bool kvm_slot_get_dirty_log(KVMState *s, KVMSlot *slot)
     return ret == 0;
 }
 
-/* Should be with all slots_lock held for the address spaces. */
+/*
+ * Should be with all slots_lock held for the address spaces.  @shared is
+ * true if other threads are harvesting rings at the same time.
+ */
 static void kvm_dirty_ring_mark_page(KVMState *s, uint32_t as_id,
-                                     uint32_t slot_id, uint64_t offset)
+                                     uint32_t slot_id, uint64_t offset,
+                                     bool shared)
 {
     KVMMemoryListener *kml;
     KVMSlot *mem;
@@ -800,7 +806,11 @@ static void kvm_dirty_ring_mark_page(KVMState *s, uint32_t as_id,
         return;
     }
 
-    set_bit(offset, mem->dirty_bmap);
+    if (shared) {
+        set_bit_atomic(offset, mem->dirty_bmap);
+    } else {
+        set_bit(offset, mem->dirty_bmap);
+    }
 }
 
 static bool dirty_gfn_is_dirtied(struct kvm_dirty_gfn *gfn)
@@ -837,7 +847,8 @@ static void dirty_gfn_set_collected(struct kvm_dirty_gfn *gfn)
  * Should be with all slots_lock held for the address spaces.  It returns the
  * dirty page we've collected on this dirty ring.
  */
-static uint32_t kvm_dirty_ring_reap_one(KVMState *s, CPUState *cpu)
+static uint32_t kvm_dirty_ring_reap_one(KVMState *s, CPUState *cpu,
+                                        bool shared)
 {
     struct kvm_dirty_gfn *dirty_gfns = cpu->kvm_dirty_gfns, *cur;
     uint32_t ring_size = s->kvm_dirty_ring_size;
@@ -861,7 +872,7 @@ static uint32_t kvm_dirty_ring_reap_one(KVMState *s, CPUState *cpu)
             break;
         }
         kvm_dirty_ring_mark_page(s, cur->slot >> 16, cur->slot & 0xffff,
-                                 cur->offset);
+                                 cur->offset, shared);
         dirty_gfn_set_collected(cur);
         trace_kvm_dirty_ring_page(cpu->cpu_index, fetch, cur->offset);
         fetch++;
@@ -873,6 +884,100 @@ static uint32_t kvm_dirty_ring_reap_one(KVMState *s, CPUState *cpu)
     return count;
 }
 
+typedef struct KVMDirtyRingHarvest {
+    KVMState *s;
+    CPUState **cpus;
+    int nr_cpus;
+    int first;
+    int stride;
+    uint64_t count;
+} KVMDirtyRingHarvest;
+
+static int kvm_dirty_ring_harvest_group(void *opaque)
+{
+    KVMDirtyRingHarvest *h = opaque;
+    int i;
+
+    for (i = h->first; i < h->nr_cpus; i += h->stride) {
+        h->count += kvm_dirty_ring_reap_one(h->s, h->cpus[i], h->stride > 1);
+    }
+    return 0;
+}
+
+/*
+ * Harvest the rings of all vcpus.  With dirty-ring-harvest-threads > 1 the
+ * vcpus are split in groups, which the calling thread and the harvest
+ * threads collect in parallel.  All groups must be done before the rings
+ * are reset, so the caller waits for the harvest threads.
+ *
+ * Must be with slots_lock held.
+ */
+static uint64_t kvm_dirty_ring_reap_all(KVMState *s)
+{
+    ThreadPool *pool = s->reaper.harvest_pool;
+    g_autofree CPUState **cpus = NULL;
+    g_autofree KVMDirtyRingHarvest *groups = NULL;
+    int nr_cpus = 0, nr_groups, i;
+    uint64_t total = 0;
+    CPUState *cpu;
+
+    if (!pool) {
+        CPU_FOREACH(cpu) {
+            total += kvm_dirty_ring_reap_one(s, cpu, false);
+        }
+        return total;
+    }
+
+    CPU_FOREACH(cpu) {
+        nr_cpus++;
+    }
+    if (!nr_cpus) {
+        return 0;
+    }
+
+    cpus = g_new(CPUState *, nr_cpus);
+    i = 0;
+    CPU_FOREACH(cpu) {
+        cpus[i++] = cpu;
+    }
+
+    nr_groups = MIN(nr_cpus, s->kvm_dirty_ring_harvest_threads);
+    groups = g_new(KVMDirtyRingHarvest, nr_groups);
+    for (i = 0; i < nr_groups; i++) {
+        groups[i] = (KVMDirtyRingHarvest) {
+            .s = s,
+            .cpus = cpus,
+            .nr_cpus = nr_cpus,
+            .first = i,
+            .stride = nr_groups,
+        };
+    }
+
+    for (i = 1; i < nr_groups; i++) {
+        thread_pool_submit(pool, kvm_dirty_ring_harvest_group, &groups[i],
+                           NULL);
+    }
+    kvm_dirty_ring_harvest_group(&groups[0]);
+    thread_pool_wait(pool);
+
+    for (i = 0; i < nr_groups; i++) {
+        total += groups[i].count;
+    }
+    return total;
+}
+
+static void kvm_dirty_ring_account(KVMState *s, uint64_t pages, uint64_t ns)
+{
+    struct KVMDirtyRingStats *stats = &s->dirty_ring_stats;
+    int bucket = ns ? MIN(64 - clz64(ns), KVM_DIRTY_RING_HIST_BUCKETS - 1) : 0;
+
+    stats->reaps++;
+    stats->pages += pages;
+    stats->time_ns += ns;
+    stats->time_max_ns = MAX(stats->time_max_ns, ns);
+    stats->latency_hist[bucket]++;
+}
+
 /* Must be with slots_lock held */
 static uint64_t kvm_dirty_ring_reap_locked(KVMState *s, CPUState* cpu)
 {
@@ -883,11 +988,9 @@ static uint64_t kvm_dirty_ring_reap_locked(KVMState *s, CPUState* cpu)
     stamp = get_clock();
 
     if (cpu) {
-        total = kvm_dirty_ring_reap_one(s, cpu);
+        total = kvm_dirty_ring_reap_one(s, cpu, false);
     } else {
-        CPU_FOREACH(cpu) {
-            total += kvm_dirty_ring_reap_one(s, cpu);
-        }
+        total = kvm_dirty_ring_reap_all(s);
     }
 
     if (total) {
@@ -898,6 +1001,7 @@ static uint64_t kvm_dirty_ring_reap_locked(KVMState *s, CPUState* cpu)
     stamp = get_clock() - stamp;
 
     if (total) {
+        kvm_dirty_ring_account(s, total, stamp);
         trace_kvm_dirty_ring_reap(total, stamp / 1000);
     }
 
@@ -1618,10 +1722,35 @@ static void *kvm_dirty_ring_reaper_thread(void *data)
     g_assert_not_reached();
 }
 
+/*
+ * Free the harvest threads on exit.  The pool is only used with slots_lock
+ * taken, and harvests fall back to the calling thread once it is gone.
+ */
+static void kvm_dirty_ring_reaper_exit(Notifier *n, void *data)
+{
+    struct KVMDirtyRingReaper *r = container_of(n, struct KVMDirtyRingReaper,
+                                                exit_notifier);
+    ThreadPool *pool;
+
+    kvm_slots_lock();
+    pool = g_steal_pointer(&r->harvest_pool);
+    kvm_slots_unlock();
+
+    thread_pool_free(pool);
+}
+
 static void kvm_dirty_ring_reaper_init(KVMState *s)
 {
     struct KVMDirtyRingReaper *r = &s->reaper;
 
+    if (s->kvm_dirty_ring_harvest_threads > 1) {
+        r->harvest_pool = thread_pool_new();
+        thread_pool_set_max_threads(r->harvest_pool,
+                                    s->kvm_dirty_ring_harvest_threads - 1);
+        r->exit_notifier.notify = kvm_dirty_ring_reaper_exit;
+        qemu_add_exit_notifier(&r->exit_notifier);
+    }
+
     qemu_thread_create(&r->reaper_thr, "kvm-reaper",
                        kvm_dirty_ring_reaper_thread,
                        s, QEMU_THREAD_JOINABLE);
@@ -3239,6 +3368,7 @@ int kvm_cpu_exec(CPUState *cpu)
              */
             trace_kvm_dirty_ring_full(cpu->cpu_index);
             bql_lock();
+            cpu->dirty_ring_full_exits++;
             /*
              * We throttle vCPU by making it sleep once it exit from kernel
              * due to dirty ring full. In the dirtylimit scenario, reaping
@@ -3909,6 +4039,40 @@ static void kvm_set_dirty_ring_size(Object *obj, Visitor *v,
     s->kvm_dirty_ring_size = value;
 }
 
+static void kvm_get_dirty_ring_harvest_threads(Object *obj, Visitor *v,
+                                               const char *name,
+                                               void *opaque, Error **errp)
+{
+    KVMState *s = KVM_STATE(obj);
+    uint32_t value = s->kvm_dirty_ring_harvest_threads;
+
+    visit_type_uint32(v, name, &value, errp);
+}
+
+static void kvm_set_dirty_ring_harvest_threads(Object *obj, Visitor *v,
+                                               const char *name,
+                                               void *opaque, Error **errp)
+{
+    KVMState *s = KVM_STATE(obj);
+    uint32_t value;
+
+    if (s->fd != -1) {
+        error_setg(errp, "Cannot set properties after the accelerator has been initialized");
+        return;
+    }
+
+    if (!visit_type_uint32(v, name, &value, errp)) {
+        return;
+    }
+    if (value < 1 || value > KVM_DIRTY_RING_HARVEST_THREADS_MAX) {
+        error_setg(errp, "dirty-ring-harvest-threads must be between 1 "
+                   "and %d", KVM_DIRTY_RING_HARVEST_THREADS_MAX);
+        return;
+    }
+
+    s->kvm_dirty_ring_harvest_threads = value;
+}
+
 static char *kvm_get_device(Object *obj,
                             Error **errp G_GNUC_UNUSED)
 {
@@ -3954,6 +4118,7 @@ static void kvm_accel_instance_init(Object *obj)
     /* KVM dirty ring is by default off */
     s->kvm_dirty_ring_size = 0;
     s->kvm_dirty_ring_with_bitmap = false;
+    s->kvm_dirty_ring_harvest_threads = 1;
     s->kvm_eager_split_size = 0;
     s->notify_vmexit = NOTIFY_VMEXIT_OPTION_RUN;
     s->notify_window = 0;
@@ -4002,6 +4167,13 @@ static void kvm_accel_class_init(ObjectClass *oc, const void *data)
     object_class_property_set_description(oc, "dirty-ring-size",
         "Size of KVM dirty page ring buffer (default: 0, i.e. use bitmap)");
 
+    object_class_property_add(oc, "dirty-ring-harvest-threads", "uint32",
+        kvm_get_dirty_ring_harvest_threads,
+        kvm_set_dirty_ring_harvest_threads,
+        NULL, NULL);
+    object_class_property_set_description(oc, "dirty-ring-harvest-threads",
+        "Number of threads harvesting the KVM dirty rings (default: 1)");
+
     object_class_property_add_str(oc, "device", kvm_get_device, kvm_set_device);
     object_class_property_set_description(oc, "device",
         "Path to the device node to use (default: /dev/kvm)");
@@ -4251,6 +4423,130 @@ static StatsDescriptors *find_stats_descriptors(StatsTarget target, int stats_fd
     return descriptors;
 }
 
+static StatsList *add_qemu_stat(StatsList *stats_list, strList *names,
+                                const char *name, uint64_t value)
+{
+    Stats *stats;
+
+    if (!apply_str_list_filter(name, names)) {
+        return stats_list;
+    }
+
+    stats = g_new0(Stats, 1);
+    stats->name = g_strdup(name);
+    stats->value = g_new0(StatsValue, 1);
+    stats->value->u.scalar = value;
+    stats->value->type = QTYPE_QNUM;
+
+    QAPI_LIST_PREPEND(stats_list, stats);
+    return stats_list;
+}
+
+/* Stats of the dirty ring harvest, which are kept by QEMU itself */
+static StatsList *add_dirty_ring_stats(StatsList *stats_list,
+                                       StatsTarget target, strList *names,
+                                       CPUState *cpu)
+{
+    struct KVMDirtyRingStats snapshot;
+    struct KVMDirtyRingStats *ring = &snapshot;
+    const char *hist_name = "dirty_ring_harvest_hist";
+    uint64_t full_exits = 0;
+    CPUState *c;
+    int i;
+
+    if (!kvm_state->kvm_dirty_ring_size) {
+        return stats_list;
+    }
+
+    if (target == STATS_TARGET_VCPU) {
+        return add_qemu_stat(stats_list, names, "dirty_ring_full_exits",
+                             cpu->dirty_ring_full_exits);
+    }
+
+    CPU_FOREACH(c) {
+        full_exits += c->dirty_ring_full_exits;
+    }
+
+    /* Harvests outside the BQL update the stats with slots_lock taken */
+    kvm_slots_lock();
+    snapshot = kvm_state->dirty_ring_stats;
+    kvm_slots_unlock();
+
+    stats_list = add_qemu_stat(stats_list, names, "dirty_ring_full_exits",
+                               full_exits);
+    stats_list = add_qemu_stat(stats_list, names, "dirty_ring_harvests",
+                               ring->reaps);
+    stats_list = add_qemu_stat(stats_list, names, "dirty_ring_harvest_pages",
+                               ring->pages);
+    stats_list = add_qemu_stat(stats_list, names, "dirty_ring_harvest_time_ns",
+                               ring->time_ns);
+    stats_list = add_qemu_stat(stats_list, names,
+                               "dirty_ring_harvest_time_max_ns",
+                               ring->time_max_ns);
+
+    if (apply_str_list_filter(hist_name, names)) {
+        Stats *stats = g_new0(Stats, 1);
+        uint64List *val_list = NULL;
+
+        for (i = KVM_DIRTY_RING_HIST_BUCKETS; i-- > 0; ) {
+            QAPI_LIST_PREPEND(val_list, ring->latency_hist[i]);
+        }
+        stats->name = g_strdup(hist_name);
+        stats->value = g_new0(StatsValue, 1);
+        stats->value->u.list = val_list;
+        stats->value->type = QTYPE_QLIST;
+        QAPI_LIST_PREPEND(stats_list, stats);
+    }
+
+    return stats_list;
+}
+
+static StatsSchemaValueList *add_qemu_schema_entry(StatsSchemaValueList *list,
+                                                   const char *name,
+                                                   StatsType type, bool ns)
+{
+    StatsSchemaValue *value = g_new0(StatsSchemaValue, 1);
+
+    value->name = g_strdup(name);
+    value->type = type;
+    if (ns) {
+        value->has_unit = true;
+        value->unit = STATS_UNIT_SECONDS;
+        value->has_base = true;
+        value->base = 10;
+        value->exponent = -9;
+    }
+
+    QAPI_LIST_PREPEND(list, value);
+    return list;
+}
+
+static StatsSchemaValueList *add_dirty_ring_schema(StatsSchemaValueList *list,
+                                                   StatsTarget target)
+{
+    if (!kvm_state->kvm_dirty_ring_size) {
+        return list;
+    }
+
+    list = add_qemu_schema_entry(list, "dirty_ring_full_exits",
+                                 STATS_TYPE_CUMULATIVE, false);
+    if (target == STATS_TARGET_VCPU) {
+        return list;
+    }
+
+    list = add_qemu_schema_entry(list, "dirty_ring_harvests",
+                                 STATS_TYPE_CUMULATIVE, false);
+    list = add_qemu_schema_entry(list, "dirty_ring_harvest_pages",
+                                 STATS_TYPE_CUMULATIVE, false);
+    list = add_qemu_schema_entry(list, "dirty_ring_harvest_time_ns",
+                                 STATS_TYPE_CUMULATIVE, true);
+    list = add_qemu_schema_entry(list, "dirty_ring_harvest_time_max_ns",
+                                 STATS_TYPE_PEAK, true);
+    list = add_qemu_schema_entry(list, "dirty_ring_harvest_hist",
+                                 STATS_TYPE_LOG2_HISTOGRAM, true);
+    return list;
+}
+
 static void query_stats(StatsResultList **result, StatsTarget target,
                         strList *names, int stats_fd, CPUState *cpu,
                         Error **errp)
@@ -4301,6 +4597,8 @@ static void query_stats(StatsResultList **result, StatsTarget target,
         stats_list = add_kvmstat_entry(pdesc, stats, stats_list, errp);
     }
 
+    stats_list = add_dirty_ring_stats(stats_list, target, names, cpu);
+
     if (!stats_list) {
         return;
     }
@@ -4345,6 +4643,8 @@ static void query_stats_schema(StatsSchemaList **result, StatsTarget target,
         stats_list = add_kvmschema_entry(pdesc, stats_list, errp);
     }
 
+    stats_list = add_dirty_ring_schema(stats_list, target);
+
     add_stats_schema(result, STATS_PROVIDER_KVM, target, stats_list);
 }
 
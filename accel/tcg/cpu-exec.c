@@ -163,7 +163,7 @@ static bool tb_lookup_cmp(const void *p, const void *d)
         tb_page_addr0(tb) == desc->page_addr0 &&
         tb->cs_base == desc->s.cs_base &&
         tb->flags == desc->s.flags &&
-        tb_cflags(tb) == desc->s.cflags) {
+        (tb_cflags(tb) & ~CF_TRACE) == desc->s.cflags) {
         /* check next page if needed */
         tb_page_addr_t tb_phys_page1 = tb_page_addr1(tb);
         if (tb_phys_page1 == -1) {
@@ -172,17 +172,29 @@ static bool tb_lookup_cmp(const void *p, const void *d)
             tb_page_addr_t phys_page1;
             vaddr virt_page1;
 
-            /*
-             * We know that the first page matched, and an otherwise valid TB
-             * encountered an incomplete instruction at the end of that page,
-             * therefore we know that generating a new TB from the current PC
-             * must also require reading from the next page -- even if the
-             * second pages do not match, and therefore the resulting insn
-             * is different for the new TB.  Therefore any exception raised
-             * here by the faulting lookup is not premature.
-             */
-            virt_page1 = TARGET_PAGE_ALIGN(desc->s.pc);
-            phys_page1 = get_page_addr_code(desc->env, virt_page1);
+            virt_page1 = (desc->s.pc & TARGET_PAGE_MASK) + TARGET_PAGE_SIZE;
+            if (((desc->s.pc ^ (desc->s.pc + tb->size - 1)) &
+                 TARGET_PAGE_MASK) == 0) {
+                /*
+                 * The code of the TB ends on the first page, and the next
+                 * page only holds the destination of a direct jump.  The
+                 * new TB need not touch it, so do not raise exceptions.
+                 */
+                phys_page1 = get_page_addr_code_nofault(desc->env,
+                                                        virt_page1);
+            } else {
+                /*
+                 * We know that the first page matched, and an otherwise
+                 * valid TB encountered an incomplete instruction at the
+                 * end of that page, therefore we know that generating a
+                 * new TB from the current PC must also require reading
+                 * from the next page -- even if the second pages do not
+                 * match, and therefore the resulting insn is different
+                 * for the new TB.  Therefore any exception raised here
+                 * by the faulting lookup is not premature.
+                 */
+                phys_page1 = get_page_addr_code(desc->env, virt_page1);
+            }
             if (tb_phys_page1 == phys_page1) {
                 return true;
             }
@@ -240,7 +252,7 @@ static inline TranslationBlock *tb_lookup(CPUState *cpu, TCGTBCPUState s)
                jc->array[hash].pc == s.pc &&
                tb->cs_base == s.cs_base &&
                tb->flags == s.flags &&
-               tb_cflags(tb) == s.cflags)) {
+               (tb_cflags(tb) & ~CF_TRACE) == s.cflags)) {
         goto hit;
     }
 
@@ -261,6 +273,62 @@ hit:
     return tb;
 }
 
+/*
+ * Return true if the executions of @tb are being counted, so that it is
+ * retranslated as a superblock once it has run tb_superblock_threshold
+ * times.  Only TBs that were translated with the default limits are
+ * candidates: icount, single-stepping and breakpoints need TBs to end
+ * where they are told to.
+ */
+static inline bool tb_superblock_pending(CPUState *cpu,
+                                         const TranslationBlock *tb)
+{
+    unsigned threshold = qatomic_read(&tb_superblock_threshold);
+
+    return unlikely(threshold) &&
+           cpu->cc->tcg_ops->superblocks &&
+           !(tb_cflags(tb) & (CF_TRACE | CF_COUNT_MASK | CF_NO_GOTO_TB |
+                              CF_SINGLE_STEP | CF_MEMI_ONLY | CF_USE_ICOUNT |
+                              CF_INVALID | CF_NOIRQ | CF_BP_PAGE)) &&
+           tb_page_addr0(tb) != -1 &&
+           qatomic_read(&tb->exec_count) < threshold;
+}
+
+/* Count an execution of @tb, return true if it just became hot */
+static inline bool tb_superblock_hot(CPUState *cpu, TranslationBlock *tb)
+{
+    return tb_superblock_pending(cpu, tb) &&
+           qatomic_fetch_inc(&tb->exec_count) + 1 ==
+           qatomic_read(&tb_superblock_threshold);
+}
+
+/*
+ * Replace the hot TB @tb with a superblock starting at the same PC.  The
+ * superblock matches the same lookups as @tb, so the latter has to go
+ * away first; the new TB replaces it in the jump cache of this CPU, and
+ * other CPUs find it in the hash table.
+ */
+static TranslationBlock *tb_form_superblock(CPUState *cpu,
+                                            TranslationBlock *tb,
+                                            TCGTBCPUState s)
+{
+    CPUJumpCache *jc = cpu->tb_jmp_cache;
+    uint32_t h;
+
+    mmap_lock();
+    tb_phys_invalidate(tb, -1);
+    s.cflags |= CF_TRACE;
+    tb = tb_gen_code(cpu, s);
+    mmap_unlock();
+
+    h = tb_jmp_cache_hash_func(s.pc);
+    jc->array[h].pc = s.pc;
+    qatomic_set(&jc->array[h].tb, tb);
+    qatomic_set(&jc->stats.superblocks, jc->stats.superblocks + 1);
+
+    return tb;
+}
+
 static void log_cpu_exec(vaddr pc, CPUState *cpu,
                          const TranslationBlock *tb)
 {
@@ -373,6 +441,7 @@ static inline bool check_for_breakpoints(CPUState *cpu, vaddr pc,
 const void *HELPER(lookup_tb_ptr)(CPUArchState *env)
 {
     CPUState *cpu = env_cpu(env);
+    CPUJumpCache *jc;
     TranslationBlock *tb;
 
     /*
@@ -391,11 +460,19 @@ const void *HELPER(lookup_tb_ptr)(CPUArchState *env)
         cpu_loop_exit(cpu);
     }
 
+    jc = cpu->tb_jmp_cache;
+    qatomic_set(&jc->stats.ptr_lookups, jc->stats.ptr_lookups + 1);
+
     tb = tb_lookup(cpu, s);
     if (tb == NULL) {
         return tcg_code_gen_epilogue;
     }
 
+    /* Let cpu_exec_loop count the execution */
+    if (tb_superblock_pending(cpu, tb)) {
+        return tcg_code_gen_epilogue;
+    }
+
     if (qemu_loglevel_mask(CPU_LOG_TB_CPU | CPU_LOG_EXEC)) {
         log_cpu_exec(s.pc, cpu, tb);
     }
@@ -612,7 +689,8 @@ void tb_set_jmp_target(TranslationBlock *tb, int n, uintptr_t addr)
     tb_target_set_jmp_target(c_tb, n, jmp_rx, jmp_rw);
 }
 
-static inline void tb_add_jump(TranslationBlock *tb, int n,
+/* Returns true if the jump was patched.  */
+static inline bool tb_add_jump(TranslationBlock *tb, int n,
                                TranslationBlock *tb_next)
 {
     uintptr_t old;
@@ -643,10 +721,63 @@ static inline void tb_add_jump(TranslationBlock *tb, int n,
 
     qemu_log_mask(CPU_LOG_EXEC, "Linking TBs %p index %d -> %p\n",
                   tb->tc.ptr, n, tb_next->tc.ptr);
-    return;
+    return true;
 
  out_unlock_next:
     qemu_spin_unlock(&tb_next->jmp_lock);
+    return false;
+}
+
+/*
+ * Return true if @tb can be the destination of a direct jump from
+ * @last_tb.
+ *
+ * We don't take care of direct jumps when address mapping changes in
+ * system emulation.  So it's not safe to make a direct jump to a TB
+ * spanning two pages because the mapping for the second page can
+ * change; tb_lookup() checks it, but a direct jump skips the lookup.
+ *
+ * With cross-page chaining, we make an exception for jumps between TBs
+ * on the same two pages: a TB spanning two pages is only ever entered
+ * after a lookup that checks both pages, or from another such TB, so
+ * the mapping of both pages was checked when the chain was entered.
+ */
+static inline bool tb_can_chain(TranslationBlock *last_tb,
+                                TranslationBlock *tb)
+{
+#ifndef CONFIG_USER_ONLY
+    tb_page_addr_t page0 = tb_page_addr0(tb) & TARGET_PAGE_MASK;
+    tb_page_addr_t page1 = tb_page_addr1(tb);
+
+    if (page1 != -1) {
+        return qatomic_read(&tb_chain_cross_page) &&
+               tb_page_addr1(last_tb) == page1 &&
+               (tb_page_addr0(last_tb) & TARGET_PAGE_MASK) == page0;
+    }
+#endif
+    return true;
+}
+
+static void tb_chain(CPUState *cpu, TranslationBlock *last_tb, int tb_exit,
+                     TranslationBlock *tb)
+{
+    CPUJumpCache *jc = cpu->tb_jmp_cache;
+
+    /* Chaining would hide the executions of @tb from tb_superblock_hot() */
+    if (tb_superblock_pending(cpu, tb)) {
+        return;
+    }
+
+    if (!tb_can_chain(last_tb, tb) || !tb_add_jump(last_tb, tb_exit, tb)) {
+        return;
+    }
+
+    qatomic_set(&jc->stats.chained, jc->stats.chained + 1);
+    if (((tb_page_addr0(last_tb) ^ tb_page_addr0(tb)) & TARGET_PAGE_MASK)
+        != 0) {
+        qatomic_set(&jc->stats.chained_cross_page,
+                    jc->stats.chained_cross_page + 1);
+    }
 }
 
 static inline bool cpu_handle_halt(CPUState *cpu)
@@ -961,22 +1092,13 @@ cpu_exec_loop(CPUState *cpu, SyncClocks *sc)
                 jc = cpu->tb_jmp_cache;
                 jc->array[h].pc = s.pc;
                 qatomic_set(&jc->array[h].tb, tb);
+            } else if (tb_superblock_hot(cpu, tb)) {
+                tb = tb_form_superblock(cpu, tb, s);
             }
 
-#ifndef CONFIG_USER_ONLY
-            /*
-             * We don't take care of direct jumps when address mapping
-             * changes in system emulation.  So it's not safe to make a
-             * direct jump to a TB spanning two pages because the mapping
-             * for the second page can change.
-             */
-            if (tb_page_addr1(tb) != -1) {
-                last_tb = NULL;
-            }
-#endif
             /* See if we can patch the calling TB. */
             if (last_tb) {
-                tb_add_jump(last_tb, tb_exit, tb);
+                tb_chain(cpu, last_tb, tb_exit, tb);
             }
 
             cpu_loop_exec_tb(cpu, tb, s.pc, &last_tb, &tb_exit);
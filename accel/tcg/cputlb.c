@@ -320,6 +320,33 @@ static inline void tlb_n_used_entries_dec(CPUState *cpu, uintptr_t mmu_idx)
     cpu->neg.tlb.d[mmu_idx].n_used_entries--;
 }
 
+/*
+ * With -accel tcg,dirty-log-size=N, the first write to a clean page while
+ * migration or dirty rate tracking is active does not update the dirty
+ * memory bitmaps.  The page is appended to a per-vCPU log instead, and
+ * the log is published in bulk when the dirty log is synced (see
+ * tcg_log_sync_global).  This saves the atomic bitmap updates and the
+ * re-read of all dirty bitmaps on each first write to a page.
+ */
+#define TLB_DIRTY_LOG_SEEN 64
+
+typedef struct TLBDirtyLog {
+    /* Taken by the vCPU when logging a page, and when syncing the log */
+    QemuSpin lock;
+    uint32_t len;
+    /* Pages that became dirty for migration, for the dirty rate */
+    uint32_t dirty_pages;
+    /* Direct-mapped cache of the pages in the log, to skip duplicates */
+    ram_addr_t seen[TLB_DIRTY_LOG_SEEN];
+    ram_addr_t pages[];
+} TLBDirtyLog;
+
+static void tlb_dirty_log_reset_locked(TLBDirtyLog *log)
+{
+    log->len = 0;
+    memset(log->seen, -1, sizeof(log->seen));
+}
+
 void tlb_init(CPUState *cpu)
 {
     int64_t now = get_clock_realtime();
@@ -333,12 +360,27 @@ void tlb_init(CPUState *cpu)
     for (i = 0; i < NB_MMU_MODES; i++) {
         tlb_mmu_init(&cpu->neg.tlb.d[i], &cpu->neg.tlb.f[i], now);
     }
+
+    if (tlb_dirty_log_size) {
+        TLBDirtyLog *log = g_malloc0(sizeof(TLBDirtyLog) +
+                                     tlb_dirty_log_size * sizeof(ram_addr_t));
+
+        qemu_spin_init(&log->lock);
+        tlb_dirty_log_reset_locked(log);
+        cpu->neg.tlb.c.dirty_log = log;
+    }
 }
 
 void tlb_destroy(CPUState *cpu)
 {
     int i;
 
+    if (cpu->neg.tlb.c.dirty_log) {
+        tlb_dirty_log_flush(cpu);
+        qemu_spin_destroy(&cpu->neg.tlb.c.dirty_log->lock);
+        g_clear_pointer(&cpu->neg.tlb.c.dirty_log, g_free);
+    }
+
     qemu_spin_destroy(&cpu->neg.tlb.c.lock);
     for (i = 0; i < NB_MMU_MODES; i++) {
         CPUTLBDesc *desc = &cpu->neg.tlb.d[i];
@@ -1334,6 +1376,91 @@ static bool victim_tlb_hit(CPUState *cpu, size_t mmu_idx, size_t index,
     return false;
 }
 
+/*
+ * Mark the page at @ram_addr dirty for migration, and count it if it was
+ * clean.  Counting pages as they are set in the bitmap, rather than the
+ * entries of the log, skips the pages that were logged twice and includes
+ * those that did not fit in the log.
+ */
+static void tlb_dirty_log_count(TLBDirtyLog *log, ram_addr_t ram_addr)
+{
+    if (!cpu_physical_memory_test_and_set_dirty_flag(ram_addr,
+                                                     DIRTY_MEMORY_MIGRATION)) {
+        qatomic_inc(&log->dirty_pages);
+    }
+}
+
+/*
+ * Publish the pages in the dirty log of @cpu to the dirty memory bitmaps.
+ * Called with the BQL held, so that the count of dirty pages for the dirty
+ * rate calculation can be updated.
+ */
+void tlb_dirty_log_flush(CPUState *cpu)
+{
+    TLBDirtyLog *log = cpu->neg.tlb.c.dirty_log;
+    uint32_t i, dirty_pages;
+
+    if (!log ||
+        (!qatomic_read(&log->len) && !qatomic_read(&log->dirty_pages))) {
+        return;
+    }
+
+    qemu_spin_lock(&log->lock);
+    for (i = 0; i < log->len; i++) {
+        ram_addr_t ram_addr = log->pages[i] << TARGET_PAGE_BITS;
+
+        tlb_dirty_log_count(log, ram_addr);
+        cpu_physical_memory_set_dirty_flag(ram_addr, DIRTY_MEMORY_VGA);
+    }
+    dirty_pages = qatomic_xchg(&log->dirty_pages, 0);
+    if (global_dirty_tracking & GLOBAL_DIRTY_DIRTY_RATE) {
+        total_dirty_pages += dirty_pages;
+    }
+    trace_tlb_dirty_log_flush(cpu->cpu_index, log->len);
+    tlb_dirty_log_reset_locked(log);
+    qemu_spin_unlock(&log->lock);
+}
+
+/*
+ * Record the first write to a clean page in the dirty log.  Returns false
+ * if the write must go through the dirty memory bitmaps: dirty memory
+ * tracking is not active, or the log is full.
+ */
+static bool tlb_dirty_log_record(CPUState *cpu, vaddr mem_vaddr,
+                                 ram_addr_t ram_addr)
+{
+    TLBDirtyLog *log = cpu->neg.tlb.c.dirty_log;
+    ram_addr_t page = ram_addr >> TARGET_PAGE_BITS;
+    ram_addr_t *seen;
+    bool ret = true;
+
+    if (!log || !qatomic_read(&global_dirty_tracking)) {
+        return false;
+    }
+
+    qemu_spin_lock(&log->lock);
+    seen = &log->seen[page % TLB_DIRTY_LOG_SEEN];
+    if (*seen != page) {
+        if (log->len == tlb_dirty_log_size) {
+            ret = false;
+            goto out;
+        }
+        log->pages[qatomic_read(&log->len)] = page;
+        qatomic_set(&log->len, log->len + 1);
+        *seen = page;
+    }
+
+    /*
+     * The page stays writable until the log is synced, which re-arms
+     * TLB_NOTDIRTY through tlb_reset_dirty().  Clearing the flag under
+     * the log lock orders it before the re-arm.
+     */
+    tlb_set_dirty(cpu, mem_vaddr);
+out:
+    qemu_spin_unlock(&log->lock);
+    return ret;
+}
+
 static void notdirty_write(CPUState *cpu, vaddr mem_vaddr, unsigned size,
                            CPUTLBEntryFull *full, uintptr_t retaddr)
 {
@@ -1343,6 +1470,13 @@ static void notdirty_write(CPUState *cpu, vaddr mem_vaddr, unsigned size,
 
     if (!cpu_physical_memory_get_dirty_flag(ram_addr, DIRTY_MEMORY_CODE)) {
         tb_invalidate_phys_range_fast(cpu, ram_addr, size, retaddr);
+    } else if (tlb_dirty_log_record(cpu, mem_vaddr, ram_addr)) {
+        return;
+    }
+
+    /* Count the pages that bypass the log, see tlb_dirty_log_flush() */
+    if (cpu->neg.tlb.c.dirty_log && qatomic_read(&global_dirty_tracking)) {
+        tlb_dirty_log_count(cpu->neg.tlb.c.dirty_log, ram_addr);
     }
 
     /*
@@ -1538,14 +1672,15 @@ void *tlb_vaddr_to_host(CPUArchState *env, vaddr addr,
  * NOTE: This function will trigger an exception if the page is
  * not executable.
  */
-tb_page_addr_t get_page_addr_code_hostp(CPUArchState *env, vaddr addr,
-                                        void **hostp)
+static tb_page_addr_t get_page_addr_code_internal(CPUArchState *env,
+                                                  vaddr addr, bool nonfault,
+                                                  void **hostp)
 {
     CPUTLBEntryFull *full;
     void *p;
 
     (void)probe_access_internal(env_cpu(env), addr, 1, MMU_INST_FETCH,
-                                cpu_mmu_index(env_cpu(env), true), false,
+                                cpu_mmu_index(env_cpu(env), true), nonfault,
                                 &p, &full, 0, false);
     if (p == NULL) {
         return -1;
@@ -1561,6 +1696,17 @@ tb_page_addr_t get_page_addr_code_hostp(CPUArchState *env, vaddr addr,
     return qemu_ram_addr_from_host_nofail(p);
 }
 
+tb_page_addr_t get_page_addr_code_hostp(CPUArchState *env, vaddr addr,
+                                        void **hostp)
+{
+    return get_page_addr_code_internal(env, addr, false, hostp);
+}
+
+tb_page_addr_t get_page_addr_code_nofault(CPUArchState *env, vaddr addr)
+{
+    return get_page_addr_code_internal(env, addr, true, NULL);
+}
+
 /* Load/store with atomicity primitives. */
 #include "ldst_atomicity.c.inc"
 
@@ -18,6 +18,12 @@ extern int64_t max_delay;
 extern int64_t max_advance;
 
 extern bool one_insn_per_tb;
+extern bool tb_chain_cross_page;
+extern unsigned tb_superblock_threshold;
+extern unsigned tlb_dirty_log_size;
+
+/* Largest dirty-log-size, i.e. 512 KiB of log per vCPU */
+#define TLB_DIRTY_LOG_SIZE_MAX 65536
 
 extern bool icount_align_option;
 
@@ -108,6 +114,16 @@ static inline tb_page_addr_t get_page_addr_code(CPUArchState *env,
     return get_page_addr_code_hostp(env, addr, NULL);
 }
 
+/**
+ * get_page_addr_code_nofault()
+ * @env: CPUArchState
+ * @addr: guest virtual address of guest code
+ *
+ * Like get_page_addr_code(), but returns -1 instead of raising an
+ * exception if @addr cannot be executed.
+ */
+tb_page_addr_t get_page_addr_code_nofault(CPUArchState *env, vaddr addr);
+
 /*
  * Access to the various translations structures need to be serialised
  * via locks for consistency.  In user-mode emulation access to the
@@ -19,6 +19,7 @@
 #include "tcg/tcg.h"
 #include "internal-common.h"
 #include "tb-context.h"
+#include "tb-jmp-cache.h"
 
 
 static void dump_drift_info(GString *buf)
@@ -141,6 +142,30 @@ static void tlb_flush_counts(size_t *pfull, size_t *ppart, size_t *pelide)
     *pelide = elide;
 }
 
+static void dump_tb_jump_info(GString *buf)
+{
+    size_t ptr_lookups = 0, chained = 0, chained_cross_page = 0;
+    size_t superblocks = 0;
+    CPUState *cpu;
+
+    CPU_FOREACH(cpu) {
+        CPUJumpCache *jc = cpu->tb_jmp_cache;
+
+        if (!jc) {
+            continue;
+        }
+        ptr_lookups += qatomic_read(&jc->stats.ptr_lookups);
+        chained += qatomic_read(&jc->stats.chained);
+        chained_cross_page += qatomic_read(&jc->stats.chained_cross_page);
+        superblocks += qatomic_read(&jc->stats.superblocks);
+    }
+
+    g_string_append_printf(buf, "TB goto_ptr lookups %zu\n", ptr_lookups);
+    g_string_append_printf(buf, "TB jumps chained    %zu (%zu cross-page)\n",
+                           chained, chained_cross_page);
+    g_string_append_printf(buf, "TB superblocks      %zu\n", superblocks);
+}
+
 static void tcg_dump_info(GString *buf)
 {
     g_string_append_printf(buf, "[TCG profiler not compiled]\n");
@@ -191,6 +216,7 @@ static void dump_exec_info(GString *buf)
                            qatomic_read(&tb_ctx.tb_flush_count));
     g_string_append_printf(buf, "TB invalidate count %u\n",
                            qatomic_read(&tb_ctx.tb_phys_invalidate_count));
+    dump_tb_jump_info(buf);
 
     tlb_flush_counts(&flush_full, &flush_part, &flush_elide);
     g_string_append_printf(buf, "TLB full flushes    %zu\n", flush_full);
@@ -24,6 +24,19 @@
  */
 typedef struct CPUJumpCache {
     struct rcu_head rcu;
+    /*
+     * How the TBs of this CPU were linked and retranslated, reported by
+     * "info jit".  Only written by the CPU itself.
+     */
+    struct {
+        /* lookups from helper_lookup_tb_ptr(), without leaving the TBs */
+        size_t ptr_lookups;
+        /* direct jumps patched by tb_add_jump(), and those between pages */
+        size_t chained;
+        size_t chained_cross_page;
+        /* hot TBs retranslated by tb_form_superblock() */
+        size_t superblocks;
+    } stats;
     struct {
         TranslationBlock *tb;
         vaddr pc;
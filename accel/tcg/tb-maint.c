@@ -56,7 +56,8 @@ static bool tb_cmp(const void *ap, const void *bp)
     return ((tb_cflags(a) & CF_PCREL || a->pc == b->pc) &&
             a->cs_base == b->cs_base &&
             a->flags == b->flags &&
-            (tb_cflags(a) & ~CF_INVALID) == (tb_cflags(b) & ~CF_INVALID) &&
+            (tb_cflags(a) & ~(CF_INVALID | CF_TRACE)) ==
+            (tb_cflags(b) & ~(CF_INVALID | CF_TRACE)) &&
             tb_page_addr0(a) == tb_page_addr0(b) &&
             tb_page_addr1(a) == tb_page_addr1(b));
 }
@@ -1124,6 +1125,14 @@ tb_invalidate_phys_page_range__locked(CPUState *cpu,
         tb_last = tb_start + tb->size - 1;
         if (n == 0) {
             tb_last = MIN(tb_last, tb_start | ~TARGET_PAGE_MASK);
+        } else if (((tb_start ^ tb_last) & TARGET_PAGE_MASK) == 0) {
+            /*
+             * The second page only holds the destination of a direct
+             * jump (see translator_use_goto_tb()).  Invalidating the
+             * destination TB unlinks the jump, there is no code of
+             * this TB to invalidate.
+             */
+            continue;
         } else {
             tb_start = tb_page_addr1(tb);
             tb_last = tb_start + (tb_last & ~TARGET_PAGE_MASK);
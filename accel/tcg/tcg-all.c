@@ -48,8 +48,11 @@ struct TCGState {
 
     OnOffAuto mttcg_enabled;
     bool one_insn_per_tb;
+    bool cross_page_chaining;
     int splitwx_enabled;
     unsigned long tb_size;
+    uint32_t superblock_threshold;
+    uint32_t dirty_log_size;
 };
 typedef struct TCGState TCGState;
 
@@ -79,6 +82,9 @@ static void tcg_accel_instance_init(Object *obj)
 }
 
 bool one_insn_per_tb;
+bool tb_chain_cross_page;
+unsigned tb_superblock_threshold;
+unsigned tlb_dirty_log_size;
 
 static int tcg_init_machine(MachineState *ms)
 {
@@ -193,6 +199,64 @@ static void tcg_set_tb_size(Object *obj, Visitor *v,
     s->tb_size = value;
 }
 
+static void tcg_get_superblock_threshold(Object *obj, Visitor *v,
+                                         const char *name, void *opaque,
+                                         Error **errp)
+{
+    TCGState *s = TCG_STATE(obj);
+    uint32_t value = s->superblock_threshold;
+
+    visit_type_uint32(v, name, &value, errp);
+}
+
+static void tcg_set_superblock_threshold(Object *obj, Visitor *v,
+                                         const char *name, void *opaque,
+                                         Error **errp)
+{
+    TCGState *s = TCG_STATE(obj);
+    uint32_t value;
+
+    if (!visit_type_uint32(v, name, &value, errp)) {
+        return;
+    }
+
+    s->superblock_threshold = value;
+    /* Set the global also: TBs start counting their executions */
+    qatomic_set(&tb_superblock_threshold, value);
+}
+
+static void tcg_get_dirty_log_size(Object *obj, Visitor *v,
+                                   const char *name, void *opaque,
+                                   Error **errp)
+{
+    TCGState *s = TCG_STATE(obj);
+    uint32_t value = s->dirty_log_size;
+
+    visit_type_uint32(v, name, &value, errp);
+}
+
+static void tcg_set_dirty_log_size(Object *obj, Visitor *v,
+                                   const char *name, void *opaque,
+                                   Error **errp)
+{
+    TCGState *s = TCG_STATE(obj);
+    uint32_t value;
+
+    if (!visit_type_uint32(v, name, &value, errp)) {
+        return;
+    }
+
+    if (value > TLB_DIRTY_LOG_SIZE_MAX) {
+        error_setg(errp, "dirty-log-size must be at most %d",
+                   TLB_DIRTY_LOG_SIZE_MAX);
+        return;
+    }
+
+    s->dirty_log_size = value;
+    /* The per-vCPU logs are allocated when the vCPUs are created */
+    tlb_dirty_log_size = value;
+}
+
 static bool tcg_get_splitwx(Object *obj, Error **errp)
 {
     TCGState *s = TCG_STATE(obj);
@@ -219,6 +283,20 @@ static void tcg_set_one_insn_per_tb(Object *obj, bool value, Error **errp)
     qatomic_set(&one_insn_per_tb, value);
 }
 
+static bool tcg_get_cross_page_chaining(Object *obj, Error **errp)
+{
+    TCGState *s = TCG_STATE(obj);
+    return s->cross_page_chaining;
+}
+
+static void tcg_set_cross_page_chaining(Object *obj, bool value, Error **errp)
+{
+    TCGState *s = TCG_STATE(obj);
+    s->cross_page_chaining = value;
+    /* Only affects TBs translated from now on */
+    qatomic_set(&tb_chain_cross_page, value);
+}
+
 static int tcg_gdbstub_supported_sstep_flags(void)
 {
     /*
@@ -264,6 +342,26 @@ static void tcg_accel_class_init(ObjectClass *oc, const void *data)
                                    tcg_set_one_insn_per_tb);
     object_class_property_set_description(oc, "one-insn-per-tb",
         "Only put one guest insn in each translation block");
+
+    object_class_property_add_bool(oc, "cross-page-chaining",
+                                   tcg_get_cross_page_chaining,
+                                   tcg_set_cross_page_chaining);
+    object_class_property_set_description(oc, "cross-page-chaining",
+        "Chain translation blocks with direct jumps to the next page");
+
+    object_class_property_add(oc, "superblock-threshold", "int",
+        tcg_get_superblock_threshold, tcg_set_superblock_threshold,
+        NULL, NULL);
+    object_class_property_set_description(oc, "superblock-threshold",
+        "Retranslate translation blocks executed this many times "
+        "as superblocks (0 = off)");
+
+    object_class_property_add(oc, "dirty-log-size", "uint32",
+        tcg_get_dirty_log_size, tcg_set_dirty_log_size,
+        NULL, NULL);
+    object_class_property_set_description(oc, "dirty-log-size",
+        "Number of pages each vCPU logs as dirty before updating "
+        "the dirty memory bitmap (0 = off, at most 65536)");
 }
 
 static const TypeInfo tcg_accel_type = {
@@ -108,6 +108,56 @@ bool translator_is_same_page(const DisasContextBase *db, vaddr addr)
     return ((addr ^ db->pc_first) & TARGET_PAGE_MASK) == 0;
 }
 
+/*
+ * Allow goto_tb to @dest on the page after the start of the TB.
+ *
+ * In system mode, a direct jump is only valid as long as the virtual
+ * to physical mapping of the destination does not change.  Record the
+ * destination page as the second page of the TB, so that tb_lookup()
+ * checks its mapping before entering the TB.  The TB is then only the
+ * target of direct jumps from TBs on the same two pages (see
+ * tb_can_chain()), so the mapping of both pages was checked when the
+ * chain was entered.  A change to the destination TB itself unlinks the
+ * jump when the destination is invalidated, as usual.
+ *
+ * In user mode, there is no such mapping, and changes to the
+ * protection of the destination page invalidate the destination TB.
+ */
+static bool translator_goto_next_page(DisasContextBase *db, vaddr dest)
+{
+    vaddr next = (db->pc_first & TARGET_PAGE_MASK) + TARGET_PAGE_SIZE;
+#ifndef CONFIG_USER_ONLY
+    TranslationBlock *tb = db->tb;
+    tb_page_addr_t page0 = tb_page_addr0(tb);
+    tb_page_addr_t page1;
+#endif
+
+    if (!qatomic_read(&tb_chain_cross_page) ||
+        ((dest ^ next) & TARGET_PAGE_MASK) != 0) {
+        return false;
+    }
+
+#ifndef CONFIG_USER_ONLY
+    if (page0 == -1) {
+        return false;
+    }
+    if (tb_page_addr1(tb) != -1) {
+        /* The second page is already part of the TB.  */
+        return true;
+    }
+
+    page1 = get_page_addr_code_nofault(cpu_env(tcg_ctx->cpu), next);
+    if (page1 == -1) {
+        return false;
+    }
+
+    /* This may restart the translation, see translator_ld().  */
+    tb_set_page_addr1(tb, page1);
+    tb_lock_page1(page0, page1);
+#endif
+    return true;
+}
+
 bool translator_use_goto_tb(DisasContextBase *db, vaddr dest)
 {
     /* Suppress goto_tb if requested. */
@@ -116,7 +166,33 @@ bool translator_use_goto_tb(DisasContextBase *db, vaddr dest)
     }
 
     /* Check for the dest on the same page as the start of the TB.  */
-    return translator_is_same_page(db, dest);
+    return translator_is_same_page(db, dest) ||
+           translator_goto_next_page(db, dest);
+}
+
+/* Bound the code duplicated when a superblock unrolls a loop */
+#define TRANSLATOR_MAX_TRACE_BRANCHES 8
+
+bool translator_follow_branch(DisasContextBase *db, vaddr dest)
+{
+    if (!(tb_cflags(db->tb) & CF_TRACE) || db->plugin_enabled) {
+        return false;
+    }
+
+    /* Keep the TB within [pc_first, pc_first + size) on a single page */
+    if (dest < db->pc_first || !translator_is_same_page(db, dest)) {
+        return false;
+    }
+
+    if (db->trace_branches >= TRANSLATOR_MAX_TRACE_BRANCHES ||
+        db->num_insns >= db->max_insns || tcg_op_buf_full()) {
+        return false;
+    }
+
+    db->pc_max = MAX(db->pc_max, db->pc_next);
+    db->pc_next = dest;
+    db->trace_branches++;
+    return true;
 }
 
 void translator_loop(CPUState *cpu, TranslationBlock *tb, int *max_insns,
@@ -132,9 +208,11 @@ void translator_loop(CPUState *cpu, TranslationBlock *tb, int *max_insns,
     db->tb = tb;
     db->pc_first = pc;
     db->pc_next = pc;
+    db->pc_max = pc;
     db->is_jmp = DISAS_NEXT;
     db->num_insns = 0;
     db->max_insns = *max_insns;
+    db->trace_branches = 0;
     db->insn_start = NULL;
     db->fake_insn = false;
     db->host_addr[0] = host_pc;
@@ -199,6 +277,15 @@ void translator_loop(CPUState *cpu, TranslationBlock *tb, int *max_insns,
             db->is_jmp = DISAS_TOO_MANY;
             break;
         }
+
+        /*
+         * Superblocks are not bounded to the end of the page by the
+         * target, as branches may go back; end them here instead.
+         */
+        if ((cflags & CF_TRACE) && !translator_is_same_page(db, db->pc_next)) {
+            db->is_jmp = DISAS_TOO_MANY;
+            break;
+        }
     }
 
     /* Emit code to exit the TB, as indicated by db->is_jmp.  */
@@ -221,7 +308,7 @@ void translator_loop(CPUState *cpu, TranslationBlock *tb, int *max_insns,
     tcg_ctx->emit_before_op = NULL;
 
     /* May be used by disas_log or plugin callbacks. */
-    tb->size = db->pc_next - db->pc_first;
+    tb->size = MAX(db->pc_max, db->pc_next) - db->pc_first;
     tb->icount = db->num_insns;
 
     if (plugin_enabled) {
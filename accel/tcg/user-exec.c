@@ -879,6 +879,14 @@ tb_page_addr_t get_page_addr_code_hostp(CPUArchState *env, vaddr addr,
     return addr;
 }
 
+tb_page_addr_t get_page_addr_code_nofault(CPUArchState *env, vaddr addr)
+{
+    int flags;
+
+    flags = probe_access_internal(env, addr, 1, MMU_INST_FETCH, true, 0);
+    return flags & TLB_INVALID_MASK ? -1 : addr;
+}
+
 /*
  * Allocate chunks of target data together.  For the only current user,
  * if we allocate one hunk per page, we have overhead of 40/128 or 40%.
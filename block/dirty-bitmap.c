@@ -229,6 +229,9 @@ int bdrv_dirty_bitmap_create_successor(BdrvDirtyBitmap *bitmap, Error **errp)
         return -1;
     }
 
+    bdrv_dirty_bitmap_set_compressed(child,
+                                     hbitmap_is_compressed(bitmap->bitmap));
+
     /* Successor will be on or off based on our current state. */
     child->disabled = bitmap->disabled;
     bitmap->disabled = true;
@@ -467,6 +470,11 @@ BlockDirtyInfoList *bdrv_query_dirty_bitmaps(BlockDriverState *bs)
         info->persistent = bm->persistent;
         info->has_inconsistent = bm->inconsistent;
         info->inconsistent = bm->inconsistent;
+        if (hbitmap_is_compressed(bm->bitmap)) {
+            info->has_compressed = true;
+            info->compressed = true;
+        }
+        info->memory = hbitmap_memory_usage(bm->bitmap);
         QAPI_LIST_APPEND(tail, info);
     }
     bdrv_dirty_bitmaps_unlock(bs);
@@ -582,6 +590,7 @@ void bdrv_clear_dirty_bitmap(BdrvDirtyBitmap *bitmap, HBitmap **out)
         HBitmap *backup = bitmap->bitmap;
         bitmap->bitmap = hbitmap_alloc(bitmap->size,
                                        hbitmap_granularity(backup));
+        hbitmap_set_compressed(bitmap->bitmap, hbitmap_is_compressed(backup));
         *out = backup;
     }
     bdrv_dirty_bitmaps_unlock(bitmap->bs);
@@ -732,6 +741,14 @@ void bdrv_dirty_bitmap_set_persistence(BdrvDirtyBitmap *bitmap, bool persistent)
     bdrv_dirty_bitmaps_unlock(bitmap->bs);
 }
 
+/* Called with BQL taken. */
+void bdrv_dirty_bitmap_set_compressed(BdrvDirtyBitmap *bitmap, bool compressed)
+{
+    bdrv_dirty_bitmaps_lock(bitmap->bs);
+    hbitmap_set_compressed(bitmap->bitmap, compressed);
+    bdrv_dirty_bitmaps_unlock(bitmap->bs);
+}
+
 /* Called with BQL taken. */
 void bdrv_dirty_bitmap_set_inconsistent(BdrvDirtyBitmap *bitmap)
 {
@@ -876,6 +893,7 @@ void bdrv_dirty_bitmap_merge_internal(BdrvDirtyBitmap *dest,
     if (backup) {
         *backup = dest->bitmap;
         dest->bitmap = hbitmap_alloc(dest->size, hbitmap_granularity(*backup));
+        hbitmap_set_compressed(dest->bitmap, hbitmap_is_compressed(*backup));
         hbitmap_merge(*backup, src->bitmap, dest->bitmap);
     } else {
         hbitmap_merge(dest->bitmap, src->bitmap, dest->bitmap);
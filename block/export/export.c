@@ -365,6 +365,10 @@ BlockExportInfoList *qmp_query_block_exports(Error **errp)
             .shutting_down  = !exp->user_owned,
         };
 
+        if (exp->drv->query_clients) {
+            info->clients = exp->drv->query_clients(exp);
+        }
+
         QAPI_LIST_APPEND(tail, info);
     }
 
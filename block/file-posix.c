@@ -39,6 +39,7 @@
 #include "qobject/qdict.h"
 #include "qobject/qstring.h"
 
+#include "system/memory.h" /* for ram_block_discard_disable() */
 #include "scsi/pr-manager.h"
 #include "scsi/constants.h"
 #include "scsi/utils.h"
@@ -183,6 +184,7 @@ typedef struct BDRVRawState {
     bool use_linux_aio:1;
     bool has_laio_fdsync:1;
     bool use_linux_io_uring:1;
+    bool use_io_uring_fixed:1;
     bool use_mpath:1;
     int page_cache_inconsistent; /* errno from fdatasync failure */
     bool has_fallocate;
@@ -197,8 +199,16 @@ typedef struct BDRVRawState {
     } stats;
 
     PRManager *pr_mgr;
+
+    /* Buffers registered with bdrv_register_buf(), see raw_register_buf() */
+    GArray *registered_bufs;
 } BDRVRawState;
 
+typedef struct RawRegisteredBuf {
+    void *host;
+    size_t size;
+} RawRegisteredBuf;
+
 typedef struct BDRVRawReopenState {
     int open_flags;
     bool drop_cache;
@@ -585,6 +595,12 @@ static QemuOptsList raw_runtime_opts = {
             .type = QEMU_OPT_NUMBER,
             .help = "AIO max batch size (0 = auto handled by AIO backend, default: 0)",
         },
+        {
+            .name = "io-uring-fixed",
+            .type = QEMU_OPT_BOOL,
+            .help = "register the file and guest RAM with io_uring "
+                    "(default: off)",
+        },
         {
             .name = "locking",
             .type = QEMU_OPT_STRING,
@@ -613,6 +629,51 @@ static QemuOptsList raw_runtime_opts = {
 
 static const char *const mutable_opts[] = { "x-check-cache-dropped", NULL };
 
+#ifdef CONFIG_LINUX_IO_URING
+/*
+ * With io-uring-fixed=on, the file descriptor and all registered buffers are
+ * registered with the io_uring instance of the node's AioContext.  Requests
+ * submitted from other AioContexts (multiqueue) use the regular path.
+ */
+static void raw_io_uring_fixed_attach(BlockDriverState *bs, AioContext *ctx)
+{
+    BDRVRawState *s = bs->opaque;
+    guint i;
+
+    if (!s->use_io_uring_fixed) {
+        return;
+    }
+
+    if (s->fd >= 0) {
+        luring_register_file(ctx, s->fd);
+    }
+    for (i = 0; i < s->registered_bufs->len; i++) {
+        RawRegisteredBuf *buf = &g_array_index(s->registered_bufs,
+                                               RawRegisteredBuf, i);
+        luring_register_buf(ctx, buf->host, buf->size);
+    }
+}
+
+static void raw_io_uring_fixed_detach(BlockDriverState *bs, AioContext *ctx)
+{
+    BDRVRawState *s = bs->opaque;
+    guint i;
+
+    if (!s->use_io_uring_fixed) {
+        return;
+    }
+
+    if (s->fd >= 0) {
+        luring_unregister_file(ctx, s->fd);
+    }
+    for (i = 0; i < s->registered_bufs->len; i++) {
+        RawRegisteredBuf *buf = &g_array_index(s->registered_bufs,
+                                               RawRegisteredBuf, i);
+        luring_unregister_buf(ctx, buf->host, buf->size);
+    }
+}
+#endif
+
 static int raw_open_common(BlockDriverState *bs, QDict *options,
                            int bdrv_flags, int open_flags,
                            bool device, Error **errp)
@@ -666,6 +727,13 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
 
     s->aio_max_batch = qemu_opt_get_number(opts, "aio-max-batch", 0);
 
+    s->use_io_uring_fixed = qemu_opt_get_bool(opts, "io-uring-fixed", false);
+    if (s->use_io_uring_fixed && !s->use_linux_io_uring) {
+        error_setg(errp, "io-uring-fixed requires aio=io_uring");
+        ret = -EINVAL;
+        goto fail;
+    }
+
     locking = qapi_enum_parse(&OnOffAuto_lookup,
                               qemu_opt_get(opts, "locking"),
                               ON_OFF_AUTO_AUTO, &local_err);
@@ -824,6 +892,21 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
         bs->supported_write_flags &= ~BDRV_REQ_FUA;
     }
 
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->use_io_uring_fixed) {
+        /* Fixed buffers pin guest RAM, like VFIO does */
+        ret = ram_block_discard_disable(true);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "ram_block_discard_disable() failed");
+            goto fail;
+        }
+        s->registered_bufs = g_array_new(false, false,
+                                         sizeof(RawRegisteredBuf));
+        bs->supported_write_flags |= BDRV_REQ_REGISTERED_BUF;
+        raw_io_uring_fixed_attach(bs, bdrv_get_aio_context(bs));
+    }
+#endif
+
     bs->supported_zero_flags = BDRV_REQ_MAY_UNMAP | BDRV_REQ_NO_FALLBACK;
     if (S_ISREG(st.st_mode)) {
         /* When extending regular files, we get zeros from the OS */
@@ -2708,6 +2791,16 @@ static void raw_close(BlockDriverState *bs)
 {
     BDRVRawState *s = bs->opaque;
 
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->use_io_uring_fixed) {
+        raw_io_uring_fixed_detach(bs, bdrv_get_aio_context(bs));
+        g_array_free(s->registered_bufs, true);
+        s->registered_bufs = NULL;
+        s->use_io_uring_fixed = false;
+        ram_block_discard_disable(false);
+    }
+#endif
+
     if (s->fd >= 0) {
 #if defined(CONFIG_BLKZONED)
         g_free(bs->wps);
@@ -2717,6 +2810,58 @@ static void raw_close(BlockDriverState *bs)
     }
 }
 
+static void raw_detach_aio_context(BlockDriverState *bs)
+{
+#ifdef CONFIG_LINUX_IO_URING
+    raw_io_uring_fixed_detach(bs, bdrv_get_aio_context(bs));
+#endif
+}
+
+static void raw_attach_aio_context(BlockDriverState *bs,
+                                   AioContext *new_context)
+{
+#ifdef CONFIG_LINUX_IO_URING
+    raw_io_uring_fixed_attach(bs, new_context);
+#endif
+}
+
+static bool raw_register_buf(BlockDriverState *bs, void *host, size_t size,
+                             Error **errp)
+{
+#ifdef CONFIG_LINUX_IO_URING
+    BDRVRawState *s = bs->opaque;
+    RawRegisteredBuf buf = { .host = host, .size = size };
+
+    if (s->use_io_uring_fixed) {
+        g_array_append_val(s->registered_bufs, buf);
+        luring_register_buf(bdrv_get_aio_context(bs), host, size);
+    }
+#endif
+    return true;
+}
+
+static void raw_unregister_buf(BlockDriverState *bs, void *host, size_t size)
+{
+#ifdef CONFIG_LINUX_IO_URING
+    BDRVRawState *s = bs->opaque;
+    guint i;
+
+    if (!s->use_io_uring_fixed) {
+        return;
+    }
+
+    for (i = 0; i < s->registered_bufs->len; i++) {
+        RawRegisteredBuf *buf = &g_array_index(s->registered_bufs,
+                                               RawRegisteredBuf, i);
+        if (buf->host == host && buf->size == size) {
+            luring_unregister_buf(bdrv_get_aio_context(bs), host, size);
+            g_array_remove_index_fast(s->registered_bufs, i);
+            break;
+        }
+    }
+#endif
+}
+
 /**
  * Truncates the given regular file @fd to @offset and, when growing, fills the
  * new space according to @prealloc.
@@ -3903,6 +4048,12 @@ static void raw_set_perm(BlockDriverState *bs, uint64_t perm, uint64_t shared)
     /* For reopen, we have already switched to the new fd (.bdrv_set_perm is
      * called after .bdrv_reopen_commit) */
     if (s->perm_change_fd && s->fd != s->perm_change_fd) {
+#ifdef CONFIG_LINUX_IO_URING
+        if (s->use_io_uring_fixed) {
+            luring_unregister_file(bdrv_get_aio_context(bs), s->fd);
+            luring_register_file(bdrv_get_aio_context(bs), s->perm_change_fd);
+        }
+#endif
         qemu_close(s->fd);
         s->fd = s->perm_change_fd;
         s->open_flags = s->perm_change_flags;
@@ -3985,6 +4136,10 @@ BlockDriver bdrv_file = {
     .bdrv_reopen_commit = raw_reopen_commit,
     .bdrv_reopen_abort = raw_reopen_abort,
     .bdrv_close = raw_close,
+    .bdrv_detach_aio_context = raw_detach_aio_context,
+    .bdrv_attach_aio_context = raw_attach_aio_context,
+    .bdrv_register_buf = raw_register_buf,
+    .bdrv_unregister_buf = raw_unregister_buf,
     .bdrv_co_create = raw_co_create,
     .bdrv_co_create_opts = raw_co_create_opts,
     .bdrv_has_zero_init = bdrv_has_zero_init_1,
@@ -4442,6 +4597,10 @@ static BlockDriver bdrv_host_device = {
     .bdrv_parse_filename = hdev_parse_filename,
     .bdrv_open          = hdev_open,
     .bdrv_close         = raw_close,
+    .bdrv_detach_aio_context = raw_detach_aio_context,
+    .bdrv_attach_aio_context = raw_attach_aio_context,
+    .bdrv_register_buf  = raw_register_buf,
+    .bdrv_unregister_buf = raw_unregister_buf,
     .bdrv_reopen_prepare = raw_reopen_prepare,
     .bdrv_reopen_commit  = raw_reopen_commit,
     .bdrv_reopen_abort   = raw_reopen_abort,
@@ -4581,6 +4740,10 @@ static BlockDriver bdrv_host_cdrom = {
     .bdrv_parse_filename = cdrom_parse_filename,
     .bdrv_open          = cdrom_open,
     .bdrv_close         = raw_close,
+    .bdrv_detach_aio_context = raw_detach_aio_context,
+    .bdrv_attach_aio_context = raw_attach_aio_context,
+    .bdrv_register_buf  = raw_register_buf,
+    .bdrv_unregister_buf = raw_unregister_buf,
     .bdrv_reopen_prepare = raw_reopen_prepare,
     .bdrv_reopen_commit  = raw_reopen_commit,
     .bdrv_reopen_abort   = raw_reopen_abort,
@@ -4707,6 +4870,10 @@ static BlockDriver bdrv_host_cdrom = {
     .bdrv_parse_filename = cdrom_parse_filename,
     .bdrv_open          = cdrom_open,
     .bdrv_close         = raw_close,
+    .bdrv_detach_aio_context = raw_detach_aio_context,
+    .bdrv_attach_aio_context = raw_attach_aio_context,
+    .bdrv_register_buf  = raw_register_buf,
+    .bdrv_unregister_buf = raw_unregister_buf,
     .bdrv_reopen_prepare = raw_reopen_prepare,
     .bdrv_reopen_commit  = raw_reopen_commit,
     .bdrv_reopen_abort   = raw_reopen_abort,
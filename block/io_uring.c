@@ -11,7 +11,10 @@
 #include "qemu/osdep.h"
 #include <liburing.h>
 #include "block/aio.h"
+#include "block/aio-wait.h"
+#include "qemu/bitmap.h"
 #include "qemu/queue.h"
+#include "qemu/units.h"
 #include "block/block.h"
 #include "block/raw-aio.h"
 #include "qemu/coroutine.h"
@@ -26,6 +29,20 @@
 /* io_uring ring size */
 #define MAX_ENTRIES 128
 
+/* Size of the fixed file and fixed buffer tables of each ring */
+#define MAX_FIXED_FILES 64
+#define MAX_FIXED_BUFS 1024
+
+/* The kernel limits the size of a single fixed buffer */
+#define MAX_FIXED_BUF_SIZE (1 * GiB)
+
+typedef struct LuringFixedBuf {
+    uintptr_t start;
+    size_t len;
+    unsigned refcnt;
+    int index;
+} LuringFixedBuf;
+
 typedef struct LuringAIOCB {
     Coroutine *co;
     struct io_uring_sqe sqeq;
@@ -58,6 +75,17 @@ struct LuringState {
     LuringQueue io_q;
 
     QEMUBH *completion_bh;
+
+    /*
+     * Fixed files and buffers, only changed in the AioContext home thread
+     * (see luring_run_fixed_op()).  has_fixed is false if the kernel or
+     * liburing do not support sparse registration.
+     */
+    bool has_fixed;
+    unsigned nr_fixed_files;
+    int fixed_files[MAX_FIXED_FILES];
+    GArray *fixed_bufs; /* LuringFixedBuf, sorted by start address */
+    DECLARE_BITMAP(fixed_buf_map, MAX_FIXED_BUFS);
 };
 
 /**
@@ -90,6 +118,15 @@ static void luring_resubmit_short_read(LuringState *s, LuringAIOCB *luringcb,
     luringcb->total_read += nread;
     remaining = luringcb->qiov->size - luringcb->total_read;
 
+    if (luringcb->sqeq.opcode == IORING_OP_READ_FIXED) {
+        /* Fixed buffers are contiguous, just advance into the buffer */
+        luringcb->sqeq.off += nread;
+        luringcb->sqeq.addr += nread;
+        luringcb->sqeq.len = remaining;
+        luring_resubmit(s, luringcb);
+        return;
+    }
+
     /* Shorten qiov */
     resubmit_qiov = &luringcb->resubmit_qiov;
     if (resubmit_qiov->iov == NULL) {
@@ -323,6 +360,68 @@ static void luring_deferred_fn(void *opaque)
     }
 }
 
+/* Returns the fixed file index of @fd, or -1 if it isn't registered */
+static int luring_fixed_file_lookup(LuringState *s, int fd)
+{
+    unsigned i;
+
+    for (i = 0; i < s->nr_fixed_files; i++) {
+        if (s->fixed_files[i] == fd) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* Returns the position of the last fixed buffer starting at or before @addr */
+static int luring_fixed_buf_find(LuringState *s, uintptr_t addr)
+{
+    int lo = 0;
+    int hi = (int)s->fixed_bufs->len - 1;
+    int found = -1;
+
+    while (lo <= hi) {
+        int mid = lo + (hi - lo) / 2;
+
+        if (g_array_index(s->fixed_bufs, LuringFixedBuf, mid).start <= addr) {
+            found = mid;
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return found;
+}
+
+/*
+ * Returns the fixed buffer index that covers the whole of @qiov, or -1 if the
+ * request must be submitted with a regular iovec.
+ */
+static int luring_fixed_buf_lookup(LuringState *s, QEMUIOVector *qiov,
+                                   BdrvRequestFlags flags)
+{
+    const LuringFixedBuf *buf;
+    uintptr_t addr;
+    int pos;
+
+    if (!(flags & BDRV_REQ_REGISTERED_BUF) || !s->has_fixed ||
+        qiov->niov != 1) {
+        return -1;
+    }
+
+    addr = (uintptr_t)qiov->iov[0].iov_base;
+    pos = luring_fixed_buf_find(s, addr);
+    if (pos < 0) {
+        return -1;
+    }
+
+    buf = &g_array_index(s->fixed_bufs, LuringFixedBuf, pos);
+    if (addr + qiov->iov[0].iov_len > buf->start + buf->len) {
+        return -1;
+    }
+    return buf->index;
+}
+
 /**
  * luring_do_submit:
  * @fd: file descriptor for I/O
@@ -338,20 +437,39 @@ static int luring_do_submit(int fd, LuringAIOCB *luringcb, LuringState *s,
                             uint64_t offset, int type, BdrvRequestFlags flags)
 {
     int ret;
+    int buf_index = -1;
+    int file_index;
     struct io_uring_sqe *sqes = &luringcb->sqeq;
+    struct iovec *iov = NULL;
+
+    if (type == QEMU_AIO_READ || type == QEMU_AIO_WRITE) {
+        buf_index = luring_fixed_buf_lookup(s, luringcb->qiov, flags);
+        iov = &luringcb->qiov->iov[0];
+    }
 
     switch (type) {
     case QEMU_AIO_WRITE:
 #ifdef HAVE_IO_URING_PREP_WRITEV2
     {
         int luring_flags = (flags & BDRV_REQ_FUA) ? RWF_DSYNC : 0;
-        io_uring_prep_writev2(sqes, fd, luringcb->qiov->iov,
-                              luringcb->qiov->niov, offset, luring_flags);
+        if (buf_index >= 0) {
+            io_uring_prep_write_fixed(sqes, fd, iov->iov_base, iov->iov_len,
+                                      offset, buf_index);
+            sqes->rw_flags = luring_flags;
+        } else {
+            io_uring_prep_writev2(sqes, fd, luringcb->qiov->iov,
+                                  luringcb->qiov->niov, offset, luring_flags);
+        }
     }
 #else
-        assert(flags == 0);
-        io_uring_prep_writev(sqes, fd, luringcb->qiov->iov,
-                             luringcb->qiov->niov, offset);
+        assert(!(flags & BDRV_REQ_FUA));
+        if (buf_index >= 0) {
+            io_uring_prep_write_fixed(sqes, fd, iov->iov_base, iov->iov_len,
+                                      offset, buf_index);
+        } else {
+            io_uring_prep_writev(sqes, fd, luringcb->qiov->iov,
+                                 luringcb->qiov->niov, offset);
+        }
 #endif
         break;
     case QEMU_AIO_ZONE_APPEND:
@@ -359,8 +477,13 @@ static int luring_do_submit(int fd, LuringAIOCB *luringcb, LuringState *s,
                              luringcb->qiov->niov, offset);
         break;
     case QEMU_AIO_READ:
-        io_uring_prep_readv(sqes, fd, luringcb->qiov->iov,
-                            luringcb->qiov->niov, offset);
+        if (buf_index >= 0) {
+            io_uring_prep_read_fixed(sqes, fd, iov->iov_base, iov->iov_len,
+                                     offset, buf_index);
+        } else {
+            io_uring_prep_readv(sqes, fd, luringcb->qiov->iov,
+                                luringcb->qiov->niov, offset);
+        }
         break;
     case QEMU_AIO_FLUSH:
         io_uring_prep_fsync(sqes, fd, IORING_FSYNC_DATASYNC);
@@ -370,6 +493,12 @@ static int luring_do_submit(int fd, LuringAIOCB *luringcb, LuringState *s,
                         __func__, type);
         abort();
     }
+
+    file_index = luring_fixed_file_lookup(s, fd);
+    if (file_index >= 0) {
+        sqes->fd = file_index;
+        io_uring_sqe_set_flags(sqes, IOSQE_FIXED_FILE);
+    }
     io_uring_sqe_set_data(sqes, luringcb);
 
     QSIMPLEQ_INSERT_TAIL(&s->io_q.submit_queue, luringcb, next);
@@ -432,6 +561,224 @@ void luring_attach_aio_context(LuringState *s, AioContext *new_context)
                        qemu_luring_poll_cb, qemu_luring_poll_ready, s);
 }
 
+static void luring_fixed_file_add(LuringState *s, int fd)
+{
+    int index;
+    int ret;
+
+    if (luring_fixed_file_lookup(s, fd) >= 0) {
+        return;
+    }
+
+    index = luring_fixed_file_lookup(s, -1);
+    if (index < 0) {
+        if (s->nr_fixed_files == MAX_FIXED_FILES) {
+            trace_luring_fixed_file_add(s, fd, -1, -ENOSPC);
+            return;
+        }
+        index = s->nr_fixed_files;
+    }
+
+    ret = io_uring_register_files_update(&s->ring, index, &fd, 1);
+    trace_luring_fixed_file_add(s, fd, index, ret);
+    if (ret < 0) {
+        return;
+    }
+
+    s->fixed_files[index] = fd;
+    if (index == s->nr_fixed_files) {
+        s->nr_fixed_files++;
+    }
+}
+
+static void luring_fixed_file_del(LuringState *s, int fd)
+{
+    int index = luring_fixed_file_lookup(s, fd);
+    int unused = -1;
+
+    if (index < 0) {
+        return;
+    }
+
+    /*
+     * The ring holds a reference to the file until it is unregistered, so
+     * this must happen before the caller closes @fd.  Requests that are
+     * still in flight keep their own reference.
+     */
+    io_uring_register_files_update(&s->ring, index, &unused, 1);
+    trace_luring_fixed_file_del(s, fd, index);
+    s->fixed_files[index] = -1;
+}
+
+static void luring_fixed_buf_add(LuringState *s, uintptr_t start, size_t len)
+{
+    LuringFixedBuf buf;
+    struct iovec iov;
+    int pos;
+    int ret;
+
+    pos = luring_fixed_buf_find(s, start);
+    if (pos >= 0) {
+        LuringFixedBuf *old = &g_array_index(s->fixed_bufs, LuringFixedBuf,
+                                             pos);
+        if (old->start == start && old->len == len) {
+            old->refcnt++;
+            return;
+        }
+    }
+
+    buf = (LuringFixedBuf) {
+        .start = start,
+        .len = len,
+        .refcnt = 1,
+        .index = find_first_zero_bit(s->fixed_buf_map, MAX_FIXED_BUFS),
+    };
+    if (buf.index == MAX_FIXED_BUFS) {
+        trace_luring_fixed_buf_add(s, (void *)start, len, -1, -ENOSPC);
+        return;
+    }
+
+    iov = (struct iovec) {
+        .iov_base = (void *)start,
+        .iov_len = len,
+    };
+
+    /* Pins the pages, so this may fail if RLIMIT_MEMLOCK is too small */
+#ifdef HAVE_IO_URING_REGISTER_SPARSE
+    ret = io_uring_register_buffers_update_tag(&s->ring, buf.index, &iov,
+                                               NULL, 1);
+#else
+    ret = -ENOTSUP;
+#endif
+    trace_luring_fixed_buf_add(s, (void *)start, len, buf.index, ret);
+    if (ret < 0) {
+        return;
+    }
+
+    set_bit(buf.index, s->fixed_buf_map);
+    g_array_insert_val(s->fixed_bufs, pos + 1, buf);
+}
+
+static void luring_fixed_buf_del(LuringState *s, uintptr_t start, size_t len)
+{
+    LuringFixedBuf *buf;
+    struct iovec iov = {};
+    int pos;
+
+    pos = luring_fixed_buf_find(s, start);
+    if (pos < 0) {
+        return;
+    }
+
+    buf = &g_array_index(s->fixed_bufs, LuringFixedBuf, pos);
+    if (buf->start != start || buf->len != len || --buf->refcnt > 0) {
+        return;
+    }
+
+#ifdef HAVE_IO_URING_REGISTER_SPARSE
+    io_uring_register_buffers_update_tag(&s->ring, buf->index, &iov, NULL, 1);
+#endif
+    trace_luring_fixed_buf_del(s, (void *)start, len, buf->index);
+    clear_bit(buf->index, s->fixed_buf_map);
+    g_array_remove_index(s->fixed_bufs, pos);
+}
+
+typedef struct LuringFixedOp {
+    AioContext *ctx;
+    bool add;
+    int fd;
+    void *host;
+    size_t size;
+} LuringFixedOp;
+
+static void luring_fixed_op_bh(void *opaque)
+{
+    LuringFixedOp *op = opaque;
+    LuringState *s = aio_setup_linux_io_uring(op->ctx, NULL);
+    uintptr_t start = (uintptr_t)op->host;
+    uintptr_t end = start + op->size;
+
+    if (!s || !s->has_fixed) {
+        return;
+    }
+
+    if (op->fd >= 0) {
+        if (op->add) {
+            luring_fixed_file_add(s, op->fd);
+        } else {
+            luring_fixed_file_del(s, op->fd);
+        }
+        return;
+    }
+
+    /* Split the buffer into chunks that the kernel accepts */
+    while (start < end) {
+        size_t len = MIN(end - start, MAX_FIXED_BUF_SIZE);
+
+        if (op->add) {
+            luring_fixed_buf_add(s, start, len);
+        } else {
+            luring_fixed_buf_del(s, start, len);
+        }
+        start += len;
+    }
+}
+
+/*
+ * The fixed file and buffer tables are only accessed from the AioContext
+ * home thread, so run the update there.
+ */
+static void luring_run_fixed_op(LuringFixedOp *op)
+{
+    if (in_aio_context_home_thread(op->ctx)) {
+        luring_fixed_op_bh(op);
+    } else {
+        aio_wait_bh_oneshot(op->ctx, luring_fixed_op_bh, op);
+    }
+}
+
+void luring_register_file(AioContext *ctx, int fd)
+{
+    LuringFixedOp op = { .ctx = ctx, .add = true, .fd = fd };
+    luring_run_fixed_op(&op);
+}
+
+void luring_unregister_file(AioContext *ctx, int fd)
+{
+    LuringFixedOp op = { .ctx = ctx, .add = false, .fd = fd };
+    luring_run_fixed_op(&op);
+}
+
+void luring_register_buf(AioContext *ctx, void *host, size_t size)
+{
+    LuringFixedOp op = {
+        .ctx = ctx, .add = true, .fd = -1, .host = host, .size = size,
+    };
+    luring_run_fixed_op(&op);
+}
+
+void luring_unregister_buf(AioContext *ctx, void *host, size_t size)
+{
+    LuringFixedOp op = {
+        .ctx = ctx, .add = false, .fd = -1, .host = host, .size = size,
+    };
+    luring_run_fixed_op(&op);
+}
+
+static void luring_init_fixed(LuringState *s)
+{
+#ifdef HAVE_IO_URING_REGISTER_SPARSE
+    if (io_uring_register_files_sparse(&s->ring, MAX_FIXED_FILES) < 0) {
+        return;
+    }
+    if (io_uring_register_buffers_sparse(&s->ring, MAX_FIXED_BUFS) < 0) {
+        io_uring_unregister_files(&s->ring);
+        return;
+    }
+    s->has_fixed = true;
+#endif
+}
+
 LuringState *luring_init(Error **errp)
 {
     int rc;
@@ -448,6 +795,8 @@ LuringState *luring_init(Error **errp)
     }
 
     ioq_init(&s->io_q);
+    s->fixed_bufs = g_array_new(false, false, sizeof(LuringFixedBuf));
+    luring_init_fixed(s);
     return s;
 
 }
@@ -455,6 +804,7 @@ LuringState *luring_init(Error **errp)
 void luring_cleanup(LuringState *s)
 {
     io_uring_queue_exit(&s->ring);
+    g_array_free(s->fixed_bufs, true);
     trace_luring_cleanup_state(s);
     g_free(s);
 }
@@ -91,6 +91,7 @@ void qmp_block_dirty_bitmap_add(const char *node, const char *name,
                                 bool has_granularity, uint32_t granularity,
                                 bool has_persistent, bool persistent,
                                 bool has_disabled, bool disabled,
+                                bool has_compressed, bool compressed,
                                 Error **errp)
 {
     BlockDriverState *bs;
@@ -140,6 +141,10 @@ void qmp_block_dirty_bitmap_add(const char *node, const char *name,
         bdrv_disable_dirty_bitmap(bitmap);
     }
 
+    if (has_compressed && compressed) {
+        bdrv_dirty_bitmap_set_compressed(bitmap, true);
+    }
+
     bdrv_dirty_bitmap_set_persistence(bitmap, persistent);
 }
 
@@ -33,7 +33,9 @@
 #include "trace.h"
 #include "qemu/option.h"
 #include "qemu/cutils.h"
+#include "qemu/host-utils.h"
 #include "qemu/main-loop.h"
+#include "qemu/units.h"
 
 #include "qapi/qapi-visit-sockets.h"
 #include "qobject/qstring.h"
@@ -47,17 +49,93 @@
 #include "qemu/yank.h"
 
 #define EN_OPTSTR ":exportname="
-#define MAX_NBD_REQUESTS    16
 
+/*
+ * The number of requests in flight on a connection is limited by a window,
+ * which adapts to the round trip time of the requests between NBD_MIN_WINDOW
+ * and MAX_NBD_REQUESTS.  See nbd_channel_update_window().
+ *
+ * The window starts at, and never drops below, the 16 requests that the
+ * client always allowed.  That is also how many requests the QEMU NBD server
+ * processes at once per connection; the protocol has no way to tell the
+ * client.  With such a server, the requests beyond 16 wait in the socket,
+ * which adds to their round trip time like any other queue, so the window
+ * settles a few requests above 16.  Servers that process more requests in
+ * parallel let it grow further.
+ */
+#define MAX_NBD_REQUESTS    64
+#define NBD_MIN_WINDOW      16
+
+/*
+ * Grow the window while fewer than NBD_WINDOW_ALPHA requests are queued
+ * behind the ones that keep the link busy, shrink it while more than
+ * NBD_WINDOW_BETA are.
+ */
+#define NBD_WINDOW_ALPHA    2
+#define NBD_WINDOW_BETA     4
+
+/*
+ * Round trip times are normalized to a request with NBD_RTT_UNIT bytes of
+ * payload, so that requests of different sizes can be compared.  Smaller
+ * requests count as if they had NBD_RTT_UNIT bytes: their round trip time is
+ * dominated by the fixed cost of a request.
+ */
+#define NBD_RTT_UNIT        (64 * KiB)
+
+/*
+ * The lowest round trip time expires after this long, so that the window
+ * follows a server or a network that got slower for good.
+ */
+#define NBD_MIN_RTT_LIFETIME_NS (10 * NANOSECONDS_PER_SECOND)
+
+#define NBD_MAX_CONNECTIONS 16
+
+/* How long to wait for the additional connections of multi-conn */
+#define NBD_EXTRA_CHANNELS_TIMEOUT_NS (5 * NANOSECONDS_PER_SECOND)
+
+/*
+ * Cookies are unique across all connections, the connection of a request
+ * follows from its index.
+ */
 #define COOKIE_TO_INDEX(cookie) ((cookie) - 1)
 #define INDEX_TO_COOKIE(index)  ((index) + 1)
+#define INDEX_TO_CHANNEL(index) ((index) / MAX_NBD_REQUESTS)
 
 typedef struct {
     Coroutine *coroutine;
     uint64_t offset;        /* original offset of the request */
     bool receiving;         /* sleeping in the yield in nbd_receive_replies */
+    int64_t start_ns;       /* when the request was sent, 0 if not timed */
+    uint32_t bytes;         /* payload of the request or of its reply */
 } NBDClientRequest;
 
+/*
+ * A connection to the server.  With multi-conn, requests are striped over
+ * several connections, otherwise only the first one is used.
+ */
+typedef struct NBDChannel {
+    NBDClientConnection *conn;
+    QIOChannel *ioc; /* The current I/O channel */
+
+    /* Protects sending data on the socket.  */
+    CoMutex send_mutex;
+
+    /*
+     * Protects receiving reply headers from the socket, as well as the
+     * fields reply and requests[].receiving of the requests of the channel
+     */
+    CoMutex receive_mutex;
+    NBDReply reply;
+
+    /* Protected by requests_lock */
+    unsigned in_flight;
+    unsigned window;
+    int64_t min_rtt_ns;
+    int64_t min_rtt_stamp_ns; /* when min_rtt_ns was measured */
+    int64_t srtt_ns;
+    uint64_t completed;
+} NBDChannel;
+
 typedef enum NBDClientState {
     NBD_CLIENT_CONNECTING_WAIT,
     NBD_CLIENT_CONNECTING_NOWAIT,
@@ -66,31 +144,24 @@ typedef enum NBDClientState {
 } NBDClientState;
 
 typedef struct BDRVNBDState {
-    QIOChannel *ioc; /* The current I/O channel */
+    NBDChannel channels[NBD_MAX_CONNECTIONS];
     NBDExportInfo info;
 
     /*
      * Protects state, free_sema, in_flight, requests[].coroutine,
-     * reconnect_delay_timer.
+     * nr_channels, next_channel, reconnect_delay_timer.
      */
     QemuMutex requests_lock;
     NBDClientState state;
     CoQueue free_sema;
     unsigned in_flight;
-    NBDClientRequest requests[MAX_NBD_REQUESTS];
+    NBDClientRequest requests[NBD_MAX_CONNECTIONS * MAX_NBD_REQUESTS];
+    unsigned nr_channels; /* connected channels */
+    unsigned next_channel;
     QEMUTimer *reconnect_delay_timer;
 
-    /* Protects sending data on the socket.  */
-    CoMutex send_mutex;
-
-    /*
-     * Protects receiving reply headers from the socket, as well as the
-     * fields reply and requests[].receiving
-     */
-    CoMutex receive_mutex;
-    NBDReply reply;
-
     QEMUTimer *open_timer;
+    QEMUTimer *extra_channels_timer;
 
     BlockDriverState *bs;
 
@@ -104,18 +175,40 @@ typedef struct BDRVNBDState {
     char *tlshostname;
     char *x_dirty_bitmap;
     bool alloc_depth;
-
-    NBDClientConnection *conn;
+    uint32_t multi_conn;
 } BDRVNBDState;
 
 static void nbd_yank(void *opaque);
 
+static NBDChannel *nbd_cookie_channel(BDRVNBDState *s, uint64_t cookie)
+{
+    return &s->channels[INDEX_TO_CHANNEL(COOKIE_TO_INDEX(cookie))];
+}
+
+/* The requests of @c are s->requests[first..first + MAX_NBD_REQUESTS) */
+static unsigned nbd_channel_first_index(BDRVNBDState *s, NBDChannel *c)
+{
+    return (c - s->channels) * MAX_NBD_REQUESTS;
+}
+
+static void nbd_cancel_connection_attempts(BDRVNBDState *s)
+{
+    int i;
+
+    for (i = 0; i < NBD_MAX_CONNECTIONS && s->channels[i].conn; i++) {
+        nbd_co_establish_connection_cancel(s->channels[i].conn);
+    }
+}
+
 static void nbd_clear_bdrvstate(BlockDriverState *bs)
 {
     BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    int i;
 
-    nbd_client_connection_release(s->conn);
-    s->conn = NULL;
+    for (i = 0; i < NBD_MAX_CONNECTIONS; i++) {
+        nbd_client_connection_release(s->channels[i].conn);
+        s->channels[i].conn = NULL;
+    }
 
     yank_unregister_instance(BLOCKDEV_YANK_INSTANCE(bs->node_name));
 
@@ -136,7 +229,7 @@ static void nbd_clear_bdrvstate(BlockDriverState *bs)
     s->x_dirty_bitmap = NULL;
 }
 
-/* Called with s->receive_mutex taken.  */
+/* Called with the receive_mutex of the request's channel taken.  */
 static bool coroutine_fn nbd_recv_coroutine_wake_one(NBDClientRequest *req)
 {
     if (req->receiving) {
@@ -148,23 +241,66 @@ static bool coroutine_fn nbd_recv_coroutine_wake_one(NBDClientRequest *req)
     return false;
 }
 
-static void coroutine_fn nbd_recv_coroutines_wake(BDRVNBDState *s)
+static void coroutine_fn nbd_recv_coroutines_wake(BDRVNBDState *s,
+                                                  NBDChannel *c)
 {
+    unsigned first = nbd_channel_first_index(s, c);
     int i;
 
-    QEMU_LOCK_GUARD(&s->receive_mutex);
-    for (i = 0; i < MAX_NBD_REQUESTS; i++) {
+    QEMU_LOCK_GUARD(&c->receive_mutex);
+    for (i = first; i < first + MAX_NBD_REQUESTS; i++) {
         if (nbd_recv_coroutine_wake_one(&s->requests[i])) {
             return;
         }
     }
 }
 
-/* Called with s->requests_lock held.  */
+static void nbd_shutdown_channels(BDRVNBDState *s)
+{
+    int i;
+
+    for (i = 0; i < NBD_MAX_CONNECTIONS; i++) {
+        if (s->channels[i].ioc) {
+            qio_channel_shutdown(s->channels[i].ioc,
+                                 QIO_CHANNEL_SHUTDOWN_BOTH, NULL);
+        }
+    }
+}
+
+/*
+ * Drops the connections to the server.  Must be called while no request
+ * uses them.
+ */
+static void nbd_release_channels(BDRVNBDState *s)
+{
+    int i;
+
+    for (i = 0; i < NBD_MAX_CONNECTIONS; i++) {
+        NBDChannel *c = &s->channels[i];
+
+        if (!c->ioc) {
+            continue;
+        }
+        if (i == 0) {
+            yank_unregister_function(BLOCKDEV_YANK_INSTANCE(s->bs->node_name),
+                                     nbd_yank, s->bs);
+        }
+        object_unref(OBJECT(c->ioc));
+        c->ioc = NULL;
+    }
+    s->nr_channels = 0;
+}
+
+/*
+ * A connection failure is handled like a failure of all connections: they
+ * are all shut down and, if reconnecting, reestablished together.
+ *
+ * Called with s->requests_lock held.
+ */
 static void coroutine_fn nbd_channel_error_locked(BDRVNBDState *s, int ret)
 {
     if (s->state == NBD_CLIENT_CONNECTED) {
-        qio_channel_shutdown(s->ioc, QIO_CHANNEL_SHUTDOWN_BOTH, NULL);
+        nbd_shutdown_channels(s);
     }
 
     if (ret == -EIO) {
@@ -202,7 +338,7 @@ static void reconnect_delay_timer_cb(void *opaque)
         }
         s->state = NBD_CLIENT_CONNECTING_NOWAIT;
     }
-    nbd_co_establish_connection_cancel(s->conn);
+    nbd_cancel_connection_attempts(s);
 }
 
 static void reconnect_delay_timer_init(BDRVNBDState *s, uint64_t expire_time_ns)
@@ -221,13 +357,8 @@ static void nbd_teardown_connection(BlockDriverState *bs)
 
     assert(!s->in_flight);
 
-    if (s->ioc) {
-        qio_channel_shutdown(s->ioc, QIO_CHANNEL_SHUTDOWN_BOTH, NULL);
-        yank_unregister_function(BLOCKDEV_YANK_INSTANCE(s->bs->node_name),
-                                 nbd_yank, s->bs);
-        object_unref(OBJECT(s->ioc));
-        s->ioc = NULL;
-    }
+    nbd_shutdown_channels(s);
+    nbd_release_channels(s);
 
     WITH_QEMU_LOCK_GUARD(&s->requests_lock) {
         s->state = NBD_CLIENT_QUIT;
@@ -246,7 +377,7 @@ static void open_timer_cb(void *opaque)
 {
     BDRVNBDState *s = opaque;
 
-    nbd_co_establish_connection_cancel(s->conn);
+    nbd_cancel_connection_attempts(s);
     open_timer_del(s);
 }
 
@@ -260,6 +391,35 @@ static void open_timer_init(BDRVNBDState *s, uint64_t expire_time_ns)
     timer_mod(s->open_timer, expire_time_ns);
 }
 
+static void extra_channels_timer_del(BDRVNBDState *s)
+{
+    if (s->extra_channels_timer) {
+        timer_free(s->extra_channels_timer);
+        s->extra_channels_timer = NULL;
+    }
+}
+
+static void extra_channels_timer_cb(void *opaque)
+{
+    BDRVNBDState *s = opaque;
+    unsigned n;
+
+    extra_channels_timer_del(s);
+    for (n = 1; n < s->multi_conn; n++) {
+        nbd_co_establish_connection_cancel(s->channels[n].conn);
+    }
+}
+
+static void extra_channels_timer_init(BDRVNBDState *s, uint64_t expire_time_ns)
+{
+    assert(!s->extra_channels_timer);
+    s->extra_channels_timer = aio_timer_new(bdrv_get_aio_context(s->bs),
+                                            QEMU_CLOCK_REALTIME,
+                                            SCALE_NS,
+                                            extra_channels_timer_cb, s);
+    timer_mod(s->extra_channels_timer, expire_time_ns);
+}
+
 static bool nbd_client_will_reconnect(BDRVNBDState *s)
 {
     /*
@@ -315,20 +475,140 @@ nbd_handle_updated_info(BlockDriverState *bs, Error **errp)
     return 0;
 }
 
+static void nbd_channel_init(NBDChannel *c, QIOChannel *ioc)
+{
+    c->ioc = ioc;
+    c->in_flight = 0;
+    c->window = NBD_MIN_WINDOW;
+    c->min_rtt_ns = 0;
+    c->min_rtt_stamp_ns = 0;
+    c->srtt_ns = 0;
+    c->completed = 0;
+
+    qio_channel_set_blocking(ioc, false, NULL);
+    qio_channel_set_follow_coroutine_ctx(ioc, true);
+}
+
+/* Whether requests can be striped over connections with @a and @b */
+static bool nbd_info_is_compatible(const NBDExportInfo *a,
+                                   const NBDExportInfo *b)
+{
+    return a->mode == b->mode &&
+        a->size == b->size &&
+        a->flags == b->flags &&
+        a->min_block == b->min_block &&
+        a->max_block == b->max_block &&
+        a->base_allocation == b->base_allocation &&
+        a->context_id == b->context_id;
+}
+
+/*
+ * Takes the connection of the extra channel @n, if it is ready, and makes it
+ * the next connected channel.  Connections that fail to negotiate compatible
+ * parameters are dropped.
+ *
+ * Returns false if the connection is not usable.
+ */
+static bool coroutine_fn nbd_co_add_extra_channel(BDRVNBDState *s, unsigned n,
+                                                  bool blocking,
+                                                  unsigned *nr_channels)
+{
+    NBDExportInfo info;
+    Error *local_err = NULL;
+    QIOChannel *ioc;
+
+    ioc = nbd_co_establish_connection(s->channels[n].conn, &info, blocking,
+                                      &local_err);
+    if (!ioc) {
+        if (blocking) {
+            trace_nbd_multi_conn_failed(n, error_get_pretty(local_err));
+        }
+        error_free(local_err);
+        return false;
+    }
+
+    if (!nbd_info_is_compatible(&s->info, &info)) {
+        NBDRequest request = { .type = NBD_CMD_DISC, .mode = info.mode };
+
+        trace_nbd_multi_conn_failed(n, "export parameters differ");
+        nbd_send_request(ioc, &request);
+        object_unref(OBJECT(ioc));
+        return false;
+    }
+
+    /*
+     * The connections are not bound to a channel, and the connected channels
+     * stay contiguous even if an earlier attempt failed.
+     */
+    assert(!s->channels[*nr_channels].ioc);
+    nbd_channel_init(&s->channels[(*nr_channels)++], ioc);
+    return true;
+}
+
+/*
+ * Opens the additional connections of multi-conn, after the first one has
+ * been established.  The attempts run in parallel, and if @blocking, they are
+ * waited for until NBD_EXTRA_CHANNELS_TIMEOUT_NS: a server that reached its
+ * connection limit keeps new connections in its backlog without negotiating.
+ * Requests are striped over the connections that could be established.
+ *
+ * An attempt that is still running when we stop waiting completes in the
+ * background, and its connection is taken at the next reconnection.
+ *
+ * Returns the number of connected channels.
+ */
+static unsigned coroutine_fn
+nbd_co_establish_extra_channels(BDRVNBDState *s, bool blocking)
+{
+    bool pending[NBD_MAX_CONNECTIONS] = { false };
+    unsigned nr_channels = 1;
+    unsigned n;
+
+    if (!(s->info.flags & NBD_FLAG_CAN_MULTI_CONN)) {
+        trace_nbd_multi_conn_unsupported(s->export ?: "");
+        return 1;
+    }
+
+    /* Start all attempts, taking those that completed in the background */
+    for (n = 1; n < s->multi_conn; n++) {
+        pending[n] = !nbd_co_add_extra_channel(s, n, false, &nr_channels);
+    }
+
+    if (!blocking || nr_channels == s->multi_conn) {
+        return nr_channels;
+    }
+
+    extra_channels_timer_init(s, qemu_clock_get_ns(QEMU_CLOCK_REALTIME) +
+                              NBD_EXTRA_CHANNELS_TIMEOUT_NS);
+    for (n = 1; n < s->multi_conn && s->extra_channels_timer; n++) {
+        /* An attempt that already failed is retried once */
+        if (pending[n]) {
+            nbd_co_add_extra_channel(s, n, true, &nr_channels);
+        }
+    }
+    extra_channels_timer_del(s);
+
+    return nr_channels;
+}
+
 int coroutine_fn nbd_co_do_establish_connection(BlockDriverState *bs,
                                                 bool blocking, Error **errp)
 {
     BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    NBDChannel *c = &s->channels[0];
+    QIOChannel *ioc;
+    unsigned nr_channels = 1;
     int ret;
     IO_CODE();
 
     assert_bdrv_graph_readable();
-    assert(!s->ioc);
+    assert(!c->ioc);
 
-    s->ioc = nbd_co_establish_connection(s->conn, &s->info, blocking, errp);
-    if (!s->ioc) {
+    ioc = nbd_co_establish_connection(c->conn, &s->info, blocking, errp);
+    if (!ioc) {
         return -ECONNREFUSED;
     }
+    c->ioc = ioc;
 
     yank_register_function(BLOCKDEV_YANK_INSTANCE(s->bs->node_name), nbd_yank,
                            bs);
@@ -341,21 +621,26 @@ int coroutine_fn nbd_co_do_establish_connection(BlockDriverState *bs,
          */
         NBDRequest request = { .type = NBD_CMD_DISC, .mode = s->info.mode };
 
-        nbd_send_request(s->ioc, &request);
+        nbd_send_request(ioc, &request);
 
         yank_unregister_function(BLOCKDEV_YANK_INSTANCE(s->bs->node_name),
                                  nbd_yank, bs);
-        object_unref(OBJECT(s->ioc));
-        s->ioc = NULL;
+        object_unref(OBJECT(ioc));
+        c->ioc = NULL;
 
         return ret;
     }
 
-    qio_channel_set_blocking(s->ioc, false, NULL);
-    qio_channel_set_follow_coroutine_ctx(s->ioc, true);
+    nbd_channel_init(c, ioc);
+
+    if (s->multi_conn > 1) {
+        nr_channels = nbd_co_establish_extra_channels(s, blocking);
+    }
 
     /* successfully connected */
     WITH_QEMU_LOCK_GUARD(&s->requests_lock) {
+        s->nr_channels = nr_channels;
+        s->next_channel = 0;
         s->state = NBD_CLIENT_CONNECTED;
     }
 
@@ -395,13 +680,8 @@ static void coroutine_fn GRAPH_RDLOCK nbd_reconnect_attempt(BDRVNBDState *s)
             s->reconnect_delay * NANOSECONDS_PER_SECOND);
     }
 
-    /* Finalize previous connection if any */
-    if (s->ioc) {
-        yank_unregister_function(BLOCKDEV_YANK_INSTANCE(s->bs->node_name),
-                                 nbd_yank, s->bs);
-        object_unref(OBJECT(s->ioc));
-        s->ioc = NULL;
-    }
+    /* Finalize previous connections if any */
+    nbd_release_channels(s);
 
     qemu_mutex_unlock(&s->requests_lock);
     ret = nbd_co_do_establish_connection(s->bs, blocking, NULL);
@@ -421,25 +701,26 @@ static coroutine_fn int nbd_receive_replies(BDRVNBDState *s, uint64_t cookie,
 {
     int ret;
     uint64_t ind = COOKIE_TO_INDEX(cookie), ind2;
-    QEMU_LOCK_GUARD(&s->receive_mutex);
+    NBDChannel *c = nbd_cookie_channel(s, cookie);
+    QEMU_LOCK_GUARD(&c->receive_mutex);
 
     while (true) {
-        if (s->reply.cookie == cookie) {
+        if (c->reply.cookie == cookie) {
             /* We are done */
             return 0;
         }
 
-        if (s->reply.cookie != 0) {
+        if (c->reply.cookie != 0) {
             /*
              * Some other request is being handled now. It should already be
-             * woken by whoever set s->reply.cookie (or never wait in this
+             * woken by whoever set c->reply.cookie (or never wait in this
              * yield). So, we should not wake it here.
              */
-            ind2 = COOKIE_TO_INDEX(s->reply.cookie);
+            ind2 = COOKIE_TO_INDEX(c->reply.cookie);
             assert(!s->requests[ind2].receiving);
 
             s->requests[ind].receiving = true;
-            qemu_co_mutex_unlock(&s->receive_mutex);
+            qemu_co_mutex_unlock(&c->receive_mutex);
 
             qemu_coroutine_yield();
             /*
@@ -447,18 +728,18 @@ static coroutine_fn int nbd_receive_replies(BDRVNBDState *s, uint64_t cookie,
              * 1. From this function, executing in parallel coroutine, when our
              *    cookie is received.
              * 2. From nbd_co_receive_one_chunk(), when previous request is
-             *    finished and s->reply.cookie set to 0.
+             *    finished and c->reply.cookie set to 0.
              * Anyway, it's OK to lock the mutex and go to the next iteration.
              */
 
-            qemu_co_mutex_lock(&s->receive_mutex);
+            qemu_co_mutex_lock(&c->receive_mutex);
             assert(!s->requests[ind].receiving);
             continue;
         }
 
         /* We are under mutex and cookie is 0. We have to do the dirty work. */
-        assert(s->reply.cookie == 0);
-        ret = nbd_receive_reply(s->bs, s->ioc, &s->reply, s->info.mode, errp);
+        assert(c->reply.cookie == 0);
+        ret = nbd_receive_reply(s->bs, c->ioc, &c->reply, s->info.mode, errp);
         if (ret == 0) {
             ret = -EIO;
             error_setg(errp, "server dropped connection");
@@ -467,19 +748,21 @@ static coroutine_fn int nbd_receive_replies(BDRVNBDState *s, uint64_t cookie,
             nbd_channel_error(s, ret);
             return ret;
         }
-        if (nbd_reply_is_structured(&s->reply) &&
+        if (nbd_reply_is_structured(&c->reply) &&
             s->info.mode < NBD_MODE_STRUCTURED) {
             nbd_channel_error(s, -EINVAL);
             error_setg(errp, "unexpected structured reply");
             return -EINVAL;
         }
-        ind2 = COOKIE_TO_INDEX(s->reply.cookie);
-        if (ind2 >= MAX_NBD_REQUESTS || !s->requests[ind2].coroutine) {
+        ind2 = COOKIE_TO_INDEX(c->reply.cookie);
+        if (ind2 >= ARRAY_SIZE(s->requests) ||
+            INDEX_TO_CHANNEL(ind2) != INDEX_TO_CHANNEL(ind) ||
+            !s->requests[ind2].coroutine) {
             nbd_channel_error(s, -EINVAL);
             error_setg(errp, "unexpected cookie value");
             return -EINVAL;
         }
-        if (s->reply.cookie == cookie) {
+        if (c->reply.cookie == cookie) {
             /* We are done */
             return 0;
         }
@@ -487,16 +770,110 @@ static coroutine_fn int nbd_receive_replies(BDRVNBDState *s, uint64_t cookie,
     }
 }
 
+/*
+ * Returns the channel with the most room in its window, or NULL if all
+ * windows are full.  Ties are broken round-robin.
+ *
+ * Called with s->requests_lock held.
+ */
+static NBDChannel *nbd_pick_channel(BDRVNBDState *s)
+{
+    NBDChannel *best = NULL;
+    unsigned i, best_room = 0;
+
+    for (i = 0; i < s->nr_channels; i++) {
+        NBDChannel *c = &s->channels[(s->next_channel + i) % s->nr_channels];
+
+        if (c->in_flight < c->window && c->window - c->in_flight > best_room) {
+            best = c;
+            best_room = c->window - c->in_flight;
+        }
+    }
+
+    if (best) {
+        s->next_channel = (best - s->channels + 1) % s->nr_channels;
+    }
+    return best;
+}
+
+/*
+ * Adapts the window of @c to the round trip time of a request that just
+ * completed, in the style of TCP Vegas: the difference between the smoothed
+ * and the lowest round trip time tells how many requests are queued in the
+ * network or in the server instead of being serviced.  If few are, and the
+ * window is what limits the requests in flight, the window grows.  If many
+ * are, it shrinks.
+ *
+ * @rtt is for a request with @bytes of payload, see NBD_RTT_UNIT.
+ *
+ * Called with s->requests_lock held.
+ */
+static void nbd_channel_update_window(NBDChannel *c, int64_t rtt,
+                                      uint32_t bytes, int64_t now)
+{
+    unsigned queued;
+
+    rtt = MAX(muldiv64(rtt, NBD_RTT_UNIT, MAX(bytes, NBD_RTT_UNIT)), 1);
+    if (!c->min_rtt_ns || rtt <= c->min_rtt_ns ||
+        now - c->min_rtt_stamp_ns > NBD_MIN_RTT_LIFETIME_NS) {
+        c->min_rtt_ns = rtt;
+        c->min_rtt_stamp_ns = now;
+    }
+    c->srtt_ns = c->srtt_ns ? (7 * c->srtt_ns + rtt) / 8 : rtt;
+
+    queued = c->window - c->window * c->min_rtt_ns / MAX(c->srtt_ns,
+                                                           c->min_rtt_ns);
+    if (queued < NBD_WINDOW_ALPHA && c->in_flight >= c->window &&
+        c->window < MAX_NBD_REQUESTS) {
+        c->window++;
+        trace_nbd_channel_window(c->window, c->min_rtt_ns, c->srtt_ns);
+    } else if (queued > NBD_WINDOW_BETA && c->window > NBD_MIN_WINDOW) {
+        c->window--;
+        trace_nbd_channel_window(c->window, c->min_rtt_ns, c->srtt_ns);
+    }
+}
+
+/*
+ * Releases the request slot of @cookie.  @ok is false if the request failed
+ * because of a connection error, its round trip time is not meaningful then.
+ *
+ * Called with s->requests_lock held.
+ */
+static void nbd_request_done(BDRVNBDState *s, uint64_t cookie, bool ok)
+{
+    NBDClientRequest *req = &s->requests[COOKIE_TO_INDEX(cookie)];
+    NBDChannel *c = nbd_cookie_channel(s, cookie);
+    unsigned window = c->window;
+
+    if (ok) {
+        c->completed++;
+    }
+    if (ok && req->start_ns) {
+        int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+
+        nbd_channel_update_window(c, now - req->start_ns, req->bytes, now);
+    }
+
+    req->coroutine = NULL;
+    c->in_flight--;
+    s->in_flight--;
+    qemu_co_queue_next(&s->free_sema);
+    if (c->window > window) {
+        qemu_co_queue_next(&s->free_sema);
+    }
+}
+
 static int coroutine_fn GRAPH_RDLOCK
 nbd_co_send_request(BlockDriverState *bs, NBDRequest *request,
                     QEMUIOVector *qiov)
 {
     BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
-    int rc, i = -1;
+    NBDChannel *c = NULL;
+    int rc, i;
 
     qemu_mutex_lock(&s->requests_lock);
-    while (s->in_flight == MAX_NBD_REQUESTS ||
-           (s->state != NBD_CLIENT_CONNECTED && s->in_flight > 0)) {
+    while (s->state == NBD_CLIENT_CONNECTED ? !(c = nbd_pick_channel(s)) :
+           s->in_flight > 0) {
         qemu_co_queue_wait(&s->free_sema, &s->requests_lock);
     }
 
@@ -510,51 +887,61 @@ nbd_co_send_request(BlockDriverState *bs, NBDRequest *request,
             rc = -EIO;
             goto err;
         }
+        c = nbd_pick_channel(s);
     }
 
-    for (i = 0; i < MAX_NBD_REQUESTS; i++) {
+    assert(c);
+    c->in_flight++;
+    for (i = nbd_channel_first_index(s, c); ; i++) {
+        assert(INDEX_TO_CHANNEL(i) == c - s->channels);
         if (s->requests[i].coroutine == NULL) {
             break;
         }
     }
 
-    assert(i < MAX_NBD_REQUESTS);
     s->requests[i].coroutine = qemu_coroutine_self();
     s->requests[i].offset = request->from;
     s->requests[i].receiving = false;
+    /* A flush waits for the disk, not for the other requests */
+    s->requests[i].start_ns = request->type == NBD_CMD_FLUSH ? 0 :
+                              qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    s->requests[i].bytes = request->type == NBD_CMD_READ ||
+                           request->type == NBD_CMD_WRITE ? request->len : 0;
     qemu_mutex_unlock(&s->requests_lock);
 
-    qemu_co_mutex_lock(&s->send_mutex);
+    qemu_co_mutex_lock(&c->send_mutex);
     request->cookie = INDEX_TO_COOKIE(i);
     request->mode = s->info.mode;
 
-    assert(s->ioc);
+    assert(c->ioc);
 
     if (qiov) {
-        qio_channel_set_cork(s->ioc, true);
-        rc = nbd_send_request(s->ioc, request);
-        if (rc >= 0 && qio_channel_writev_all(s->ioc, qiov->iov, qiov->niov,
+        qio_channel_set_cork(c->ioc, true);
+        rc = nbd_send_request(c->ioc, request);
+        if (rc >= 0 && qio_channel_writev_all(c->ioc, qiov->iov, qiov->niov,
                                               NULL) < 0) {
             rc = -EIO;
         }
-        qio_channel_set_cork(s->ioc, false);
+        qio_channel_set_cork(c->ioc, false);
     } else {
-        rc = nbd_send_request(s->ioc, request);
+        rc = nbd_send_request(c->ioc, request);
     }
-    qemu_co_mutex_unlock(&s->send_mutex);
+    qemu_co_mutex_unlock(&c->send_mutex);
 
     if (rc < 0) {
         qemu_mutex_lock(&s->requests_lock);
-err:
         nbd_channel_error_locked(s, rc);
-        if (i != -1) {
-            s->requests[i].coroutine = NULL;
-        }
-        s->in_flight--;
-        qemu_co_queue_next(&s->free_sema);
+        nbd_request_done(s, request->cookie, false);
         qemu_mutex_unlock(&s->requests_lock);
     }
     return rc;
+
+err:
+    nbd_channel_error_locked(s, rc);
+    s->in_flight--;
+    qemu_co_queue_next(&s->free_sema);
+    qemu_mutex_unlock(&s->requests_lock);
+    return rc;
 }
 
 static inline uint16_t payload_advance16(uint8_t **payload)
@@ -754,16 +1141,17 @@ static int nbd_parse_error_payload(NBDStructuredReplyChunk *chunk,
 }
 
 static int coroutine_fn
-nbd_co_receive_offset_data_payload(BDRVNBDState *s, uint64_t orig_offset,
+nbd_co_receive_offset_data_payload(BDRVNBDState *s, NBDChannel *c,
+                                   uint64_t orig_offset,
                                    QEMUIOVector *qiov, Error **errp)
 {
     QEMUIOVector sub_qiov;
     uint64_t offset;
     size_t data_size;
     int ret;
-    NBDStructuredReplyChunk *chunk = &s->reply.structured;
+    NBDStructuredReplyChunk *chunk = &c->reply.structured;
 
-    assert(nbd_reply_is_structured(&s->reply));
+    assert(nbd_reply_is_structured(&c->reply));
 
     /* The NBD spec requires at least one byte of payload */
     if (chunk->length <= sizeof(offset)) {
@@ -772,7 +1160,7 @@ nbd_co_receive_offset_data_payload(BDRVNBDState *s, uint64_t orig_offset,
         return -EINVAL;
     }
 
-    if (nbd_read64(s->ioc, &offset, "OFFSET_DATA offset", errp) < 0) {
+    if (nbd_read64(c->ioc, &offset, "OFFSET_DATA offset", errp) < 0) {
         return -EIO;
     }
 
@@ -790,7 +1178,7 @@ nbd_co_receive_offset_data_payload(BDRVNBDState *s, uint64_t orig_offset,
 
     qemu_iovec_init(&sub_qiov, qiov->niov);
     qemu_iovec_concat(&sub_qiov, qiov, offset - orig_offset, data_size);
-    ret = qio_channel_readv_all(s->ioc, sub_qiov.iov, sub_qiov.niov, errp);
+    ret = qio_channel_readv_all(c->ioc, sub_qiov.iov, sub_qiov.niov, errp);
     qemu_iovec_destroy(&sub_qiov);
 
     return ret < 0 ? -EIO : 0;
@@ -798,14 +1186,14 @@ nbd_co_receive_offset_data_payload(BDRVNBDState *s, uint64_t orig_offset,
 
 #define NBD_MAX_MALLOC_PAYLOAD 1000
 static coroutine_fn int nbd_co_receive_structured_payload(
-        BDRVNBDState *s, void **payload, Error **errp)
+        NBDChannel *c, void **payload, Error **errp)
 {
     int ret;
     uint32_t len;
 
-    assert(nbd_reply_is_structured(&s->reply));
+    assert(nbd_reply_is_structured(&c->reply));
 
-    len = s->reply.structured.length;
+    len = c->reply.structured.length;
 
     if (len == 0) {
         return 0;
@@ -822,7 +1210,7 @@ static coroutine_fn int nbd_co_receive_structured_payload(
     }
 
     *payload = g_new(char, len);
-    ret = nbd_read(s->ioc, *payload, len, "structured payload", errp);
+    ret = nbd_read(c->ioc, *payload, len, "structured payload", errp);
     if (ret < 0) {
         g_free(*payload);
         *payload = NULL;
@@ -854,6 +1242,7 @@ static coroutine_fn int nbd_co_do_receive_one_chunk(
     ERRP_GUARD();
     int ret;
     int i = COOKIE_TO_INDEX(cookie);
+    NBDChannel *c = nbd_cookie_channel(s, cookie);
     void *local_payload = NULL;
     NBDStructuredReplyChunk *chunk;
 
@@ -867,29 +1256,29 @@ static coroutine_fn int nbd_co_do_receive_one_chunk(
         error_prepend(errp, "Connection closed: ");
         return -EIO;
     }
-    assert(s->ioc);
+    assert(c->ioc);
 
-    assert(s->reply.cookie == cookie);
+    assert(c->reply.cookie == cookie);
 
-    if (nbd_reply_is_simple(&s->reply)) {
+    if (nbd_reply_is_simple(&c->reply)) {
         if (only_structured) {
             error_setg(errp, "Protocol error: simple reply when structured "
                              "reply chunk was expected");
             return -EINVAL;
         }
 
-        *request_ret = -nbd_errno_to_system_errno(s->reply.simple.error);
+        *request_ret = -nbd_errno_to_system_errno(c->reply.simple.error);
         if (*request_ret < 0 || !qiov) {
             return 0;
         }
 
-        return qio_channel_readv_all(s->ioc, qiov->iov, qiov->niov,
+        return qio_channel_readv_all(c->ioc, qiov->iov, qiov->niov,
                                      errp) < 0 ? -EIO : 0;
     }
 
     /* handle structured reply chunk */
     assert(s->info.mode >= NBD_MODE_STRUCTURED);
-    chunk = &s->reply.structured;
+    chunk = &c->reply.structured;
 
     if (chunk->type == NBD_REPLY_TYPE_NONE) {
         if (!(chunk->flags & NBD_REPLY_FLAG_DONE)) {
@@ -911,7 +1300,7 @@ static coroutine_fn int nbd_co_do_receive_one_chunk(
             return -EINVAL;
         }
 
-        return nbd_co_receive_offset_data_payload(s, s->requests[i].offset,
+        return nbd_co_receive_offset_data_payload(s, c, s->requests[i].offset,
                                                   qiov, errp);
     }
 
@@ -919,7 +1308,7 @@ static coroutine_fn int nbd_co_do_receive_one_chunk(
         payload = &local_payload;
     }
 
-    ret = nbd_co_receive_structured_payload(s, payload, errp);
+    ret = nbd_co_receive_structured_payload(c, payload, errp);
     if (ret < 0) {
         return ret;
     }
@@ -943,6 +1332,7 @@ static coroutine_fn int nbd_co_receive_one_chunk(
         int *request_ret, QEMUIOVector *qiov, NBDReply *reply, void **payload,
         Error **errp)
 {
+    NBDChannel *c = nbd_cookie_channel(s, cookie);
     int ret = nbd_co_do_receive_one_chunk(s, cookie, only_structured,
                                           request_ret, qiov, payload, errp);
 
@@ -951,11 +1341,11 @@ static coroutine_fn int nbd_co_receive_one_chunk(
         nbd_channel_error(s, ret);
     } else {
         /* For assert at loop start in nbd_connection_entry */
-        *reply = s->reply;
+        *reply = c->reply;
     }
-    s->reply.cookie = 0;
+    c->reply.cookie = 0;
 
-    nbd_recv_coroutines_wake(s);
+    nbd_recv_coroutines_wake(s, c);
 
     return ret;
 }
@@ -1059,9 +1449,7 @@ static bool coroutine_fn nbd_reply_chunk_iter_receive(BDRVNBDState *s,
 
 break_loop:
     qemu_mutex_lock(&s->requests_lock);
-    s->requests[COOKIE_TO_INDEX(cookie)].coroutine = NULL;
-    s->in_flight--;
-    qemu_co_queue_next(&s->free_sema);
+    nbd_request_done(s, cookie, iter->ret == 0);
     qemu_mutex_unlock(&s->requests_lock);
 
     return false;
@@ -1490,7 +1878,7 @@ static void nbd_yank(void *opaque)
     BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
 
     QEMU_LOCK_GUARD(&s->requests_lock);
-    qio_channel_shutdown(s->ioc, QIO_CHANNEL_SHUTDOWN_BOTH, NULL);
+    nbd_shutdown_channels(s);
     s->state = NBD_CLIENT_QUIT;
 }
 
@@ -1498,9 +1886,12 @@ static void nbd_client_close(BlockDriverState *bs)
 {
     BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
     NBDRequest request = { .type = NBD_CMD_DISC, .mode = s->info.mode };
+    int i;
 
-    if (s->ioc) {
-        nbd_send_request(s->ioc, &request);
+    for (i = 0; i < NBD_MAX_CONNECTIONS; i++) {
+        if (s->channels[i].ioc) {
+            nbd_send_request(s->channels[i].ioc, &request);
+        }
     }
 
     nbd_teardown_connection(bs);
@@ -1840,6 +2231,12 @@ static QemuOptsList nbd_runtime_opts = {
                     "attempts until successful or until @open-timeout seconds "
                     "have elapsed. Default 0",
         },
+        {
+            .name = "multi-conn",
+            .type = QEMU_OPT_NUMBER,
+            .help = "Number of connections to open to the server, if it "
+                    "allows more than one. Default 1",
+        },
         { /* end of list */ }
     },
 };
@@ -1896,6 +2293,13 @@ static int nbd_process_options(BlockDriverState *bs, QDict *options,
     s->reconnect_delay = qemu_opt_get_number(opts, "reconnect-delay", 0);
     s->open_timeout = qemu_opt_get_number(opts, "open-timeout", 0);
 
+    s->multi_conn = qemu_opt_get_number(opts, "multi-conn", 1);
+    if (s->multi_conn < 1 || s->multi_conn > NBD_MAX_CONNECTIONS) {
+        error_setg(errp, "multi-conn must be between 1 and %d",
+                   NBD_MAX_CONNECTIONS);
+        goto error;
+    }
+
     ret = 0;
 
  error:
@@ -1906,14 +2310,16 @@ static int nbd_process_options(BlockDriverState *bs, QDict *options,
 static int nbd_open(BlockDriverState *bs, QDict *options, int flags,
                     Error **errp)
 {
-    int ret;
+    int i, ret;
     BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
 
     s->bs = bs;
     qemu_mutex_init(&s->requests_lock);
     qemu_co_queue_init(&s->free_sema);
-    qemu_co_mutex_init(&s->send_mutex);
-    qemu_co_mutex_init(&s->receive_mutex);
+    for (i = 0; i < NBD_MAX_CONNECTIONS; i++) {
+        qemu_co_mutex_init(&s->channels[i].send_mutex);
+        qemu_co_mutex_init(&s->channels[i].receive_mutex);
+    }
 
     if (!yank_register_instance(BLOCKDEV_YANK_INSTANCE(bs->node_name), errp)) {
         return -EEXIST;
@@ -1924,12 +2330,20 @@ static int nbd_open(BlockDriverState *bs, QDict *options, int flags,
         goto fail;
     }
 
-    s->conn = nbd_client_connection_new(s->saddr, true, s->export,
-                                        s->x_dirty_bitmap, s->tlscreds,
-                                        s->tlshostname);
+    /*
+     * The additional connections of multi-conn are attempted once each time
+     * the first one is established, see nbd_co_establish_extra_channels().
+     */
+    for (i = 0; i < s->multi_conn; i++) {
+        s->channels[i].conn = nbd_client_connection_new(s->saddr, true,
+                                                        s->export,
+                                                        s->x_dirty_bitmap,
+                                                        s->tlscreds,
+                                                        s->tlshostname);
+    }
 
     if (s->open_timeout) {
-        nbd_client_connection_enable_retry(s->conn);
+        nbd_client_connection_enable_retry(s->channels[0].conn);
         open_timer_init(s, qemu_clock_get_ns(QEMU_CLOCK_REALTIME) +
                         s->open_timeout * NANOSECONDS_PER_SECOND);
     }
@@ -1947,7 +2361,7 @@ static int nbd_open(BlockDriverState *bs, QDict *options, int flags,
      */
     open_timer_del(s);
 
-    nbd_client_connection_enable_retry(s->conn);
+    nbd_client_connection_enable_retry(s->channels[0].conn);
 
     return 0;
 
@@ -1957,6 +2371,34 @@ fail:
     return ret;
 }
 
+static BlockStatsSpecific *nbd_get_specific_stats(BlockDriverState *bs)
+{
+    BlockStatsSpecific *stats = g_new0(BlockStatsSpecific, 1);
+    BlockStatsSpecificNbdConnectionList **tail = &stats->u.nbd.connections;
+    BDRVNBDState *s = bs->opaque;
+    unsigned i;
+
+    stats->driver = BLOCKDEV_DRIVER_NBD;
+
+    QEMU_LOCK_GUARD(&s->requests_lock);
+    for (i = 0; i < s->nr_channels; i++) {
+        NBDChannel *c = &s->channels[i];
+        BlockStatsSpecificNbdConnection *conn;
+
+        conn = g_new(BlockStatsSpecificNbdConnection, 1);
+        *conn = (BlockStatsSpecificNbdConnection) {
+            .in_flight = c->in_flight,
+            .window = c->window,
+            .completed = c->completed,
+            .min_rtt_ns = c->min_rtt_ns,
+            .rtt_ns = c->srtt_ns,
+        };
+        QAPI_LIST_APPEND(tail, conn);
+    }
+
+    return stats;
+}
+
 static void nbd_refresh_limits(BlockDriverState *bs, Error **errp)
 {
     BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
@@ -2108,7 +2550,7 @@ static void nbd_cancel_in_flight(BlockDriverState *bs)
     }
     qemu_mutex_unlock(&s->requests_lock);
 
-    nbd_co_establish_connection_cancel(s->conn);
+    nbd_cancel_connection_attempts(s);
 }
 
 static void nbd_attach_aio_context(BlockDriverState *bs,
@@ -2162,6 +2604,7 @@ static BlockDriver bdrv_nbd = {
     .bdrv_dirname               = nbd_dirname,
     .strong_runtime_opts        = nbd_strong_runtime_opts,
     .bdrv_cancel_in_flight      = nbd_cancel_in_flight,
+    .bdrv_get_specific_stats    = nbd_get_specific_stats,
 
     .bdrv_attach_aio_context    = nbd_attach_aio_context,
     .bdrv_detach_aio_context    = nbd_detach_aio_context,
@@ -2190,6 +2633,7 @@ static BlockDriver bdrv_nbd_tcp = {
     .bdrv_dirname               = nbd_dirname,
     .strong_runtime_opts        = nbd_strong_runtime_opts,
     .bdrv_cancel_in_flight      = nbd_cancel_in_flight,
+    .bdrv_get_specific_stats    = nbd_get_specific_stats,
 
     .bdrv_attach_aio_context    = nbd_attach_aio_context,
     .bdrv_detach_aio_context    = nbd_detach_aio_context,
@@ -2218,6 +2662,7 @@ static BlockDriver bdrv_nbd_unix = {
     .bdrv_dirname               = nbd_dirname,
     .strong_runtime_opts        = nbd_strong_runtime_opts,
     .bdrv_cancel_in_flight      = nbd_cancel_in_flight,
+    .bdrv_get_specific_stats    = nbd_get_specific_stats,
 
     .bdrv_attach_aio_context    = nbd_attach_aio_context,
     .bdrv_detach_aio_context    = nbd_detach_aio_context,
@@ -0,0 +1,583 @@
+/*
+ * Prefetch filter block driver
+ *
+ * The filter is meant to be inserted above an overlay whose backing file
+ * is slow to read from, e.g. a golden image on NBD or HTTP.  Like the
+ * copy-on-read filter it copies whatever the guest reads into the overlay.
+ * In addition it watches the reads for sequential and strided streams,
+ * and once a stream is established it copies the data that the stream is
+ * going to read next into the overlay in the background.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+
+#include "qapi/error.h"
+#include "qapi/qapi-types-block-core.h"
+#include "qemu/coroutine.h"
+#include "qemu/hbitmap.h"
+#include "qemu/module.h"
+#include "qemu/option.h"
+#include "qemu/units.h"
+#include "block/block-io.h"
+#include "block/block_int.h"
+#include "trace.h"
+
+/* Number of streams that are tracked at the same time */
+#define PREFETCH_STREAMS 8
+
+/* Number of reads that must follow a pattern before read-ahead starts */
+#define PREFETCH_CONFIDENCE 2
+
+typedef struct PrefetchOpts {
+    int64_t window;
+    int64_t request_size;
+    int64_t max_requests;
+} PrefetchOpts;
+
+typedef struct PrefetchStream {
+    /* Offset and end of the last read of the stream */
+    int64_t last;
+    int64_t next;
+    /* Distance between the reads of a strided stream, 0 if sequential */
+    int64_t stride;
+    /* Number of reads that followed the pattern, 0 if the slot is free */
+    unsigned confidence;
+    /* Next read of a strided stream that has not been read ahead yet */
+    int64_t ahead;
+    uint64_t lru;
+} PrefetchStream;
+
+typedef struct BDRVPrefetchState {
+    PrefetchOpts opts;
+
+    QemuMutex lock;
+    /*
+     * Chunks of @opts.request_size bytes that have been read ahead, or are
+     * being read ahead.  Guest writes clear their chunks again.
+     */
+    HBitmap *prefetched;
+    /* Length of the node, the size of @prefetched */
+    int64_t length;
+    PrefetchStream streams[PREFETCH_STREAMS];
+    uint64_t lru_clock;
+    unsigned in_flight;
+
+    /* Statistics, protected by @lock */
+    uint64_t read_bytes;
+    uint64_t hit_bytes;
+    uint64_t prefetch_requests;
+    uint64_t prefetch_bytes;
+    uint64_t failed_requests;
+} BDRVPrefetchState;
+
+typedef struct PrefetchRequest {
+    BlockDriverState *bs;
+    int64_t offset;
+    int64_t bytes;
+} PrefetchRequest;
+
+#define PREFETCH_OPT_WINDOW "window"
+#define PREFETCH_OPT_REQUEST_SIZE "request-size"
+#define PREFETCH_OPT_MAX_REQUESTS "max-requests"
+static QemuOptsList runtime_opts = {
+    .name = "prefetch",
+    .head = QTAILQ_HEAD_INITIALIZER(runtime_opts.head),
+    .desc = {
+        {
+            .name = PREFETCH_OPT_WINDOW,
+            .type = QEMU_OPT_SIZE,
+            .help = "how far ahead of a stream to read, default 4M",
+        },
+        {
+            .name = PREFETCH_OPT_REQUEST_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "size of each read-ahead request, default 256K",
+        },
+        {
+            .name = PREFETCH_OPT_MAX_REQUESTS,
+            .type = QEMU_OPT_NUMBER,
+            .help = "maximum number of read-ahead requests in flight, "
+                "default 8",
+        },
+        { /* end of list */ }
+    },
+};
+
+static bool prefetch_absorb_opts(PrefetchOpts *dest, QDict *options,
+                                 Error **errp)
+{
+    QemuOpts *opts = qemu_opts_create(&runtime_opts, NULL, 0, &error_abort);
+
+    if (!qemu_opts_absorb_qdict(opts, options, errp)) {
+        qemu_opts_del(opts);
+        return false;
+    }
+
+    dest->window = qemu_opt_get_size(opts, PREFETCH_OPT_WINDOW, 4 * MiB);
+    dest->request_size =
+        qemu_opt_get_size(opts, PREFETCH_OPT_REQUEST_SIZE, 256 * KiB);
+    dest->max_requests =
+        qemu_opt_get_number(opts, PREFETCH_OPT_MAX_REQUESTS, 8);
+
+    qemu_opts_del(opts);
+
+    if (dest->request_size < BDRV_SECTOR_SIZE ||
+        dest->request_size > BDRV_REQUEST_MAX_BYTES ||
+        !is_power_of_2(dest->request_size)) {
+        error_setg(errp, "request-size parameter of prefetch filter must be "
+                   "a power of 2 between %llu and %llu", BDRV_SECTOR_SIZE,
+                   (unsigned long long)pow2floor(BDRV_REQUEST_MAX_BYTES));
+        return false;
+    }
+
+    if (dest->window < dest->request_size || dest->window > INT32_MAX) {
+        error_setg(errp, "window parameter of prefetch filter must be "
+                   "between request-size and %d", INT32_MAX);
+        return false;
+    }
+
+    if (dest->max_requests < 1 || dest->max_requests > UINT16_MAX) {
+        error_setg(errp, "max-requests parameter of prefetch filter must be "
+                   "between 1 and %d", UINT16_MAX);
+        return false;
+    }
+
+    return true;
+}
+
+static int GRAPH_UNLOCKED
+prefetch_open(BlockDriverState *bs, QDict *options, int flags, Error **errp)
+{
+    BDRVPrefetchState *s = bs->opaque;
+    int64_t length;
+    int ret;
+
+    GLOBAL_STATE_CODE();
+
+    ret = bdrv_open_file_child(NULL, options, "file", bs, errp);
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (!prefetch_absorb_opts(&s->opts, options, errp)) {
+        return -EINVAL;
+    }
+
+    GRAPH_RDLOCK_GUARD_MAINLOOP();
+
+    length = bdrv_getlength(bs->file->bs);
+    if (length < 0) {
+        error_setg_errno(errp, -length, "Failed to get file length");
+        return length;
+    }
+
+    bs->supported_read_flags = BDRV_REQ_PREFETCH;
+
+    bs->supported_write_flags = BDRV_REQ_WRITE_UNCHANGED |
+        (BDRV_REQ_FUA & bs->file->bs->supported_write_flags);
+
+    bs->supported_zero_flags = BDRV_REQ_WRITE_UNCHANGED |
+        ((BDRV_REQ_FUA | BDRV_REQ_MAY_UNMAP | BDRV_REQ_NO_FALLBACK) &
+            bs->file->bs->supported_zero_flags);
+
+    qemu_mutex_init(&s->lock);
+    s->length = length;
+    s->prefetched = hbitmap_alloc(length, ctz64(s->opts.request_size));
+
+    return 0;
+}
+
+static void prefetch_close(BlockDriverState *bs)
+{
+    BDRVPrefetchState *s = bs->opaque;
+
+    hbitmap_free(s->prefetched);
+    qemu_mutex_destroy(&s->lock);
+}
+
+#define PERM_PASSTHROUGH (BLK_PERM_CONSISTENT_READ \
+                          | BLK_PERM_WRITE \
+                          | BLK_PERM_RESIZE)
+#define PERM_UNCHANGED (BLK_PERM_ALL & ~PERM_PASSTHROUGH)
+
+static void prefetch_child_perm(BlockDriverState *bs, BdrvChild *c,
+                                BdrvChildRole role,
+                                BlockReopenQueue *reopen_queue,
+                                uint64_t perm, uint64_t shared,
+                                uint64_t *nperm, uint64_t *nshared)
+{
+    *nperm = perm & PERM_PASSTHROUGH;
+    *nshared = (shared & PERM_PASSTHROUGH) | PERM_UNCHANGED;
+
+    /*
+     * Reading ahead writes unchanged data to the child, but we must not
+     * request write permissions for an inactive node.
+     */
+    if (!(bs->open_flags & BDRV_O_INACTIVE)) {
+        *nperm |= BLK_PERM_WRITE_UNCHANGED;
+    }
+}
+
+static int64_t coroutine_fn GRAPH_RDLOCK
+prefetch_co_getlength(BlockDriverState *bs)
+{
+    return bdrv_co_getlength(bs->file->bs);
+}
+
+/*
+ * Clear the chunks that overlap [@offset, @offset + @bytes).  The bitmap
+ * only works in whole chunks, so a partial write clears the whole chunk.
+ *
+ * Called with s->lock held.
+ */
+static void prefetch_reset_locked(BDRVPrefetchState *s, int64_t offset,
+                                  int64_t bytes)
+{
+    int64_t chunk = s->opts.request_size;
+    int64_t start = QEMU_ALIGN_DOWN(offset, chunk);
+    int64_t end = MIN(QEMU_ALIGN_UP(offset + bytes, chunk), s->length);
+
+    /* The node may have been shrunk in the meantime */
+    if (start < end) {
+        hbitmap_reset(s->prefetched, start, end - start);
+    }
+}
+
+static void coroutine_fn prefetch_co_entry(void *opaque)
+{
+    PrefetchRequest *req = opaque;
+    BlockDriverState *bs = req->bs;
+    BDRVPrefetchState *s = bs->opaque;
+    int ret;
+    GRAPH_RDLOCK_GUARD();
+
+    ret = bdrv_co_preadv(bs->file, req->offset, req->bytes, NULL,
+                         BDRV_REQ_COPY_ON_READ | BDRV_REQ_PREFETCH);
+    trace_prefetch_co_done(bs, req->offset, req->bytes, ret);
+
+    WITH_QEMU_LOCK_GUARD(&s->lock) {
+        if (ret < 0) {
+            prefetch_reset_locked(s, req->offset, req->bytes);
+            s->failed_requests++;
+        }
+        s->in_flight--;
+    }
+
+    g_free(req);
+    bdrv_dec_in_flight(bs);
+}
+
+/*
+ * Queue read-ahead of the chunks in [@offset, @offset + @bytes) that have
+ * not been read ahead yet, as long as the number of requests in flight
+ * allows.  Returns false once that limit has been reached.
+ *
+ * Called with s->lock held.
+ */
+static bool prefetch_queue_range(BlockDriverState *bs, int64_t offset,
+                                 int64_t bytes, GSList **reqs)
+{
+    BDRVPrefetchState *s = bs->opaque;
+    int64_t chunk = s->opts.request_size;
+    int64_t length = s->length;
+    int64_t end = MIN(offset + bytes, length);
+
+    offset = QEMU_ALIGN_DOWN(offset, chunk);
+    while (offset < end) {
+        PrefetchRequest *req;
+
+        /* Skip the chunks that have been read ahead already */
+        offset = hbitmap_next_zero(s->prefetched, offset, end - offset);
+        if (offset < 0) {
+            break;
+        }
+        if (s->in_flight >= s->opts.max_requests) {
+            return false;
+        }
+
+        req = g_new(PrefetchRequest, 1);
+        *req = (PrefetchRequest) {
+            .bs = bs,
+            .offset = offset,
+            .bytes = MIN(chunk, length - offset),
+        };
+        hbitmap_set(s->prefetched, req->offset, req->bytes);
+        s->in_flight++;
+        s->prefetch_requests++;
+        s->prefetch_bytes += req->bytes;
+        *reqs = g_slist_prepend(*reqs, req);
+        offset += chunk;
+    }
+
+    return true;
+}
+
+/* Called with s->lock held.  */
+static PrefetchStream *prefetch_match_stream(BDRVPrefetchState *s,
+                                             int64_t offset)
+{
+    PrefetchStream *victim = &s->streams[0];
+    int i;
+
+    for (i = 0; i < PREFETCH_STREAMS; i++) {
+        PrefetchStream *st = &s->streams[i];
+
+        if (!st->confidence) {
+            continue;
+        }
+        if (offset == st->next) {
+            /* Sequential, possibly after a strided start */
+            st->stride = 0;
+            st->ahead = 0;
+            st->confidence++;
+            return st;
+        }
+        if (st->stride && offset == st->last + st->stride) {
+            st->confidence++;
+            return st;
+        }
+    }
+
+    /*
+     * A read shortly after the only read of a stream may be the second
+     * read of a strided stream.
+     */
+    for (i = 0; i < PREFETCH_STREAMS; i++) {
+        PrefetchStream *st = &s->streams[i];
+
+        if (st->confidence == 1 && offset > st->next &&
+            offset - st->last <= s->opts.window) {
+            st->stride = offset - st->last;
+            st->ahead = 0;
+            st->confidence++;
+            return st;
+        }
+    }
+
+    /* Start a new stream in a free slot, or in the least recently used one */
+    for (i = 0; i < PREFETCH_STREAMS; i++) {
+        PrefetchStream *st = &s->streams[i];
+
+        if (!st->confidence) {
+            victim = st;
+            break;
+        }
+        if (st->lru < victim->lru) {
+            victim = st;
+        }
+    }
+    victim->stride = 0;
+    victim->ahead = 0;
+    victim->confidence = 1;
+    return victim;
+}
+
+/*
+ * Account a read of [@offset, @offset + @bytes), match it against the
+ * tracked streams and queue read-ahead for the stream it belongs to.
+ *
+ * Called with s->lock held.
+ */
+static void prefetch_track_read(BlockDriverState *bs, int64_t offset,
+                                int64_t bytes, GSList **reqs)
+{
+    BDRVPrefetchState *s = bs->opaque;
+    PrefetchStream *stream;
+    int64_t chunk = s->opts.request_size;
+    int64_t start, count, pos, budget;
+
+    s->read_bytes += bytes;
+    start = offset;
+    while (hbitmap_next_dirty_area(s->prefetched, start, offset + bytes,
+                                   INT64_MAX, &start, &count)) {
+        s->hit_bytes += count;
+        start += count;
+    }
+
+    stream = prefetch_match_stream(s, offset);
+    stream->last = offset;
+    stream->next = offset + bytes;
+    stream->lru = ++s->lru_clock;
+
+    if (stream->confidence < PREFETCH_CONFIDENCE) {
+        return;
+    }
+
+    /*
+     * Read-ahead works in whole chunks, so small strides are as good as
+     * sequential reads.
+     */
+    if (stream->stride < chunk) {
+        prefetch_queue_range(bs, stream->next, s->opts.window, reqs);
+        return;
+    }
+
+    /*
+     * Read ahead the next reads of the stream that fit into the window.
+     * Continue after the reads that earlier reads of the stream queued,
+     * and look at no more chunks than may be in flight, so that a large
+     * window with a small stride does not keep us here for long.
+     */
+    budget = s->opts.max_requests;
+    for (pos = MAX(stream->last + stream->stride, stream->ahead);
+         pos + bytes <= stream->next + s->opts.window && budget > 0;
+         pos += stream->stride) {
+        if (!prefetch_queue_range(bs, pos, bytes, reqs)) {
+            break;
+        }
+        stream->ahead = pos + stream->stride;
+        budget -= QEMU_ALIGN_UP(pos + bytes, chunk) / chunk -
+                  QEMU_ALIGN_DOWN(pos, chunk) / chunk;
+    }
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+prefetch_co_preadv_part(BlockDriverState *bs, int64_t offset, int64_t bytes,
+                        QEMUIOVector *qiov, size_t qiov_offset,
+                        BdrvRequestFlags flags)
+{
+    BDRVPrefetchState *s = bs->opaque;
+    GSList *reqs = NULL, *l;
+
+    if (!(flags & BDRV_REQ_PREFETCH)) {
+        WITH_QEMU_LOCK_GUARD(&s->lock) {
+            prefetch_track_read(bs, offset, bytes, &reqs);
+        }
+    }
+
+    /*
+     * The read-ahead coroutines start once this one yields, so that the
+     * read that triggered them is submitted first.
+     */
+    reqs = g_slist_reverse(reqs);
+    for (l = reqs; l; l = l->next) {
+        PrefetchRequest *req = l->data;
+
+        trace_prefetch_co_issue(bs, req->offset, req->bytes);
+        bdrv_inc_in_flight(bs);
+        aio_co_enter(bdrv_get_aio_context(bs),
+                     qemu_coroutine_create(prefetch_co_entry, req));
+    }
+    g_slist_free(reqs);
+
+    return bdrv_co_preadv_part(bs->file, offset, bytes, qiov, qiov_offset,
+                               flags | BDRV_REQ_COPY_ON_READ);
+}
+
+/* The guest overwrites the data, it does not count as read ahead anymore */
+static void prefetch_forget(BlockDriverState *bs, int64_t offset,
+                            int64_t bytes)
+{
+    BDRVPrefetchState *s = bs->opaque;
+
+    WITH_QEMU_LOCK_GUARD(&s->lock) {
+        prefetch_reset_locked(s, offset, bytes);
+    }
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+prefetch_co_pwritev_part(BlockDriverState *bs, int64_t offset, int64_t bytes,
+                         QEMUIOVector *qiov, size_t qiov_offset,
+                         BdrvRequestFlags flags)
+{
+    if (!(flags & BDRV_REQ_WRITE_UNCHANGED)) {
+        prefetch_forget(bs, offset, bytes);
+    }
+    return bdrv_co_pwritev_part(bs->file, offset, bytes, qiov, qiov_offset,
+                                flags);
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+prefetch_co_pwrite_zeroes(BlockDriverState *bs, int64_t offset, int64_t bytes,
+                          BdrvRequestFlags flags)
+{
+    if (!(flags & BDRV_REQ_WRITE_UNCHANGED)) {
+        prefetch_forget(bs, offset, bytes);
+    }
+    return bdrv_co_pwrite_zeroes(bs->file, offset, bytes, flags);
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+prefetch_co_pdiscard(BlockDriverState *bs, int64_t offset, int64_t bytes)
+{
+    prefetch_forget(bs, offset, bytes);
+    return bdrv_co_pdiscard(bs->file, offset, bytes);
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+prefetch_co_truncate(BlockDriverState *bs, int64_t offset, bool exact,
+                     PreallocMode prealloc, BdrvRequestFlags flags,
+                     Error **errp)
+{
+    BDRVPrefetchState *s = bs->opaque;
+    int64_t length;
+    int ret;
+
+    ret = bdrv_co_truncate(bs->file, offset, exact, prealloc, flags, errp);
+    if (ret < 0) {
+        return ret;
+    }
+
+    length = bdrv_co_getlength(bs->file->bs);
+    if (length < 0) {
+        error_setg_errno(errp, -length, "Failed to get file length");
+        return length;
+    }
+
+    WITH_QEMU_LOCK_GUARD(&s->lock) {
+        s->length = length;
+        hbitmap_truncate(s->prefetched, length);
+    }
+    return 0;
+}
+
+static BlockStatsSpecific *prefetch_get_specific_stats(BlockDriverState *bs)
+{
+    BDRVPrefetchState *s = bs->opaque;
+    BlockStatsSpecific *stats = g_new0(BlockStatsSpecific, 1);
+    BlockStatsSpecificPrefetch *prefetch = &stats->u.prefetch;
+
+    stats->driver = BLOCKDEV_DRIVER_PREFETCH;
+
+    WITH_QEMU_LOCK_GUARD(&s->lock) {
+        prefetch->read_bytes = s->read_bytes;
+        prefetch->hit_bytes = s->hit_bytes;
+        prefetch->prefetch_requests = s->prefetch_requests;
+        prefetch->prefetch_bytes = s->prefetch_bytes;
+        prefetch->failed_prefetch_requests = s->failed_requests;
+        prefetch->in_flight = s->in_flight;
+    }
+
+    return stats;
+}
+
+static BlockDriver bdrv_prefetch_filter = {
+    .format_name                        = "prefetch",
+    .instance_size                      = sizeof(BDRVPrefetchState),
+
+    .bdrv_open                          = prefetch_open,
+    .bdrv_close                         = prefetch_close,
+    .bdrv_child_perm                    = prefetch_child_perm,
+
+    .bdrv_co_getlength                  = prefetch_co_getlength,
+    .bdrv_co_truncate                   = prefetch_co_truncate,
+
+    .bdrv_co_preadv_part                = prefetch_co_preadv_part,
+    .bdrv_co_pwritev_part               = prefetch_co_pwritev_part,
+    .bdrv_co_pwrite_zeroes              = prefetch_co_pwrite_zeroes,
+    .bdrv_co_pdiscard                   = prefetch_co_pdiscard,
+
+    .bdrv_get_specific_stats            = prefetch_get_specific_stats,
+
+    .is_filter                          = true,
+};
+
+static void bdrv_prefetch_init(void)
+{
+    bdrv_register(&bdrv_prefetch_filter);
+}
+
+block_init(bdrv_prefetch_init);
@@ -342,6 +342,7 @@ static coroutine_fn GRAPH_RDLOCK
 BdrvDirtyBitmap *load_bitmap(BlockDriverState *bs,
                              Qcow2Bitmap *bm, Error **errp)
 {
+    BDRVQcow2State *s = bs->opaque;
     int ret;
     uint64_t *bitmap_table = NULL;
     uint32_t granularity;
@@ -353,6 +354,10 @@ BdrvDirtyBitmap *load_bitmap(BlockDriverState *bs,
         goto fail;
     }
 
+    if (s->compress_bitmaps) {
+        bdrv_dirty_bitmap_set_compressed(bitmap, true);
+    }
+
     if (bm->flags & BME_FLAG_IN_USE) {
         /* Data is unusable, skip loading it */
         return bitmap;
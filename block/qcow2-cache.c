@@ -25,16 +25,73 @@
 #include "qemu/osdep.h"
 #include "block/block-io.h"
 #include "qemu/memalign.h"
+#include "qemu/queue.h"
+#include "qemu/xxhash.h"
 #include "qcow2.h"
 #include "trace.h"
 
+/*
+ * Cached tables are indexed by a hash table on their offset, so that lookups
+ * don't need to scan the whole cache.
+ *
+ * Replacement uses a segmented LRU: tables enter the cache in the probation
+ * segment and are promoted to the protected segment when they are hit again.
+ * Victims are taken from the tail of the probation segment first, so a burst
+ * of tables that are only touched once (e.g. a sequential scan) cannot push
+ * the frequently used tables out of the cache. Tables that are currently in
+ * use (ref > 0) are not on any LRU list.
+ *
+ * Lookups can also be done without s->lock (see qcow2_cache_lookup_lockless).
+ * Each table has a sequence lock that is held for writing while the table is
+ * in use, because users may modify it, and while the table is replaced.
+ * Lockless readers therefore only succeed for tables that nobody has got.
+ * They count their hits in the entry, and the hits are folded into the
+ * statistics and the LRU state when the entry is about to be replaced or
+ * cleaned, so that tables that are only read without s->lock are not the
+ * first to go.
+ *
+ * When a table must be written back before it can be replaced, and this
+ * requires a flush first, the other unused dirty tables are written back in
+ * the background, without s->lock (see qcow2_cache_writeback_start).  They
+ * stay dirty until the write has completed, and writing a table or dropping
+ * it waits for the background write first, so that the older copy of the
+ * table cannot overwrite a newer one on disk.
+ */
+
 typedef struct Qcow2CachedTable {
     int64_t  offset;
     uint64_t lru_counter;
     int      ref;
     bool     dirty;
+    bool     protected;
+    int      hash_next;
+    /* Value of dirty_gen of the cache when the table was last marked dirty */
+    uint64_t dirty_gen;
+    /* Hits of lockless lookups that have not been accounted yet */
+    unsigned lockless_hits;
+    QemuSeqLock seqlock;
+    QTAILQ_ENTRY(Qcow2CachedTable) lru_entry;
 } Qcow2CachedTable;
 
+typedef QTAILQ_HEAD(, Qcow2CachedTable) Qcow2CacheLRU;
+
+typedef struct Qcow2CacheWritebackTable {
+    int      index;
+    int64_t  offset;
+    uint64_t dirty_gen;
+    int      ret;
+} Qcow2CacheWritebackTable;
+
+/* Copies of tables that are being written back in the background */
+typedef struct Qcow2CacheWriteback {
+    BlockDriverState *bs;
+    Qcow2Cache *c;
+    void *buf;
+    int count;
+    Qcow2CacheWritebackTable *tables;
+    bool done;
+} Qcow2CacheWriteback;
+
 struct Qcow2Cache {
     Qcow2CachedTable       *entries;
     struct Qcow2Cache      *depends;
@@ -44,6 +101,28 @@ struct Qcow2Cache {
     void                   *table_array;
     uint64_t                lru_counter;
     uint64_t                cache_clean_lru_counter;
+
+    int                    *hash_buckets;
+    unsigned                hash_mask;
+    Qcow2CacheLRU           probation_lru;
+    Qcow2CacheLRU           protected_lru;
+    int                     protected_count;
+    int                     protected_max;
+
+    uint64_t                hits;
+    uint64_t                misses;
+    uint64_t                evictions;
+
+    BlockDriverState       *bs;
+    uint64_t                dirty_gen;
+    /*
+     * Set with s->lock held while a background write-back is in flight, and
+     * until its result has been applied to the entries.  @writeback_lock
+     * protects writeback->done and @writeback_queue.
+     */
+    Qcow2CacheWriteback    *writeback;
+    QemuMutex               writeback_lock;
+    CoQueue                 writeback_queue;
 };
 
 static inline void *qcow2_cache_get_table_addr(Qcow2Cache *c, int table)
@@ -71,6 +150,127 @@ static inline const char *qcow2_cache_get_name(BDRVQcow2State *s, Qcow2Cache *c)
     }
 }
 
+static inline unsigned qcow2_cache_hash(Qcow2Cache *c, uint64_t offset)
+{
+    return qemu_xxhash2(offset / c->table_size) & c->hash_mask;
+}
+
+/* Returns the index of the entry caching @offset, or -1 if there is none */
+static int qcow2_cache_lookup(Qcow2Cache *c, uint64_t offset)
+{
+    int i;
+
+    for (i = c->hash_buckets[qcow2_cache_hash(c, offset)]; i >= 0;
+         i = c->entries[i].hash_next) {
+        if (c->entries[i].offset == offset) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void qcow2_cache_hash_insert(Qcow2Cache *c, int i)
+{
+    unsigned bucket = qcow2_cache_hash(c, c->entries[i].offset);
+
+    c->entries[i].hash_next = c->hash_buckets[bucket];
+    c->hash_buckets[bucket] = i;
+}
+
+static void qcow2_cache_hash_remove(Qcow2Cache *c, int i)
+{
+    int *p = &c->hash_buckets[qcow2_cache_hash(c, c->entries[i].offset)];
+
+    while (*p != i) {
+        assert(*p >= 0);
+        p = &c->entries[*p].hash_next;
+    }
+    *p = c->entries[i].hash_next;
+    c->entries[i].hash_next = -1;
+}
+
+static void qcow2_cache_lru_unlink(Qcow2Cache *c, Qcow2CachedTable *t)
+{
+    if (t->protected) {
+        QTAILQ_REMOVE(&c->protected_lru, t, lru_entry);
+        c->protected_count--;
+    } else {
+        QTAILQ_REMOVE(&c->probation_lru, t, lru_entry);
+    }
+}
+
+/* Puts an unused entry back on the LRU list of its segment as the MRU entry */
+static void qcow2_cache_lru_link(Qcow2Cache *c, Qcow2CachedTable *t)
+{
+    if (!t->protected) {
+        QTAILQ_INSERT_HEAD(&c->probation_lru, t, lru_entry);
+        return;
+    }
+
+    QTAILQ_INSERT_HEAD(&c->protected_lru, t, lru_entry);
+    c->protected_count++;
+
+    /* Demote the least recently used protected entries */
+    while (c->protected_count > c->protected_max) {
+        Qcow2CachedTable *victim = QTAILQ_LAST(&c->protected_lru);
+
+        QTAILQ_REMOVE(&c->protected_lru, victim, lru_entry);
+        c->protected_count--;
+        victim->protected = false;
+        QTAILQ_INSERT_HEAD(&c->probation_lru, victim, lru_entry);
+    }
+}
+
+/*
+ * Drops the table cached in an unused entry and makes the entry the first
+ * candidate for replacement.
+ */
+static void qcow2_cache_entry_free(Qcow2Cache *c, int i)
+{
+    Qcow2CachedTable *t = &c->entries[i];
+
+    assert(t->ref == 0);
+
+    if (t->offset) {
+        qcow2_cache_hash_remove(c, i);
+    }
+    t->offset = 0;
+    t->lru_counter = 0;
+    qatomic_set(&t->lockless_hits, 0);
+
+    qcow2_cache_lru_unlink(c, t);
+    t->protected = false;
+    QTAILQ_INSERT_TAIL(&c->probation_lru, t, lru_entry);
+}
+
+/* Resets the index and LRU lists of a cache that contains no tables */
+static void qcow2_cache_reset(Qcow2Cache *c)
+{
+    unsigned bucket;
+    int i;
+
+    for (bucket = 0; bucket <= c->hash_mask; bucket++) {
+        c->hash_buckets[bucket] = -1;
+    }
+
+    QTAILQ_INIT(&c->probation_lru);
+    QTAILQ_INIT(&c->protected_lru);
+    c->protected_count = 0;
+
+    for (i = 0; i < c->size; i++) {
+        Qcow2CachedTable *t = &c->entries[i];
+
+        assert(t->ref == 0);
+        seqlock_write_begin(&t->seqlock);
+        t->offset = 0;
+        t->lru_counter = 0;
+        t->protected = false;
+        t->hash_next = -1;
+        seqlock_write_end(&t->seqlock);
+        QTAILQ_INSERT_TAIL(&c->probation_lru, t, lru_entry);
+    }
+}
+
 static void qcow2_cache_table_release(Qcow2Cache *c, int i, int num_tables)
 {
 /* Using MADV_DONTNEED to discard memory is a Linux-specific feature */
@@ -86,9 +286,34 @@ static void qcow2_cache_table_release(Qcow2Cache *c, int i, int num_tables)
 #endif
 }
 
+/*
+ * Accounts the hits of lockless lookups of an unused table as if the table
+ * had been used normally: it becomes the most recently used table of the
+ * protected segment.  Returns false if there were no such hits.
+ */
+static bool qcow2_cache_fold_lockless_hits(Qcow2Cache *c, Qcow2CachedTable *t)
+{
+    unsigned hits = qatomic_xchg(&t->lockless_hits, 0);
+
+    if (!hits) {
+        return false;
+    }
+
+    c->hits += hits;
+    t->lru_counter = ++c->lru_counter;
+    qcow2_cache_lru_unlink(c, t);
+    t->protected = true;
+    qcow2_cache_lru_link(c, t);
+    return true;
+}
+
 static inline bool can_clean_entry(Qcow2Cache *c, int i)
 {
     Qcow2CachedTable *t = &c->entries[i];
+
+    if (t->ref == 0 && t->offset != 0) {
+        qcow2_cache_fold_lockless_hits(c, t);
+    }
     return t->ref == 0 && !t->dirty && t->offset != 0 &&
         t->lru_counter <= c->cache_clean_lru_counter;
 }
@@ -106,8 +331,9 @@ void qcow2_cache_clean_unused(Qcow2Cache *c)
 
         /* And count how many we can clean in a row */
         while (i < c->size && can_clean_entry(c, i)) {
-            c->entries[i].offset = 0;
-            c->entries[i].lru_counter = 0;
+            seqlock_write_begin(&c->entries[i].seqlock);
+            qcow2_cache_entry_free(c, i);
+            seqlock_write_end(&c->entries[i].seqlock);
             i++;
             to_clean++;
         }
@@ -132,22 +358,207 @@ Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables,
     assert(table_size <= s->cluster_size);
 
     c = g_new0(Qcow2Cache, 1);
+    c->bs = bs;
     c->size = num_tables;
     c->table_size = table_size;
+    c->hash_mask = pow2ceil(num_tables) - 1;
+    /* Keep at least a fifth of the cache for the probation segment */
+    c->protected_max = num_tables - DIV_ROUND_UP(num_tables, 5);
     c->entries = g_try_new0(Qcow2CachedTable, num_tables);
+    c->hash_buckets = g_try_new(int, c->hash_mask + 1);
     c->table_array = qemu_try_blockalign(bs->file->bs,
                                          (size_t) num_tables * c->table_size);
 
-    if (!c->entries || !c->table_array) {
+    if (!c->entries || !c->hash_buckets || !c->table_array) {
         qemu_vfree(c->table_array);
+        g_free(c->hash_buckets);
         g_free(c->entries);
         g_free(c);
-        c = NULL;
+        return NULL;
     }
 
+    qcow2_cache_reset(c);
+    qemu_mutex_init(&c->writeback_lock);
+    qemu_co_queue_init(&c->writeback_queue);
+
     return c;
 }
 
+static void qcow2_cache_writeback_free(Qcow2CacheWriteback *wb)
+{
+    qemu_vfree(wb->buf);
+    g_free(wb->tables);
+    g_free(wb);
+}
+
+/*
+ * Marks the tables that have been written back in the background as clean,
+ * unless they have been modified in the meantime.
+ */
+static void qcow2_cache_writeback_reap(Qcow2Cache *c)
+{
+    Qcow2CacheWriteback *wb = c->writeback;
+    int k;
+
+    if (!wb || !qatomic_load_acquire(&wb->done)) {
+        return;
+    }
+
+    for (k = 0; k < wb->count; k++) {
+        Qcow2CacheWritebackTable *wt = &wb->tables[k];
+        Qcow2CachedTable *t = &c->entries[wt->index];
+
+        if (wt->ret >= 0 && t->offset == wt->offset &&
+            t->dirty_gen == wt->dirty_gen) {
+            t->dirty = false;
+        }
+    }
+
+    c->writeback = NULL;
+    qcow2_cache_writeback_free(wb);
+}
+
+/* Waits for the background write-back of tables, if there is one */
+static void coroutine_mixed_fn qcow2_cache_writeback_wait(Qcow2Cache *c)
+{
+    Qcow2CacheWriteback *wb = c->writeback;
+
+    if (!wb) {
+        return;
+    }
+
+    if (qemu_in_coroutine()) {
+        QEMU_LOCK_GUARD(&c->writeback_lock);
+        while (!wb->done) {
+            qemu_co_queue_wait(&c->writeback_queue, &c->writeback_lock);
+        }
+    } else {
+        BDRV_POLL_WHILE(c->bs, !qatomic_load_acquire(&wb->done));
+    }
+
+    qcow2_cache_writeback_reap(c);
+}
+
+static void coroutine_fn qcow2_cache_writeback_entry(void *opaque)
+{
+    Qcow2CacheWriteback *wb = opaque;
+    BlockDriverState *bs = wb->bs;
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2Cache *c = wb->c;
+    int k;
+
+    GRAPH_RDLOCK_GUARD();
+
+    for (k = 0; k < wb->count; k++) {
+        Qcow2CacheWritebackTable *wt = &wb->tables[k];
+
+        if (c == s->refcount_block_cache) {
+            BLKDBG_CO_EVENT(bs->file, BLKDBG_REFBLOCK_UPDATE_PART);
+        } else if (c == s->l2_table_cache) {
+            BLKDBG_CO_EVENT(bs->file, BLKDBG_L2_UPDATE);
+        }
+        wt->ret = bdrv_co_pwrite(bs->file, wt->offset, c->table_size,
+                                 (uint8_t *) wb->buf +
+                                 (size_t) k * c->table_size, 0);
+    }
+
+    WITH_QEMU_LOCK_GUARD(&c->writeback_lock) {
+        qatomic_store_release(&wb->done, true);
+        qemu_co_queue_restart_all(&c->writeback_queue);
+    }
+
+    bdrv_dec_in_flight(bs);
+}
+
+/*
+ * Starts writing back the unused dirty tables in the background, so that
+ * they don't need to be written back when they are replaced later.  The
+ * tables are copied, so that they can be used and modified while they are
+ * written, and the write happens without s->lock.
+ *
+ * Must be called with s->lock held.  Nothing is done if the tables depend
+ * on another cache or a flush, as taking care of that is up to the caller.
+ */
+static void GRAPH_RDLOCK
+qcow2_cache_writeback_start(BlockDriverState *bs, Qcow2Cache *c)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2CacheWriteback *wb;
+    int i, count = 0;
+
+    /* Not from the synchronous paths, which don't hold s->lock */
+    if (!qemu_in_coroutine()) {
+        return;
+    }
+
+    qcow2_cache_writeback_reap(c);
+    if (c->writeback || c->depends || c->depends_on_flush) {
+        return;
+    }
+
+    for (i = 0; i < c->size; i++) {
+        Qcow2CachedTable *t = &c->entries[i];
+
+        if (t->ref == 0 && t->dirty && t->offset) {
+            count++;
+        }
+    }
+    if (count == 0) {
+        return;
+    }
+
+    wb = g_new0(Qcow2CacheWriteback, 1);
+    wb->bs = bs;
+    wb->c = c;
+    wb->buf = qemu_try_blockalign(bs->file->bs, (size_t) count * c->table_size);
+    wb->tables = g_new(Qcow2CacheWritebackTable, count);
+    if (!wb->buf) {
+        qcow2_cache_writeback_free(wb);
+        return;
+    }
+
+    for (i = 0; i < c->size; i++) {
+        Qcow2CachedTable *t = &c->entries[i];
+        Qcow2CacheWritebackTable *wt;
+        int ret;
+
+        if (t->ref || !t->dirty || !t->offset) {
+            continue;
+        }
+
+        /* Leave tables that fail the check to qcow2_cache_entry_flush() */
+        ret = qcow2_pre_write_overlap_check(bs, c == s->l2_table_cache ?
+                                            QCOW2_OL_ACTIVE_L2 :
+                                            QCOW2_OL_REFCOUNT_BLOCK,
+                                            t->offset, c->table_size, false);
+        if (ret < 0) {
+            continue;
+        }
+
+        wt = &wb->tables[wb->count];
+        *wt = (Qcow2CacheWritebackTable) {
+            .index      = i,
+            .offset     = t->offset,
+            .dirty_gen  = t->dirty_gen,
+        };
+        memcpy((uint8_t *) wb->buf + (size_t) wb->count * c->table_size,
+               qcow2_cache_get_table_addr(c, i), c->table_size);
+        wb->count++;
+    }
+    if (wb->count == 0) {
+        qcow2_cache_writeback_free(wb);
+        return;
+    }
+
+    trace_qcow2_cache_writeback_start(qemu_coroutine_self(),
+                                      c == s->l2_table_cache, wb->count);
+
+    c->writeback = wb;
+    bdrv_inc_in_flight(bs);
+    aio_co_enter(bdrv_get_aio_context(bs),
+                 qemu_coroutine_create(qcow2_cache_writeback_entry, wb));
+}
+
 int qcow2_cache_destroy(Qcow2Cache *c)
 {
     int i;
@@ -156,7 +567,15 @@ int qcow2_cache_destroy(Qcow2Cache *c)
         assert(c->entries[i].ref == 0);
     }
 
+    /* The node has been drained, so a background write-back has completed */
+    if (c->writeback) {
+        assert(c->writeback->done);
+        qcow2_cache_writeback_free(c->writeback);
+    }
+    qemu_mutex_destroy(&c->writeback_lock);
+
     qemu_vfree(c->table_array);
+    g_free(c->hash_buckets);
     g_free(c->entries);
     g_free(c);
 
@@ -189,6 +608,12 @@ qcow2_cache_entry_flush(BlockDriverState *bs, Qcow2Cache *c, int i)
         return 0;
     }
 
+    /* A background write must not overwrite the table afterwards */
+    qcow2_cache_writeback_wait(c);
+    if (!c->entries[i].dirty) {
+        return 0;
+    }
+
     trace_qcow2_cache_entry_flush(qemu_coroutine_self(),
                                   c == s->l2_table_cache, i);
 
@@ -300,19 +725,14 @@ void qcow2_cache_depends_on_flush(Qcow2Cache *c)
 
 int qcow2_cache_empty(BlockDriverState *bs, Qcow2Cache *c)
 {
-    int ret, i;
+    int ret;
 
     ret = qcow2_cache_flush(bs, c);
     if (ret < 0) {
         return ret;
     }
 
-    for (i = 0; i < c->size; i++) {
-        assert(c->entries[i].ref == 0);
-        c->entries[i].offset = 0;
-        c->entries[i].lru_counter = 0;
-    }
-
+    qcow2_cache_reset(c);
     qcow2_cache_table_release(c, 0, c->size);
 
     c->lru_counter = 0;
@@ -325,11 +745,10 @@ qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
                    void **table, bool read_from_disk)
 {
     BDRVQcow2State *s = bs->opaque;
-    int i;
+    Qcow2CachedTable *t;
+    bool hit;
+    int i, n;
     int ret;
-    int lookup_index;
-    uint64_t min_lru_counter = UINT64_MAX;
-    int min_lru_index = -1;
 
     assert(offset != 0);
 
@@ -344,40 +763,66 @@ qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
     }
 
     /* Check if the table is already cached */
-    i = lookup_index = (offset / c->table_size * 4) % c->size;
-    do {
-        const Qcow2CachedTable *t = &c->entries[i];
-        if (t->offset == offset) {
-            goto found;
-        }
-        if (t->ref == 0 && t->lru_counter < min_lru_counter) {
-            min_lru_counter = t->lru_counter;
-            min_lru_index = i;
+    i = qcow2_cache_lookup(c, offset);
+    if (i >= 0) {
+        hit = true;
+        c->hits++;
+        goto found;
+    }
+
+    hit = false;
+    c->misses++;
+
+    for (n = 0; ; n++) {
+        t = QTAILQ_LAST(&c->probation_lru);
+        if (!t) {
+            t = QTAILQ_LAST(&c->protected_lru);
         }
-        if (++i == c->size) {
-            i = 0;
+        if (!t) {
+            /* This can't happen in current synchronous code, but leave the
+             * check here as a reminder for whoever starts using AIO with the
+             * cache */
+            abort();
         }
-    } while (i != lookup_index);
 
-    if (min_lru_index == -1) {
-        /* This can't happen in current synchronous code, but leave the check
-         * here as a reminder for whoever starts using AIO with the cache */
-        abort();
+        /* Tables that lockless readers used are not the least recently used */
+        if (n >= c->size || !t->offset ||
+            !qcow2_cache_fold_lockless_hits(c, t)) {
+            break;
+        }
     }
 
     /* Cache miss: write a table back and replace it */
-    i = min_lru_index;
+    i = t - c->entries;
     trace_qcow2_cache_get_replace_entry(qemu_coroutine_self(),
                                         c == s->l2_table_cache, i);
 
-    ret = qcow2_cache_entry_flush(bs, c, i);
+    if (t->dirty && (c->depends || c->depends_on_flush)) {
+        /*
+         * Writing the table back requires a flush first. Start writing back
+         * the other unused dirty tables as well, so that evicting them later
+         * doesn't require another flush.
+         */
+        ret = qcow2_cache_entry_flush(bs, c, i);
+        if (ret == 0) {
+            qcow2_cache_writeback_start(bs, c);
+        }
+    } else {
+        ret = qcow2_cache_entry_flush(bs, c, i);
+    }
     if (ret < 0) {
         return ret;
     }
 
     trace_qcow2_cache_get_read(qemu_coroutine_self(),
                                c == s->l2_table_cache, i);
-    c->entries[i].offset = 0;
+    if (t->offset) {
+        c->evictions++;
+    }
+
+    /* Lockless readers must not see the new table before it is complete */
+    seqlock_write_begin(&t->seqlock);
+    qcow2_cache_entry_free(c, i);
     if (read_from_disk) {
         if (c == s->l2_table_cache) {
             BLKDBG_EVENT(bs->file, BLKDBG_L2_LOAD);
@@ -386,15 +831,28 @@ qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
         ret = bdrv_pread(bs->file, offset, c->table_size,
                          qcow2_cache_get_table_addr(c, i), 0);
         if (ret < 0) {
+            seqlock_write_end(&t->seqlock);
             return ret;
         }
     }
 
-    c->entries[i].offset = offset;
+    t->offset = offset;
+    qcow2_cache_hash_insert(c, i);
 
     /* And return the right table */
 found:
-    c->entries[i].ref++;
+    t = &c->entries[i];
+    if (t->ref == 0) {
+        qcow2_cache_lru_unlink(c, t);
+        t->protected = hit;
+        if (hit) {
+            /* The new user may modify the table */
+            seqlock_write_begin(&t->seqlock);
+        }
+    } else if (hit) {
+        t->protected = true;
+    }
+    t->ref++;
     *table = qcow2_cache_get_table_addr(c, i);
 
     trace_qcow2_cache_get_done(qemu_coroutine_self(),
@@ -423,7 +881,9 @@ void qcow2_cache_put(Qcow2Cache *c, void **table)
     *table = NULL;
 
     if (c->entries[i].ref == 0) {
+        seqlock_write_end(&c->entries[i].seqlock);
         c->entries[i].lru_counter = ++c->lru_counter;
+        qcow2_cache_lru_link(c, &c->entries[i]);
     }
 
     assert(c->entries[i].ref >= 0);
@@ -434,29 +894,92 @@ void qcow2_cache_entry_mark_dirty(Qcow2Cache *c, void *table)
     int i = qcow2_cache_get_table_idx(c, table);
     assert(c->entries[i].offset != 0);
     c->entries[i].dirty = true;
+    c->entries[i].dirty_gen = ++c->dirty_gen;
 }
 
 void *qcow2_cache_is_table_offset(Qcow2Cache *c, uint64_t offset)
 {
-    int i;
+    int i = qcow2_cache_lookup(c, offset);
 
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].offset == offset) {
-            return qcow2_cache_get_table_addr(c, i);
-        }
-    }
-    return NULL;
+    return i >= 0 ? qcow2_cache_get_table_addr(c, i) : NULL;
 }
 
 void qcow2_cache_discard(Qcow2Cache *c, void *table)
 {
     int i = qcow2_cache_get_table_idx(c, table);
 
-    assert(c->entries[i].ref == 0);
+    /* The cluster may be reused, don't let a background write land there */
+    qcow2_cache_writeback_wait(c);
 
-    c->entries[i].offset = 0;
-    c->entries[i].lru_counter = 0;
+    seqlock_write_begin(&c->entries[i].seqlock);
+    qcow2_cache_entry_free(c, i);
     c->entries[i].dirty = false;
+    seqlock_write_end(&c->entries[i].seqlock);
 
     qcow2_cache_table_release(c, i, 1);
 }
+
+/*
+ * Looks up the table at @offset without s->lock.  Returns the index of its
+ * entry and stores the table in *table, or returns -1 if the table is not
+ * cached.
+ *
+ * The contents of the table may change at any time, so the caller must not
+ * act on anything it read from *table until qcow2_cache_lockless_retry()
+ * has returned false for @seq.  The memory of the table stays valid as long
+ * as requests are in flight.
+ */
+int qcow2_cache_lookup_lockless(Qcow2Cache *c, uint64_t offset, void **table,
+                                unsigned *seq)
+{
+    int i, n = 0;
+
+    /*
+     * The hash chains may change under our feet, but entry indices are
+     * always valid.  Stop after as many steps as there are entries in case
+     * an entry moved to another chain while we were following it.
+     */
+    for (i = qatomic_read(&c->hash_buckets[qcow2_cache_hash(c, offset)]);
+         i >= 0 && n < c->size;
+         i = qatomic_read(&c->entries[i].hash_next), n++) {
+        Qcow2CachedTable *t = &c->entries[i];
+
+        *seq = seqlock_read_begin(&t->seqlock);
+        if (t->offset == offset) {
+            *table = qcow2_cache_get_table_addr(c, i);
+            return i;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Returns true if the table returned by qcow2_cache_lookup_lockless() may
+ * have been modified or replaced since the lookup.
+ */
+bool qcow2_cache_lockless_retry(Qcow2Cache *c, int i, unsigned seq)
+{
+    return seqlock_read_retry(&c->entries[i].seqlock, seq);
+}
+
+/* Accounts a successful lockless lookup of the table in entry @i */
+void qcow2_cache_lockless_hit(Qcow2Cache *c, int i)
+{
+    qatomic_inc(&c->entries[i].lockless_hits);
+}
+
+void qcow2_cache_get_stats(Qcow2Cache *c, Qcow2CacheStats *stats)
+{
+    uint64_t lockless_hits = 0;
+    int i;
+
+    for (i = 0; i < c->size; i++) {
+        lockless_hits += qatomic_read(&c->entries[i].lockless_hits);
+    }
+
+    *stats = (Qcow2CacheStats) {
+        .hits = c->hits + lockless_hits,
+        .misses = c->misses,
+        .evictions = c->evictions,
+    };
+}
@@ -30,8 +30,41 @@
 #include "qcow2.h"
 #include "qemu/bswap.h"
 #include "qemu/memalign.h"
+#include "qemu/rcu.h"
 #include "trace.h"
 
+typedef struct Qcow2OldL1Table {
+    struct rcu_head rcu;
+    uint64_t *table;
+} Qcow2OldL1Table;
+
+static void qcow2_free_old_l1_table(Qcow2OldL1Table *old)
+{
+    qemu_vfree(old->table);
+    g_free(old);
+}
+
+/*
+ * Replaces the in-memory L1 table.  Lockless readers may still be looking at
+ * the old table, so it is only freed after an RCU grace period.
+ */
+void qcow2_set_l1_table(BDRVQcow2State *s, uint64_t *l1_table, int l1_size)
+{
+    uint64_t *old_l1_table = s->l1_table;
+
+    seqlock_write_begin(&s->l1_seqlock);
+    qatomic_rcu_set(&s->l1_table, l1_table);
+    qatomic_set(&s->l1_size, l1_size);
+    seqlock_write_end(&s->l1_seqlock);
+
+    if (old_l1_table) {
+        Qcow2OldL1Table *old = g_new(Qcow2OldL1Table, 1);
+
+        old->table = old_l1_table;
+        call_rcu(old, qcow2_free_old_l1_table, rcu);
+    }
+}
+
 int coroutine_fn qcow2_shrink_l1_table(BlockDriverState *bs,
                                        uint64_t exact_size)
 {
@@ -68,7 +101,9 @@ int coroutine_fn qcow2_shrink_l1_table(BlockDriverState *bs,
         }
         qcow2_free_clusters(bs, s->l1_table[i] & L1E_OFFSET_MASK,
                             s->cluster_size, QCOW2_DISCARD_ALWAYS);
+        seqlock_write_begin(&s->l1_seqlock);
         s->l1_table[i] = 0;
+        seqlock_write_end(&s->l1_seqlock);
     }
     return 0;
 
@@ -78,8 +113,10 @@ fail:
      * overwritten l1_table. In this case it would be better to clear the
      * l1_table in memory to avoid possible image corruption.
      */
+    seqlock_write_begin(&s->l1_seqlock);
     memset(s->l1_table + new_l1_size, 0,
            (s->l1_size - new_l1_size) * L1E_SIZE);
+    seqlock_write_end(&s->l1_seqlock);
     return ret;
 }
 
@@ -177,12 +214,10 @@ int qcow2_grow_l1_table(BlockDriverState *bs, uint64_t min_size,
     if (ret < 0) {
         goto fail;
     }
-    qemu_vfree(s->l1_table);
     old_l1_table_offset = s->l1_table_offset;
     s->l1_table_offset = new_l1_table_offset;
-    s->l1_table = new_l1_table;
     old_l1_size = s->l1_size;
-    s->l1_size = new_l1_size;
+    qcow2_set_l1_table(s, new_l1_table, new_l1_size);
     qcow2_free_clusters(bs, old_l1_table_offset, old_l1_size * L1E_SIZE,
                         QCOW2_DISCARD_OTHER);
     return 0;
@@ -357,7 +392,9 @@ static int GRAPH_RDLOCK l2_allocate(BlockDriverState *bs, int l1_index)
 
     /* update the L1 entry */
     trace_qcow2_l2_allocate_write_l1(bs, l1_index);
+    seqlock_write_begin(&s->l1_seqlock);
     s->l1_table[l1_index] = l2_offset | QCOW_OFLAG_COPIED;
+    seqlock_write_end(&s->l1_seqlock);
     ret = qcow2_write_l1_entry(bs, l1_index);
     if (ret < 0) {
         goto fail;
@@ -371,7 +408,9 @@ fail:
     if (l2_slice != NULL) {
         qcow2_cache_put(s->l2_table_cache, (void **) &l2_slice);
     }
+    seqlock_write_begin(&s->l1_seqlock);
     s->l1_table[l1_index] = old_l2_offset;
+    seqlock_write_end(&s->l1_seqlock);
     if (l2_offset > 0) {
         qcow2_free_clusters(bs, l2_offset, s->l2_size * l2_entry_size(s),
                             QCOW2_DISCARD_ALWAYS);
@@ -742,6 +781,118 @@ fail:
     return ret;
 }
 
+/*
+ * Like qcow2_get_host_offset(), but without s->lock.  This only works if the
+ * L2 slice is cached and nobody is using it at the moment, and only for the
+ * common types of clusters.  Returns false if the lookup must be retried with
+ * s->lock held; errors are also left to the locked lookup to report.
+ */
+bool qcow2_get_host_offset_lockless(BlockDriverState *bs, uint64_t offset,
+                                    unsigned int *bytes, uint64_t *host_offset,
+                                    QCow2SubclusterType *subcluster_type)
+{
+    BDRVQcow2State *s = bs->opaque;
+    unsigned int l2_index, sc_index, l1_seq, l2_seq;
+    uint64_t l1_index, l2_offset, *l1_table, *l2_slice, l2_entry, l2_bitmap;
+    uint64_t bytes_available, bytes_needed, nb_clusters;
+    uint64_t host_cluster_offset, out_offset = 0;
+    unsigned int offset_in_cluster;
+    int l1_size, start_of_slice, sc, i;
+    QCow2SubclusterType type;
+
+    RCU_READ_LOCK_GUARD();
+
+    /* Get a consistent pair of L1 table and size */
+    l1_seq = seqlock_read_begin(&s->l1_seqlock);
+    l1_table = qatomic_rcu_read(&s->l1_table);
+    l1_size = qatomic_read(&s->l1_size);
+    if (seqlock_read_retry(&s->l1_seqlock, l1_seq)) {
+        return false;
+    }
+
+    l1_index = offset_to_l1_index(s, offset);
+    if (l1_index >= l1_size) {
+        return false;
+    }
+    l2_offset = l1_table[l1_index] & L1E_OFFSET_MASK;
+    if (!l2_offset || offset_into_cluster(s, l2_offset)) {
+        return false;
+    }
+
+    start_of_slice = l2_entry_size(s) *
+        (offset_to_l2_index(s, offset) - offset_to_l2_slice_index(s, offset));
+    i = qcow2_cache_lookup_lockless(s->l2_table_cache,
+                                    l2_offset + start_of_slice,
+                                    (void **) &l2_slice, &l2_seq);
+    if (i < 0) {
+        return false;
+    }
+
+    offset_in_cluster = offset_into_cluster(s, offset);
+    bytes_needed = (uint64_t) *bytes + offset_in_cluster;
+    bytes_available =
+        ((uint64_t) (s->l2_slice_size - offset_to_l2_slice_index(s, offset)))
+        << s->cluster_bits;
+    bytes_needed = MIN(bytes_needed, bytes_available);
+    nb_clusters = size_to_clusters(s, bytes_needed);
+
+    l2_index = offset_to_l2_slice_index(s, offset);
+    sc_index = offset_to_sc_index(s, offset);
+    l2_entry = get_l2_entry(s, l2_slice, l2_index);
+    l2_bitmap = get_l2_bitmap(s, l2_slice, l2_index);
+
+    type = qcow2_get_subcluster_type(bs, l2_entry, l2_bitmap, sc_index);
+    switch (type) {
+    case QCOW2_SUBCLUSTER_ZERO_PLAIN:
+    case QCOW2_SUBCLUSTER_ZERO_ALLOC:
+        if (s->qcow_version < 3) {
+            return false;
+        }
+        break;
+    case QCOW2_SUBCLUSTER_NORMAL:
+    case QCOW2_SUBCLUSTER_UNALLOCATED_PLAIN:
+    case QCOW2_SUBCLUSTER_UNALLOCATED_ALLOC:
+        break;
+    default:
+        /* Compressed and invalid clusters go through the locked lookup */
+        return false;
+    }
+
+    if (type == QCOW2_SUBCLUSTER_NORMAL ||
+        type == QCOW2_SUBCLUSTER_ZERO_ALLOC ||
+        type == QCOW2_SUBCLUSTER_UNALLOCATED_ALLOC) {
+        host_cluster_offset = l2_entry & L2E_OFFSET_MASK;
+        if (offset_into_cluster(s, host_cluster_offset) ||
+            (has_data_file(bs) &&
+             host_cluster_offset != offset - offset_in_cluster)) {
+            return false;
+        }
+        out_offset = host_cluster_offset + offset_in_cluster;
+    }
+
+    sc = count_contiguous_subclusters(bs, nb_clusters, sc_index,
+                                      l2_slice, &l2_index);
+    if (sc < 0) {
+        return false;
+    }
+
+    /* Only now we know that everything we read was consistent */
+    if (qcow2_cache_lockless_retry(s->l2_table_cache, i, l2_seq) ||
+        seqlock_read_retry(&s->l1_seqlock, l1_seq)) {
+        return false;
+    }
+    qcow2_cache_lockless_hit(s->l2_table_cache, i);
+
+    bytes_available = ((int64_t)sc + sc_index) << s->subcluster_bits;
+    bytes_available = MIN(bytes_available, bytes_needed);
+    assert(bytes_available - offset_in_cluster <= UINT_MAX);
+
+    *bytes = bytes_available - offset_in_cluster;
+    *host_offset = out_offset;
+    *subcluster_type = type;
+    return true;
+}
+
 /*
  * get_cluster_table
  *
@@ -1619,22 +1770,7 @@ do_alloc_cluster_offset(BlockDriverState *bs, uint64_t guest_offset,
 
     /* Allocate new clusters */
     trace_qcow2_cluster_alloc_phys(qemu_coroutine_self());
-    if (*host_offset == INV_OFFSET) {
-        int64_t cluster_offset =
-            qcow2_alloc_clusters(bs, *nb_clusters * s->cluster_size);
-        if (cluster_offset < 0) {
-            return cluster_offset;
-        }
-        *host_offset = cluster_offset;
-        return 0;
-    } else {
-        int64_t ret = qcow2_alloc_clusters_at(bs, *host_offset, *nb_clusters);
-        if (ret < 0) {
-            return ret;
-        }
-        *nb_clusters = ret;
-        return 0;
-    }
+    return qcow2_alloc_data_clusters(bs, host_offset, nb_clusters);
 }
 
 /*
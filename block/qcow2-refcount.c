@@ -1065,6 +1065,113 @@ int64_t coroutine_fn qcow2_alloc_clusters_at(BlockDriverState *bs, uint64_t offs
     return i;
 }
 
+/*
+ * Refills the reservation of data clusters with at least @nb_clusters
+ * clusters.  Allocating writes that are in flight at the same time are
+ * likely to be followed by more of them, so the reservation is made large
+ * enough for one allocation of every request in the group, which takes a
+ * single pass over the refcount blocks instead of one per request.
+ */
+static int coroutine_fn GRAPH_RDLOCK
+reserve_data_clusters(BlockDriverState *bs, uint64_t nb_clusters)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t batch_max = MAX(QCOW2_ALLOC_BATCH_MAX >> s->cluster_bits, 1);
+    uint64_t group = 1, batch;
+    QCowL2Meta *m;
+    int64_t offset;
+
+    assert(s->reserved_clusters == 0);
+
+    QLIST_FOREACH(m, &s->cluster_allocs, next_in_flight) {
+        group++;
+    }
+    batch = MAX(MIN(nb_clusters * group, batch_max), nb_clusters);
+
+    offset = qcow2_alloc_clusters(bs, batch << s->cluster_bits);
+    if (offset < 0 && batch > nb_clusters) {
+        /* Don't fail a request only because the batch didn't fit */
+        batch = nb_clusters;
+        offset = qcow2_alloc_clusters(bs, batch << s->cluster_bits);
+    }
+    if (offset < 0) {
+        return offset;
+    }
+
+    trace_qcow2_reserve_data_clusters(qemu_coroutine_self(), offset, batch,
+                                      group);
+    s->reserved_offset = offset;
+    s->reserved_clusters = batch;
+    return 0;
+}
+
+/*
+ * Allocates host clusters for guest data.  If *host_offset is INV_OFFSET,
+ * the clusters may be allocated anywhere, otherwise only at *host_offset.
+ *
+ * Clusters are taken from the reservation of data clusters if possible.
+ * *nb_clusters is decreased if not all of the requested clusters could be
+ * allocated contiguously, possibly to 0 if *host_offset was given.  On
+ * success, *host_offset is set to the offset of the first allocated
+ * cluster.
+ *
+ * Returns 0 on success and -errno on failure.
+ */
+int coroutine_fn GRAPH_RDLOCK
+qcow2_alloc_data_clusters(BlockDriverState *bs, uint64_t *host_offset,
+                          uint64_t *nb_clusters)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int ret;
+
+    if (*host_offset != INV_OFFSET &&
+        (s->reserved_clusters == 0 || s->reserved_offset != *host_offset))
+    {
+        int64_t count = qcow2_alloc_clusters_at(bs, *host_offset,
+                                                *nb_clusters);
+        if (count < 0) {
+            return count;
+        }
+        *nb_clusters = count;
+        return 0;
+    }
+
+    if (s->reserved_clusters == 0) {
+        ret = reserve_data_clusters(bs, *nb_clusters);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    *nb_clusters = MIN(*nb_clusters, s->reserved_clusters);
+    *host_offset = s->reserved_offset;
+
+    s->reserved_offset += *nb_clusters << s->cluster_bits;
+    s->reserved_clusters -= *nb_clusters;
+
+    return 0;
+}
+
+/*
+ * Frees the clusters of the reservation of data clusters that haven't been
+ * used yet.  This must be called before anything that expects all clusters
+ * with a non-zero refcount to be referenced, e.g. before checking the image
+ * or shrinking it, and before the image is closed.
+ */
+void GRAPH_RDLOCK qcow2_release_reserved_clusters(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    if (s->reserved_clusters == 0) {
+        return;
+    }
+
+    qcow2_free_clusters(bs, s->reserved_offset,
+                        s->reserved_clusters << s->cluster_bits,
+                        QCOW2_DISCARD_NEVER);
+    s->reserved_clusters = 0;
+}
+
 /* only used to allocate compressed sectors. We try to allocate
    contiguous sectors. size must be <= cluster_size */
 int64_t coroutine_fn GRAPH_RDLOCK qcow2_alloc_bytes(BlockDriverState *bs, int size)
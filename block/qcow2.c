@@ -614,6 +614,9 @@ qcow2_co_check_locked(BlockDriverState *bs, BdrvCheckResult *result,
 
     memset(result, 0, sizeof(*result));
 
+    /* Reserved clusters would be reported as leaks */
+    qcow2_release_reserved_clusters(bs);
+
     ret = qcow2_check_read_snapshot_table(bs, &snapshot_res, fix);
     if (ret < 0) {
         qcow2_add_check_result(result, &snapshot_res, false);
@@ -734,6 +737,11 @@ static QemuOptsList qcow2_runtime_opts = {
             .type = QEMU_OPT_BOOL,
             .help = "Do not unreference discarded clusters",
         },
+        {
+            .name = QCOW2_OPT_COMPRESS_BITMAPS,
+            .type = QEMU_OPT_BOOL,
+            .help = "Keep persistent dirty bitmaps compressed in memory",
+        },
         {
             .name = QCOW2_OPT_OVERLAP,
             .type = QEMU_OPT_STRING,
@@ -978,6 +986,7 @@ typedef struct Qcow2ReopenState {
     int overlap_check;
     bool discard_passthrough[QCOW2_DISCARD_MAX];
     bool discard_no_unref;
+    bool compress_bitmaps;
     uint64_t cache_clean_interval;
     QCryptoBlockOpenOptions *crypto_opts; /* Disk encryption runtime options */
 } Qcow2ReopenState;
@@ -1157,6 +1166,9 @@ qcow2_update_options_prepare(BlockDriverState *bs, Qcow2ReopenState *r,
         goto fail;
     }
 
+    r->compress_bitmaps = qemu_opt_get_bool(opts, QCOW2_OPT_COMPRESS_BITMAPS,
+                                            false);
+
     switch (s->crypt_method_header) {
     case QCOW_CRYPT_NONE:
         if (encryptfmt) {
@@ -1238,6 +1250,7 @@ static void qcow2_update_options_commit(BlockDriverState *bs,
     }
 
     s->discard_no_unref = r->discard_no_unref;
+    s->compress_bitmaps = r->compress_bitmaps;
 
     if (s->cache_clean_interval != r->cache_clean_interval) {
         cache_clean_timer_del(bs);
@@ -1888,6 +1901,8 @@ qcow2_do_open(BlockDriverState *bs, QDict *options, int flags,
 #endif
 
     qemu_co_queue_init(&s->thread_task_queue);
+    qemu_co_queue_init(&s->compress_alloc_queue);
+    qemu_co_queue_init(&s->link_l2_done);
 
     return ret;
 
@@ -2013,6 +2028,9 @@ qcow2_reopen_prepare(BDRVReopenState *state,BlockReopenQueue *queue,
             goto fail;
         }
 
+        /* The image is marked clean, so the refcounts must be accurate */
+        qcow2_release_reserved_clusters(state->bs);
+
         ret = bdrv_flush(state->bs);
         if (ret < 0) {
             goto fail;
@@ -2227,6 +2245,67 @@ out:
     return ret;
 }
 
+typedef struct Qcow2LinkL2Request {
+    QCowL2Meta *l2meta;
+    int ret;
+    bool done;
+    QSLIST_ENTRY(Qcow2LinkL2Request) next;
+} Qcow2LinkL2Request;
+
+/*
+ * Updates the L2 entries for @l2meta, like qcow2_handle_l2meta(bs, l2meta,
+ * true) followed by qcow2_handle_l2meta(bs, l2meta, false) for whatever
+ * could not be linked.
+ *
+ * With many allocating writes in flight, most of them complete while
+ * another one holds s->lock.  Instead of having each of them take the lock
+ * in turn, the first one to get it updates the L2 entries of all writes
+ * that are waiting, and the others only need to pick up their result.
+ *
+ * Must be called without s->lock held, returns with s->lock held.
+ */
+static int coroutine_fn GRAPH_RDLOCK
+qcow2_link_l2meta(BlockDriverState *bs, QCowL2Meta *l2meta)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2LinkL2Request req = {
+        .l2meta = l2meta,
+    };
+
+    if (!l2meta) {
+        qemu_co_mutex_lock(&s->lock);
+        return 0;
+    }
+
+    QSLIST_INSERT_HEAD_ATOMIC(&s->link_l2_requests, &req, next);
+    qemu_co_mutex_lock(&s->lock);
+
+    while (!req.done) {
+        QSLIST_HEAD(, Qcow2LinkL2Request) batch;
+        Qcow2LinkL2Request *r;
+
+        QSLIST_MOVE_ATOMIC(&batch, &s->link_l2_requests);
+        if (QSLIST_EMPTY(&batch)) {
+            /* Another coroutine is linking our request */
+            qemu_co_queue_wait(&s->link_l2_done, &s->lock);
+            continue;
+        }
+
+        while ((r = QSLIST_FIRST(&batch)) != NULL) {
+            QSLIST_REMOVE_HEAD(&batch, next);
+
+            r->ret = qcow2_handle_l2meta(bs, &r->l2meta, true);
+            qcow2_handle_l2meta(bs, &r->l2meta, false);
+
+            /* @r may go away as soon as s->lock is dropped */
+            r->done = true;
+        }
+        qemu_co_queue_restart_all(&s->link_l2_done);
+    }
+
+    return req.ret;
+}
+
 static int coroutine_fn GRAPH_RDLOCK
 qcow2_co_preadv_encrypted(BlockDriverState *bs,
                            uint64_t host_offset,
@@ -2405,12 +2484,16 @@ qcow2_co_preadv_part(BlockDriverState *bs, int64_t offset, int64_t bytes,
                             QCOW_MAX_CRYPT_CLUSTERS * s->cluster_size);
         }
 
-        qemu_co_mutex_lock(&s->lock);
-        ret = qcow2_get_host_offset(bs, offset, &cur_bytes,
-                                    &host_offset, &type);
-        qemu_co_mutex_unlock(&s->lock);
-        if (ret < 0) {
-            goto out;
+        /* Most lookups hit a cached L2 slice and don't need s->lock */
+        if (!qcow2_get_host_offset_lockless(bs, offset, &cur_bytes,
+                                            &host_offset, &type)) {
+            qemu_co_mutex_lock(&s->lock);
+            ret = qcow2_get_host_offset(bs, offset, &cur_bytes,
+                                        &host_offset, &type);
+            qemu_co_mutex_unlock(&s->lock);
+            if (ret < 0) {
+                goto out;
+            }
         }
 
         if (type == QCOW2_SUBCLUSTER_ZERO_PLAIN ||
@@ -2643,9 +2726,8 @@ int qcow2_co_pwritev_task(BlockDriverState *bs, uint64_t host_offset,
         }
     }
 
-    qemu_co_mutex_lock(&s->lock);
-
-    ret = qcow2_handle_l2meta(bs, &l2meta, true);
+    ret = qcow2_link_l2meta(bs, l2meta);
+    l2meta = NULL;
     goto out_locked;
 
 out_unlocked:
@@ -2772,6 +2854,8 @@ static int GRAPH_RDLOCK qcow2_inactivate(BlockDriverState *bs)
                           bdrv_get_device_or_node_name(bs));
     }
 
+    qcow2_release_reserved_clusters(bs);
+
     ret = qcow2_cache_flush(bs, s->l2_table_cache);
     if (ret) {
         result = ret;
@@ -4344,6 +4428,12 @@ qcow2_co_truncate(BlockDriverState *bs, int64_t offset, bool exact,
     old_length = bs->total_sectors * BDRV_SECTOR_SIZE;
     new_l1_size = size_to_l1(s, offset);
 
+    /*
+     * Both shrinking and preallocation look at the end of the allocated
+     * clusters, which must not include the reservation.
+     */
+    qcow2_release_reserved_clusters(bs);
+
     if (offset < old_length) {
         int64_t last_cluster, old_file_size;
         if (prealloc != PREALLOC_MODE_OFF) {
@@ -4675,6 +4765,25 @@ fail:
     return ret;
 }
 
+/*
+ * Wait until all compressed writes that took an earlier ticket have allocated
+ * their clusters.  Must be called with s->lock held.
+ */
+static void coroutine_fn
+qcow2_compress_alloc_wait(BDRVQcow2State *s, unsigned ticket)
+{
+    while (s->compress_alloc_serving != ticket) {
+        qemu_co_queue_wait(&s->compress_alloc_queue, &s->lock);
+    }
+}
+
+/* Let the next compressed write allocate.  Must be called with s->lock held. */
+static void coroutine_fn qcow2_compress_alloc_done(BDRVQcow2State *s)
+{
+    s->compress_alloc_serving++;
+    qemu_co_queue_restart_all(&s->compress_alloc_queue);
+}
+
 static int coroutine_fn GRAPH_RDLOCK
 qcow2_co_pwritev_compressed_task(BlockDriverState *bs,
                                  uint64_t offset, uint64_t bytes,
@@ -4685,10 +4794,14 @@ qcow2_co_pwritev_compressed_task(BlockDriverState *bs,
     ssize_t out_len;
     uint8_t *buf, *out_buf;
     uint64_t cluster_offset;
+    unsigned ticket;
 
     assert(bytes == s->cluster_size || (bytes < s->cluster_size &&
            (offset + bytes == bs->total_sectors << BDRV_SECTOR_BITS)));
 
+    /* Taken before the first yield, so tickets follow the issuing order */
+    ticket = qatomic_fetch_inc(&s->compress_alloc_ticket);
+
     buf = qemu_blockalign(bs, s->cluster_size);
     if (bytes < s->cluster_size) {
         /* Zero-pad last write if image size is not cluster aligned */
@@ -4700,21 +4813,34 @@ qcow2_co_pwritev_compressed_task(BlockDriverState *bs,
 
     out_len = qcow2_co_compress(bs, out_buf, s->cluster_size - 1,
                                 buf, s->cluster_size);
+
+    qemu_co_mutex_lock(&s->lock);
+    qcow2_compress_alloc_wait(s, ticket);
+
     if (out_len == -ENOMEM) {
-        /* could not compress: write normal cluster */
+        /*
+         * could not compress: write normal cluster, keeping our turn until
+         * it has been allocated
+         */
+        qemu_co_mutex_unlock(&s->lock);
         ret = qcow2_co_pwritev_part(bs, offset, bytes, qiov, qiov_offset, 0);
+        qemu_co_mutex_lock(&s->lock);
+        qcow2_compress_alloc_done(s);
+        qemu_co_mutex_unlock(&s->lock);
         if (ret < 0) {
             goto fail;
         }
         goto success;
     } else if (out_len < 0) {
+        qcow2_compress_alloc_done(s);
+        qemu_co_mutex_unlock(&s->lock);
         ret = -EINVAL;
         goto fail;
     }
 
-    qemu_co_mutex_lock(&s->lock);
     ret = qcow2_alloc_compressed_cluster_offset(bs, offset, out_len,
                                                 &cluster_offset);
+    qcow2_compress_alloc_done(s);
     if (ret < 0) {
         qemu_co_mutex_unlock(&s->lock);
         goto fail;
@@ -4908,7 +5034,9 @@ static int GRAPH_RDLOCK make_completely_empty(BlockDriverState *bs)
     if (ret < 0) {
         goto fail_broken_refcounts;
     }
+    seqlock_write_begin(&s->l1_seqlock);
     memset(s->l1_table, 0, l1_size2);
+    seqlock_write_end(&s->l1_seqlock);
 
     BLKDBG_EVENT(bs->file, BLKDBG_EMPTY_IMAGE_PREPARE);
 
@@ -5025,6 +5153,8 @@ static int GRAPH_RDLOCK qcow2_make_empty(BlockDriverState *bs)
 
     l1_clusters = DIV_ROUND_UP(s->l1_size, s->cluster_size / L1E_SIZE);
 
+    qcow2_release_reserved_clusters(bs);
+
     if (s->qcow_version >= 3 && !s->snapshots && !s->nb_bitmaps &&
         3 + l1_clusters <= s->refcount_block_size &&
         s->crypt_method_header != QCOW_CRYPT_LUKS &&
@@ -5248,6 +5378,7 @@ qcow2_co_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
     bdi->subcluster_size = s->subcluster_size;
     bdi->vm_state_offset = qcow2_vm_state_offset(s);
     bdi->is_dirty = s->incompatible_features & QCOW2_INCOMPAT_DIRTY;
+    bdi->multi_cluster_compressed_writes = !has_data_file(bs);
     return 0;
 }
 
@@ -5331,6 +5462,26 @@ qcow2_get_specific_info(BlockDriverState *bs, Error **errp)
     return spec_info;
 }
 
+static BlockStatsSpecific *qcow2_get_specific_stats(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    BlockStatsSpecific *stats = g_new0(BlockStatsSpecific, 1);
+
+    stats->driver = BLOCKDEV_DRIVER_QCOW2;
+    stats->u.qcow2.l2_cache = g_new0(Qcow2CacheStats, 1);
+    stats->u.qcow2.refcount_cache = g_new0(Qcow2CacheStats, 1);
+
+    if (s->l2_table_cache) {
+        qcow2_cache_get_stats(s->l2_table_cache, stats->u.qcow2.l2_cache);
+    }
+    if (s->refcount_block_cache) {
+        qcow2_cache_get_stats(s->refcount_block_cache,
+                              stats->u.qcow2.refcount_cache);
+    }
+
+    return stats;
+}
+
 static int coroutine_mixed_fn GRAPH_RDLOCK
 qcow2_has_zero_init(BlockDriverState *bs)
 {
@@ -6180,6 +6331,7 @@ BlockDriver bdrv_qcow2 = {
     .bdrv_measure                       = qcow2_measure,
     .bdrv_co_get_info                   = qcow2_co_get_info,
     .bdrv_get_specific_info             = qcow2_get_specific_info,
+    .bdrv_get_specific_stats            = qcow2_get_specific_stats,
 
     .bdrv_co_save_vmstate               = qcow2_co_save_vmstate,
     .bdrv_co_load_vmstate               = qcow2_co_load_vmstate,
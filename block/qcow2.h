@@ -28,6 +28,7 @@
 #include "crypto/block.h"
 #include "qemu/coroutine.h"
 #include "qemu/units.h"
+#include "qemu/seqlock.h"
 #include "block/block_int.h"
 
 //#define DEBUG_ALLOC
@@ -71,6 +72,9 @@
 /* Maximum of parallel sub-request per guest request */
 #define QCOW2_MAX_WORKERS 8
 
+/* Maximum size of the data clusters reserved for concurrent allocations */
+#define QCOW2_ALLOC_BATCH_MAX (4 * MiB)
+
 /* indicate that the refcount of the referenced cluster is exactly one. */
 #define QCOW_OFLAG_COPIED     (1ULL << 63)
 /* indicate that the cluster is compressed (they never have the copied flag) */
@@ -134,6 +138,7 @@
 #define QCOW2_OPT_DISCARD_SNAPSHOT "pass-discard-snapshot"
 #define QCOW2_OPT_DISCARD_OTHER "pass-discard-other"
 #define QCOW2_OPT_DISCARD_NO_UNREF "discard-no-unref"
+#define QCOW2_OPT_COMPRESS_BITMAPS "compress-bitmaps"
 #define QCOW2_OPT_OVERLAP "overlap-check"
 #define QCOW2_OPT_OVERLAP_TEMPLATE "overlap-check.template"
 #define QCOW2_OPT_OVERLAP_MAIN_HEADER "overlap-check.main-header"
@@ -342,6 +347,12 @@ typedef struct BDRVQcow2State {
     uint64_t cluster_offset_mask;
     uint64_t l1_table_offset;
     uint64_t *l1_table;
+    /*
+     * Taken for writing (with s->lock held) when L1 entries or the L1 table
+     * itself change, so that qcow2_get_host_offset_lockless() can notice.
+     * Replaced L1 tables are freed after an RCU grace period.
+     */
+    QemuSeqLock l1_seqlock;
 
     Qcow2Cache *l2_table_cache;
     Qcow2Cache *refcount_block_cache;
@@ -350,6 +361,14 @@ typedef struct BDRVQcow2State {
 
     QLIST_HEAD(, QCowL2Meta) cluster_allocs;
 
+    /*
+     * Data clusters that have been allocated in bulk for concurrent
+     * allocating writes, but aren't referenced by any L2 entry yet.
+     * Protected by s->lock.
+     */
+    uint64_t reserved_offset;
+    uint64_t reserved_clusters;
+
     uint64_t *refcount_table;
     uint64_t refcount_table_offset;
     uint32_t refcount_table_size;
@@ -388,6 +407,9 @@ typedef struct BDRVQcow2State {
 
     bool discard_no_unref;
 
+    /* Keep the persistent bitmaps compressed in memory */
+    bool compress_bitmaps;
+
     int overlap_check; /* bitmask of Qcow2MetadataOverlap values */
     bool signaled_corruption;
 
@@ -411,6 +433,26 @@ typedef struct BDRVQcow2State {
     CoQueue thread_task_queue;
     int nb_threads;
 
+    /*
+     * Compressed writes are compressed in parallel, but allocate their host
+     * clusters in the order in which they were issued, so that the layout of
+     * the image does not depend on which compression finishes first.  Each
+     * write takes a ticket and waits on compress_alloc_queue (under s->lock)
+     * until compress_alloc_serving reaches it.
+     */
+    unsigned compress_alloc_ticket;
+    unsigned compress_alloc_serving;
+    CoQueue compress_alloc_queue;
+
+    /*
+     * Allocating writes that have written their data and wait for s->lock
+     * to update their L2 entries.  Whoever takes s->lock first links the L2
+     * entries of all of them, and wakes up those who found their request
+     * already taken from the list on link_l2_done.
+     */
+    QSLIST_HEAD(, Qcow2LinkL2Request) link_l2_requests;
+    CoQueue link_l2_done;
+
     BdrvChild *data_file;
 
     bool metadata_preallocation_checked;
@@ -873,6 +915,11 @@ int64_t GRAPH_RDLOCK coroutine_fn
 qcow2_alloc_clusters_at(BlockDriverState *bs, uint64_t offset,
                         int64_t nb_clusters);
 
+int coroutine_fn GRAPH_RDLOCK
+qcow2_alloc_data_clusters(BlockDriverState *bs, uint64_t *host_offset,
+                          uint64_t *nb_clusters);
+void GRAPH_RDLOCK qcow2_release_reserved_clusters(BlockDriverState *bs);
+
 int64_t coroutine_fn GRAPH_RDLOCK qcow2_alloc_bytes(BlockDriverState *bs, int size);
 void GRAPH_RDLOCK qcow2_free_clusters(BlockDriverState *bs,
                                       int64_t offset, int64_t size,
@@ -917,6 +964,8 @@ int coroutine_fn GRAPH_RDLOCK
 qcow2_detect_metadata_preallocation(BlockDriverState *bs);
 
 /* qcow2-cluster.c functions */
+void qcow2_set_l1_table(BDRVQcow2State *s, uint64_t *l1_table, int l1_size);
+
 int GRAPH_RDLOCK
 qcow2_grow_l1_table(BlockDriverState *bs, uint64_t min_size, bool exact_size);
 
@@ -931,6 +980,10 @@ int GRAPH_RDLOCK
 qcow2_get_host_offset(BlockDriverState *bs, uint64_t offset,
                       unsigned int *bytes, uint64_t *host_offset,
                       QCow2SubclusterType *subcluster_type);
+bool GRAPH_RDLOCK
+qcow2_get_host_offset_lockless(BlockDriverState *bs, uint64_t offset,
+                               unsigned int *bytes, uint64_t *host_offset,
+                               QCow2SubclusterType *subcluster_type);
 
 int coroutine_fn GRAPH_RDLOCK
 qcow2_alloc_host_offset(BlockDriverState *bs, uint64_t offset,
@@ -1021,6 +1074,12 @@ qcow2_cache_get_empty(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
 void qcow2_cache_put(Qcow2Cache *c, void **table);
 void *qcow2_cache_is_table_offset(Qcow2Cache *c, uint64_t offset);
 void qcow2_cache_discard(Qcow2Cache *c, void *table);
+void qcow2_cache_get_stats(Qcow2Cache *c, Qcow2CacheStats *stats);
+
+int qcow2_cache_lookup_lockless(Qcow2Cache *c, uint64_t offset, void **table,
+                                unsigned *seq);
+bool qcow2_cache_lockless_retry(Qcow2Cache *c, int i, unsigned seq);
+void qcow2_cache_lockless_hit(Qcow2Cache *c, int i);
 
 /* qcow2-bitmap.c functions */
 int coroutine_fn GRAPH_RDLOCK
@@ -3827,6 +3827,8 @@ static const Property vtd_properties[] = {
     DEFINE_PROP_BOOL("dma-translation", IntelIOMMUState, dma_translation, true),
     DEFINE_PROP_BOOL("stale-tm", IntelIOMMUState, stale_tm, false),
     DEFINE_PROP_BOOL("fs1gp", IntelIOMMUState, fs1gp, true),
+    DEFINE_PROP_UINT32("translation-cache-size", IntelIOMMUState,
+                       translation_cache_size, 0),
 };
 
 /* Read IRTE entry with specific index */
@@ -4203,6 +4205,7 @@ VTDAddressSpace *vtd_find_add_as(IntelIOMMUState *s, PCIBus *bus,
         .pasid = pasid,
     };
     VTDAddressSpace *vtd_dev_as;
+    Error *err = NULL;
     char name[128];
 
     vtd_iommu_lock(s);
@@ -4321,6 +4324,17 @@ VTDAddressSpace *vtd_find_add_as(IntelIOMMUState *s, PCIBus *bus,
         g_hash_table_insert(s->vtd_address_spaces, new_key, vtd_dev_as);
 
         vtd_iommu_unlock(s);
+
+        /*
+         * get_address_space() cannot fail, so a device whose cache
+         * cannot be enabled still translates, only without the cache.
+         */
+        if (s->translation_cache_size &&
+            !memory_region_iommu_set_translation_cache(
+                &vtd_dev_as->iommu, s->translation_cache_size, &err)) {
+            error_prepend(&err, "%s: ", name);
+            warn_report_err(err);
+        }
     }
     return vtd_dev_as;
 }
@@ -4788,6 +4802,18 @@ static bool vtd_decide_config(IntelIOMMUState *s, Error **errp)
         return false;
     }
 
+    if (s->translation_cache_size) {
+        if (!is_power_of_2(s->translation_cache_size)) {
+            error_setg(errp, "translation-cache-size must be a power of 2");
+            return false;
+        }
+        if (s->snoop_control) {
+            error_setg(errp, "translation-cache-size is not supported "
+                       "with snoop-control");
+            return false;
+        }
+    }
+
     return true;
 }
 
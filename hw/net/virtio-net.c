@@ -34,6 +34,9 @@
 #include "qapi/error.h"
 #include "qapi/qapi-events-net.h"
 #include "hw/qdev-properties.h"
+#include "hw/qdev-properties-system.h"
+#include "hw/virtio/iothread-vq-mapping.h"
+#include "block/aio-wait.h"
 #include "qapi/qapi-types-migration.h"
 #include "qapi/qapi-events-migration.h"
 #include "hw/virtio/virtio-access.h"
@@ -41,6 +44,7 @@
 #include "standard-headers/linux/ethtool.h"
 #include "system/system.h"
 #include "system/replay.h"
+#include "system/iothread.h"
 #include "trace.h"
 #include "monitor/qdev.h"
 #include "monitor/monitor.h"
@@ -374,20 +378,301 @@ static void virtio_net_vnet_endian_status(VirtIONet *n, uint8_t status)
     }
 }
 
+/* Queue pairs may run in an iothread, see virtio_net_start_ioeventfd() */
+static void virtio_net_notify(VirtIODevice *vdev, VirtQueue *vq)
+{
+    if (qemu_in_iothread()) {
+        virtio_notify_irqfd(vdev, vq);
+    } else {
+        virtio_notify(vdev, vq);
+    }
+}
+
 static void virtio_net_drop_tx_queue_data(VirtIODevice *vdev, VirtQueue *vq)
 {
     unsigned int dropped = virtqueue_drop_all(vq);
     if (dropped) {
-        virtio_notify(vdev, vq);
+        virtio_net_notify(vdev, vq);
+    }
+}
+
+/* Get back the buffers lent by virtio_net_post_rx_buffers() */
+static void virtio_net_rx_release(VirtIONetQueue *q, NetClientState *nc,
+                                  bool give_back)
+{
+    if (!q->rx_posted) {
+        return;
+    }
+
+    trace_virtio_net_release_rx_buffers(q->n, nc->queue_index, q->rx_posted,
+                                        give_back);
+    q->rx_give_back = give_back;
+    qemu_release_rx_buffers(nc);
+    q->rx_give_back = true;
+}
+
+static void virtio_net_tx_bh(void *opaque);
+
+/*
+ * With iothread-vq-mapping, virtio_net_start_ioeventfd() moves each queue
+ * pair to its iothread, together with its tx bh and its peer, so that the
+ * packets of the pair go through neither the main loop nor the BQL.  The
+ * control virtqueue stays in the main loop.  Whenever the main loop
+ * changes state that the queue pairs use, virtio_net_dataplane_pause()
+ * brings them back for the time being.
+ */
+
+/* The number of queue pairs that have virtqueues */
+static int virtio_net_dataplane_pairs(VirtIONet *n)
+{
+    return n->multiqueue ? n->max_queue_pairs : 1;
+}
+
+/* Whether the queue pairs can run in their iothreads */
+static bool virtio_net_dataplane_usable(VirtIONet *n)
+{
+    int i;
+
+    /* Receive segment coalescing and software RSS span queue pairs */
+    if (n->vhost_started || n->rsc4_enabled || n->rsc6_enabled ||
+        (n->rss_data.enabled && n->rss_data.enabled_software_rss)) {
+        return false;
+    }
+
+    for (i = 0; i < virtio_net_dataplane_pairs(n); i++) {
+        if (!qemu_can_set_peer_aio_context(qemu_get_subqueue(n->nic, i))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Context: BH in IOThread */
+static void virtio_net_dataplane_stop_bh(void *opaque)
+{
+    VirtIONetQueue *q = opaque;
+    AioContext *ctx = qemu_get_current_aio_context();
+
+    virtio_queue_aio_detach_host_notifier(q->rx_vq, ctx);
+    virtio_queue_aio_detach_host_notifier(q->tx_vq, ctx);
+}
+
+/*
+ * Move a queue pair, its tx bh and its peer to @ctx, or only detach the
+ * host notifiers of the pair if @ctx is NULL.  Attaching them kicks the
+ * virtqueues, so no notification is lost on the way.
+ *
+ * Context: BQL held
+ */
+static void virtio_net_queue_set_aio_context(VirtIONetQueue *q,
+                                             AioContext *ctx)
+{
+    VirtIONet *n = q->n;
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    NetClientState *nc = qemu_get_subqueue(n->nic, q - n->vqs);
+    AioContext *main_ctx = qemu_get_aio_context();
+    bool in_iothread = ctx && ctx != main_ctx;
+
+    if (q->ctx == ctx) {
+        return;
+    }
+
+    if (q->ctx == main_ctx) {
+        virtio_queue_aio_detach_host_notifier(q->rx_vq, main_ctx);
+        virtio_queue_aio_detach_host_notifier(q->tx_vq, main_ctx);
+    } else if (q->ctx) {
+        aio_wait_bh_oneshot(q->ctx, virtio_net_dataplane_stop_bh, q);
+    }
+
+    if (in_iothread || (q->ctx && q->ctx != main_ctx)) {
+        qemu_set_peer_aio_context(nc, in_iothread ? ctx : NULL);
+
+        qemu_bh_delete(q->tx_bh);
+        if (in_iothread) {
+            q->tx_bh = aio_bh_new(ctx, virtio_net_tx_bh, q);
+        } else {
+            q->tx_bh = qemu_bh_new_guarded(virtio_net_tx_bh, q,
+                                           &DEVICE(vdev)->mem_reentrancy_guard);
+        }
+        if (q->tx_waiting && vdev->vm_running) {
+            qemu_bh_schedule(q->tx_bh);
+        }
+    }
+
+    trace_virtio_net_queue_set_aio_context(n, q - n->vqs, ctx);
+    q->ctx = ctx;
+
+    if (ctx) {
+        virtio_queue_aio_attach_host_notifier_no_poll(q->rx_vq, ctx);
+        virtio_queue_aio_attach_host_notifier(q->tx_vq, ctx);
     }
 }
 
+/*
+ * Bring the queue pairs back to the main loop, until the matching
+ * virtio_net_dataplane_resume().  Returns whether they were paused.
+ *
+ * Context: BQL held
+ */
+static bool virtio_net_dataplane_pause(VirtIONet *n)
+{
+    int i;
+
+    if (!n->dataplane_started) {
+        return false;
+    }
+
+    if (!n->dataplane_paused++) {
+        for (i = 0; i < virtio_net_dataplane_pairs(n); i++) {
+            virtio_net_queue_set_aio_context(&n->vqs[i],
+                                             qemu_get_aio_context());
+        }
+    }
+    return true;
+}
+
+/* Context: BQL held */
+static void virtio_net_dataplane_resume(VirtIONet *n)
+{
+    int i;
+
+    assert(n->dataplane_started && n->dataplane_paused);
+
+    /* The queue pairs stay in the main loop if they have to */
+    if (--n->dataplane_paused || !virtio_net_dataplane_usable(n)) {
+        return;
+    }
+
+    for (i = 0; i < virtio_net_dataplane_pairs(n); i++) {
+        virtio_net_queue_set_aio_context(&n->vqs[i], n->pair_aio_context[i]);
+    }
+}
+
+/* Context: BQL held */
+static int virtio_net_start_ioeventfd(VirtIODevice *vdev)
+{
+    VirtIONet *n = VIRTIO_NET(vdev);
+    BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(vdev)));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    int nvqs = virtio_net_dataplane_pairs(n) * 2 + 1;
+    int i, r;
+
+    if (!n->pair_aio_context) {
+        return virtio_device_start_ioeventfd_impl(vdev);
+    }
+
+    if (!virtio_net_dataplane_usable(n)) {
+        trace_virtio_net_dataplane_unusable(n);
+        return virtio_device_start_ioeventfd_impl(vdev);
+    }
+
+    /* Set up guest notifier (irq) */
+    r = k->set_guest_notifiers(qbus->parent, nvqs, true);
+    if (r != 0) {
+        warn_report_once("virtio-net failed to set guest notifier (%d), "
+                         "not using iothread-vq-mapping; ensure -accel kvm "
+                         "is set.", r);
+        return virtio_device_start_ioeventfd_impl(vdev);
+    }
+
+    /*
+     * Batch all the host notifiers in a single transaction to avoid
+     * quadratic time complexity in address_space_update_ioeventfds().
+     */
+    memory_region_transaction_begin();
+
+    /* Set up virtqueue notify */
+    for (i = 0; i < nvqs; i++) {
+        r = virtio_bus_set_host_notifier(VIRTIO_BUS(qbus), i, true);
+        if (r != 0) {
+            int j = i;
+
+            error_report("virtio-net failed to set host notifier (%d)", r);
+            while (i--) {
+                virtio_bus_set_host_notifier(VIRTIO_BUS(qbus), i, false);
+            }
+
+            /*
+             * The transaction expects the ioeventfds to be open when it
+             * commits. Do it now, before the cleanup loop.
+             */
+            memory_region_transaction_commit();
+
+            while (j--) {
+                virtio_bus_cleanup_host_notifier(VIRTIO_BUS(qbus), j);
+            }
+            k->set_guest_notifiers(qbus->parent, nvqs, false);
+            return r;
+        }
+    }
+
+    memory_region_transaction_commit();
+
+    n->dataplane_started = true;
+    n->dataplane_paused = 0;
+
+    virtio_queue_aio_attach_host_notifier_no_poll(n->ctrl_vq,
+                                                  qemu_get_aio_context());
+    for (i = 0; i < virtio_net_dataplane_pairs(n); i++) {
+        virtio_net_queue_set_aio_context(&n->vqs[i], n->pair_aio_context[i]);
+    }
+    return 0;
+}
+
+/* Context: BQL held */
+static void virtio_net_stop_ioeventfd(VirtIODevice *vdev)
+{
+    VirtIONet *n = VIRTIO_NET(vdev);
+    BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(vdev)));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    int nvqs = virtio_net_dataplane_pairs(n) * 2 + 1;
+    int i;
+
+    if (!n->dataplane_started) {
+        virtio_device_stop_ioeventfd_impl(vdev);
+        return;
+    }
+
+    for (i = 0; i < virtio_net_dataplane_pairs(n); i++) {
+        virtio_net_queue_set_aio_context(&n->vqs[i], NULL);
+        n->vqs[i].reset_pending[0] = n->vqs[i].reset_pending[1] = false;
+    }
+    virtio_queue_aio_detach_host_notifier(n->ctrl_vq, qemu_get_aio_context());
+
+    n->dataplane_started = false;
+    n->dataplane_paused = 0;
+
+    /*
+     * Batch all the host notifiers in a single transaction to avoid
+     * quadratic time complexity in address_space_update_ioeventfds().
+     */
+    memory_region_transaction_begin();
+
+    for (i = 0; i < nvqs; i++) {
+        virtio_bus_set_host_notifier(VIRTIO_BUS(qbus), i, false);
+    }
+
+    /*
+     * The transaction expects the ioeventfds to be open when it
+     * commits. Do it now, before the cleanup loop.
+     */
+    memory_region_transaction_commit();
+
+    for (i = 0; i < nvqs; i++) {
+        virtio_bus_cleanup_host_notifier(VIRTIO_BUS(qbus), i);
+    }
+
+    /* Clean up guest notifier (irq) */
+    k->set_guest_notifiers(qbus->parent, nvqs, false);
+}
+
 static int virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
 {
     VirtIONet *n = VIRTIO_NET(vdev);
     VirtIONetQueue *q;
     int i;
     uint8_t queue_status;
+    bool paused = virtio_net_dataplane_pause(n);
 
     virtio_net_vnet_endian_status(n, status);
     virtio_net_vhost_status(n, status);
@@ -407,6 +692,11 @@ static int virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
 
         if (queue_started) {
             qemu_flush_queued_packets(ncs);
+        } else if (!(queue_status & VIRTIO_CONFIG_S_DRIVER_OK) ||
+                   !vdev->vm_running) {
+            /* The lent buffers can stay while only the link is down */
+            virtio_net_rx_release(q, ncs,
+                                  queue_status & VIRTIO_CONFIG_S_DRIVER_OK);
         }
 
         if (!q->tx_waiting) {
@@ -437,6 +727,10 @@ static int virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
             }
         }
     }
+
+    if (paused) {
+        virtio_net_dataplane_resume(n);
+    }
     return 0;
 }
 
@@ -554,6 +848,7 @@ static RxFilterInfo *virtio_net_query_rxfilter(NetClientState *nc)
 static void virtio_net_queue_reset(VirtIODevice *vdev, uint32_t queue_index)
 {
     VirtIONet *n = VIRTIO_NET(vdev);
+    VirtIONetQueue *q;
     NetClientState *nc;
 
     /* validate queue_index and skip for cvq */
@@ -561,6 +856,12 @@ static void virtio_net_queue_reset(VirtIODevice *vdev, uint32_t queue_index)
         return;
     }
 
+    /* Keep the pair out of its iothread until the queue is enabled again */
+    q = &n->vqs[vq2q(queue_index)];
+    if (!q->reset_pending[queue_index % 2] && virtio_net_dataplane_pause(n)) {
+        q->reset_pending[queue_index % 2] = true;
+    }
+
     nc = qemu_get_subqueue(n->nic, vq2q(queue_index));
 
     if (!nc->peer) {
@@ -572,12 +873,17 @@ static void virtio_net_queue_reset(VirtIODevice *vdev, uint32_t queue_index)
         vhost_net_virtqueue_reset(vdev, nc, queue_index);
     }
 
+    if (!(queue_index % 2)) {
+        virtio_net_rx_release(&n->vqs[vq2q(queue_index)], nc, false);
+    }
+
     flush_or_purge_queued_packets(nc);
 }
 
 static void virtio_net_queue_enable(VirtIODevice *vdev, uint32_t queue_index)
 {
     VirtIONet *n = VIRTIO_NET(vdev);
+    VirtIONetQueue *q;
     NetClientState *nc;
     int r;
 
@@ -586,6 +892,12 @@ static void virtio_net_queue_enable(VirtIODevice *vdev, uint32_t queue_index)
         return;
     }
 
+    q = &n->vqs[vq2q(queue_index)];
+    if (q->reset_pending[queue_index % 2]) {
+        q->reset_pending[queue_index % 2] = false;
+        virtio_net_dataplane_resume(n);
+    }
+
     nc = qemu_get_subqueue(n->nic, vq2q(queue_index));
 
     if (!nc->peer || !vdev->vhost_started) {
@@ -1598,7 +1910,9 @@ size_t virtio_net_handle_ctrl_iov(VirtIODevice *vdev,
 
 static void virtio_net_handle_ctrl(VirtIODevice *vdev, VirtQueue *vq)
 {
+    VirtIONet *n = VIRTIO_NET(vdev);
     VirtQueueElement *elem;
+    bool paused = virtio_net_dataplane_pause(n);
 
     for (;;) {
         size_t written;
@@ -1619,6 +1933,10 @@ static void virtio_net_handle_ctrl(VirtIODevice *vdev, VirtQueue *vq)
             break;
         }
     }
+
+    if (paused) {
+        virtio_net_dataplane_resume(n);
+    }
 }
 
 /* RX */
@@ -1702,17 +2020,24 @@ static void virtio_net_hdr_swap(VirtIODevice *vdev, struct virtio_net_hdr *hdr)
  * we should provide a mechanism to disable it to avoid polluting the host
  * cache.
  */
+#define DHCLIENT_CSUM_SIZE \
+    (ETH_HLEN + sizeof(struct ip_header) + sizeof(struct udp_header))
+
+/* Only the first DHCLIENT_CSUM_SIZE bytes of @buf are looked at */
+static bool is_broken_dhclient_packet(const struct virtio_net_hdr *hdr,
+                                      const uint8_t *buf, size_t size)
+{
+    return (hdr->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) && /* missing csum */
+           (size >= DHCLIENT_CSUM_SIZE && size < 1500) && /* normal MTU */
+           (buf[12] == 0x08 && buf[13] == 0x00) && /* ethertype == IPv4 */
+           (buf[23] == 17) && /* ip.protocol == UDP */
+           (buf[34] == 0 && buf[35] == 67); /* udp.srcport == bootps */
+}
+
 static void work_around_broken_dhclient(struct virtio_net_hdr *hdr,
                                         uint8_t *buf, size_t size)
 {
-    size_t csum_size = ETH_HLEN + sizeof(struct ip_header) +
-                       sizeof(struct udp_header);
-
-    if ((hdr->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) && /* missing csum */
-        (size >= csum_size && size < 1500) && /* normal sized MTU */
-        (buf[12] == 0x08 && buf[13] == 0x00) && /* ethertype == IPv4 */
-        (buf[23] == 17) && /* ip.protocol == UDP */
-        (buf[34] == 0 && buf[35] == 67)) { /* udp.srcport == bootps */
+    if (is_broken_dhclient_packet(hdr, buf, size)) {
         net_checksum_calculate(buf, size, CSUM_UDP);
         hdr->flags &= ~VIRTIO_NET_HDR_F_NEEDS_CSUM;
     }
@@ -2043,7 +2368,7 @@ static ssize_t virtio_net_receive_rcu(NetClientState *nc, const uint8_t *buf,
     }
 
     virtqueue_flush(q->rx_vq, i);
-    virtio_notify(vdev, q->rx_vq);
+    virtio_net_notify(vdev, q->rx_vq);
 
     return size;
 
@@ -2064,6 +2389,467 @@ static ssize_t virtio_net_do_receive(NetClientState *nc, const uint8_t *buf,
     return virtio_net_receive_rcu(nc, buf, size);
 }
 
+/*
+ * Zero-copy receive, see qemu_receive_direct().
+ *
+ * The elements for a packet are popped before it is read, and the sender
+ * reads the packet straight into their buffers, behind the header that
+ * the guest expects.  The host header goes to @buf, and so does the end
+ * of the packet if it does not fit the elements: @buf then matches what
+ * virtio_net_receive_rcu() gets, except for the part in guest memory.
+ *
+ * A packet that is filtered out has been written to buffers that the
+ * guest does not get back yet.  It could see such packets anyway, by
+ * turning on promiscuous mode.
+ */
+
+/* Enough of the packet for receive_filter() and the dhclient workaround */
+#define VIRTIO_NET_RX_DIRECT_PEEK 64
+
+/* Put back the first @num elements of @elems, @lens bytes were written */
+static void virtio_net_rx_unpop(VirtIONetQueue *q, VirtQueueElement **elems,
+                                const size_t *lens, int num)
+{
+    while (num-- > 0) {
+        virtqueue_unpop(q->rx_vq, elems[num], lens ? lens[num] : 0);
+        g_free(elems[num]);
+    }
+}
+
+/*
+ * Receive one packet from @sender.  Its elements are filled in the used
+ * ring after the @used elements already there, but not flushed.
+ *
+ * Returns 1 if a packet was read, even if it was dropped or left in @buf
+ * (then *@pending is set); 0 or -errno from @read_packet if there was
+ * none; -ENOBUFS if the guest has no buffers; or -EINVAL if the device
+ * broke.
+ */
+static int virtio_net_receive_direct_one(VirtIONetQueue *q,
+                                         NetClientState *sender,
+                                         NetReadPacket *read_packet,
+                                         uint8_t *buf, unsigned *used,
+                                         size_t *pending)
+{
+    VirtIONet *n = q->n;
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    QEMU_UNINITIALIZED VirtQueueElement *elems[VIRTQUEUE_MAX_SIZE];
+    QEMU_UNINITIALIZED size_t lens[VIRTQUEUE_MAX_SIZE];
+    QEMU_UNINITIALIZED struct iovec iov[VIRTQUEUE_MAX_SIZE];
+    size_t hdr_len = n->host_hdr_len;
+    size_t max = NET_BUFSIZE - hdr_len;
+    size_t want, cap = 0, head, size, offset;
+    struct iovec *guest_iov;
+    int i = 0, iovcnt = 0, guest_iovcnt, first, num, j;
+    bool linear = false;
+    ssize_t ret;
+
+    /* Room for the packets seen lately, at least for a full sized frame */
+    want = MAX(q->rx_direct_hint, ETH_MAX_L2_HDR_LEN + ETH_MTU);
+    if (!virtio_net_has_buffers(q, n->guest_hdr_len + want)) {
+        return -ENOBUFS;
+    }
+
+    if (hdr_len) {
+        iov[iovcnt++] = (struct iovec) { .iov_base = buf, .iov_len = hdr_len };
+    }
+    guest_iov = &iov[iovcnt];
+
+    do {
+        VirtQueueElement *elem;
+        size_t skip = i ? 0 : n->guest_hdr_len;
+
+        elem = virtqueue_pop(q->rx_vq, sizeof(VirtQueueElement));
+        if (!elem) {
+            break;
+        }
+        if (elem->in_num < 1) {
+            virtio_error(vdev,
+                         "virtio-net receive queue contains no in buffers");
+            virtqueue_detach_element(q->rx_vq, elem, 0);
+            g_free(elem);
+            virtio_net_rx_unpop(q, elems, NULL, i);
+            return -EINVAL;
+        }
+
+        num = iov_copy(&iov[iovcnt], ARRAY_SIZE(iov) - 1 - iovcnt,
+                       elem->in_sg, elem->in_num, skip, max - cap);
+        lens[i] = iov_size(&iov[iovcnt], num);
+        elems[i++] = elem;
+        iovcnt += num;
+        cap += lens[i - 1];
+    } while (n->mergeable_rx_bufs && cap < want && cap < max &&
+             i < VIRTQUEUE_MAX_SIZE && iovcnt < ARRAY_SIZE(iov) - 1);
+
+    if (!i) {
+        return -ENOBUFS;
+    }
+
+    guest_iovcnt = &iov[iovcnt] - guest_iov;
+    if (cap < max) {
+        iov[iovcnt++] = (struct iovec) {
+            .iov_base = buf + hdr_len + cap,
+            .iov_len = max - cap,
+        };
+    }
+
+    ret = read_packet(sender, iov, iovcnt);
+    if (ret <= 0 || ret < (ssize_t)hdr_len) {
+        virtio_net_rx_unpop(q, elems, NULL, i);
+        return ret <= 0 ? ret : 1;
+    }
+    size = ret;
+    head = MIN(size - hdr_len, cap);
+
+    /* From now on, @lens are the bytes written to each element */
+    offset = head;
+    for (j = 0; j < i; j++) {
+        size_t len = MIN(lens[j], offset);
+
+        offset -= len;
+        lens[j] = len + (j ? 0 : n->guest_hdr_len);
+    }
+
+    iov_to_buf(guest_iov, guest_iovcnt, 0, buf + hdr_len,
+               MIN(head, VIRTIO_NET_RX_DIRECT_PEEK));
+    if (!receive_filter(n, buf, size)) {
+        virtio_net_rx_unpop(q, elems, lens, i);
+        return 1;
+    }
+
+    /* Pop elements for the end of the packet, which went to @buf */
+    first = i;
+    for (offset = cap; offset < size - hdr_len; offset += lens[i++]) {
+        VirtQueueElement *elem;
+
+        if (!n->mergeable_rx_bufs) {
+            /* Drop it, as virtio_net_receive_rcu() does */
+            virtio_net_rx_unpop(q, elems, lens, i);
+            return 1;
+        }
+        if (i == VIRTQUEUE_MAX_SIZE) {
+            virtio_error(vdev, "virtio-net unexpected long buffer chain");
+            virtio_net_rx_unpop(q, elems, lens, i);
+            return -EINVAL;
+        }
+
+        elem = virtqueue_pop(q->rx_vq, sizeof(VirtQueueElement));
+        if (!elem) {
+            /* Let the sender queue the packet until there are buffers */
+            iov_to_buf(guest_iov, guest_iovcnt, 0, buf + hdr_len, head);
+            virtio_net_rx_unpop(q, elems, lens, i);
+            *pending = size;
+            return 1;
+        }
+        if (elem->in_num < 1) {
+            virtio_error(vdev,
+                         "virtio-net receive queue contains no in buffers");
+            virtqueue_detach_element(q->rx_vq, elem, 0);
+            g_free(elem);
+            virtio_net_rx_unpop(q, elems, lens, i);
+            return -EINVAL;
+        }
+        elems[i] = elem;
+        lens[i] = MIN(iov_size(elem->in_sg, elem->in_num),
+                      size - hdr_len - offset);
+    }
+
+    if (n->has_vnet_hdr &&
+        is_broken_dhclient_packet((struct virtio_net_hdr *)buf,
+                                  buf + hdr_len, size - hdr_len)) {
+        iov_to_buf(guest_iov, guest_iovcnt, 0, buf + hdr_len, head);
+        linear = true;
+    }
+    receive_header(n, elems[0]->in_sg, elems[0]->in_num, buf, size);
+    if (linear) {
+        iov_from_buf(guest_iov, guest_iovcnt, 0, buf + hdr_len, head);
+    }
+
+    for (j = first, offset = hdr_len + cap; j < i; offset += lens[j++]) {
+        iov_from_buf(elems[j]->in_sg, elems[j]->in_num, 0,
+                     buf + offset, lens[j]);
+    }
+
+    /* Give back the elements that were not needed after all */
+    num = i;
+    while (num > 1 && !lens[num - 1]) {
+        num--;
+    }
+    virtio_net_rx_unpop(q, elems + num, NULL, i - num);
+
+    if (n->mergeable_rx_bufs) {
+        uint16_t num_buffers;
+
+        virtio_stw_p(vdev, &num_buffers, num);
+        iov_from_buf(elems[0]->in_sg, elems[0]->in_num,
+                     offsetof(struct virtio_net_hdr_mrg_rxbuf, num_buffers),
+                     &num_buffers, sizeof(num_buffers));
+    }
+
+    for (j = 0; j < num; j++) {
+        virtqueue_fill(q->rx_vq, elems[j], lens[j], *used + j);
+        g_free(elems[j]);
+    }
+    *used += num;
+
+    q->rx_direct_hint = (q->rx_direct_hint + size - hdr_len) / 2;
+    return 1;
+}
+
+static int virtio_net_receive_direct(NetClientState *nc,
+                                     NetClientState *sender,
+                                     NetReadPacket *read_packet,
+                                     uint8_t *buf, int budget,
+                                     size_t *pending)
+{
+    VirtIONet *n = qemu_get_nic_opaque(nc);
+    VirtIONetQueue *q = virtio_net_get_subqueue(nc);
+    unsigned used = 0;
+    int packets = 0;
+    int ret = 0;
+
+    /* These need to look at the packet before it is put in guest memory */
+    if (n->rsc4_enabled || n->rsc6_enabled || n->rss_data.populate_hash ||
+        (n->rss_data.enabled && n->rss_data.enabled_software_rss)) {
+        return -ENOTSUP;
+    }
+
+    RCU_READ_LOCK_GUARD();
+
+    while (packets < budget && !*pending) {
+        ret = virtio_net_receive_direct_one(q, sender, read_packet, buf,
+                                            &used, pending);
+        if (ret <= 0) {
+            break;
+        }
+        packets++;
+    }
+
+    /* One notification for the whole batch */
+    if (used) {
+        virtqueue_flush(q->rx_vq, used);
+        virtio_net_notify(VIRTIO_DEVICE(n), q->rx_vq);
+    }
+
+    trace_virtio_net_receive_direct(n, nc->queue_index, packets, used);
+
+    /* Without buffers, the sender queues packets as usual */
+    if (!packets && ret == -ENOBUFS) {
+        return -ENOTSUP;
+    }
+    return packets;
+}
+
+/*
+ * An element lent by virtio_net_post_rx_buffers().  @seq counts the lent
+ * elements, and skips a number whenever the usual receive path popped
+ * elements in between, see virtio_net_rx_can_rewind().
+ */
+typedef struct VirtIONetRxPosted {
+    VirtQueueElement elem;
+    uint64_t seq;
+} VirtIONetRxPosted;
+
+/*
+ * Lend receive buffers to the peer.  Each buffer is the part of an element
+ * after the guest header, which must be contiguous in host memory and have
+ * room for @size bytes; a packet then always takes a single element.  The
+ * peer does not write the @headroom bytes in front of it, which can be the
+ * guest header and the end of another buffer.  The elements for @reserve
+ * more packets stay on the avail ring, for the packets that the peer
+ * receives elsewhere first: all the elements could be lent otherwise, and
+ * such a packet would wait for them in the queue, in front of the packets
+ * that use them.
+ */
+static int virtio_net_post_rx_buffers(NetClientState *nc, NetRxBuffer *bufs,
+                                      int num, size_t headroom, size_t size,
+                                      int reserve, const void *base,
+                                      size_t len)
+{
+    VirtIONet *n = qemu_get_nic_opaque(nc);
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    VirtIONetQueue *q = virtio_net_get_subqueue(nc);
+    int vq_index = virtio_get_queue_index(q->rx_vq);
+    const uint8_t *start = base;
+    int i;
+
+    /* As for virtio_net_receive_direct(), and the header is ours to write */
+    if (n->has_vnet_hdr || n->rsc4_enabled || n->rsc6_enabled ||
+        n->rss_data.populate_hash ||
+        (n->rss_data.enabled && n->rss_data.enabled_software_rss)) {
+        return -ENOTSUP;
+    }
+
+    RCU_READ_LOCK_GUARD();
+
+    for (i = 0; i < num; i++) {
+        VirtIONetRxPosted *posted;
+        VirtQueueElement *elem;
+        size_t offset = n->guest_hdr_len;
+        uint8_t *data = NULL;
+        size_t room = 0;
+        unsigned j;
+
+        if (!virtio_net_has_buffers(q, n->guest_hdr_len + size)) {
+            break;
+        }
+
+        if (reserve) {
+            unsigned int in_bytes, need = (n->guest_hdr_len + size) *
+                                          (reserve + 1);
+
+            virtqueue_get_avail_bytes(q->rx_vq, &in_bytes, NULL, need, 0);
+            if (in_bytes < need) {
+                break;
+            }
+        }
+
+        /* Leave a gap if the usual receive path popped elements */
+        if (virtio_queue_get_last_avail_idx(vdev, vq_index) !=
+            q->rx_post_avail) {
+            q->rx_post_seq++;
+        }
+
+        posted = virtqueue_pop(q->rx_vq, sizeof(VirtIONetRxPosted));
+        if (!posted) {
+            break;
+        }
+        elem = &posted->elem;
+
+        for (j = 0; j < elem->in_num; j++) {
+            if (offset < elem->in_sg[j].iov_len) {
+                data = (uint8_t *)elem->in_sg[j].iov_base + offset;
+                room = elem->in_sg[j].iov_len - offset;
+                break;
+            }
+            offset -= elem->in_sg[j].iov_len;
+        }
+
+        if (room < size || data < start + headroom ||
+            data + size > start + len) {
+            /* Leave it to the usual receive path */
+            virtqueue_unpop(q->rx_vq, elem, 0);
+            g_free(elem);
+            break;
+        }
+
+        posted->seq = q->rx_post_seq++;
+        q->rx_post_avail = virtio_queue_get_last_avail_idx(vdev, vq_index);
+        bufs[i] = (NetRxBuffer) {
+            .data = data,
+            .size = room,
+            .opaque = elem,
+        };
+    }
+
+    q->rx_posted += i;
+    trace_virtio_net_post_rx_buffers(n, nc->queue_index, i, q->rx_posted);
+    return i;
+}
+
+/*
+ * Whether the buffers that come back unused are the elements popped last
+ * from the rx vq.  They can then go back on the avail ring, instead of
+ * reaching the guest as empty packets, which it counts as length errors.
+ */
+static bool virtio_net_rx_can_rewind(VirtIONetQueue *q, NetRxBuffer *bufs,
+                                     const size_t *lens, int num,
+                                     bool can_receive)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(q->n);
+    uint64_t min = UINT64_MAX, max = 0;
+    int i, unused = 0;
+
+    if (virtio_queue_get_last_avail_idx(vdev,
+                                        virtio_get_queue_index(q->rx_vq)) !=
+        q->rx_post_avail) {
+        return false;
+    }
+
+    for (i = 0; i < num; i++) {
+        VirtIONetRxPosted *posted = bufs[i].opaque;
+
+        if (!lens[i] || !can_receive) {
+            min = MIN(min, posted->seq);
+            max = MAX(max, posted->seq);
+            unused++;
+        }
+    }
+
+    /* The numbers are unique, so these are the last ones without a gap */
+    return unused && max == q->rx_post_seq - 1 && max - min == unused - 1;
+}
+
+static int virtio_net_fill_rx_buffers(NetClientState *nc, NetRxBuffer *bufs,
+                                      const size_t *lens, int num)
+{
+    VirtIONet *n = qemu_get_nic_opaque(nc);
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    VirtIONetQueue *q = virtio_net_get_subqueue(nc);
+    bool can_receive = virtio_net_can_receive(nc);
+    bool rewind;
+    unsigned used = 0;
+    int kept = 0;
+    int i;
+
+    RCU_READ_LOCK_GUARD();
+
+    rewind = q->rx_give_back &&
+             virtio_net_rx_can_rewind(q, bufs, lens, num, can_receive);
+
+    for (i = 0; i < num; i++) {
+        VirtQueueElement *elem = bufs[i].opaque;
+        size_t len = lens[i];
+
+        if (len && can_receive && (nc->link_down || nc->peer->link_down)) {
+            /* Dropped, the buffers stay lent while the link is down */
+            bufs[kept++] = bufs[i];
+            continue;
+        }
+
+        if (len && can_receive) {
+            if (!receive_filter(n, bufs[i].data, len)) {
+                /* The peer can use it for the next packet */
+                bufs[kept++] = bufs[i];
+                continue;
+            }
+
+            receive_header(n, elem->in_sg, elem->in_num, bufs[i].data, len);
+            if (n->mergeable_rx_bufs) {
+                uint16_t num_buffers;
+
+                virtio_stw_p(vdev, &num_buffers, 1);
+                iov_from_buf(elem->in_sg, elem->in_num,
+                             offsetof(struct virtio_net_hdr_mrg_rxbuf,
+                                      num_buffers),
+                             &num_buffers, sizeof(num_buffers));
+            }
+            virtqueue_fill(q->rx_vq, elem, n->guest_hdr_len + len, used++);
+        } else if (rewind) {
+            virtqueue_unpop(q->rx_vq, elem, 0);
+        } else if (q->rx_give_back) {
+            virtqueue_fill(q->rx_vq, elem, 0, used++);
+        } else {
+            /* The queue is being reset */
+            virtqueue_detach_element(q->rx_vq, elem, 0);
+        }
+        g_free(elem);
+    }
+
+    q->rx_posted -= num - kept;
+
+    if (used) {
+        virtqueue_flush(q->rx_vq, used);
+        if (vdev->vm_running) {
+            virtio_net_notify(vdev, q->rx_vq);
+        }
+    }
+
+    trace_virtio_net_fill_rx_buffers(n, nc->queue_index, num, used, kept);
+    return kept;
+}
+
+
 /*
  * Accessors to read and write the IP packet data length field. This
  * is a potentially unaligned network-byte-order 16 bit unsigned integer
@@ -2693,7 +3479,7 @@ static void virtio_net_tx_complete(NetClientState *nc, ssize_t len)
     int ret;
 
     virtqueue_push(q->tx_vq, q->async_tx.elem, 0);
-    virtio_notify(vdev, q->tx_vq);
+    virtio_net_notify(vdev, q->tx_vq);
 
     g_free(q->async_tx.elem);
     q->async_tx.elem = NULL;
@@ -2805,7 +3591,7 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
 
 drop:
         virtqueue_push(q->tx_vq, elem, 0);
-        virtio_notify(vdev, q->tx_vq);
+        virtio_net_notify(vdev, q->tx_vq);
         g_free(elem);
 
         if (++num_packets >= n->tx_burst) {
@@ -2999,6 +3785,8 @@ static void virtio_net_add_queue(VirtIONet *n, int index)
     }
 
     n->vqs[index].tx_waiting = 0;
+    n->vqs[index].rx_give_back = true;
+    n->vqs[index].ctx = NULL;
     n->vqs[index].n = n;
 }
 
@@ -3513,6 +4301,9 @@ static NetClientInfo net_virtio_info = {
     .size = sizeof(NICState),
     .can_receive = virtio_net_can_receive,
     .receive = virtio_net_receive,
+    .receive_direct = virtio_net_receive_direct,
+    .post_rx_buffers = virtio_net_post_rx_buffers,
+    .fill_rx_buffers = virtio_net_fill_rx_buffers,
     .link_status_changed = virtio_net_set_link_status,
     .query_rx_filter = virtio_net_query_rxfilter,
     .announce = virtio_net_announce,
@@ -3746,6 +4537,57 @@ static bool failover_hide_primary_device(DeviceListener *listener,
     return qatomic_read(&n->failover_primary_hidden);
 }
 
+/* Context: BQL held */
+static bool virtio_net_pair_aio_context_init(VirtIONet *n, Error **errp)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(vdev)));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+
+    if (!n->iothread_vq_mapping_list) {
+        return true;
+    }
+
+    if (n->net_conf.tx && !strcmp(n->net_conf.tx, "timer")) {
+        error_setg(errp, "iothread-vq-mapping requires tx=bh");
+        return false;
+    }
+    if (!k->set_guest_notifiers || !k->ioeventfd_assign) {
+        error_setg(errp,
+                   "device is incompatible with iothread "
+                   "(transport does not support notifiers)");
+        return false;
+    }
+    if (!virtio_device_ioeventfd_enabled(vdev)) {
+        error_setg(errp, "ioeventfd is required for iothread");
+        return false;
+    }
+
+    /* The rx and tx virtqueues of a pair go together, so map the pairs */
+    n->pair_aio_context = g_new(AioContext *, n->max_queue_pairs);
+    if (!iothread_vq_mapping_apply(n->iothread_vq_mapping_list,
+                                   n->pair_aio_context, n->max_queue_pairs,
+                                   errp)) {
+        g_free(n->pair_aio_context);
+        n->pair_aio_context = NULL;
+        return false;
+    }
+
+    return true;
+}
+
+/* Context: BQL held */
+static void virtio_net_pair_aio_context_cleanup(VirtIONet *n)
+{
+    assert(!n->dataplane_started);
+
+    if (n->pair_aio_context) {
+        iothread_vq_mapping_cleanup(n->iothread_vq_mapping_list);
+        g_free(n->pair_aio_context);
+        n->pair_aio_context = NULL;
+    }
+}
+
 static void virtio_net_device_realize(DeviceState *dev, Error **errp)
 {
     VirtIODevice *vdev = VIRTIO_DEVICE(dev);
@@ -3840,6 +4682,12 @@ static void virtio_net_device_realize(DeviceState *dev, Error **errp)
         virtio_cleanup(vdev);
         return;
     }
+
+    if (!virtio_net_pair_aio_context_init(n, errp)) {
+        virtio_cleanup(vdev);
+        return;
+    }
+
     n->vqs = g_new0(VirtIONetQueue, n->max_queue_pairs);
     n->curr_queue_pairs = 1;
     n->tx_timeout = n->net_conf.txtimer;
@@ -3958,6 +4806,7 @@ static void virtio_net_device_unrealize(DeviceState *dev)
     qemu_announce_timer_del(&n->announce_timer, false);
     g_free(n->vqs);
     qemu_del_nic(n->nic);
+    virtio_net_pair_aio_context_cleanup(n);
     virtio_net_rsc_cleanup(n);
     g_free(n->rss_data.indirections_table);
     net_rx_pkt_uninit(n->rx_pkt);
@@ -4117,6 +4966,8 @@ static const Property virtio_net_properties[] = {
                        TX_TIMER_INTERVAL),
     DEFINE_PROP_INT32("x-txburst", VirtIONet, net_conf.txburst, TX_BURST),
     DEFINE_PROP_STRING("tx", VirtIONet, net_conf.tx),
+    DEFINE_PROP_IOTHREAD_VQ_MAPPING_LIST("iothread-vq-mapping", VirtIONet,
+                                         iothread_vq_mapping_list),
     DEFINE_PROP_UINT16("rx_queue_size", VirtIONet, net_conf.rx_queue_size,
                        VIRTIO_NET_RX_QUEUE_DEFAULT_SIZE),
     DEFINE_PROP_UINT16("tx_queue_size", VirtIONet, net_conf.tx_queue_size,
@@ -4154,6 +5005,8 @@ static void virtio_net_class_init(ObjectClass *klass, const void *data)
     vdc->queue_reset = virtio_net_queue_reset;
     vdc->queue_enable = virtio_net_queue_enable;
     vdc->set_status = virtio_net_set_status;
+    vdc->start_ioeventfd = virtio_net_start_ioeventfd;
+    vdc->stop_ioeventfd = virtio_net_stop_ioeventfd;
     vdc->guest_notifier_mask = virtio_net_guest_notifier_mask;
     vdc->guest_notifier_pending = virtio_net_guest_notifier_pending;
     vdc->legacy_features |= (0x1 << VIRTIO_NET_F_GSO);
@@ -150,6 +150,28 @@ static void virtio_iommu_switch_address_space_all(VirtIOIOMMU *s)
     }
 }
 
+/*
+ * The address spaces go away with the device, drop their translation
+ * caches so that they no longer receive notifications.
+ */
+static void virtio_iommu_disable_translation_caches(VirtIOIOMMU *s)
+{
+    GHashTableIter iter;
+    IOMMUPciBus *iommu_pci_bus;
+    int i;
+
+    g_hash_table_iter_init(&iter, s->as_by_busptr);
+    while (g_hash_table_iter_next(&iter, NULL, (void **)&iommu_pci_bus)) {
+        for (i = 0; i < PCI_DEVFN_MAX; i++) {
+            if (!iommu_pci_bus->pbdev[i]) {
+                continue;
+            }
+            memory_region_iommu_set_translation_cache(
+                &iommu_pci_bus->pbdev[i]->iommu_mr, 0, &error_abort);
+        }
+    }
+}
+
 /**
  * The bus number is used for lookup when SID based operations occur.
  * In that case we lazily populate the IOMMUPciBus array from the bus hash
@@ -408,6 +430,7 @@ static AddressSpace *virtio_iommu_find_add_as(PCIBus *bus, void *opaque,
     IOMMUPciBus *sbus = g_hash_table_lookup(s->as_by_busptr, bus);
     static uint32_t mr_index;
     IOMMUDevice *sdev;
+    Error *err = NULL;
 
     if (!sbus) {
         sbus = g_malloc0(sizeof(IOMMUPciBus) +
@@ -464,6 +487,18 @@ static AddressSpace *virtio_iommu_find_add_as(PCIBus *bus, void *opaque,
 
         virtio_iommu_switch_address_space(sdev);
         g_free(name);
+
+        /*
+         * get_address_space() cannot fail, so an endpoint whose cache
+         * cannot be enabled still translates, only without the cache.
+         */
+        if (s->translation_cache_size &&
+            !memory_region_iommu_set_translation_cache(
+                &sdev->iommu_mr, s->translation_cache_size, &err)) {
+            error_prepend(&err, "%02x:%02x.%x: ", pci_bus_num(bus),
+                          PCI_SLOT(devfn), PCI_FUNC(devfn));
+            warn_report_err(err);
+        }
     }
     return &sdev->as;
 }
@@ -1427,6 +1462,11 @@ static void virtio_iommu_device_realize(DeviceState *dev, Error **errp)
         error_setg(errp, "aw-bits must be within [32,64]");
         return;
     }
+    if (s->translation_cache_size &&
+        !is_power_of_2(s->translation_cache_size)) {
+        error_setg(errp, "translation-cache-size must be a power of 2");
+        return;
+    }
     s->config.input_range.end =
         s->aw_bits == 64 ? UINT64_MAX : BIT_ULL(s->aw_bits) - 1;
 
@@ -1489,6 +1529,7 @@ static void virtio_iommu_device_unrealize(DeviceState *dev)
     qemu_unregister_reset(virtio_iommu_system_reset, s);
     qemu_remove_machine_init_done_notifier(&s->machine_done);
 
+    virtio_iommu_disable_translation_caches(s);
     g_hash_table_destroy(s->as_by_busptr);
     if (s->domains) {
         g_tree_destroy(s->domains);
@@ -1663,6 +1704,8 @@ static const Property virtio_iommu_properties[] = {
     DEFINE_PROP_GRANULE_MODE("granule", VirtIOIOMMU, granule_mode,
                              GRANULE_MODE_HOST),
     DEFINE_PROP_UINT8("aw-bits", VirtIOIOMMU, aw_bits, 64),
+    DEFINE_PROP_UINT32("translation-cache-size", VirtIOIOMMU,
+                       translation_cache_size, 0),
 };
 
 static void virtio_iommu_class_init(ObjectClass *klass, const void *data)
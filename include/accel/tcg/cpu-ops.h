@@ -36,6 +36,12 @@ struct TCGCPUOps {
      */
     bool precise_smc;
 
+    /**
+     * @superblocks: Translation of TBs with CF_TRACE follows direct
+     *               branches, see translator_follow_branch().
+     */
+    bool superblocks;
+
     /**
      * @guest_default_memory_order: default barrier that is required
      *                              for the guest memory ordering.
@@ -53,6 +53,10 @@ typedef QLIST_HEAD(, AioHandler) AioHandlerList;
 typedef void QEMUBHFunc(void *opaque);
 typedef bool AioPollFn(void *opaque);
 typedef void IOHandler(void *opaque);
+typedef void AioThreadCreateFunc(void *opaque, QemuThread *thread,
+                                 const char *name,
+                                 void *(*start_routine)(void *), void *arg,
+                                 int mode);
 
 struct ThreadPoolAio;
 struct LinuxAioState;
@@ -212,6 +216,9 @@ struct AioContext {
      * Has its own locking.
      */
     struct ThreadPoolAio *thread_pool;
+    /* Creates the thread pool's worker threads, if not NULL */
+    AioThreadCreateFunc *thread_create;
+    void *thread_create_opaque;
 
 #ifdef CONFIG_LINUX_AIO
     struct LinuxAioState *linux_aio;
@@ -724,4 +731,21 @@ void aio_context_set_aio_params(AioContext *ctx, int64_t max_batch);
  */
 void aio_context_set_thread_pool_params(AioContext *ctx, int64_t min,
                                         int64_t max, Error **errp);
+
+/**
+ * aio_context_set_thread_create_func:
+ * @ctx: the aio context
+ * @fn: function that creates the worker threads of the thread pool
+ * @opaque: first argument of @fn
+ *
+ * By default the worker threads are created with qemu_thread_create()
+ * and inherit the CPU affinity of the thread that creates them.  @fn can
+ * create them in a different context, for example a thread-context
+ * object bound to the host NUMA node of the AioContext's thread.
+ *
+ * Must be called before the thread pool of @ctx is first used.
+ */
+void aio_context_set_thread_create_func(AioContext *ctx,
+                                        AioThreadCreateFunc *fn,
+                                        void *opaque);
 #endif
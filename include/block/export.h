@@ -48,6 +48,12 @@ typedef struct BlockExportDriver {
      * shutting down.
      */
     void (*request_shutdown)(BlockExport *);
+
+    /*
+     * Returns information about the clients connected to the export. Optional,
+     * export types that don't implement it report no client list.
+     */
+    BlockExportClientInfoList *(*query_clients)(BlockExport *);
 } BlockExportDriver;
 
 struct BlockExport {
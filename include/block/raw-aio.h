@@ -84,6 +84,19 @@ int coroutine_fn luring_co_submit(BlockDriverState *bs, int fd, uint64_t offset,
 void luring_detach_aio_context(LuringState *s, AioContext *old_context);
 void luring_attach_aio_context(LuringState *s, AioContext *new_context);
 bool luring_has_fua(void);
+
+/*
+ * Register a file descriptor or a buffer with the io_uring instance of @ctx,
+ * so that requests submitted in @ctx use fixed files and fixed buffers.
+ * Registration is best effort: I/O keeps working if it fails.  A registered
+ * file descriptor must be unregistered before it is closed.
+ *
+ * Must be called from the main loop thread or from @ctx's home thread.
+ */
+void luring_register_file(AioContext *ctx, int fd);
+void luring_unregister_file(AioContext *ctx, int fd);
+void luring_register_buf(AioContext *ctx, void *host, size_t size);
+void luring_unregister_buf(AioContext *ctx, void *host, size_t size);
 #else
 static inline bool luring_has_fua(void)
 {
@@ -22,13 +22,36 @@
 
 #define THREAD_POOL_MAX_THREADS_DEFAULT         64
 
+/* Number of buckets of the latency histograms in ThreadPoolStats */
+#define THREAD_POOL_LATENCY_BUCKETS             32
+
 typedef int ThreadPoolFunc(void *opaque);
 
 typedef struct ThreadPoolAio ThreadPoolAio;
 
+typedef struct ThreadPoolStats {
+    /* number of requests run by the worker threads */
+    uint64_t requests;
+    /* requests a worker thread took from another worker's queue */
+    uint64_t steals;
+    /*
+     * Logarithmic histograms of the time requests spend waiting in the
+     * queue and running, in nanoseconds.  Bucket 0 counts zero, bucket i
+     * counts [2^(i-1), 2^i), the last bucket also counts anything longer.
+     */
+    uint64_t queue_ns[THREAD_POOL_LATENCY_BUCKETS];
+    uint64_t run_ns[THREAD_POOL_LATENCY_BUCKETS];
+} ThreadPoolStats;
+
 ThreadPoolAio *thread_pool_new_aio(struct AioContext *ctx);
 void thread_pool_free_aio(ThreadPoolAio *pool);
 
+/*
+ * Return the statistics of @pool since it was created.  Can be called
+ * from any thread.
+ */
+void thread_pool_get_stats(ThreadPoolAio *pool, ThreadPoolStats *stats);
+
 /*
  * thread_pool_submit_{aio,co} API: submit I/O requests in the thread's
  * current AioContext.
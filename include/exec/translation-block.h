@@ -81,6 +81,7 @@ struct TranslationBlock {
 #define CF_NOIRQ         0x00010000 /* Generate an uninterruptible TB */
 #define CF_PCREL         0x00020000 /* Opcodes in TB are PC-relative */
 #define CF_BP_PAGE       0x00040000 /* Breakpoint present in code page */
+#define CF_TRACE         0x00080000 /* Superblock, not part of the lookup key */
 #define CF_CLUSTER_MASK  0xff000000 /* Top 8 bits are cluster ID */
 #define CF_CLUSTER_SHIFT 24
 
@@ -144,6 +145,14 @@ struct TranslationBlock {
     uintptr_t jmp_list_head;
     uintptr_t jmp_list_next[2];
     uintptr_t jmp_dest[2];
+
+    /*
+     * Number of times the TB was entered from the main loop or through
+     * goto_ptr, while superblock formation is enabled; see
+     * tb_superblock_hot().  Not counted when the TB is entered through
+     * a direct jump.
+     */
+    uint32_t exec_count;
 };
 
 /* The alignment given to TranslationBlock during allocation. */
@@ -54,9 +54,12 @@ typedef enum DisasJumpType {
  * @pc_first: Address of first guest instruction in this TB.
  * @pc_next: Address of next guest instruction in this TB (current during
  *           disassembly).
+ * @pc_max: End of the highest guest instruction translated before the last
+ *          branch followed by translator_follow_branch().
  * @is_jmp: What instruction to disassemble next.
  * @num_insns: Number of translated instructions (including current).
  * @max_insns: Maximum number of instructions to be translated in this TB.
+ * @trace_branches: Number of branches followed in this TB.
  * @plugin_enabled: TCG plugin enabled in this TB.
  * @fake_insn: True if translator_fake_ldb used.
  * @insn_start: The last op emitted by the insn_start hook,
@@ -68,9 +71,11 @@ struct DisasContextBase {
     TranslationBlock *tb;
     vaddr pc_first;
     vaddr pc_next;
+    vaddr pc_max;
     DisasJumpType is_jmp;
     int num_insns;
     int max_insns;
+    int trace_branches;
     bool plugin_enabled;
     bool fake_insn;
     uint8_t code_mmuidx;
@@ -144,6 +149,7 @@ typedef struct TranslatorOps {
  * - When the TCG operation buffer is full.
  * - When single-stepping is enabled (system-wide or on the current vCPU).
  * - When too many instructions have been translated.
+ * - For superblocks, when the next instruction is on another page.
  */
 void translator_loop(CPUState *cpu, TranslationBlock *tb, int *max_insns,
                      vaddr pc, void *host_pc, const TranslatorOps *ops,
@@ -159,6 +165,20 @@ void translator_loop(CPUState *cpu, TranslationBlock *tb, int *max_insns,
  */
 bool translator_use_goto_tb(DisasContextBase *db, vaddr dest);
 
+/**
+ * translator_follow_branch
+ * @db: Disassembly context
+ * @dest: target pc of a direct branch
+ *
+ * Return true if translation of a superblock (a TB with CF_TRACE) may
+ * continue at @dest, in which case db->pc_next is set to @dest.  The
+ * caller must then emit side exits for the other paths out of the branch
+ * instead of ending the TB.  Translation is not continued at destinations
+ * before the start of the TB or on another page, and only a few branches
+ * are followed in a TB.
+ */
+bool translator_follow_branch(DisasContextBase *db, vaddr dest);
+
 /**
  * translator_io_start
  * @db: Disassembly context
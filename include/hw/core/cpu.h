@@ -315,6 +315,12 @@ typedef struct CPUTLBCommon {
     size_t full_flush_count;
     size_t part_flush_count;
     size_t elide_flush_count;
+    /*
+     * Pages written while dirty memory tracking is active, not yet
+     * published to the dirty memory bitmaps; NULL unless the TCG
+     * dirty-log-size property is set.  See tlb_dirty_log_flush().
+     */
+    struct TLBDirtyLog *dirty_log;
 } CPUTLBCommon;
 
 /*
@@ -452,6 +458,8 @@ struct qemu_work_item;
  *    ring is enabled.
  * @kvm_fetch_index: Keeps the index that we last fetched from the per-vCPU
  *    dirty ring structure.
+ * @dirty_ring_full_exits: Number of times the vCPU exited to userspace
+ *    because its KVM dirty ring was full.
  *
  * @neg_align: The CPUState is the common part of a concrete ArchCPU
  * which is allocated when an individual CPU instance is created. As
@@ -536,6 +544,7 @@ struct CPUState {
     struct kvm_dirty_gfn *kvm_dirty_gfns;
     uint32_t kvm_fetch_index;
     uint64_t dirty_pages;
+    uint64_t dirty_ring_full_exits;
     int kvm_vcpu_stats_fd;
     bool vcpu_dirty;
 
@@ -70,6 +70,7 @@ struct VirtIOIOMMU {
     bool granule_frozen;
     GranuleMode granule_mode;
     uint8_t aw_bits;
+    uint32_t translation_cache_size;
 };
 
 #endif
@@ -20,6 +20,7 @@
 #include "net/announce.h"
 #include "qemu/option_int.h"
 #include "qom/object.h"
+#include "qapi/qapi-types-virtio.h"
 
 #include "ebpf/ebpf_rss.h"
 
@@ -160,6 +161,19 @@ typedef struct VirtIONetQueue {
     struct {
         VirtQueueElement *elem;
     } async_tx;
+    /* running average of the size of packets received directly */
+    size_t rx_direct_hint;
+    /* receive buffers lent to the peer */
+    unsigned rx_posted;
+    /* the next number of a lent buffer, and the last avail idx after it */
+    uint64_t rx_post_seq;
+    unsigned int rx_post_avail;
+    /* whether the guest gets back the buffers that the peer releases */
+    bool rx_give_back;
+    /* where the queue pair runs while the dataplane is started */
+    AioContext *ctx;
+    /* whether the dataplane is paused for a reset of the rx or tx vq */
+    bool reset_pending[2];
     struct VirtIONet *n;
 } VirtIONetQueue;
 
@@ -227,6 +241,11 @@ struct VirtIONet {
     struct EBPFRSSContext ebpf_rss;
     uint32_t nr_ebpf_rss_fds;
     char **ebpf_rss_fds;
+    /* queue pairs in iothreads, see virtio_net_start_ioeventfd() */
+    IOThreadVirtQueueMappingList *iothread_vq_mapping_list;
+    AioContext **pair_aio_context;
+    bool dataplane_started;
+    unsigned dataplane_paused;
 };
 
 size_t virtio_net_handle_ctrl_iov(VirtIODevice *vdev,
@@ -275,4 +275,33 @@ int qio_channel_socket_set_send_buffer(QIOChannelSocket *ioc,
                                        size_t size,
                                        Error **errp);
 
+/**
+ * qio_channel_socket_enable_zero_copy:
+ * @ioc: the socket channel object
+ *
+ * Enable zero copy writes (MSG_ZEROCOPY) on a connected socket,
+ * if the host supports them for this type of socket. Sockets
+ * connected with qio_channel_socket_connect_sync() already have
+ * them enabled when possible.
+ *
+ * Returns: true if QIO_CHANNEL_FEATURE_WRITE_ZERO_COPY is set
+ */
+bool qio_channel_socket_enable_zero_copy(QIOChannelSocket *ioc);
+
+/**
+ * qio_channel_socket_poll_zero_copy:
+ * @ioc: the socket channel object
+ * @errp: pointer to a NULL-initialized error object
+ *
+ * Process the zero copy completion notifications that are
+ * pending on the socket, without waiting for further ones.
+ * Afterwards, the buffers of the first @ioc->zero_copy_sent
+ * zero copy writes can be reused. Unlike qio_channel_flush(),
+ * this never blocks and can be called from a coroutine.
+ *
+ * Returns: 0 on success, or -1 on error.
+ */
+int qio_channel_socket_poll_zero_copy(QIOChannelSocket *ioc,
+                                      Error **errp);
+
 #endif /* QIO_CHANNEL_SOCKET_H */
@@ -33,6 +33,8 @@ OBJECT_DECLARE_TYPE(QIOChannel, QIOChannelClass,
 #define QIO_CHANNEL_ERR_BLOCK -2
 
 #define QIO_CHANNEL_WRITE_FLAG_ZERO_COPY 0x1
+/* With ZERO_COPY, copy the data if the kernel cannot pin more memory */
+#define QIO_CHANNEL_WRITE_FLAG_ZERO_COPY_FALLBACK 0x2
 
 #define QIO_CHANNEL_READ_FLAG_MSG_PEEK 0x1
 #define QIO_CHANNEL_READ_FLAG_RELAXED_EOF 0x2
@@ -957,7 +959,9 @@ int coroutine_mixed_fn qio_channel_readv_full_all(QIOChannel *ioc,
  * In this case, if the buffer gets changed between queueing and
  * sending, the updated buffer will be sent. If this is not a
  * desired behavior, it's suggested to call qio_channel_flush()
- * before reusing the buffer.
+ * before reusing the buffer. If QIO_CHANNEL_WRITE_FLAG_ZERO_COPY_FALLBACK
+ * is passed too, the writes that fail because the process cannot lock
+ * more memory are copied instead, and do not count as zero copy writes.
  *
  * Returns: 0 if all bytes were written, or -1 on error
  */
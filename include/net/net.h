@@ -42,6 +42,16 @@ typedef struct NICConf {
 
 /* Net clients */
 
+/*
+ * A receive buffer that a NIC lends to its peer, for the peer to write a
+ * packet into it directly.  The NIC writes its own header in front of it.
+ */
+typedef struct NetRxBuffer {
+    void *data;
+    size_t size;
+    void *opaque;   /* for the NIC */
+} NetRxBuffer;
+
 typedef void (NetPoll)(NetClientState *, bool enable);
 typedef bool (NetCanReceive)(NetClientState *);
 typedef int (NetStart)(NetClientState *);
@@ -49,6 +59,15 @@ typedef int (NetLoad)(NetClientState *);
 typedef void (NetStop)(NetClientState *);
 typedef ssize_t (NetReceive)(NetClientState *, const uint8_t *, size_t);
 typedef ssize_t (NetReceiveIOV)(NetClientState *, const struct iovec *, int);
+typedef ssize_t (NetReadPacket)(NetClientState *, const struct iovec *, int);
+typedef int (NetReceiveDirect)(NetClientState *, NetClientState *,
+                               NetReadPacket *, uint8_t *, int, size_t *);
+typedef int (NetPostRxBuffers)(NetClientState *, NetRxBuffer *, int, size_t,
+                               size_t, int, const void *, size_t);
+typedef int (NetFillRxBuffers)(NetClientState *, NetRxBuffer *,
+                               const size_t *, int);
+typedef void (NetReleaseRxBuffers)(NetClientState *);
+typedef void (NetSetAioContext)(NetClientState *, AioContext *);
 typedef void (NetCleanup) (NetClientState *);
 typedef void (LinkStatusChanged)(NetClientState *);
 typedef void (NetClientDestructor)(NetClientState *);
@@ -73,6 +92,10 @@ typedef struct NetClientInfo {
     size_t size;
     NetReceive *receive;
     NetReceiveIOV *receive_iov;
+    NetReceiveDirect *receive_direct;
+    NetPostRxBuffers *post_rx_buffers;
+    NetFillRxBuffers *fill_rx_buffers;
+    NetReleaseRxBuffers *release_rx_buffers;
     NetCanReceive *can_receive;
     NetStart *start;
     NetLoad *load;
@@ -92,6 +115,7 @@ typedef struct NetClientInfo {
     NetAnnounce *announce;
     SetSteeringEBPF *set_steering_ebpf;
     NetCheckPeerType *check_peer_type;
+    NetSetAioContext *set_aio_context;
 } NetClientInfo;
 
 struct NetClientState {
@@ -175,6 +199,96 @@ ssize_t qemu_receive_packet(NetClientState *nc, const uint8_t *buf, int size);
 ssize_t qemu_send_packet_raw(NetClientState *nc, const uint8_t *buf, int size);
 ssize_t qemu_send_packet_async(NetClientState *nc, const uint8_t *buf,
                                int size, NetPacketSent *sent_cb);
+/**
+ * qemu_receive_direct: Read packets straight into the buffers of the peer
+ * @sender: the net client that has packets to send
+ * @read_packet: called to read one packet into an I/O vector; returns the
+ *               size of the packet, or -errno (-EAGAIN if there are no more
+ *               packets)
+ * @buf: a buffer of NET_BUFSIZE bytes, for the parts of a packet that do
+ *       not fit the buffers of the peer
+ * @budget: the maximum number of packets to read
+ * @pending: set to the size of a packet left in @buf, that the sender must
+ *           send with qemu_send_packet_async() because the peer ran out of
+ *           buffers in the middle of it; or to 0
+ *
+ * This saves a copy of each packet, for peers that support it, when there
+ * are no net filters in the way.  The packets are read and delivered in
+ * a batch, so that the peer can notify the guest once.
+ *
+ * Returns the number of packets read, or -ENOTSUP if the peer cannot take
+ * packets this way right now; the sender must then read the next packet
+ * into its own buffer and send it as usual.
+ */
+int qemu_receive_direct(NetClientState *sender, NetReadPacket *read_packet,
+                        uint8_t *buf, int budget, size_t *pending);
+/**
+ * qemu_post_rx_buffers: Borrow receive buffers from the peer
+ * @sender: the net client that will write packets into the buffers
+ * @bufs: filled with the buffers
+ * @num: the maximum number of buffers
+ * @headroom: the bytes in front of each buffer that must be in the same
+ *            memory; @sender does not write them
+ * @size: the room that each buffer must have for a packet
+ * @reserve: the number of packets of @size that the peer must still be
+ *           able to receive as usual, e.g. from other buffers of @sender
+ * @base: the start of the host memory that the buffers must be in
+ * @len: the length of that memory
+ *
+ * The peer stops at the first buffer that does not fit.  The buffers stay
+ * with @sender until it gives them back with qemu_fill_rx_buffers(); when
+ * the peer needs them back, it calls the release_rx_buffers() callback of
+ * @sender, which must give back all of them before returning.
+ *
+ * Returns the number of buffers, or -ENOTSUP if the peer cannot lend
+ * buffers right now.
+ */
+int qemu_post_rx_buffers(NetClientState *sender, NetRxBuffer *bufs, int num,
+                         size_t headroom, size_t size, int reserve,
+                         const void *base, size_t len);
+/**
+ * qemu_fill_rx_buffers: Give back buffers from qemu_post_rx_buffers()
+ * @sender: the net client that borrowed the buffers
+ * @bufs: the buffers
+ * @lens: the size of the packet in each buffer, 0 for a buffer that was
+ *        not used
+ * @num: the number of buffers
+ *
+ * The packets are received by the peer in a batch, so that it can notify
+ * the guest once.
+ *
+ * Returns the number of buffers that the peer does not take back, because
+ * it dropped their packet; they are moved to the start of @bufs, and stay
+ * with @sender.
+ */
+int qemu_fill_rx_buffers(NetClientState *sender, NetRxBuffer *bufs,
+                         const size_t *lens, int num);
+/**
+ * qemu_release_rx_buffers: Get back the receive buffers lent to the peer
+ * @nc: the NIC that lent the buffers
+ */
+void qemu_release_rx_buffers(NetClientState *nc);
+/**
+ * qemu_can_set_peer_aio_context: Check if the peer can run in an iothread
+ * @nc: the NIC queue
+ *
+ * Returns true if qemu_set_peer_aio_context() can be used for @nc, that
+ * is if the peer supports it and there are no net filters on the path.
+ */
+bool qemu_can_set_peer_aio_context(NetClientState *nc);
+/**
+ * qemu_set_peer_aio_context: Move the peer of a NIC queue to an AioContext
+ * @nc: the NIC queue
+ * @ctx: the AioContext that @nc runs in, or %NULL for the main loop
+ *
+ * The peer then sends its packets to @nc, and handles those that @nc sends
+ * to it, from @ctx.  Before returning it waits for its handlers in the old
+ * AioContext, so the caller must not send or receive on @nc in the
+ * meantime.
+ *
+ * Context: BQL held
+ */
+void qemu_set_peer_aio_context(NetClientState *nc, AioContext *ctx);
 void qemu_purge_queued_packets(NetClientState *nc);
 void qemu_flush_queued_packets(NetClientState *nc);
 void qemu_flush_or_purge_queued_packets(NetClientState *nc, bool purge);
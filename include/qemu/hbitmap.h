@@ -71,6 +71,35 @@ HBitmap *hbitmap_alloc(uint64_t size, int granularity);
  */
 void hbitmap_truncate(HBitmap *hb, uint64_t size);
 
+/**
+ * hbitmap_set_compressed:
+ * @hb: The bitmap to change.
+ * @compressed: Whether the bitmap should be compressed.
+ *
+ * Compressed bitmaps do not use memory for the parts of the bitmap that
+ * are entirely clear or entirely set, and store runs of set bits compactly
+ * elsewhere.  Most operations are somewhat slower on compressed bitmaps,
+ * but setting and resetting bits stays about as fast.
+ * This may invalidate existing HBitmapIterators.
+ */
+void hbitmap_set_compressed(HBitmap *hb, bool compressed);
+
+/**
+ * hbitmap_is_compressed:
+ * @hb: HBitmap to operate on.
+ *
+ * Return whether @hb is compressed.
+ */
+bool hbitmap_is_compressed(const HBitmap *hb);
+
+/**
+ * hbitmap_memory_usage:
+ * @hb: HBitmap to operate on.
+ *
+ * Return the number of bytes of memory used by @hb.
+ */
+uint64_t hbitmap_memory_usage(const HBitmap *hb);
+
 /**
  * hbitmap_merge:
  *
@@ -350,4 +379,12 @@ bool hbitmap_status(const HBitmap *hb, int64_t start, int64_t count,
  */
 int64_t hbitmap_iter_next(HBitmapIter *hbi);
 
+/**
+ * test_hbitmap_next_accel:
+ *
+ * Switch to the next slower implementation of the bulk bitmap operations,
+ * for testing and benchmarking.  Return false if there is none.
+ */
+bool test_hbitmap_next_accel(void);
+
 #endif
@@ -38,6 +38,11 @@ struct IOThread {
     int64_t poll_max_ns;
     int64_t poll_grow;
     int64_t poll_shrink;
+
+    /* Context for creating the iothread and its thread pool workers */
+    struct ThreadContext *thread_context;
+    /* Reference to thread_context held while ctx exists */
+    struct ThreadContext *ctx_thread_context;
 };
 typedef struct IOThread IOThread;
 
@@ -99,6 +99,24 @@ struct KVMDirtyRingReaper {
     QemuThread reaper_thr;
     volatile uint64_t reaper_iteration; /* iteration number of reaper thr */
     volatile enum KVMDirtyRingReaperState reaper_state; /* reap thr state */
+    /* Helper threads that harvest groups of vcpus in parallel, or NULL */
+    struct ThreadPool *harvest_pool;
+    /* Frees harvest_pool on exit */
+    Notifier exit_notifier;
+};
+
+#define KVM_DIRTY_RING_HARVEST_THREADS_MAX 64
+
+/* Log2 histogram buckets for the dirty ring harvest latency, in ns */
+#define KVM_DIRTY_RING_HIST_BUCKETS 32
+
+/* Dirty ring harvest statistics, protected by slots_lock */
+struct KVMDirtyRingStats {
+    uint64_t reaps;         /* harvests that found dirty pages */
+    uint64_t pages;         /* pages harvested */
+    uint64_t time_ns;       /* total time spent harvesting */
+    uint64_t time_max_ns;   /* longest harvest */
+    uint64_t latency_hist[KVM_DIRTY_RING_HIST_BUCKETS];
 };
 struct KVMState
 {
@@ -156,8 +174,10 @@ struct KVMState
     uint64_t kvm_dirty_ring_bytes;  /* Size of the per-vcpu dirty ring */
     uint32_t kvm_dirty_ring_size;   /* Number of dirty GFNs per ring */
     bool kvm_dirty_ring_with_bitmap;
+    uint32_t kvm_dirty_ring_harvest_threads; /* Threads harvesting the rings */
     uint64_t kvm_eager_split_size;  /* Eager Page Splitting chunk size */
     struct KVMDirtyRingReaper reaper;
+    struct KVMDirtyRingStats dirty_ring_stats;
     struct KVMMsrEnergy msr_energy;
     NotifyVmexitOption notify_vmexit;
     uint32_t notify_window;
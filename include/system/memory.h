@@ -809,11 +809,16 @@ struct MemoryRegion {
     bool disable_reentrancy_guard;
 };
 
+typedef struct IOMMUTranslationCache IOMMUTranslationCache;
+
 struct IOMMUMemoryRegion {
     MemoryRegion parent_obj;
 
     QLIST_HEAD(, IOMMUNotifier) iommu_notify;
     IOMMUNotifierFlag iommu_notify_flags;
+
+    /* Accessed via RCU.  */
+    IOMMUTranslationCache *translation_cache;
 };
 
 #define IOMMU_NOTIFIER_FOREACH(n, mr) \
@@ -1904,6 +1909,33 @@ int memory_region_iommu_attrs_to_index(IOMMUMemoryRegion *iommu_mr,
  */
 int memory_region_iommu_num_indexes(IOMMUMemoryRegion *iommu_mr);
 
+/**
+ * memory_region_iommu_set_translation_cache: enable, resize or disable
+ * the translation cache of an IOMMU memory region.
+ *
+ * The translation cache remembers the results of the IOMMU's translate
+ * method, together with the RAM section that each cached page resolves
+ * to in the target address space, so that repeated DMA to the same pages
+ * skips both the IOMMU and the dispatch tree lookup.  Entries are dropped
+ * when the IOMMU sends an unmap notification for them and whenever the
+ * memory topology changes.  Since an IOMMU notifier is registered for
+ * this purpose, the IOMMU must send unmap notifications for every change
+ * to its translations that removes or restricts a mapping.
+ *
+ * The cache is disabled when the memory region is finalized; an IOMMU
+ * whose address spaces go away before that, for example on unrealize,
+ * must disable it first.
+ *
+ * Must be called with the BQL held.  Returns true on success.
+ *
+ * @iommu_mr: the memory region
+ * @size: the number of cache entries, a power of two, or 0 to disable
+ *        the cache
+ * @errp: pointer to Error*, to store an error if it happens.
+ */
+bool memory_region_iommu_set_translation_cache(IOMMUMemoryRegion *iommu_mr,
+                                               unsigned size, Error **errp);
+
 /**
  * memory_region_name: get a memory region's name
  *
@@ -290,6 +290,31 @@ static inline void cpu_physical_memory_set_dirty_flag(ram_addr_t addr,
     set_bit_atomic(offset, blocks->blocks[idx]);
 }
 
+/*
+ * Set the dirty flag of the page at @addr for @client, and return whether
+ * it was already set.
+ */
+static inline bool
+cpu_physical_memory_test_and_set_dirty_flag(ram_addr_t addr, unsigned client)
+{
+    unsigned long page, idx, offset, mask;
+    DirtyMemoryBlocks *blocks;
+
+    assert(client < DIRTY_MEMORY_NUM);
+
+    page = addr >> TARGET_PAGE_BITS;
+    idx = page / DIRTY_MEMORY_BLOCK_SIZE;
+    offset = page % DIRTY_MEMORY_BLOCK_SIZE;
+    mask = BIT_MASK(offset);
+
+    RCU_READ_LOCK_GUARD();
+
+    blocks = qatomic_rcu_read(&ram_list.dirty_memory[client]);
+
+    return qatomic_fetch_or(&blocks->blocks[idx][BIT_WORD(offset)],
+                            mask) & mask;
+}
+
 static inline void cpu_physical_memory_set_dirty_range(ram_addr_t start,
                                                        ram_addr_t length,
                                                        uint8_t mask)
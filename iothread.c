@@ -24,6 +24,9 @@
 #include "qemu/error-report.h"
 #include "qemu/rcu.h"
 #include "qemu/main-loop.h"
+#include "qemu/thread-context.h"
+#include "block/thread-pool.h"
+#include "system/stats.h"
 
 
 #ifdef CONFIG_POSIX
@@ -129,6 +132,10 @@ static void iothread_instance_finalize(Object *obj)
         aio_context_unref(iothread->ctx);
         iothread->ctx = NULL;
     }
+    if (iothread->ctx_thread_context) {
+        object_unref(OBJECT(iothread->ctx_thread_context));
+        iothread->ctx_thread_context = NULL;
+    }
     if (iothread->worker_context) {
         g_main_context_unref(iothread->worker_context);
         iothread->worker_context = NULL;
@@ -177,6 +184,16 @@ static void iothread_set_aio_context_params(EventLoopBase *base, Error **errp)
 }
 
 
+static void iothread_create_thread(void *opaque, QemuThread *thread,
+                                   const char *name,
+                                   void *(*start_routine)(void *), void *arg,
+                                   int mode)
+{
+    ThreadContext *tc = opaque;
+
+    thread_context_create_thread(tc, thread, name, start_routine, arg, mode);
+}
+
 static void iothread_init(EventLoopBase *base, Error **errp)
 {
     Error *local_error = NULL;
@@ -207,11 +224,28 @@ static void iothread_init(EventLoopBase *base, Error **errp)
         return;
     }
 
-    /* This assumes we are called from a thread with useful CPU affinity for us
-     * to inherit.
-     */
-    qemu_thread_create(&iothread->thread, thread_name, iothread_run,
-                       iothread, QEMU_THREAD_JOINABLE);
+    if (iothread->thread_context) {
+        /*
+         * Run the iothread and its thread pool workers with the CPU
+         * affinity of the thread context, e.g. on the host NUMA node of
+         * the devices it serves.
+         */
+        iothread->ctx_thread_context = iothread->thread_context;
+        object_ref(OBJECT(iothread->ctx_thread_context));
+        aio_context_set_thread_create_func(iothread->ctx,
+                                           iothread_create_thread,
+                                           iothread->ctx_thread_context);
+        thread_context_create_thread(iothread->ctx_thread_context,
+                                     &iothread->thread, thread_name,
+                                     iothread_run, iothread,
+                                     QEMU_THREAD_JOINABLE);
+    } else {
+        /* This assumes we are called from a thread with useful CPU affinity
+         * for us to inherit.
+         */
+        qemu_thread_create(&iothread->thread, thread_name, iothread_run,
+                           iothread, QEMU_THREAD_JOINABLE);
+    }
 
     /* Wait for initialization to complete */
     while (iothread->thread_id == -1) {
@@ -292,6 +326,144 @@ static void iothread_set_poll_param(Object *obj, Visitor *v,
     }
 }
 
+static void iothread_check_thread_context(const Object *obj,
+                                          const char *name,
+                                          Object *val, Error **errp)
+{
+    const IOThread *iothread = IOTHREAD(obj);
+
+    if (iothread->ctx) {
+        error_setg(errp, "cannot change the thread context of a running "
+                   "iothread");
+    }
+}
+
+static StatsList *iothread_stats_add(StatsList *stats_list, const char *name,
+                                     uint64_t *values, int n)
+{
+    Stats *stats = g_new0(Stats, 1);
+
+    stats->name = g_strdup(name);
+    stats->value = g_new0(StatsValue, 1);
+    if (n == 1) {
+        stats->value->type = QTYPE_QNUM;
+        stats->value->u.scalar = values[0];
+    } else {
+        stats->value->type = QTYPE_QLIST;
+        for (int i = n - 1; i >= 0; i--) {
+            QAPI_LIST_PREPEND(stats->value->u.list, values[i]);
+        }
+    }
+
+    QAPI_LIST_PREPEND(stats_list, stats);
+    return stats_list;
+}
+
+typedef struct IOThreadStatsArgs {
+    StatsResultList **result;
+    strList *names;
+} IOThreadStatsArgs;
+
+static int iothread_stats_query(Object *obj, void *opaque)
+{
+    IOThreadStatsArgs *stats_args = opaque;
+    IOThread *iothread;
+    ThreadPoolAio *pool;
+    ThreadPoolStats tps;
+    StatsList *stats_list = NULL;
+
+    iothread = (IOThread *)object_dynamic_cast(obj, TYPE_IOTHREAD);
+    if (!iothread || !iothread->ctx) {
+        return 0;
+    }
+
+    pool = qatomic_load_acquire(&iothread->ctx->thread_pool);
+    if (pool) {
+        thread_pool_get_stats(pool, &tps);
+    } else {
+        memset(&tps, 0, sizeof(tps));
+    }
+
+    if (apply_str_list_filter("requests", stats_args->names)) {
+        stats_list = iothread_stats_add(stats_list, "requests",
+                                        &tps.requests, 1);
+    }
+    if (apply_str_list_filter("steals", stats_args->names)) {
+        stats_list = iothread_stats_add(stats_list, "steals", &tps.steals, 1);
+    }
+    if (apply_str_list_filter("queue-latency", stats_args->names)) {
+        stats_list = iothread_stats_add(stats_list, "queue-latency",
+                                        tps.queue_ns,
+                                        THREAD_POOL_LATENCY_BUCKETS);
+    }
+    if (apply_str_list_filter("run-latency", stats_args->names)) {
+        stats_list = iothread_stats_add(stats_list, "run-latency",
+                                        tps.run_ns,
+                                        THREAD_POOL_LATENCY_BUCKETS);
+    }
+
+    if (stats_list) {
+        g_autofree char *path = object_get_canonical_path(obj);
+
+        add_stats_entry(stats_args->result, STATS_PROVIDER_THREAD_POOL,
+                        path, stats_list);
+    }
+    return 0;
+}
+
+static void iothread_stats_cb(StatsResultList **result, StatsTarget target,
+                              strList *names, strList *targets, Error **errp)
+{
+    IOThreadStatsArgs stats_args = {
+        .result = result,
+        .names = names,
+    };
+
+    if (target != STATS_TARGET_IOTHREAD) {
+        return;
+    }
+
+    object_child_foreach(object_get_objects_root(), iothread_stats_query,
+                         &stats_args);
+}
+
+static StatsSchemaValueList *iothread_schema_add(StatsSchemaValueList *list,
+                                                 const char *name,
+                                                 StatsType type)
+{
+    StatsSchemaValue *value = g_new0(StatsSchemaValue, 1);
+
+    value->name = g_strdup(name);
+    value->type = type;
+    if (type == STATS_TYPE_LOG2_HISTOGRAM) {
+        value->has_unit = true;
+        value->unit = STATS_UNIT_SECONDS;
+        value->has_base = true;
+        value->base = 10;
+        value->exponent = -9;
+    }
+
+    QAPI_LIST_PREPEND(list, value);
+    return list;
+}
+
+static void iothread_schemas_cb(StatsSchemaList **result, Error **errp)
+{
+    StatsSchemaValueList *stats_list = NULL;
+
+    stats_list = iothread_schema_add(stats_list, "run-latency",
+                                     STATS_TYPE_LOG2_HISTOGRAM);
+    stats_list = iothread_schema_add(stats_list, "queue-latency",
+                                     STATS_TYPE_LOG2_HISTOGRAM);
+    stats_list = iothread_schema_add(stats_list, "steals",
+                                     STATS_TYPE_CUMULATIVE);
+    stats_list = iothread_schema_add(stats_list, "requests",
+                                     STATS_TYPE_CUMULATIVE);
+
+    add_stats_schema(result, STATS_PROVIDER_THREAD_POOL, STATS_TARGET_IOTHREAD,
+                     stats_list);
+}
+
 static void iothread_class_init(ObjectClass *klass, const void *class_data)
 {
     EventLoopBaseClass *bc = EVENT_LOOP_BASE_CLASS(klass);
@@ -311,6 +483,16 @@ static void iothread_class_init(ObjectClass *klass, const void *class_data)
                               iothread_get_poll_param,
                               iothread_set_poll_param,
                               NULL, &poll_shrink_info);
+    object_class_property_add_link(klass, "thread-context",
+                                   TYPE_THREAD_CONTEXT,
+                                   offsetof(IOThread, thread_context),
+                                   iothread_check_thread_context,
+                                   OBJ_PROP_LINK_STRONG);
+    object_class_property_set_description(klass, "thread-context",
+        "Context to use for creating the iothread and its worker threads");
+
+    add_stats_callbacks(STATS_PROVIDER_THREAD_POOL, iothread_stats_cb,
+                        iothread_schemas_cb);
 }
 
 static const TypeInfo iothread_info = {
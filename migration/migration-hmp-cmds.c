@@ -174,14 +174,27 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
                        ", miss=%" PRIu64 "\n"
                        "  miss_rate=%0.2f"
                        ", encode_rate=%0.2f"
-                       ", overflow=%" PRIu64 "\n",
+                       ", overflow=%" PRIu64 "\n"
+                       "  hit_rate=%0.2f"
+                       ", evictions=%" PRIu64 "\n",
                        info->xbzrle_cache->cache_size,
                        info->xbzrle_cache->bytes,
                        info->xbzrle_cache->pages,
                        info->xbzrle_cache->cache_miss,
                        info->xbzrle_cache->cache_miss_rate,
                        info->xbzrle_cache->encoding_rate,
-                       info->xbzrle_cache->overflow);
+                       info->xbzrle_cache->overflow,
+                       info->xbzrle_cache->cache_hit_rate,
+                       info->xbzrle_cache->cache_evictions);
+    }
+
+    if (info->multifd_dedup) {
+        monitor_printf(mon, "Multifd dedup: size=%" PRIu64
+                       ", pages=%" PRIu64
+                       ", hit_rate=%0.2f\n",
+                       info->multifd_dedup->cache_size,
+                       info->multifd_dedup->pages,
+                       info->multifd_dedup->hit_rate);
     }
 
     if (info->has_cpu_throttle_percentage) {
@@ -303,6 +316,10 @@ void hmp_info_migrate_parameters(Monitor *mon, const QDict *qdict)
         monitor_printf(mon, "%s: %u\n",
             MigrationParameter_str(MIGRATION_PARAMETER_MULTIFD_CHANNELS),
             params->multifd_channels);
+        monitor_printf(mon, "%s: %" PRIu64 " bytes\n",
+            MigrationParameter_str(
+                MIGRATION_PARAMETER_MULTIFD_DEDUP_CACHE_SIZE),
+            params->multifd_dedup_cache_size);
         monitor_printf(mon, "%s: %s\n",
             MigrationParameter_str(MIGRATION_PARAMETER_MULTIFD_COMPRESSION),
             MultiFDCompression_str(params->multifd_compression));
@@ -314,6 +331,10 @@ void hmp_info_migrate_parameters(Monitor *mon, const QDict *qdict)
         monitor_printf(mon, "%s: %" PRIu64 " bytes\n",
             MigrationParameter_str(MIGRATION_PARAMETER_XBZRLE_CACHE_SIZE),
             params->xbzrle_cache_size);
+        monitor_printf(mon, "%s: %u\n",
+            MigrationParameter_str(
+                MIGRATION_PARAMETER_XBZRLE_CACHE_ASSOCIATIVITY),
+            params->xbzrle_cache_associativity);
         monitor_printf(mon, "%s: %" PRIu64 "\n",
             MigrationParameter_str(MIGRATION_PARAMETER_MAX_POSTCOPY_BANDWIDTH),
             params->max_postcopy_bandwidth);
@@ -575,6 +596,10 @@ void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
         p->has_multifd_channels = true;
         visit_type_uint8(v, param, &p->multifd_channels, &err);
         break;
+    case MIGRATION_PARAMETER_MULTIFD_DEDUP_CACHE_SIZE:
+        p->has_multifd_dedup_cache_size = true;
+        visit_type_size(v, param, &p->multifd_dedup_cache_size, &err);
+        break;
     case MIGRATION_PARAMETER_MULTIFD_COMPRESSION:
         p->has_multifd_compression = true;
         visit_type_MultiFDCompression(v, param, &p->multifd_compression,
@@ -607,6 +632,10 @@ void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
         }
         p->xbzrle_cache_size = cache_size;
         break;
+    case MIGRATION_PARAMETER_XBZRLE_CACHE_ASSOCIATIVITY:
+        p->has_xbzrle_cache_associativity = true;
+        visit_type_uint8(v, param, &p->xbzrle_cache_associativity, &err);
+        break;
     case MIGRATION_PARAMETER_MAX_POSTCOPY_BANDWIDTH:
         p->has_max_postcopy_bandwidth = true;
         visit_type_size(v, param, &p->max_postcopy_bandwidth, &err);
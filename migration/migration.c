@@ -1296,6 +1296,19 @@ static void populate_ram_info(MigrationInfo *info, MigrationState *s)
         info->xbzrle_cache->cache_miss_rate = xbzrle_counters.cache_miss_rate;
         info->xbzrle_cache->encoding_rate = xbzrle_counters.encoding_rate;
         info->xbzrle_cache->overflow = xbzrle_counters.overflow;
+        info->xbzrle_cache->cache_hit_rate = xbzrle_counters.cache_hit_rate;
+        info->xbzrle_cache->cache_evictions = xbzrle_counters.cache_evictions;
+    }
+
+    if (migrate_multifd_dedup()) {
+        uint64_t dedup_pages = stat64_get(&mig_stats.dedup_pages);
+        uint64_t lookups = dedup_pages + stat64_get(&mig_stats.normal_pages);
+
+        info->multifd_dedup = g_malloc0(sizeof(*info->multifd_dedup));
+        info->multifd_dedup->cache_size = multifd_dedup_cache_size();
+        info->multifd_dedup->pages = dedup_pages;
+        info->multifd_dedup->hit_rate =
+            lookups ? (double)dedup_pages / lookups : 0;
     }
 
     if (cpu_throttle_active()) {
@@ -0,0 +1,558 @@
+/*
+ * Multifd deduplication of RAM pages
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+/*
+ * Both sides keep a cache of multifd-dedup-cache-size bytes worth of
+ * pages.  The source decides which slot every sent page is stored in and
+ * tells the destination in a table that follows the packet header.  A page
+ * whose contents are already in a slot is sent as a reference to that slot
+ * instead of as data.
+ *
+ * Packets of one channel are processed in order on the destination, and
+ * within a packet the normal pages are stored before the deduplicated
+ * pages are filled in.  Packets of different channels are processed in
+ * parallel; the only ordering between them is the sync done by
+ * multifd_send_sync_main(), which starts a new epoch on the source.  So:
+ *
+ *  - a slot stored in the current epoch can only be referenced by the
+ *    channel that stored it;
+ *  - a slot stored or referenced by another channel in the current epoch
+ *    cannot be reused for another page until the next epoch;
+ *  - a slot stored or referenced by the packet being prepared cannot be
+ *    reused by the same packet.
+ *
+ * The source keeps a copy of each slot and sends stored pages from that
+ * copy, so that the caches on both sides stay identical even if the guest
+ * modifies the page while it is being sent.  References are only created
+ * after comparing the page with that copy, so hash collisions are harmless.
+ *
+ * On the source, the slots are split into shards chosen by the page hash,
+ * each with its own lock and clock hand, so that the send threads rarely
+ * contend.  The locks only cover the slot metadata: a channel comparing a
+ * page with a slot pins it, and a channel storing a page marks the slot as
+ * filling; pinned and filling slots are neither replaced nor referenced,
+ * so the copies are compared and written without holding the lock.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/atomic.h"
+#include "qemu/bitops.h"
+#include "qemu/bswap.h"
+#include "qemu/lockable.h"
+#include "qapi/error.h"
+#include "io/channel.h"
+#include "system/ramblock.h"
+#include "migration.h"
+#include "migration-stats.h"
+#include "multifd.h"
+#include "options.h"
+#include "ram.h"
+#include "trace.h"
+
+/* Number of slots the clock hand looks at before giving up */
+#define MULTIFD_DEDUP_MAX_SCAN 64
+
+/* Maximum number of shards of the source cache, a power of 2 */
+#define MULTIFD_DEDUP_MAX_SHARDS 64
+
+/* ref_channel of slots referenced by several channels in one epoch */
+#define MULTIFD_DEDUP_MANY_CHANNELS -1
+
+typedef struct {
+    uint64_t hash;
+    /* last packet that stored a page in this slot */
+    uint32_t store_epoch;
+    int store_channel;
+    uint64_t store_packet;
+    /* last packet that referenced this slot */
+    uint32_t ref_epoch;
+    int ref_channel;
+    uint64_t ref_packet;
+    /* channels comparing a page with the copy of the slot */
+    uint32_t pins;
+    bool valid;
+    /* the copy is being written, read with qatomic_load_acquire() */
+    bool filling;
+    /* referenced since the clock hand last passed this slot */
+    bool accessed;
+} MultiFDDedupSlot;
+
+typedef struct {
+    /* protects everything below and the slots of the shard */
+    QemuMutex lock;
+    /* clock hand for slot replacement, relative to the first slot */
+    uint32_t hand;
+    /* hash index: slot number + 1 for each bucket, 0 if empty */
+    uint32_t *buckets;
+} QEMU_ALIGNED(64) MultiFDDedupShard;
+
+typedef struct {
+    /* advanced by multifd_dedup_send_sync() while the channels are idle */
+    uint32_t epoch;
+    uint64_t size;
+    /* shard i owns slots [i * shard_slots, (i + 1) * shard_slots) */
+    MultiFDDedupShard *shards;
+    uint32_t nr_shards;
+    uint32_t shard_slots;
+    uint32_t bucket_mask;
+    MultiFDDedupSlot *slots;
+    /* copy of the slot contents as sent to the destination */
+    uint8_t *data;
+} MultiFDDedupSendState;
+
+typedef struct {
+    uint32_t nr_slots;
+    uint8_t *data;
+} MultiFDDedupRecvState;
+
+static MultiFDDedupSendState *multifd_dedup_send_state;
+static MultiFDDedupRecvState *multifd_dedup_recv_state;
+
+uint64_t multifd_dedup_cache_size(void)
+{
+    if (multifd_dedup_send_state) {
+        return multifd_dedup_send_state->size;
+    }
+    return migrate_multifd_dedup_cache_size();
+}
+
+/* xxh64 round on every 64 bit word of the page */
+static uint64_t multifd_dedup_hash(const uint8_t *page, uint32_t size)
+{
+    const uint64_t prime1 = 0x9e3779b185ebca87ULL;
+    const uint64_t prime2 = 0xc2b2ae3d27d4eb4fULL;
+    uint64_t h = size;
+
+    for (uint32_t i = 0; i < size; i += sizeof(uint64_t)) {
+        uint64_t v = ldq_he_p(page + i);
+
+        h = rol64(h + v * prime2, 31) * prime1;
+    }
+
+    return h ^ (h >> 29);
+}
+
+static uint8_t *multifd_dedup_send_data(uint32_t slot)
+{
+    return multifd_dedup_send_state->data +
+           (size_t)slot * multifd_ram_page_size();
+}
+
+/* The shard is chosen by the high bits of the hash, the bucket by the low */
+static MultiFDDedupShard *multifd_dedup_shard(uint64_t hash)
+{
+    MultiFDDedupSendState *s = multifd_dedup_send_state;
+
+    return &s->shards[(hash >> 32) & (s->nr_shards - 1)];
+}
+
+/*
+ * Returns the slot that may hold a copy of @page for the packet being
+ * prepared on @p and pins it, or MULTIFD_DEDUP_NO_SLOT.
+ *
+ * Called with the lock of @shard held.
+ */
+static uint32_t multifd_dedup_lookup(MultiFDSendParams *p,
+                                     MultiFDDedupShard *shard, uint64_t hash)
+{
+    MultiFDDedupSendState *s = multifd_dedup_send_state;
+    uint32_t slot = shard->buckets[hash & s->bucket_mask];
+    MultiFDDedupSlot *e;
+
+    if (!slot) {
+        return MULTIFD_DEDUP_NO_SLOT;
+    }
+    slot--;
+    e = &s->slots[slot];
+
+    if (!e->valid || e->hash != hash || qatomic_load_acquire(&e->filling) ||
+        (e->store_epoch == qatomic_read(&s->epoch) &&
+         e->store_channel != p->id)) {
+        return MULTIFD_DEDUP_NO_SLOT;
+    }
+
+    e->pins++;
+    return slot;
+}
+
+/*
+ * Records that the packet being prepared on @p references @slot.
+ *
+ * Called with the lock of the shard of @slot held.
+ */
+static void multifd_dedup_ref(MultiFDSendParams *p, uint32_t slot)
+{
+    MultiFDDedupSendState *s = multifd_dedup_send_state;
+    MultiFDDedupSlot *e = &s->slots[slot];
+    uint32_t epoch = qatomic_read(&s->epoch);
+
+    if (e->ref_epoch != epoch) {
+        e->ref_epoch = epoch;
+        e->ref_channel = p->id;
+    } else if (e->ref_channel != p->id) {
+        e->ref_channel = MULTIFD_DEDUP_MANY_CHANNELS;
+    }
+    e->ref_packet = p->packets_sent;
+    e->accessed = true;
+}
+
+/* Can the destination still need the current contents of the slot? */
+static bool multifd_dedup_slot_busy(MultiFDSendParams *p, MultiFDDedupSlot *e)
+{
+    uint32_t epoch = qatomic_read(&multifd_dedup_send_state->epoch);
+
+    if (e->pins || qatomic_load_acquire(&e->filling)) {
+        return true;
+    }
+
+    if (e->store_epoch == epoch &&
+        (e->store_channel != p->id || e->store_packet == p->packets_sent)) {
+        return true;
+    }
+
+    if (e->ref_epoch == epoch &&
+        (e->ref_channel != p->id || e->ref_packet == p->packets_sent)) {
+        return true;
+    }
+
+    return false;
+}
+
+/*
+ * Reserves a free slot of @shard for a copy of @page and returns it, or
+ * MULTIFD_DEDUP_NO_SLOT if no slot could be found quickly.  The caller
+ * must fill the slot with multifd_dedup_fill().
+ *
+ * Called with the lock of @shard held.
+ */
+static uint32_t multifd_dedup_insert(MultiFDSendParams *p,
+                                     MultiFDDedupShard *shard, uint64_t hash)
+{
+    MultiFDDedupSendState *s = multifd_dedup_send_state;
+    uint32_t first = (shard - s->shards) * s->shard_slots;
+
+    for (int n = 0; n < MULTIFD_DEDUP_MAX_SCAN; n++) {
+        uint32_t slot = first + shard->hand;
+        MultiFDDedupSlot *e = &s->slots[slot];
+
+        shard->hand = (shard->hand + 1) % s->shard_slots;
+
+        if (e->valid) {
+            if (multifd_dedup_slot_busy(p, e)) {
+                continue;
+            }
+            if (e->accessed) {
+                e->accessed = false;
+                continue;
+            }
+            if (shard->buckets[e->hash & s->bucket_mask] == slot + 1) {
+                shard->buckets[e->hash & s->bucket_mask] = 0;
+            }
+        }
+
+        *e = (MultiFDDedupSlot) {
+            .hash = hash,
+            .store_epoch = qatomic_read(&s->epoch),
+            .store_channel = p->id,
+            .store_packet = p->packets_sent,
+            /* Not referenced in this epoch */
+            .ref_epoch = qatomic_read(&s->epoch) - 1,
+            .valid = true,
+            .filling = true,
+        };
+        shard->buckets[hash & s->bucket_mask] = slot + 1;
+        return slot;
+    }
+
+    return MULTIFD_DEDUP_NO_SLOT;
+}
+
+/* Writes the copy of a slot reserved by multifd_dedup_insert() */
+static void multifd_dedup_fill(uint32_t slot, const uint8_t *page)
+{
+    MultiFDDedupSlot *e = &multifd_dedup_send_state->slots[slot];
+
+    memcpy(multifd_dedup_send_data(slot), page, multifd_ram_page_size());
+    qatomic_store_release(&e->filling, false);
+}
+
+void multifd_dedup_send_setup(void)
+{
+    MultiFDDedupSendState *s;
+    uint32_t nr_slots;
+
+    if (!migrate_multifd_dedup()) {
+        return;
+    }
+
+    s = g_new0(MultiFDDedupSendState, 1);
+    s->size = migrate_multifd_dedup_cache_size();
+    nr_slots = s->size / multifd_ram_page_size();
+    s->nr_shards = MAX(1, MIN(MULTIFD_DEDUP_MAX_SHARDS,
+                              nr_slots / MULTIFD_DEDUP_MAX_SCAN));
+    s->shard_slots = nr_slots / s->nr_shards;
+    s->bucket_mask = 2 * s->shard_slots - 1;
+    s->shards = g_new0(MultiFDDedupShard, s->nr_shards);
+    for (uint32_t i = 0; i < s->nr_shards; i++) {
+        qemu_mutex_init(&s->shards[i].lock);
+        s->shards[i].buckets = g_new0(uint32_t, 2 * s->shard_slots);
+    }
+    s->slots = g_new0(MultiFDDedupSlot, nr_slots);
+    s->data = g_malloc(s->size);
+    multifd_dedup_send_state = s;
+}
+
+void multifd_dedup_send_cleanup(void)
+{
+    MultiFDDedupSendState *s = multifd_dedup_send_state;
+
+    if (!s) {
+        return;
+    }
+
+    for (uint32_t i = 0; i < s->nr_shards; i++) {
+        qemu_mutex_destroy(&s->shards[i].lock);
+        g_free(s->shards[i].buckets);
+    }
+    g_free(s->shards);
+    g_free(s->slots);
+    g_free(s->data);
+    g_clear_pointer(&multifd_dedup_send_state, g_free);
+}
+
+void multifd_dedup_send_sync(void)
+{
+    MultiFDDedupSendState *s = multifd_dedup_send_state;
+
+    if (!s) {
+        return;
+    }
+
+    trace_multifd_dedup_send_sync(qatomic_add_fetch(&s->epoch, 1));
+}
+
+/**
+ * multifd_send_dedup_detect: Look up all normal pages in the dedup cache.
+ *
+ * Moves pages found in the cache behind the normal pages in
+ * p->pages->offset and updates p->pages->normal_num and
+ * p->pages->dedup_num.  p->dedup_slots receives the slot each normal page
+ * was stored in, followed by the slot each deduplicated page refers to.
+ *
+ * @param p A pointer to the send params.
+ */
+void multifd_send_dedup_detect(MultiFDSendParams *p)
+{
+    MultiFDPages_t *pages = &p->data->u.ram;
+    RAMBlock *rb = pages->block;
+    uint32_t page_size = multifd_ram_page_size();
+    int i = 0;
+    int j = pages->normal_num - 1;
+
+    pages->dedup_num = 0;
+
+    if (!multifd_dedup_send_state) {
+        return;
+    }
+
+    while (i <= j) {
+        uint8_t *page = rb->host + pages->offset[i];
+        uint64_t hash = multifd_dedup_hash(page, page_size);
+        MultiFDDedupShard *shard = multifd_dedup_shard(hash);
+        uint32_t slot, stored = MULTIFD_DEDUP_NO_SLOT;
+        bool same;
+
+        WITH_QEMU_LOCK_GUARD(&shard->lock) {
+            slot = multifd_dedup_lookup(p, shard, hash);
+            if (slot == MULTIFD_DEDUP_NO_SLOT) {
+                stored = multifd_dedup_insert(p, shard, hash);
+            }
+        }
+
+        if (slot != MULTIFD_DEDUP_NO_SLOT) {
+            same = !memcmp(multifd_dedup_send_data(slot), page, page_size);
+
+            WITH_QEMU_LOCK_GUARD(&shard->lock) {
+                multifd_dedup_send_state->slots[slot].pins--;
+                if (same) {
+                    multifd_dedup_ref(p, slot);
+                } else {
+                    slot = MULTIFD_DEDUP_NO_SLOT;
+                    stored = multifd_dedup_insert(p, shard, hash);
+                }
+            }
+        }
+
+        if (slot == MULTIFD_DEDUP_NO_SLOT) {
+            if (stored != MULTIFD_DEDUP_NO_SLOT) {
+                multifd_dedup_fill(stored, page);
+            }
+            p->dedup_slots[i] = cpu_to_be32(stored);
+            i++;
+            continue;
+        }
+
+        if (i != j) {
+            ram_addr_t temp = pages->offset[i];
+
+            pages->offset[i] = pages->offset[j];
+            pages->offset[j] = temp;
+        }
+        p->dedup_slots[j] = cpu_to_be32(slot);
+        j--;
+    }
+
+    pages->dedup_num = pages->normal_num - i;
+    pages->normal_num = i;
+
+    stat64_add(&mig_stats.dedup_pages, pages->dedup_num);
+}
+
+/*
+ * Returns the buffer to send for the i-th normal page: the cache copy if
+ * the page was stored in the cache, the guest page otherwise.
+ */
+void *multifd_dedup_send_page(MultiFDSendParams *p, int i)
+{
+    MultiFDPages_t *pages = &p->data->u.ram;
+    uint32_t slot;
+
+    if (!multifd_dedup_send_state) {
+        return pages->block->host + pages->offset[i];
+    }
+
+    slot = be32_to_cpu(p->dedup_slots[i]);
+    if (slot == MULTIFD_DEDUP_NO_SLOT) {
+        return pages->block->host + pages->offset[i];
+    }
+
+    return multifd_dedup_send_data(slot);
+}
+
+/* Size of the slot table that follows the packet header, 0 if none */
+size_t multifd_dedup_send_slots_size(MultiFDSendParams *p)
+{
+    MultiFDPages_t *pages = &p->data->u.ram;
+
+    if (!multifd_dedup_send_state) {
+        return 0;
+    }
+
+    return (pages->normal_num + pages->dedup_num) * sizeof(uint32_t);
+}
+
+void multifd_dedup_recv_setup(void)
+{
+    if (!migrate_multifd_dedup()) {
+        return;
+    }
+
+    multifd_dedup_recv_state = g_new0(MultiFDDedupRecvState, 1);
+    multifd_dedup_recv_state->nr_slots =
+        migrate_multifd_dedup_cache_size() / multifd_ram_page_size();
+    multifd_dedup_recv_state->data =
+        g_malloc(migrate_multifd_dedup_cache_size());
+}
+
+void multifd_dedup_recv_cleanup(void)
+{
+    if (!multifd_dedup_recv_state) {
+        return;
+    }
+
+    g_free(multifd_dedup_recv_state->data);
+    g_clear_pointer(&multifd_dedup_recv_state, g_free);
+}
+
+static uint8_t *multifd_dedup_recv_data(uint32_t slot)
+{
+    return multifd_dedup_recv_state->data +
+           (size_t)slot * multifd_ram_page_size();
+}
+
+/**
+ * multifd_recv_dedup_slots: Read and check the slot table of a packet.
+ *
+ * Must be called before the normal pages are read from the channel.
+ *
+ * @param p A pointer to the recv params.
+ * @param errp Pointer to an error.
+ */
+int multifd_recv_dedup_slots(MultiFDRecvParams *p, Error **errp)
+{
+    uint32_t count = p->normal_num + p->dedup_num;
+
+    if (!(p->flags & MULTIFD_FLAG_DEDUP)) {
+        if (p->dedup_num) {
+            error_setg(errp, "multifd %u: received %u deduplicated pages "
+                       "without slot table", p->id, p->dedup_num);
+            return -1;
+        }
+        return 0;
+    }
+
+    if (!multifd_dedup_recv_state) {
+        error_setg(errp, "multifd %u: received deduplicated pages, but "
+                   "capability multifd-dedup is not enabled", p->id);
+        return -1;
+    }
+
+    if (qio_channel_read_all(p->c, (char *)p->dedup_slots,
+                             count * sizeof(uint32_t), errp)) {
+        return -1;
+    }
+
+    for (int i = 0; i < count; i++) {
+        uint32_t slot = be32_to_cpu(p->dedup_slots[i]);
+
+        if (slot >= multifd_dedup_recv_state->nr_slots &&
+            (i >= p->normal_num || slot != MULTIFD_DEDUP_NO_SLOT)) {
+            error_setg(errp, "multifd %u: invalid dedup slot %u (max %u)",
+                       p->id, slot, multifd_dedup_recv_state->nr_slots);
+            return -1;
+        }
+        p->dedup_slots[i] = slot;
+    }
+
+    return 0;
+}
+
+/**
+ * multifd_recv_dedup_process: Store the normal pages of a packet in the
+ * dedup cache, then fill the deduplicated pages from the cache.
+ *
+ * Must be called after the normal pages have been read.
+ *
+ * @param p A pointer to the recv params.
+ */
+void multifd_recv_dedup_process(MultiFDRecvParams *p)
+{
+    uint32_t page_size = multifd_ram_page_size();
+
+    if (!(p->flags & MULTIFD_FLAG_DEDUP)) {
+        return;
+    }
+
+    for (int i = 0; i < p->normal_num; i++) {
+        uint32_t slot = p->dedup_slots[i];
+
+        if (slot != MULTIFD_DEDUP_NO_SLOT) {
+            memcpy(multifd_dedup_recv_data(slot), p->host + p->normal[i],
+                   page_size);
+        }
+    }
+
+    for (int i = 0; i < p->dedup_num; i++) {
+        uint32_t slot = p->dedup_slots[p->normal_num + i];
+
+        memcpy(p->host + p->dedup[i], multifd_dedup_recv_data(slot),
+               page_size);
+        ramblock_recv_bitmap_set_offset(p->block, p->dedup[i]);
+    }
+
+    trace_multifd_recv_dedup(p->id, p->dedup_num);
+}
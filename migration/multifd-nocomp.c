@@ -70,8 +70,12 @@ static int multifd_nocomp_send_setup(MultiFDSendParams *p, Error **errp)
     }
 
     if (!migrate_mapped_ram()) {
-        /* We need one extra place for the packet header */
-        p->iov = g_new0(struct iovec, page_count + 1);
+        /*
+         * We need one extra place for the packet header, one for the
+         * dedup slot table or the XBZRLE lengths, and one for the XBZRLE
+         * encoded pages
+         */
+        p->iov = g_new0(struct iovec, page_count + 3);
     } else {
         p->iov = g_new0(struct iovec, page_count);
     }
@@ -92,18 +96,37 @@ static void multifd_ram_prepare_header(MultiFDSendParams *p)
     p->iovs_num++;
 }
 
+static void multifd_dedup_prepare_slots(MultiFDSendParams *p)
+{
+    size_t size = multifd_dedup_send_slots_size(p);
+
+    if (size) {
+        p->iov[p->iovs_num].iov_base = p->dedup_slots;
+        p->iov[p->iovs_num].iov_len = size;
+        p->iovs_num++;
+    }
+}
+
+static void *multifd_send_page_buf(MultiFDSendParams *p, int i)
+{
+    void *buf = multifd_xbzrle_send_page(p, i);
+
+    return buf ? buf : multifd_dedup_send_page(p, i);
+}
+
 static void multifd_send_prepare_iovs(MultiFDSendParams *p)
 {
     MultiFDPages_t *pages = &p->data->u.ram;
     uint32_t page_size = multifd_ram_page_size();
 
     for (int i = 0; i < pages->normal_num; i++) {
-        p->iov[p->iovs_num].iov_base = pages->block->host + pages->offset[i];
+        p->iov[p->iovs_num].iov_base = multifd_send_page_buf(p, i);
         p->iov[p->iovs_num].iov_len = page_size;
         p->iovs_num++;
     }
 
     p->next_packet_size = pages->normal_num * page_size;
+    p->next_packet_size += multifd_xbzrle_prepare_data(p);
 }
 
 static int multifd_nocomp_send_prepare(MultiFDSendParams *p, Error **errp)
@@ -123,13 +146,18 @@ static int multifd_nocomp_send_prepare(MultiFDSendParams *p, Error **errp)
     if (!use_zero_copy_send) {
         /*
          * Only !zerocopy needs the header in IOV; zerocopy will
-         * send it separately.
+         * send it separately.  Dedup is not used with zerocopy.
          */
         multifd_ram_prepare_header(p);
+        multifd_dedup_prepare_slots(p);
+        multifd_xbzrle_prepare_lens(p);
     }
 
     multifd_send_prepare_iovs(p);
     p->flags |= MULTIFD_FLAG_NOCOMP;
+    if (multifd_dedup_send_slots_size(p)) {
+        p->flags |= MULTIFD_FLAG_DEDUP;
+    }
 
     multifd_send_fill_packet(p);
 
@@ -177,16 +205,24 @@ static int multifd_nocomp_recv(MultiFDRecvParams *p, Error **errp)
 
     multifd_recv_zero_page_process(p);
 
-    if (!p->normal_num) {
-        return 0;
+    if (multifd_recv_dedup_slots(p, errp) ||
+        multifd_recv_xbzrle_lens(p, errp)) {
+        return -1;
     }
 
-    for (int i = 0; i < p->normal_num; i++) {
-        p->iov[i].iov_base = p->host + p->normal[i];
-        p->iov[i].iov_len = multifd_ram_page_size();
-        ramblock_recv_bitmap_set_offset(p->block, p->normal[i]);
+    if (p->normal_num) {
+        for (int i = 0; i < p->normal_num; i++) {
+            p->iov[i].iov_base = p->host + p->normal[i];
+            p->iov[i].iov_len = multifd_ram_page_size();
+            ramblock_recv_bitmap_set_offset(p->block, p->normal[i]);
+        }
+        if (qio_channel_readv_all(p->c, p->iov, p->normal_num, errp)) {
+            return -1;
+        }
     }
-    return qio_channel_readv_all(p->c, p->iov, p->normal_num, errp);
+
+    multifd_recv_dedup_process(p);
+    return multifd_recv_xbzrle_process(p, errp);
 }
 
 static void multifd_pages_reset(MultiFDPages_t *pages)
@@ -197,6 +233,8 @@ static void multifd_pages_reset(MultiFDPages_t *pages)
      */
     pages->num = 0;
     pages->normal_num = 0;
+    pages->dedup_num = 0;
+    pages->xbzrle_num = 0;
     pages->block = NULL;
 }
 
@@ -204,11 +242,14 @@ void multifd_ram_fill_packet(MultiFDSendParams *p)
 {
     MultiFDPacket_t *packet = p->packet;
     MultiFDPages_t *pages = &p->data->u.ram;
-    uint32_t zero_num = pages->num - pages->normal_num;
+    uint32_t zero_num = pages->num - pages->normal_num - pages->dedup_num -
+                        pages->xbzrle_num;
 
     packet->pages_alloc = cpu_to_be32(multifd_ram_page_count());
     packet->normal_pages = cpu_to_be32(pages->normal_num);
     packet->zero_pages = cpu_to_be32(zero_num);
+    packet->dedup_pages = cpu_to_be32(pages->dedup_num);
+    packet->xbzrle_pages = cpu_to_be32(pages->xbzrle_num);
 
     if (pages->block) {
         pstrcpy(packet->ramblock, sizeof(packet->ramblock),
@@ -223,7 +264,8 @@ void multifd_ram_fill_packet(MultiFDSendParams *p)
     }
 
     trace_multifd_send_ram_fill(p->id, pages->normal_num,
-                                zero_num);
+                                zero_num, pages->dedup_num,
+                                pages->xbzrle_num);
 }
 
 int multifd_ram_unfill_packet(MultiFDRecvParams *p, Error **errp)
@@ -248,15 +290,36 @@ int multifd_ram_unfill_packet(MultiFDRecvParams *p, Error **errp)
         return -1;
     }
 
+    p->dedup_num = be32_to_cpu(packet->dedup_pages);
+    if (p->dedup_num > pages_per_packet - p->normal_num) {
+        error_setg(errp,
+                   "multifd: received packet with %u deduplicated pages, "
+                   "expected maximum %u",
+                   p->dedup_num, pages_per_packet - p->normal_num);
+        return -1;
+    }
+
+    p->xbzrle_num = be32_to_cpu(packet->xbzrle_pages);
+    if (p->xbzrle_num > pages_per_packet - p->normal_num - p->dedup_num) {
+        error_setg(errp,
+                   "multifd: received packet with %u XBZRLE pages, "
+                   "expected maximum %u", p->xbzrle_num,
+                   pages_per_packet - p->normal_num - p->dedup_num);
+        return -1;
+    }
+
     p->zero_num = be32_to_cpu(packet->zero_pages);
-    if (p->zero_num > pages_per_packet - p->normal_num) {
+    if (p->zero_num > pages_per_packet - p->normal_num - p->dedup_num -
+                      p->xbzrle_num) {
         error_setg(errp,
                    "multifd: received packet with %u zero pages, expected maximum %u",
-                   p->zero_num, pages_per_packet - p->normal_num);
+                   p->zero_num, pages_per_packet - p->normal_num -
+                   p->dedup_num - p->xbzrle_num);
         return -1;
     }
 
-    if (p->normal_num == 0 && p->zero_num == 0) {
+    if (p->normal_num == 0 && p->zero_num == 0 && p->dedup_num == 0 &&
+        p->xbzrle_num == 0) {
         return 0;
     }
 
@@ -282,9 +345,36 @@ int multifd_ram_unfill_packet(MultiFDRecvParams *p, Error **errp)
         p->normal[i] = offset;
     }
 
-    for (i = 0; i < p->zero_num; i++) {
+    for (i = 0; i < p->dedup_num; i++) {
         uint64_t offset = be64_to_cpu(packet->offset[p->normal_num + i]);
 
+        if (offset > (p->block->used_length - page_size)) {
+            error_setg(errp, "multifd: offset too long %" PRIu64
+                       " (max " RAM_ADDR_FMT ")",
+                       offset, p->block->used_length);
+            return -1;
+        }
+        p->dedup[i] = offset;
+    }
+
+    for (i = 0; i < p->xbzrle_num; i++) {
+        uint64_t offset = be64_to_cpu(packet->offset[p->normal_num +
+                                                     p->dedup_num + i]);
+
+        if (offset > (p->block->used_length - page_size)) {
+            error_setg(errp, "multifd: offset too long %" PRIu64
+                       " (max " RAM_ADDR_FMT ")",
+                       offset, p->block->used_length);
+            return -1;
+        }
+        p->xbzrle[i] = offset;
+    }
+
+    for (i = 0; i < p->zero_num; i++) {
+        uint64_t offset = be64_to_cpu(packet->offset[p->normal_num +
+                                                     p->dedup_num +
+                                                     p->xbzrle_num + i]);
+
         if (offset > (p->block->used_length - page_size)) {
             error_setg(errp, "multifd: offset too long %" PRIu64
                        " (max " RAM_ADDR_FMT ")",
@@ -0,0 +1,312 @@
+/*
+ * Multifd XBZRLE encoding of RAM pages
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+/*
+ * Once the first round over RAM is complete, each multifd send thread
+ * encodes the normal pages of its packets against the XBZRLE cache.  The
+ * cache is shared by all channels, because a page is not sent by the same
+ * channel in every round; only the set of the page being looked up is
+ * locked, so the lookups and the encoding run in parallel.
+ *
+ * A page is sent at most once between two multifd syncs, so when an
+ * encoded page reaches the destination the previous version of the page
+ * has already been loaded there, and it can be decoded in place.
+ *
+ * Pages are copied out of guest RAM before they are looked up, and the
+ * copy is both what is cached and what is sent, so that the cache matches
+ * the destination even if the guest modifies the page in the meantime.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/bswap.h"
+#include "qapi/error.h"
+#include "io/channel.h"
+#include "system/ramblock.h"
+#include "multifd.h"
+#include "options.h"
+#include "ram.h"
+#include "xbzrle.h"
+#include "trace.h"
+
+struct MultiFDXbzrleSend {
+    /* copies of the normal pages of the packet */
+    uint8_t *pages;
+    /* cached contents of the page being encoded */
+    uint8_t *old;
+    /* a page full of zeros, cached for the zero pages of the packet */
+    uint8_t *zero;
+    /* encoded pages, back to back */
+    uint8_t *data;
+    uint32_t data_len;
+    /* encoded page lengths, big endian */
+    uint32_t *lens;
+    /* offsets of the encoded pages */
+    ram_addr_t *offset;
+    /* whether the normal pages of the packet are sent from @pages */
+    bool staged;
+};
+
+void multifd_xbzrle_send_setup(MultiFDSendParams *p)
+{
+    uint32_t page_count = multifd_ram_page_count();
+    uint32_t page_size = multifd_ram_page_size();
+    MultiFDXbzrleSend *x;
+
+    if (!migrate_xbzrle()) {
+        return;
+    }
+
+    x = g_new0(MultiFDXbzrleSend, 1);
+    x->pages = g_malloc((size_t)page_count * page_size);
+    x->old = g_malloc(page_size);
+    x->zero = g_malloc0(page_size);
+    x->data = g_malloc((size_t)page_count * page_size);
+    x->lens = g_new0(uint32_t, page_count);
+    x->offset = g_new0(ram_addr_t, page_count);
+    p->xbzrle = x;
+}
+
+void multifd_xbzrle_send_cleanup(MultiFDSendParams *p)
+{
+    MultiFDXbzrleSend *x = p->xbzrle;
+
+    if (!x) {
+        return;
+    }
+
+    g_free(x->pages);
+    g_free(x->old);
+    g_free(x->zero);
+    g_free(x->data);
+    g_free(x->lens);
+    g_free(x->offset);
+    g_clear_pointer(&p->xbzrle, g_free);
+}
+
+/**
+ * multifd_send_xbzrle_encode: XBZRLE encode the normal pages of a packet.
+ *
+ * Moves the encoded pages behind the normal pages in p->pages->offset and
+ * updates p->pages->normal_num and p->pages->xbzrle_num.  Zero pages are
+ * only recorded in the XBZRLE cache.
+ *
+ * @param p A pointer to the send params.
+ */
+void multifd_send_xbzrle_encode(MultiFDSendParams *p)
+{
+    MultiFDPages_t *pages = &p->data->u.ram;
+    MultiFDXbzrleSend *x = p->xbzrle;
+    RAMBlock *rb = pages->block;
+    uint32_t page_size = multifd_ram_page_size();
+    uint64_t hits = 0, bytes = 0, overflow = 0;
+    uint32_t normal = 0, encoded = 0;
+
+    pages->xbzrle_num = 0;
+
+    if (!x) {
+        return;
+    }
+
+    x->data_len = 0;
+    x->staged = xbzrle_multifd_started();
+    if (!x->staged) {
+        return;
+    }
+
+    for (int i = pages->normal_num; i < pages->num; i++) {
+        xbzrle_multifd_cache_insert(rb->offset + pages->offset[i], x->zero);
+    }
+
+    for (int i = 0; i < pages->normal_num; i++) {
+        ram_addr_t offset = pages->offset[i];
+        uint8_t *page = x->pages + (size_t)normal * page_size;
+        int len = -1;
+
+        memcpy(page, rb->host + offset, page_size);
+
+        if (xbzrle_multifd_cache_update(rb->offset + offset, page, x->old)) {
+            hits++;
+            len = xbzrle_encode_buffer(x->old, page, page_size,
+                                       x->data + x->data_len, page_size);
+            if (len < 0) {
+                overflow++;
+                bytes += page_size;
+            }
+        }
+
+        if (len < 0) {
+            /* send the copy in x->pages, it is what the cache has */
+            pages->offset[normal++] = offset;
+            continue;
+        }
+
+        x->offset[encoded] = offset;
+        x->lens[encoded] = cpu_to_be32(len);
+        x->data_len += len;
+        bytes += len + sizeof(uint32_t);
+        encoded++;
+    }
+
+    xbzrle_multifd_account(hits, pages->normal_num - hits, bytes, overflow);
+
+    memcpy(pages->offset + normal, x->offset, encoded * sizeof(ram_addr_t));
+    pages->normal_num = normal;
+    pages->xbzrle_num = encoded;
+
+    trace_multifd_send_xbzrle(p->id, encoded, x->data_len);
+}
+
+/* Returns the buffer to send for the i-th normal page, or NULL */
+void *multifd_xbzrle_send_page(MultiFDSendParams *p, int i)
+{
+    MultiFDXbzrleSend *x = p->xbzrle;
+
+    if (!x || !x->staged) {
+        return NULL;
+    }
+
+    return x->pages + (size_t)i * multifd_ram_page_size();
+}
+
+/* Adds the table of encoded page lengths to the IOV */
+void multifd_xbzrle_prepare_lens(MultiFDSendParams *p)
+{
+    MultiFDPages_t *pages = &p->data->u.ram;
+
+    if (!pages->xbzrle_num) {
+        return;
+    }
+
+    p->iov[p->iovs_num].iov_base = p->xbzrle->lens;
+    p->iov[p->iovs_num].iov_len = pages->xbzrle_num * sizeof(uint32_t);
+    p->iovs_num++;
+    p->flags |= MULTIFD_FLAG_XBZRLE;
+}
+
+/* Adds the encoded pages to the IOV, returns their size */
+uint32_t multifd_xbzrle_prepare_data(MultiFDSendParams *p)
+{
+    MultiFDPages_t *pages = &p->data->u.ram;
+    MultiFDXbzrleSend *x = p->xbzrle;
+
+    if (!pages->xbzrle_num || !x->data_len) {
+        return 0;
+    }
+
+    p->iov[p->iovs_num].iov_base = x->data;
+    p->iov[p->iovs_num].iov_len = x->data_len;
+    p->iovs_num++;
+
+    return x->data_len;
+}
+
+void multifd_xbzrle_recv_setup(MultiFDRecvParams *p)
+{
+    uint32_t page_count = multifd_ram_page_count();
+
+    if (!migrate_xbzrle()) {
+        return;
+    }
+
+    p->xbzrle_lens = g_new0(uint32_t, page_count);
+    p->xbzrle_data = g_malloc((size_t)page_count * multifd_ram_page_size());
+}
+
+void multifd_xbzrle_recv_cleanup(MultiFDRecvParams *p)
+{
+    g_clear_pointer(&p->xbzrle_lens, g_free);
+    g_clear_pointer(&p->xbzrle_data, g_free);
+}
+
+/**
+ * multifd_recv_xbzrle_lens: Read and check the encoded page lengths.
+ *
+ * Must be called before the normal pages are read from the channel.
+ *
+ * @param p A pointer to the recv params.
+ * @param errp Pointer to an error.
+ */
+int multifd_recv_xbzrle_lens(MultiFDRecvParams *p, Error **errp)
+{
+    uint32_t page_size = multifd_ram_page_size();
+
+    p->xbzrle_data_len = 0;
+
+    if (!(p->flags & MULTIFD_FLAG_XBZRLE)) {
+        if (p->xbzrle_num) {
+            error_setg(errp, "multifd %u: received %u XBZRLE pages "
+                       "without lengths", p->id, p->xbzrle_num);
+            return -1;
+        }
+        return 0;
+    }
+
+    if (!p->xbzrle_lens) {
+        error_setg(errp, "multifd %u: received XBZRLE pages, but "
+                   "capability xbzrle is not enabled", p->id);
+        return -1;
+    }
+
+    if (qio_channel_read_all(p->c, (char *)p->xbzrle_lens,
+                             p->xbzrle_num * sizeof(uint32_t), errp)) {
+        return -1;
+    }
+
+    for (int i = 0; i < p->xbzrle_num; i++) {
+        uint32_t len = be32_to_cpu(p->xbzrle_lens[i]);
+
+        if (len > page_size) {
+            error_setg(errp, "multifd %u: XBZRLE page of %u bytes "
+                       "(max %u)", p->id, len, page_size);
+            return -1;
+        }
+        p->xbzrle_lens[i] = len;
+        p->xbzrle_data_len += len;
+    }
+
+    return 0;
+}
+
+/**
+ * multifd_recv_xbzrle_process: Read and decode the XBZRLE pages.
+ *
+ * Must be called after the normal pages have been read.
+ *
+ * @param p A pointer to the recv params.
+ * @param errp Pointer to an error.
+ */
+int multifd_recv_xbzrle_process(MultiFDRecvParams *p, Error **errp)
+{
+    uint32_t page_size = multifd_ram_page_size();
+    uint8_t *data = p->xbzrle_data;
+
+    if (!p->xbzrle_num) {
+        return 0;
+    }
+
+    if (p->xbzrle_data_len &&
+        qio_channel_read_all(p->c, (char *)p->xbzrle_data,
+                             p->xbzrle_data_len, errp)) {
+        return -1;
+    }
+
+    for (int i = 0; i < p->xbzrle_num; i++) {
+        uint32_t len = p->xbzrle_lens[i];
+
+        if (xbzrle_decode_buffer(data, len, p->host + p->xbzrle[i],
+                                 page_size) < 0) {
+            error_setg(errp, "multifd %u: failed to decode XBZRLE page at "
+                       "offset " RAM_ADDR_FMT, p->id, p->xbzrle[i]);
+            return -1;
+        }
+        ramblock_recv_bitmap_set_offset(p->block, p->xbzrle[i]);
+        data += len;
+    }
+
+    trace_multifd_recv_xbzrle(p->id, p->xbzrle_num, p->xbzrle_data_len);
+    return 0;
+}
@@ -41,7 +41,9 @@ static void swap_page_offset(ram_addr_t *pages_offset, int a, int b)
  * multifd_send_zero_page_detect: Perform zero page detection on all pages.
  *
  * Sorts normal pages before zero pages in p->pages->offset and updates
- * p->pages->normal_num.
+ * p->pages->normal_num.  If deduplication is enabled, the normal pages
+ * are then looked up in the dedup cache; if XBZRLE is enabled, they are
+ * then encoded against the XBZRLE cache.
  *
  * @param p A pointer to the send params.
  */
@@ -77,8 +79,13 @@ void multifd_send_zero_page_detect(MultiFDSendParams *p)
     pages->normal_num = i;
 
 out:
+    multifd_send_dedup_detect(p);
+    multifd_send_xbzrle_encode(p);
+
     stat64_add(&mig_stats.normal_pages, pages->normal_num);
-    stat64_add(&mig_stats.zero_pages, pages->num - pages->normal_num);
+    stat64_add(&mig_stats.zero_pages,
+               pages->num - pages->normal_num - pages->dedup_num -
+               pages->xbzrle_num);
 }
 
 void multifd_recv_zero_page_process(MultiFDRecvParams *p)
@@ -515,6 +515,8 @@ static bool multifd_send_cleanup_channel(MultiFDSendParams *p, Error **errp)
     g_free(p->name);
     p->name = NULL;
     g_clear_pointer(&p->data, multifd_send_data_free);
+    g_clear_pointer(&p->dedup_slots, g_free);
+    multifd_xbzrle_send_cleanup(p);
     p->packet_len = 0;
     g_clear_pointer(&p->packet_device_state, g_free);
     g_free(p->packet);
@@ -530,6 +532,7 @@ static void multifd_send_cleanup_state(void)
     file_cleanup_outgoing_migration();
     socket_cleanup_outgoing_migration();
     multifd_device_state_send_cleanup();
+    multifd_dedup_send_cleanup();
     qemu_sem_destroy(&multifd_send_state->channels_created);
     qemu_sem_destroy(&multifd_send_state->channels_ready);
     qemu_mutex_destroy(&multifd_send_state->multifd_send_mutex);
@@ -650,6 +653,14 @@ int multifd_send_sync_main(MultiFDSyncReq req)
             return -1;
         }
     }
+
+    /*
+     * Everything sent so far is received before anything that follows
+     * the SYNC packets, start a new dedup epoch.
+     */
+    if (req == MULTIFD_SYNC_ALL) {
+        multifd_dedup_send_sync();
+    }
     trace_multifd_send_sync_main(multifd_send_state->packet_num);
 
     return 0;
@@ -947,6 +958,8 @@ bool multifd_send_setup(void)
         qemu_sem_init(&p->sem_sync, 0);
         p->id = i;
         p->data = multifd_send_data_alloc();
+        p->dedup_slots = g_new0(uint32_t, page_count);
+        multifd_xbzrle_send_setup(p);
 
         if (use_packets) {
             p->packet_len = sizeof(MultiFDPacket_t)
@@ -991,6 +1004,7 @@ bool multifd_send_setup(void)
     }
 
     multifd_device_state_send_setup();
+    multifd_dedup_send_setup();
 
     return true;
 
@@ -1136,11 +1150,19 @@ static void multifd_recv_cleanup_channel(MultiFDRecvParams *p)
     p->normal = NULL;
     g_free(p->zero);
     p->zero = NULL;
+    g_free(p->dedup);
+    p->dedup = NULL;
+    g_free(p->dedup_slots);
+    p->dedup_slots = NULL;
+    g_free(p->xbzrle);
+    p->xbzrle = NULL;
+    multifd_xbzrle_recv_cleanup(p);
     multifd_recv_state->ops->recv_cleanup(p);
 }
 
 static void multifd_recv_cleanup_state(void)
 {
+    multifd_dedup_recv_cleanup();
     qemu_sem_destroy(&multifd_recv_state->sem_sync);
     g_free(multifd_recv_state->params);
     multifd_recv_state->params = NULL;
@@ -1353,7 +1375,8 @@ static void *multifd_recv_thread(void *opaque)
                  * because older QEMUs (<9.0) still send data along with
                  * the SYNC packet.
                  */
-                has_data = p->normal_num || p->zero_num;
+                has_data = p->normal_num || p->zero_num || p->dedup_num ||
+                           p->xbzrle_num;
             }
 
             qemu_mutex_unlock(&p->mutex);
@@ -1487,8 +1510,14 @@ int multifd_recv_setup(Error **errp)
         p->name = g_strdup_printf(MIGRATION_THREAD_DST_MULTIFD, i);
         p->normal = g_new0(ram_addr_t, page_count);
         p->zero = g_new0(ram_addr_t, page_count);
+        p->dedup = g_new0(ram_addr_t, page_count);
+        p->dedup_slots = g_new0(uint32_t, page_count);
+        p->xbzrle = g_new0(ram_addr_t, page_count);
+        multifd_xbzrle_recv_setup(p);
     }
 
+    multifd_dedup_recv_setup();
+
     for (i = 0; i < thread_count; i++) {
         MultiFDRecvParams *p = &multifd_recv_state->params[i];
         int ret;
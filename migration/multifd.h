@@ -18,6 +18,7 @@
 
 typedef struct MultiFDRecvData MultiFDRecvData;
 typedef struct MultiFDSendData MultiFDSendData;
+typedef struct MultiFDXbzrleSend MultiFDXbzrleSend;
 
 typedef enum {
     /* No sync request */
@@ -73,6 +74,21 @@ MultiFDRecvData *multifd_get_recv_data(void);
  */
 #define MULTIFD_FLAG_DEVICE_STATE (32 << 1)
 
+/*
+ * If set, the packet header is followed by the dedup slot table: one
+ * uint32_t for each normal page and each deduplicated page.
+ */
+#define MULTIFD_FLAG_DEDUP (64 << 1)
+
+/* Dedup slot table entry for normal pages that are not cached */
+#define MULTIFD_DEDUP_NO_SLOT UINT32_MAX
+
+/*
+ * If set, the packet header is followed by one uint32_t for each XBZRLE
+ * page, its encoded length, and the encoded pages follow the normal pages.
+ */
+#define MULTIFD_FLAG_XBZRLE (128 << 1)
+
 /* This value needs to be a multiple of qemu_target_page_size() */
 #define MULTIFD_PACKET_SIZE (512 * 1024)
 
@@ -94,12 +110,18 @@ typedef struct {
     uint64_t packet_num;
     /* zero pages */
     uint32_t zero_pages;
+    /* pages sent as a reference to the dedup cache */
+    uint32_t dedup_pages;
+    /* XBZRLE encoded pages */
+    uint32_t xbzrle_pages;
     uint32_t unused32[1];    /* Reserved for future use */
-    uint64_t unused64[3];    /* Reserved for future use */
+    uint64_t unused64[2];    /* Reserved for future use */
     char ramblock[256];
     /*
      * This array contains the pointers to:
      *  - normal pages (initial normal_pages entries)
+     *  - deduplicated pages (following dedup_pages entries)
+     *  - XBZRLE encoded pages (following xbzrle_pages entries)
      *  - zero pages (following zero_pages entries)
      */
     uint64_t offset[];
@@ -120,6 +142,10 @@ typedef struct {
     uint32_t num;
     /* number of normal pages */
     uint32_t normal_num;
+    /* number of deduplicated pages, following the normal pages */
+    uint32_t dedup_num;
+    /* number of XBZRLE encoded pages, following the deduplicated pages */
+    uint32_t xbzrle_num;
     /*
      * Pointer to the ramblock.  NOTE: it's caller's responsibility to make
      * sure the pointer is always valid!
@@ -234,6 +260,10 @@ typedef struct {
     uint32_t iovs_num;
     /* used for compression methods */
     void *compress_data;
+    /* dedup slot table, big endian, see multifd-dedup.c */
+    uint32_t *dedup_slots;
+    /* XBZRLE encoding buffers, see multifd-xbzrle.c */
+    MultiFDXbzrleSend *xbzrle;
 }  MultiFDSendParams;
 
 typedef struct {
@@ -291,6 +321,21 @@ typedef struct {
     ram_addr_t *zero;
     /* num of zero pages */
     uint32_t zero_num;
+    /* Pages that are sent as a reference to the dedup cache */
+    ram_addr_t *dedup;
+    /* num of deduplicated pages */
+    uint32_t dedup_num;
+    /* dedup slot table, see multifd-dedup.c */
+    uint32_t *dedup_slots;
+    /* Pages that are sent XBZRLE encoded */
+    ram_addr_t *xbzrle;
+    /* num of XBZRLE encoded pages */
+    uint32_t xbzrle_num;
+    /* encoded page lengths */
+    uint32_t *xbzrle_lens;
+    /* encoded pages and their total size */
+    uint8_t *xbzrle_data;
+    uint32_t xbzrle_data_len;
     /* used for de-compression methods */
     void *compress_data;
     /* Flags for the QIOChannel */
@@ -382,6 +427,29 @@ bool multifd_send_prepare_common(MultiFDSendParams *p);
 void multifd_send_zero_page_detect(MultiFDSendParams *p);
 void multifd_recv_zero_page_process(MultiFDRecvParams *p);
 
+uint64_t multifd_dedup_cache_size(void);
+void multifd_dedup_send_setup(void);
+void multifd_dedup_send_cleanup(void);
+void multifd_dedup_send_sync(void);
+void multifd_send_dedup_detect(MultiFDSendParams *p);
+void *multifd_dedup_send_page(MultiFDSendParams *p, int i);
+size_t multifd_dedup_send_slots_size(MultiFDSendParams *p);
+void multifd_dedup_recv_setup(void);
+void multifd_dedup_recv_cleanup(void);
+int multifd_recv_dedup_slots(MultiFDRecvParams *p, Error **errp);
+void multifd_recv_dedup_process(MultiFDRecvParams *p);
+
+void multifd_xbzrle_send_setup(MultiFDSendParams *p);
+void multifd_xbzrle_send_cleanup(MultiFDSendParams *p);
+void multifd_send_xbzrle_encode(MultiFDSendParams *p);
+void *multifd_xbzrle_send_page(MultiFDSendParams *p, int i);
+void multifd_xbzrle_prepare_lens(MultiFDSendParams *p);
+uint32_t multifd_xbzrle_prepare_data(MultiFDSendParams *p);
+void multifd_xbzrle_recv_setup(MultiFDRecvParams *p);
+void multifd_xbzrle_recv_cleanup(MultiFDRecvParams *p);
+int multifd_recv_xbzrle_lens(MultiFDRecvParams *p, Error **errp);
+int multifd_recv_xbzrle_process(MultiFDRecvParams *p, Error **errp);
+
 void multifd_channel_connect(MultiFDSendParams *p, QIOChannel *ioc);
 bool multifd_send(MultiFDSendData **send_data);
 MultiFDSendData *multifd_send_data_alloc(void);
@@ -29,6 +29,7 @@
 #include "qemu-file.h"
 #include "ram.h"
 #include "options.h"
+#include "page_cache.h"
 #include "system/kvm.h"
 
 /* Maximum migrate downtime set to 2000 seconds */
@@ -49,10 +50,14 @@
 
 /* Migration XBZRLE default cache size */
 #define DEFAULT_MIGRATE_XBZRLE_CACHE_SIZE (64 * 1024 * 1024)
+#define DEFAULT_MIGRATE_XBZRLE_CACHE_ASSOCIATIVITY 4
 
 /* The delay time (in ms) between two COLO checkpoints */
 #define DEFAULT_MIGRATE_X_CHECKPOINT_DELAY (200 * 100)
 #define DEFAULT_MIGRATE_MULTIFD_CHANNELS 2
+#define DEFAULT_MIGRATE_MULTIFD_DEDUP_CACHE_SIZE (64 * 1024 * 1024)
+#define MIN_MIGRATE_MULTIFD_DEDUP_CACHE_SIZE (1024 * 1024)
+#define MAX_MIGRATE_MULTIFD_DEDUP_CACHE_SIZE (64ULL * 1024 * 1024 * 1024)
 #define DEFAULT_MIGRATE_MULTIFD_COMPRESSION MULTIFD_COMPRESSION_NONE
 /* 0: means nocompress, 1: best speed, ... 9: best compress ratio */
 #define DEFAULT_MIGRATE_MULTIFD_ZLIB_LEVEL 1
@@ -129,6 +134,9 @@ const Property migration_properties[] = {
     DEFINE_PROP_UINT8("multifd-channels", MigrationState,
                       parameters.multifd_channels,
                       DEFAULT_MIGRATE_MULTIFD_CHANNELS),
+    DEFINE_PROP_SIZE("multifd-dedup-cache-size", MigrationState,
+                      parameters.multifd_dedup_cache_size,
+                      DEFAULT_MIGRATE_MULTIFD_DEDUP_CACHE_SIZE),
     DEFINE_PROP_MULTIFD_COMPRESSION("multifd-compression", MigrationState,
                       parameters.multifd_compression,
                       DEFAULT_MIGRATE_MULTIFD_COMPRESSION),
@@ -144,6 +152,9 @@ const Property migration_properties[] = {
     DEFINE_PROP_SIZE("xbzrle-cache-size", MigrationState,
                       parameters.xbzrle_cache_size,
                       DEFAULT_MIGRATE_XBZRLE_CACHE_SIZE),
+    DEFINE_PROP_UINT8("xbzrle-cache-associativity", MigrationState,
+                      parameters.xbzrle_cache_associativity,
+                      DEFAULT_MIGRATE_XBZRLE_CACHE_ASSOCIATIVITY),
     DEFINE_PROP_SIZE("max-postcopy-bandwidth", MigrationState,
                       parameters.max_postcopy_bandwidth,
                       DEFAULT_MIGRATE_MAX_POSTCOPY_BANDWIDTH),
@@ -201,6 +212,7 @@ const Property migration_properties[] = {
                         MIGRATION_CAPABILITY_SWITCHOVER_ACK),
     DEFINE_PROP_MIG_CAP("x-dirty-limit", MIGRATION_CAPABILITY_DIRTY_LIMIT),
     DEFINE_PROP_MIG_CAP("mapped-ram", MIGRATION_CAPABILITY_MAPPED_RAM),
+    DEFINE_PROP_MIG_CAP("multifd-dedup", MIGRATION_CAPABILITY_MULTIFD_DEDUP),
 };
 const size_t migration_properties_count = ARRAY_SIZE(migration_properties);
 
@@ -281,6 +293,13 @@ bool migrate_multifd(void)
     return s->capabilities[MIGRATION_CAPABILITY_MULTIFD];
 }
 
+bool migrate_multifd_dedup(void)
+{
+    MigrationState *s = migrate_get_current();
+
+    return s->capabilities[MIGRATION_CAPABILITY_MULTIFD_DEDUP];
+}
+
 bool migrate_pause_before_switchover(void)
 {
     MigrationState *s = migrate_get_current();
@@ -603,9 +622,14 @@ bool migrate_caps_check(bool *old_caps, bool *new_caps, Error **errp)
         }
     }
 
-    if (new_caps[MIGRATION_CAPABILITY_MULTIFD]) {
-        if (new_caps[MIGRATION_CAPABILITY_XBZRLE]) {
-            error_setg(errp, "Multifd is not compatible with xbzrle");
+    if (new_caps[MIGRATION_CAPABILITY_MULTIFD] &&
+        new_caps[MIGRATION_CAPABILITY_XBZRLE]) {
+        if (new_caps[MIGRATION_CAPABILITY_ZERO_COPY_SEND] ||
+            new_caps[MIGRATION_CAPABILITY_MULTIFD_DEDUP] ||
+            migrate_multifd_compression()) {
+            error_setg(errp, "Multifd xbzrle is only available for "
+                       "non-compressed multifd migration without "
+                       "zero-copy-send or multifd-dedup");
             return false;
         }
     }
@@ -624,6 +648,18 @@ bool migrate_caps_check(bool *old_caps, bool *new_caps, Error **errp)
         }
     }
 
+    if (new_caps[MIGRATION_CAPABILITY_MULTIFD_DEDUP]) {
+        if (!new_caps[MIGRATION_CAPABILITY_MULTIFD] ||
+            new_caps[MIGRATION_CAPABILITY_MAPPED_RAM] ||
+            new_caps[MIGRATION_CAPABILITY_ZERO_COPY_SEND] ||
+            migrate_multifd_compression()) {
+            error_setg(errp, "Multifd dedup is only available for "
+                       "non-compressed multifd migration without mapped-ram "
+                       "or zero-copy-send");
+            return false;
+        }
+    }
+
     /*
      * On destination side, check the cases that capability is being set
      * after incoming thread has started.
@@ -794,6 +830,13 @@ int migrate_multifd_channels(void)
     return s->parameters.multifd_channels;
 }
 
+uint64_t migrate_multifd_dedup_cache_size(void)
+{
+    MigrationState *s = migrate_get_current();
+
+    return s->parameters.multifd_dedup_cache_size;
+}
+
 MultiFDCompression migrate_multifd_compression(void)
 {
     MigrationState *s = migrate_get_current();
@@ -865,6 +908,13 @@ uint64_t migrate_xbzrle_cache_size(void)
     return s->parameters.xbzrle_cache_size;
 }
 
+uint8_t migrate_xbzrle_cache_associativity(void)
+{
+    MigrationState *s = migrate_get_current();
+
+    return s->parameters.xbzrle_cache_associativity;
+}
+
 ZeroPageDetection migrate_zero_page_detection(void)
 {
     MigrationState *s = migrate_get_current();
@@ -917,6 +967,8 @@ MigrationParameters *qmp_query_migrate_parameters(Error **errp)
     params->x_checkpoint_delay = s->parameters.x_checkpoint_delay;
     params->has_multifd_channels = true;
     params->multifd_channels = s->parameters.multifd_channels;
+    params->has_multifd_dedup_cache_size = true;
+    params->multifd_dedup_cache_size = s->parameters.multifd_dedup_cache_size;
     params->has_multifd_compression = true;
     params->multifd_compression = s->parameters.multifd_compression;
     params->has_multifd_zlib_level = true;
@@ -927,6 +979,9 @@ MigrationParameters *qmp_query_migrate_parameters(Error **errp)
     params->multifd_zstd_level = s->parameters.multifd_zstd_level;
     params->has_xbzrle_cache_size = true;
     params->xbzrle_cache_size = s->parameters.xbzrle_cache_size;
+    params->has_xbzrle_cache_associativity = true;
+    params->xbzrle_cache_associativity =
+        s->parameters.xbzrle_cache_associativity;
     params->has_max_postcopy_bandwidth = true;
     params->max_postcopy_bandwidth = s->parameters.max_postcopy_bandwidth;
     params->has_max_cpu_throttle = true;
@@ -975,11 +1030,13 @@ void migrate_params_init(MigrationParameters *params)
     params->has_downtime_limit = true;
     params->has_x_checkpoint_delay = true;
     params->has_multifd_channels = true;
+    params->has_multifd_dedup_cache_size = true;
     params->has_multifd_compression = true;
     params->has_multifd_zlib_level = true;
     params->has_multifd_qatzip_level = true;
     params->has_multifd_zstd_level = true;
     params->has_xbzrle_cache_size = true;
+    params->has_xbzrle_cache_associativity = true;
     params->has_max_postcopy_bandwidth = true;
     params->has_max_cpu_throttle = true;
     params->has_announce_initial = true;
@@ -1063,6 +1120,18 @@ bool migrate_params_check(MigrationParameters *params, Error **errp)
         return false;
     }
 
+    if (params->has_multifd_dedup_cache_size &&
+        (params->multifd_dedup_cache_size <
+         MIN_MIGRATE_MULTIFD_DEDUP_CACHE_SIZE ||
+         params->multifd_dedup_cache_size >
+         MAX_MIGRATE_MULTIFD_DEDUP_CACHE_SIZE ||
+         !is_power_of_2(params->multifd_dedup_cache_size))) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "multifd_dedup_cache_size",
+                   "a power of two between 1 MiB and 64 GiB");
+        return false;
+    }
+
     if (params->has_multifd_zlib_level &&
         (params->multifd_zlib_level > 9)) {
         error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "multifd_zlib_level",
@@ -1094,6 +1163,16 @@ bool migrate_params_check(MigrationParameters *params, Error **errp)
         return false;
     }
 
+    if (params->has_xbzrle_cache_associativity &&
+        (!is_power_of_2(params->xbzrle_cache_associativity) ||
+         params->xbzrle_cache_associativity > PAGE_CACHE_MAX_WAYS)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "xbzrle_cache_associativity",
+                   "a power of two no more than "
+                   stringify(PAGE_CACHE_MAX_WAYS));
+        return false;
+    }
+
     if (params->has_max_cpu_throttle &&
         (params->max_cpu_throttle < params->cpu_throttle_initial ||
          params->max_cpu_throttle > 99)) {
@@ -1149,6 +1228,20 @@ bool migrate_params_check(MigrationParameters *params, Error **errp)
     }
 #endif
 
+    if (migrate_multifd_dedup() &&
+        params->has_multifd_compression && params->multifd_compression) {
+        error_setg(errp,
+                   "Multifd dedup only available for non-compressed multifd migration");
+        return false;
+    }
+
+    if (migrate_multifd() && migrate_xbzrle() &&
+        params->has_multifd_compression && params->multifd_compression) {
+        error_setg(errp,
+                   "Multifd xbzrle only available for non-compressed multifd migration");
+        return false;
+    }
+
     if (migrate_mapped_ram() &&
         (migrate_multifd_compression() || migrate_tls())) {
         error_setg(errp,
@@ -1237,6 +1330,9 @@ static void migrate_params_test_apply(MigrateSetParameters *params,
     if (params->has_multifd_channels) {
         dest->multifd_channels = params->multifd_channels;
     }
+    if (params->has_multifd_dedup_cache_size) {
+        dest->multifd_dedup_cache_size = params->multifd_dedup_cache_size;
+    }
     if (params->has_multifd_compression) {
         dest->multifd_compression = params->multifd_compression;
     }
@@ -1252,6 +1348,9 @@ static void migrate_params_test_apply(MigrateSetParameters *params,
     if (params->has_xbzrle_cache_size) {
         dest->xbzrle_cache_size = params->xbzrle_cache_size;
     }
+    if (params->has_xbzrle_cache_associativity) {
+        dest->xbzrle_cache_associativity = params->xbzrle_cache_associativity;
+    }
     if (params->has_max_postcopy_bandwidth) {
         dest->max_postcopy_bandwidth = params->max_postcopy_bandwidth;
     }
@@ -1360,6 +1459,10 @@ static void migrate_params_apply(MigrateSetParameters *params, Error **errp)
     if (params->has_multifd_channels) {
         s->parameters.multifd_channels = params->multifd_channels;
     }
+    if (params->has_multifd_dedup_cache_size) {
+        s->parameters.multifd_dedup_cache_size =
+            params->multifd_dedup_cache_size;
+    }
     if (params->has_multifd_compression) {
         s->parameters.multifd_compression = params->multifd_compression;
     }
@@ -1374,7 +1477,15 @@ static void migrate_params_apply(MigrateSetParameters *params, Error **errp)
     }
     if (params->has_xbzrle_cache_size) {
         s->parameters.xbzrle_cache_size = params->xbzrle_cache_size;
-        xbzrle_cache_resize(params->xbzrle_cache_size, errp);
+    }
+    if (params->has_xbzrle_cache_associativity) {
+        s->parameters.xbzrle_cache_associativity =
+            params->xbzrle_cache_associativity;
+    }
+    if (params->has_xbzrle_cache_size ||
+        params->has_xbzrle_cache_associativity) {
+        xbzrle_cache_resize(s->parameters.xbzrle_cache_size,
+                            s->parameters.xbzrle_cache_associativity, errp);
     }
     if (params->has_max_postcopy_bandwidth) {
         s->parameters.max_postcopy_bandwidth = params->max_postcopy_bandwidth;
@@ -17,28 +17,53 @@
 #include "qapi/qmp/qerror.h"
 #include "qapi/error.h"
 #include "qemu/host-utils.h"
+#include "qemu/lockable.h"
+#include "qemu/rcu.h"
+#include "qemu/stats64.h"
+#include "qemu/thread.h"
 #include "page_cache.h"
 #include "trace.h"
 
 /* the page in cache will not be replaced in two cycles */
 #define CACHED_PAGE_LIFETIME 2
 
+/* Maximum number of locks protecting the sets */
+#define PAGE_CACHE_SHARDS 64
+
 typedef struct CacheItem CacheItem;
 
 struct CacheItem {
     uint64_t it_addr;
     uint64_t it_age;
     uint8_t *it_data;
+    /* number of cache hits, a measure of how often the page is dirtied */
+    uint32_t it_hits;
 };
 
+typedef struct CacheShard {
+    QemuMutex lock;
+} QEMU_ALIGNED(64) CacheShard;
+
 struct PageCache {
+    /* sets of @ways items, one after the other */
     CacheItem *page_cache;
     size_t page_size;
     size_t max_num_items;
     size_t num_items;
+    size_t ways;
+    size_t num_sets;
+    /* set i is protected by shards[i % num_shards] */
+    CacheShard *shards;
+    size_t num_shards;
+    Stat64 hits;
+    Stat64 misses;
+    Stat64 evictions;
+    Stat64 rejected;
+    struct rcu_head rcu;
 };
 
-PageCache *cache_init(uint64_t new_size, size_t page_size, Error **errp)
+PageCache *cache_init(uint64_t new_size, size_t page_size, unsigned ways,
+                      Error **errp)
 {
     int64_t i;
     size_t num_pages = new_size / page_size;
@@ -57,8 +82,15 @@ PageCache *cache_init(uint64_t new_size, size_t page_size, Error **errp)
         return NULL;
     }
 
+    if (!is_power_of_2(ways) || ways > PAGE_CACHE_MAX_WAYS) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "cache associativity",
+                   "is not a power of two up to "
+                   stringify(PAGE_CACHE_MAX_WAYS));
+        return NULL;
+    }
+
     /* We prefer not to abort if there is no memory */
-    cache = g_try_malloc(sizeof(*cache));
+    cache = g_try_malloc0(sizeof(*cache));
     if (!cache) {
         error_setg(errp, "Failed to allocate cache");
         return NULL;
@@ -66,8 +98,11 @@ PageCache *cache_init(uint64_t new_size, size_t page_size, Error **errp)
     cache->page_size = page_size;
     cache->num_items = 0;
     cache->max_num_items = num_pages;
+    cache->ways = MIN(ways, num_pages);
+    cache->num_sets = num_pages / cache->ways;
+    cache->num_shards = MIN(PAGE_CACHE_SHARDS, cache->num_sets);
 
-    trace_migration_pagecache_init(cache->max_num_items);
+    trace_migration_pagecache_init(cache->max_num_items, cache->ways);
 
     /* We prefer not to abort if there is no memory */
     cache->page_cache = g_try_malloc((cache->max_num_items) *
@@ -82,6 +117,12 @@ PageCache *cache_init(uint64_t new_size, size_t page_size, Error **errp)
         cache->page_cache[i].it_data = NULL;
         cache->page_cache[i].it_age = 0;
         cache->page_cache[i].it_addr = -1;
+        cache->page_cache[i].it_hits = 0;
+    }
+
+    cache->shards = g_new(CacheShard, cache->num_shards);
+    for (i = 0; i < cache->num_shards; i++) {
+        qemu_mutex_init(&cache->shards[i].lock);
     }
 
     return cache;
@@ -98,64 +139,118 @@ void cache_fini(PageCache *cache)
         g_free(cache->page_cache[i].it_data);
     }
 
+    for (i = 0; i < cache->num_shards; i++) {
+        qemu_mutex_destroy(&cache->shards[i].lock);
+    }
+
+    g_free(cache->shards);
     g_free(cache->page_cache);
     cache->page_cache = NULL;
     g_free(cache);
 }
 
-static size_t cache_get_cache_pos(const PageCache *cache,
-                                  uint64_t address)
+void cache_fini_rcu(PageCache *cache)
 {
-    g_assert(cache->max_num_items);
-    return (address / cache->page_size) & (cache->max_num_items - 1);
+    call_rcu(cache, cache_fini, rcu);
 }
 
-static CacheItem *cache_get_by_addr(const PageCache *cache, uint64_t addr)
+static size_t cache_get_set(const PageCache *cache, uint64_t address)
 {
-    size_t pos;
+    uint64_t page = address / cache->page_size;
 
-    g_assert(cache);
-    g_assert(cache->page_cache);
+    g_assert(cache->max_num_items);
 
-    pos = cache_get_cache_pos(cache, addr);
+    if (cache->num_sets == 1) {
+        return 0;
+    }
 
-    return &cache->page_cache[pos];
+    /*
+     * Fibonacci hashing, so that pages with a power of two stride do not
+     * all end up in the same few sets.
+     */
+    return (page * 0x9e3779b97f4a7c15ULL) >> (64 - ctz64(cache->num_sets));
 }
 
-uint8_t *get_cached_data(const PageCache *cache, uint64_t addr)
+static QemuMutex *cache_set_lock(PageCache *cache, size_t set)
 {
-    return cache_get_by_addr(cache, addr)->it_data;
+    return &cache->shards[set & (cache->num_shards - 1)].lock;
 }
 
-bool cache_is_cached(const PageCache *cache, uint64_t addr,
-                     uint64_t current_age)
+/* Must be called with the lock of @set held */
+static CacheItem *cache_find(PageCache *cache, size_t set, uint64_t addr)
 {
-    CacheItem *it;
-
-    it = cache_get_by_addr(cache, addr);
+    CacheItem *it = &cache->page_cache[set * cache->ways];
 
-    if (it->it_addr == addr) {
-        /* update the it_age when the cache hit */
-        it->it_age = current_age;
-        return true;
+    for (size_t i = 0; i < cache->ways; i++, it++) {
+        if (it->it_addr == addr) {
+            return it;
+        }
     }
-    return false;
+
+    return NULL;
 }
 
-int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata,
-                 uint64_t current_age)
+/*
+ * Pick the item of @set to replace with a new page, or NULL if all pages
+ * in the set are still fresh.  Among the pages that are old enough to be
+ * replaced, the one that was hit the least often is evicted; the hit count
+ * halves for every generation without a hit, so that pages that are no
+ * longer being dirtied eventually give way.
+ *
+ * Must be called with the lock of @set held.
+ */
+static CacheItem *cache_find_victim(PageCache *cache, size_t set,
+                                    uint64_t current_age)
 {
+    CacheItem *it = &cache->page_cache[set * cache->ways];
+    CacheItem *victim = NULL;
+    uint32_t victim_hits = 0;
+
+    for (size_t i = 0; i < cache->ways; i++, it++) {
+        uint64_t idle;
+        uint32_t hits;
+
+        if (!it->it_data || it->it_addr == -1) {
+            return it;
+        }
+
+        if (it->it_age + CACHED_PAGE_LIFETIME > current_age) {
+            /* the cache page is fresh, don't replace it */
+            continue;
+        }
 
+        idle = current_age - it->it_age;
+        hits = idle >= 32 ? 0 : it->it_hits >> idle;
+        if (!victim || hits < victim_hits ||
+            (hits == victim_hits && it->it_age < victim->it_age)) {
+            victim = it;
+            victim_hits = hits;
+        }
+    }
+
+    return victim;
+}
+
+/* Must be called with the lock of @set held */
+static int cache_insert_locked(PageCache *cache, size_t set, uint64_t addr,
+                               const uint8_t *pdata, uint64_t current_age)
+{
     CacheItem *it;
 
     /* actual update of entry */
-    it = cache_get_by_addr(cache, addr);
-
-    if (it->it_data && it->it_addr != addr &&
-        it->it_age + CACHED_PAGE_LIFETIME > current_age) {
-        /* the cache page is fresh, don't replace it */
-        return -1;
+    it = cache_find(cache, set, addr);
+    if (!it) {
+        it = cache_find_victim(cache, set, current_age);
+        if (!it) {
+            stat64_add(&cache->rejected, 1);
+            return -1;
+        }
+        if (it->it_data && it->it_addr != -1) {
+            stat64_add(&cache->evictions, 1);
+        }
+        it->it_hits = 0;
     }
+
     /* allocate page */
     if (!it->it_data) {
         it->it_data = g_try_malloc(cache->page_size);
@@ -163,7 +258,7 @@ int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata,
             trace_migration_pagecache_insert();
             return -1;
         }
-        cache->num_items++;
+        qatomic_inc(&cache->num_items);
     }
 
     memcpy(it->it_data, pdata, cache->page_size);
@@ -173,3 +268,79 @@ int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata,
 
     return 0;
 }
+
+uint8_t *get_cached_data(PageCache *cache, uint64_t addr)
+{
+    size_t set = cache_get_set(cache, addr);
+    CacheItem *it;
+
+    QEMU_LOCK_GUARD(cache_set_lock(cache, set));
+    it = cache_find(cache, set, addr);
+
+    return it ? it->it_data : NULL;
+}
+
+bool cache_is_cached(PageCache *cache, uint64_t addr, uint64_t current_age)
+{
+    size_t set = cache_get_set(cache, addr);
+    CacheItem *it;
+
+    QEMU_LOCK_GUARD(cache_set_lock(cache, set));
+    it = cache_find(cache, set, addr);
+
+    if (it) {
+        /* update the it_age when the cache hit */
+        it->it_age = current_age;
+        if (it->it_hits < UINT32_MAX) {
+            it->it_hits++;
+        }
+        stat64_add(&cache->hits, 1);
+        return true;
+    }
+
+    stat64_add(&cache->misses, 1);
+    return false;
+}
+
+int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata,
+                 uint64_t current_age)
+{
+    size_t set = cache_get_set(cache, addr);
+
+    QEMU_LOCK_GUARD(cache_set_lock(cache, set));
+    return cache_insert_locked(cache, set, addr, pdata, current_age);
+}
+
+bool cache_exchange(PageCache *cache, uint64_t addr, const uint8_t *pdata,
+                    uint8_t *old, uint64_t current_age)
+{
+    size_t set = cache_get_set(cache, addr);
+    CacheItem *it;
+
+    QEMU_LOCK_GUARD(cache_set_lock(cache, set));
+    it = cache_find(cache, set, addr);
+
+    if (!it) {
+        stat64_add(&cache->misses, 1);
+        cache_insert_locked(cache, set, addr, pdata, current_age);
+        return false;
+    }
+
+    memcpy(old, it->it_data, cache->page_size);
+    memcpy(it->it_data, pdata, cache->page_size);
+    it->it_age = current_age;
+    if (it->it_hits < UINT32_MAX) {
+        it->it_hits++;
+    }
+    stat64_add(&cache->hits, 1);
+
+    return true;
+}
+
+void cache_get_stats(PageCache *cache, PageCacheStats *stats)
+{
+    stats->hits = stat64_get(&cache->hits);
+    stats->misses = stat64_get(&cache->misses);
+    stats->evictions = stat64_get(&cache->evictions);
+    stats->rejected = stat64_get(&cache->rejected);
+}
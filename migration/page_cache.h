@@ -18,23 +18,48 @@
 /* Page cache for storing guest pages */
 typedef struct PageCache PageCache;
 
+/* Maximum number of pages in a set of the cache */
+#define PAGE_CACHE_MAX_WAYS 64
+
+typedef struct PageCacheStats {
+    /* lookups that found the page */
+    uint64_t hits;
+    /* lookups that did not find the page */
+    uint64_t misses;
+    /* pages replaced by another page */
+    uint64_t evictions;
+    /* pages not inserted because their set only had recently used pages */
+    uint64_t rejected;
+} PageCacheStats;
+
 /**
  * cache_init: Initialize the page cache
  *
+ * The cache is split in sets of @ways pages; a page can only be cached
+ * in the set its address hashes to.  Sets are protected by a few locks,
+ * so the cache can be used by several threads at once.
  *
  * Returns new allocated cache or NULL on error
  *
  * @cache_size: cache size in bytes
  * @page_size: cache page size
+ * @ways: number of pages in a set, a power of 2
  * @errp: set *errp if the check failed, with reason
  */
-PageCache *cache_init(uint64_t cache_size, size_t page_size, Error **errp);
+PageCache *cache_init(uint64_t cache_size, size_t page_size, unsigned ways,
+                      Error **errp);
 /**
  * cache_fini: free all cache resources
  * @cache pointer to the PageCache struct
  */
 void cache_fini(PageCache *cache);
 
+/**
+ * cache_fini_rcu: free all cache resources after an RCU grace period
+ * @cache pointer to the PageCache struct
+ */
+void cache_fini_rcu(PageCache *cache);
+
 /**
  * cache_is_cached: Checks to see if the page is cached
  *
@@ -44,18 +69,18 @@ void cache_fini(PageCache *cache);
  * @addr: page addr
  * @current_age: current bitmap generation
  */
-bool cache_is_cached(const PageCache *cache, uint64_t addr,
-                     uint64_t current_age);
+bool cache_is_cached(PageCache *cache, uint64_t addr, uint64_t current_age);
 
 /**
  * get_cached_data: Get the data cached for an addr
  *
- * Returns pointer to the data cached or NULL if not cached
+ * Returns pointer to the data cached or NULL if not cached.  The data
+ * may be replaced as soon as another thread inserts a page in the cache.
  *
  * @cache pointer to the PageCache struct
  * @addr: page addr
  */
-uint8_t *get_cached_data(const PageCache *cache, uint64_t addr);
+uint8_t *get_cached_data(PageCache *cache, uint64_t addr);
 
 /**
  * cache_insert: insert the page into the cache. the page cache
@@ -71,4 +96,30 @@ uint8_t *get_cached_data(const PageCache *cache, uint64_t addr);
 int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata,
                  uint64_t current_age);
 
+/**
+ * cache_exchange: replace the cached data of a page
+ *
+ * If the page is cached, copy the cached data to @old and replace it with
+ * @pdata, atomically with respect to other users of the cache.  Otherwise
+ * try to insert @pdata like cache_insert() does.
+ *
+ * Returns %true if the page was cached
+ *
+ * @cache pointer to the PageCache struct
+ * @addr: page address
+ * @pdata: pointer to the page
+ * @old: buffer for the previously cached data
+ * @current_age: current bitmap generation
+ */
+bool cache_exchange(PageCache *cache, uint64_t addr, const uint8_t *pdata,
+                    uint8_t *old, uint64_t current_age);
+
+/**
+ * cache_get_stats: Get the hit and replacement counters of the cache
+ *
+ * @cache pointer to the PageCache struct
+ * @stats: filled with the counters since the cache was created
+ */
+void cache_get_stats(PageCache *cache, PageCacheStats *stats);
+
 #endif
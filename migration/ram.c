@@ -148,13 +148,18 @@ static struct {
     uint8_t *encoded_buf;
     /* buffer for storing page content */
     uint8_t *current_buf;
-    /* Cache for XBZRLE, Protected by lock. */
+    /*
+     * Cache for XBZRLE, Protected by lock.  The multifd send threads
+     * access it without the lock, within an RCU critical section.
+     */
     PageCache *cache;
     QemuMutex lock;
     /* it will store a page full of zeros */
     uint8_t *zero_target_page;
     /* buffer used for XBZRLE decoding */
     uint8_t *decoded_buf;
+    /* RAMState.xbzrle_started, for the multifd send threads */
+    bool multifd_started;
 } XBZRLE;
 
 static void XBZRLE_cache_lock(void)
@@ -177,16 +182,19 @@ static void XBZRLE_cache_unlock(void)
  * This function is called from migrate_params_apply in main
  * thread, possibly while a migration is in progress.  A running
  * migration may be using the cache and might finish during this call,
- * hence changes to the cache are protected by XBZRLE.lock().
+ * hence changes to the cache are protected by XBZRLE.lock().  The old
+ * cache is freed after an RCU grace period, because multifd send threads
+ * may still be using it.
  *
  * Returns 0 for success or -1 for error
  *
  * @new_size: new cache size
+ * @ways: new cache associativity
  * @errp: set *errp if the check failed, with reason
  */
-int xbzrle_cache_resize(uint64_t new_size, Error **errp)
+int xbzrle_cache_resize(uint64_t new_size, unsigned ways, Error **errp)
 {
-    PageCache *new_cache;
+    PageCache *new_cache, *old_cache;
     int64_t ret = 0;
 
     /* Check for truncation */
@@ -196,22 +204,18 @@ int xbzrle_cache_resize(uint64_t new_size, Error **errp)
         return -1;
     }
 
-    if (new_size == migrate_xbzrle_cache_size()) {
-        /* nothing to do */
-        return 0;
-    }
-
     XBZRLE_cache_lock();
 
     if (XBZRLE.cache != NULL) {
-        new_cache = cache_init(new_size, TARGET_PAGE_SIZE, errp);
+        new_cache = cache_init(new_size, TARGET_PAGE_SIZE, ways, errp);
         if (!new_cache) {
             ret = -1;
             goto out;
         }
 
-        cache_fini(XBZRLE.cache);
-        XBZRLE.cache = new_cache;
+        old_cache = XBZRLE.cache;
+        qatomic_rcu_set(&XBZRLE.cache, new_cache);
+        cache_fini_rcu(old_cache);
     }
 out:
     XBZRLE_cache_unlock();
@@ -394,6 +398,8 @@ struct RAMState {
     uint64_t xbzrle_pages_prev;
     /* Amount of xbzrle encoded bytes since the beginning of the period */
     uint64_t xbzrle_bytes_prev;
+    /* xbzrle cache counters at the beginning of the period */
+    PageCacheStats xbzrle_cache_prev;
     /* Are we really using XBZRLE (e.g., after the first round). */
     bool xbzrle_started;
     /* Are we on the last stage of migration */
@@ -606,6 +612,85 @@ static void xbzrle_cache_zero_page(ram_addr_t current_addr)
                  stat64_get(&mig_stats.dirty_sync_count));
 }
 
+/**
+ * xbzrle_multifd_started: check whether multifd send threads should
+ * XBZRLE encode pages
+ */
+bool xbzrle_multifd_started(void)
+{
+    return qatomic_read(&XBZRLE.multifd_started);
+}
+
+/**
+ * xbzrle_multifd_cache_update: update the XBZRLE cache from a multifd
+ * send thread
+ *
+ * Returns true if the page was cached, in which case the old contents
+ * are copied to @old.  In all cases @page replaces the cached contents
+ * if the cache has room for it, so @page is what must be sent.
+ *
+ * The cache is not protected by XBZRLE.lock here, so that the send
+ * threads can use it concurrently; the cache locks its sets itself and
+ * RCU keeps it alive across a resize.
+ *
+ * @addr: address of the page
+ * @page: contents of the page that will be sent
+ * @old: buffer for the previously cached contents
+ */
+bool xbzrle_multifd_cache_update(ram_addr_t addr, const uint8_t *page,
+                                 uint8_t *old)
+{
+    uint64_t generation = stat64_get(&mig_stats.dirty_sync_count);
+    PageCache *cache;
+
+    RCU_READ_LOCK_GUARD();
+    cache = qatomic_rcu_read(&XBZRLE.cache);
+    if (!cache) {
+        return false;
+    }
+
+    return cache_exchange(cache, addr, page, old, generation);
+}
+
+/**
+ * xbzrle_multifd_cache_insert: insert a page in the XBZRLE cache from a
+ * multifd send thread
+ *
+ * @addr: address of the page
+ * @page: contents of the page
+ */
+void xbzrle_multifd_cache_insert(ram_addr_t addr, const uint8_t *page)
+{
+    uint64_t generation = stat64_get(&mig_stats.dirty_sync_count);
+    PageCache *cache;
+
+    RCU_READ_LOCK_GUARD();
+    cache = qatomic_rcu_read(&XBZRLE.cache);
+    if (cache) {
+        cache_insert(cache, addr, page, generation);
+    }
+}
+
+/**
+ * xbzrle_multifd_account: account XBZRLE pages sent by a multifd send
+ * thread
+ *
+ * @pages: number of pages found in the cache
+ * @cache_miss: number of pages not found in the cache
+ * @bytes: encoded bytes, including overflowed pages
+ * @overflow: number of pages that could not be encoded
+ */
+void xbzrle_multifd_account(uint64_t pages, uint64_t cache_miss,
+                            uint64_t bytes, uint64_t overflow)
+{
+    XBZRLE_cache_lock();
+    xbzrle_counters.pages += pages;
+    xbzrle_counters.cache_miss += cache_miss;
+    xbzrle_counters.bytes += bytes;
+    xbzrle_counters.overflow += overflow;
+    XBZRLE_cache_unlock();
+}
+
 #define ENCODING_FLAG_XBZRLE 0x1
 
 /**
@@ -961,6 +1046,32 @@ uint64_t ram_get_total_transferred_pages(void)
         xbzrle_counters.pages;
 }
 
+static void xbzrle_update_cache_rates(RAMState *rs)
+{
+    PageCacheStats stats, *prev = &rs->xbzrle_cache_prev;
+    uint64_t hits, lookups;
+
+    XBZRLE_cache_lock();
+    if (!XBZRLE.cache) {
+        XBZRLE_cache_unlock();
+        return;
+    }
+    cache_get_stats(XBZRLE.cache, &stats);
+    XBZRLE_cache_unlock();
+
+    /* the counters start again from zero when the cache is resized */
+    if (stats.hits < prev->hits || stats.misses < prev->misses ||
+        stats.evictions < prev->evictions) {
+        memset(prev, 0, sizeof(*prev));
+    }
+
+    hits = stats.hits - prev->hits;
+    lookups = hits + stats.misses - prev->misses;
+    xbzrle_counters.cache_hit_rate = lookups ? (double)hits / lookups : 0;
+    xbzrle_counters.cache_evictions += stats.evictions - prev->evictions;
+    *prev = stats;
+}
+
 static void migration_update_rates(RAMState *rs, int64_t end_time)
 {
     uint64_t page_count = rs->target_page_count - rs->target_page_count_prev;
@@ -990,6 +1101,7 @@ static void migration_update_rates(RAMState *rs, int64_t end_time)
         }
         rs->xbzrle_pages_prev = xbzrle_counters.pages;
         rs->xbzrle_bytes_prev = xbzrle_counters.bytes;
+        xbzrle_update_cache_rates(rs);
     }
 }
 
@@ -1323,6 +1435,7 @@ static int find_dirty_block(RAMState *rs, PageSearchStatus *pss)
             /* After the first round, enable XBZRLE. */
             if (migrate_xbzrle()) {
                 rs->xbzrle_started = true;
+                qatomic_set(&XBZRLE.multifd_started, true);
             }
         }
         /* Didn't find anything this time, but try again on the new block */
@@ -2352,11 +2465,13 @@ static void xbzrle_cleanup(void)
 {
     XBZRLE_cache_lock();
     if (XBZRLE.cache) {
-        cache_fini(XBZRLE.cache);
+        PageCache *cache = XBZRLE.cache;
+
+        qatomic_rcu_set(&XBZRLE.cache, NULL);
+        cache_fini_rcu(cache);
         g_free(XBZRLE.encoded_buf);
         g_free(XBZRLE.current_buf);
         g_free(XBZRLE.zero_target_page);
-        XBZRLE.cache = NULL;
         XBZRLE.encoded_buf = NULL;
         XBZRLE.current_buf = NULL;
         XBZRLE.zero_target_page = NULL;
@@ -2423,6 +2538,7 @@ static void ram_state_reset(RAMState *rs)
     rs->last_page = 0;
     rs->last_version = ram_list.version;
     rs->xbzrle_started = false;
+    qatomic_set(&XBZRLE.multifd_started, false);
 
     ram_page_hint_reset(&rs->page_hint);
 }
@@ -2675,7 +2791,8 @@ static bool xbzrle_init(Error **errp)
     }
 
     XBZRLE.cache = cache_init(migrate_xbzrle_cache_size(),
-                              TARGET_PAGE_SIZE, errp);
+                              TARGET_PAGE_SIZE,
+                              migrate_xbzrle_cache_associativity(), errp);
     if (!XBZRLE.cache) {
         goto free_zero_page;
     }
@@ -73,7 +73,13 @@ extern XBZRLECacheStats xbzrle_counters;
         if (!qemu_ram_is_migratable(block)) {} else
 
 void ram_mig_init(void);
-int xbzrle_cache_resize(uint64_t new_size, Error **errp);
+int xbzrle_cache_resize(uint64_t new_size, unsigned ways, Error **errp);
+bool xbzrle_multifd_started(void);
+bool xbzrle_multifd_cache_update(ram_addr_t addr, const uint8_t *page,
+                                 uint8_t *old);
+void xbzrle_multifd_cache_insert(ram_addr_t addr, const uint8_t *page);
+void xbzrle_multifd_account(uint64_t pages, uint64_t cache_miss,
+                            uint64_t bytes, uint64_t overflow);
 uint64_t ram_bytes_remaining(void);
 uint64_t ram_bytes_total(void);
 void mig_throttle_counter_reset(void);
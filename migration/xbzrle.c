@@ -13,11 +13,20 @@
 #include "qemu/osdep.h"
 #include "qemu/cutils.h"
 #include "qemu/host-utils.h"
+#include "qemu/bswap.h"
 #include "xbzrle.h"
 
-#if defined(CONFIG_AVX512BW_OPT)
+#if defined(CONFIG_AVX512BW_OPT) || defined(CONFIG_AVX2_OPT)
 #include <immintrin.h>
 #include "host/cpuinfo.h"
+#endif
+
+#if defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define XBZRLE_NEON
+#endif
+
+#if defined(CONFIG_AVX512BW_OPT)
 
 static int __attribute__((target("avx512bw")))
 xbzrle_encode_buffer_avx512(uint8_t *old_buf, uint8_t *new_buf, int slen,
@@ -137,28 +146,6 @@ xbzrle_encode_buffer_avx512(uint8_t *old_buf, uint8_t *new_buf, int slen,
     return d;
 }
 
-static int xbzrle_encode_buffer_int(uint8_t *old_buf, uint8_t *new_buf,
-                                    int slen, uint8_t *dst, int dlen);
-
-static int (*accel_func)(uint8_t *, uint8_t *, int, uint8_t *, int);
-
-static void __attribute__((constructor)) init_accel(void)
-{
-    unsigned info = cpuinfo_init();
-    if (info & CPUINFO_AVX512BW) {
-        accel_func = xbzrle_encode_buffer_avx512;
-    } else {
-        accel_func = xbzrle_encode_buffer_int;
-    }
-}
-
-int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
-                         uint8_t *dst, int dlen)
-{
-    return accel_func(old_buf, new_buf, slen, dst, dlen);
-}
-
-#define xbzrle_encode_buffer xbzrle_encode_buffer_int
 #endif
 
 /*
@@ -171,8 +158,8 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
 
   length = uleb128 encoded integer
  */
-int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
-                         uint8_t *dst, int dlen)
+static int xbzrle_encode_buffer_int(uint8_t *old_buf, uint8_t *new_buf,
+                                    int slen, uint8_t *dst, int dlen)
 {
     uint32_t zrun_len = 0, nzrun_len = 0;
     int d = 0, i = 0;
@@ -273,7 +260,101 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
     return d;
 }
 
-int xbzrle_decode_buffer(uint8_t *src, int slen, uint8_t *dst, int dlen)
+/*
+ * Copy the data of a nzrun.  Runs are usually short, so avoid the call to
+ * memcpy and copy them with (possibly overlapping) loads and stores that
+ * never write outside [dst, dst + len): the bytes around the run belong to
+ * zruns and must keep their old contents.
+ */
+static inline void xbzrle_copy_small(uint8_t *dst, const uint8_t *src,
+                                     uint32_t len)
+{
+    if (len >= 8) {
+        uint64_t head = ldq_he_p(src);
+        uint64_t tail = ldq_he_p(src + len - 8);
+
+        stq_he_p(dst, head);
+        stq_he_p(dst + len - 8, tail);
+    } else if (len >= 4) {
+        uint32_t head = ldl_he_p(src);
+        uint32_t tail = ldl_he_p(src + len - 4);
+
+        stl_he_p(dst, head);
+        stl_he_p(dst + len - 4, tail);
+    } else {
+        for (uint32_t i = 0; i < len; i++) {
+            dst[i] = src[i];
+        }
+    }
+}
+
+static void xbzrle_copy_int(uint8_t *dst, const uint8_t *src, uint32_t len)
+{
+    if (len < 16) {
+        xbzrle_copy_small(dst, src, len);
+    } else {
+        memcpy(dst, src, len);
+    }
+}
+
+#if defined(CONFIG_AVX2_OPT)
+static void __attribute__((target("avx2")))
+xbzrle_copy_avx2(uint8_t *dst, const uint8_t *src, uint32_t len)
+{
+    if (len >= 32) {
+        uint32_t i;
+
+        for (i = 0; i + 32 <= len; i += 32) {
+            __m256i v = _mm256_loadu_si256((const __m256i *)(src + i));
+            _mm256_storeu_si256((__m256i *)(dst + i), v);
+        }
+        if (i < len) {
+            __m256i v = _mm256_loadu_si256((const __m256i *)(src + len - 32));
+            _mm256_storeu_si256((__m256i *)(dst + len - 32), v);
+        }
+    } else if (len >= 16) {
+        __m128i head = _mm_loadu_si128((const __m128i *)src);
+        __m128i tail = _mm_loadu_si128((const __m128i *)(src + len - 16));
+
+        _mm_storeu_si128((__m128i *)dst, head);
+        _mm_storeu_si128((__m128i *)(dst + len - 16), tail);
+    } else {
+        xbzrle_copy_small(dst, src, len);
+    }
+}
+#endif
+
+#if defined(XBZRLE_NEON)
+static void xbzrle_copy_neon(uint8_t *dst, const uint8_t *src, uint32_t len)
+{
+    if (len >= 16) {
+        uint32_t i;
+
+        for (i = 0; i + 32 <= len; i += 32) {
+            uint8x16_t v0 = vld1q_u8(src + i);
+            uint8x16_t v1 = vld1q_u8(src + i + 16);
+
+            vst1q_u8(dst + i, v0);
+            vst1q_u8(dst + i + 16, v1);
+        }
+        if (i + 16 <= len) {
+            vst1q_u8(dst + i, vld1q_u8(src + i));
+            i += 16;
+        }
+        if (i < len) {
+            vst1q_u8(dst + len - 16, vld1q_u8(src + len - 16));
+        }
+    } else {
+        xbzrle_copy_small(dst, src, len);
+    }
+}
+#endif
+
+typedef void (*xbzrle_copy_fn)(uint8_t *, const uint8_t *, uint32_t);
+
+static inline int QEMU_ALWAYS_INLINE
+xbzrle_decode_buffer_common(uint8_t *src, int slen, uint8_t *dst, int dlen,
+                            xbzrle_copy_fn copy)
 {
     int i = 0, d = 0;
     int ret;
@@ -314,10 +395,72 @@ int xbzrle_decode_buffer(uint8_t *src, int slen, uint8_t *dst, int dlen)
             return -1;
         }
 
-        memcpy(dst + d, src + i, count);
+        copy(dst + d, src + i, count);
         d += count;
         i += count;
     }
 
     return d;
 }
+
+static int xbzrle_decode_buffer_int(uint8_t *src, int slen, uint8_t *dst,
+                                    int dlen)
+{
+    return xbzrle_decode_buffer_common(src, slen, dst, dlen, xbzrle_copy_int);
+}
+
+#if defined(CONFIG_AVX2_OPT)
+static int __attribute__((target("avx2")))
+xbzrle_decode_buffer_avx2(uint8_t *src, int slen, uint8_t *dst, int dlen)
+{
+    return xbzrle_decode_buffer_common(src, slen, dst, dlen, xbzrle_copy_avx2);
+}
+#endif
+
+#if defined(XBZRLE_NEON)
+static int xbzrle_decode_buffer_neon(uint8_t *src, int slen, uint8_t *dst,
+                                     int dlen)
+{
+    return xbzrle_decode_buffer_common(src, slen, dst, dlen, xbzrle_copy_neon);
+}
+#endif
+
+static int (*encode_accel)(uint8_t *, uint8_t *, int, uint8_t *, int) =
+    xbzrle_encode_buffer_int;
+
+#if defined(XBZRLE_NEON)
+static int (*decode_accel)(uint8_t *, int, uint8_t *, int) =
+    xbzrle_decode_buffer_neon;
+#else
+static int (*decode_accel)(uint8_t *, int, uint8_t *, int) =
+    xbzrle_decode_buffer_int;
+#endif
+
+#if defined(CONFIG_AVX512BW_OPT) || defined(CONFIG_AVX2_OPT)
+static void __attribute__((constructor)) init_accel(void)
+{
+    unsigned info = cpuinfo_init();
+
+#if defined(CONFIG_AVX512BW_OPT)
+    if (info & CPUINFO_AVX512BW) {
+        encode_accel = xbzrle_encode_buffer_avx512;
+    }
+#endif
+#if defined(CONFIG_AVX2_OPT)
+    if (info & CPUINFO_AVX2) {
+        decode_accel = xbzrle_decode_buffer_avx2;
+    }
+#endif
+}
+#endif
+
+int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                         uint8_t *dst, int dlen)
+{
+    return encode_accel(old_buf, new_buf, slen, dst, dlen);
+}
+
+int xbzrle_decode_buffer(uint8_t *src, int slen, uint8_t *dst, int dlen)
+{
+    return decode_accel(src, slen, dst, dlen);
+}
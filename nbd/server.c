@@ -18,12 +18,17 @@
  */
 
 #include "qemu/osdep.h"
+#ifdef CONFIG_POSIX
+#include <sys/resource.h>
+#endif
 
 #include "block/block_int.h"
 #include "block/export.h"
 #include "block/dirty-bitmap.h"
 #include "qapi/error.h"
 #include "qemu/queue.h"
+#include "qemu/stats64.h"
+#include "system/iothread.h"
 #include "trace.h"
 #include "nbd-internal.h"
 #include "qemu/units.h"
@@ -101,10 +106,55 @@ struct NBDExport {
     bool allocation_depth;
     BdrvDirtyBitmap **export_bitmaps;
     size_t nr_export_bitmaps;
+
+    /* If non-empty, client connections are spread over these iothreads */
+    IOThread **iothreads;
+    size_t nr_iothreads;
+    size_t next_iothread;
+
+    bool zero_copy;
 };
 
 static QTAILQ_HEAD(, NBDExport) exports = QTAILQ_HEAD_INITIALIZER(exports);
 
+/*
+ * Read replies of at least this size are sent with MSG_ZEROCOPY, if enabled.
+ * For smaller ones, the page pinning and the completion notifications cost
+ * more than the copy.
+ */
+#define NBD_ZERO_COPY_MIN_SIZE (64 * KiB)
+
+/*
+ * Stop sending zero copy replies while this many bytes are not completed.
+ * The kernel charges the pinned pages to RLIMIT_MEMLOCK, so the limit is
+ * lowered to half of it, see nbd_zero_copy_max_pending().
+ */
+#define NBD_ZERO_COPY_MAX_PENDING (256 * MiB)
+
+#define NBD_ZERO_COPY_POLL_MS 100
+
+/* A read buffer that was sent with MSG_ZEROCOPY */
+typedef struct NBDZeroCopyBuffer {
+    void *data;
+    size_t size;
+    /* The kernel is done with @data once sioc->zero_copy_sent reaches @seq */
+    ssize_t seq;
+    QSIMPLEQ_ENTRY(NBDZeroCopyBuffer) next;
+} NBDZeroCopyBuffer;
+
+/*
+ * Zero copy state of a client.  It is only accessed in the client AioContext
+ * and, once the client is gone, by a main loop timer that waits for the last
+ * buffers to complete.
+ */
+typedef struct NBDZeroCopy {
+    QIOChannelSocket *sioc;
+    QSIMPLEQ_HEAD(, NBDZeroCopyBuffer) buffers;
+    size_t pending; /* total size of @buffers */
+    size_t max_pending;
+    QEMUTimer *timer;
+} NBDZeroCopy;
+
 /*
  * NBDMetaContexts represents a list of meta contexts in use,
  * as selected by NBD_OPT_SET_META_CONTEXT. Also used for
@@ -155,9 +205,56 @@ struct NBDClient {
     uint32_t opt; /* Current option being negotiated */
     uint32_t optlen; /* remaining length of data in ioc for the option being
                         negotiated now */
+
+    /*
+     * The iothread that processes requests, or NULL if they are processed in
+     * the AioContext of the export. Set once the client is attached to the
+     * export.
+     */
+    IOThread *iothread;
+
+    /* Statistics, updated by the coroutines that process requests */
+    Stat64 requests;
+    Stat64 read_bytes;
+    Stat64 written_bytes;
+    int64_t connected_ns; /* QEMU_CLOCK_REALTIME */
+
+    NBDZeroCopy *zero_copy; /* NULL unless read replies use MSG_ZEROCOPY */
 };
 
 static void nbd_client_receive_next_request(NBDClient *client);
+static void nbd_client_zero_copy_init(NBDClient *client);
+
+/* The AioContext in which the requests of @client are processed */
+static AioContext *nbd_client_aio_context(NBDClient *client)
+{
+    if (client->iothread) {
+        return iothread_get_aio_context(client->iothread);
+    }
+    return nbd_export_aio_context(client->exp);
+}
+
+/*
+ * Attaches @client to @exp after a successful negotiation, and picks the
+ * iothread that processes its requests.
+ *
+ * Context: BQL held
+ */
+static void nbd_export_add_client(NBDExport *exp, NBDClient *client)
+{
+    client->exp = exp;
+    if (exp->nr_iothreads) {
+        client->iothread = exp->iothreads[exp->next_iothread];
+        exp->next_iothread = (exp->next_iothread + 1) % exp->nr_iothreads;
+    }
+    client->connected_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    if (exp->zero_copy) {
+        nbd_client_zero_copy_init(client);
+    }
+    QTAILQ_INSERT_TAIL(&exp->clients, client, next);
+    blk_exp_ref(&exp->common);
+    trace_nbd_export_add_client(exp->name, nbd_client_aio_context(client));
+}
 
 /* Basic flow for negotiation
 
@@ -536,8 +633,7 @@ nbd_negotiate_handle_export_name(NBDClient *client, bool no_zeroes,
         return ret;
     }
 
-    QTAILQ_INSERT_TAIL(&client->exp->clients, client, next);
-    blk_exp_ref(&client->exp->common);
+    nbd_export_add_client(client->exp, client);
 
     return 0;
 }
@@ -750,10 +846,8 @@ nbd_negotiate_handle_info(NBDClient *client, Error **errp)
     }
 
     if (client->opt == NBD_OPT_GO) {
-        client->exp = exp;
         client->check_align = check_align;
-        QTAILQ_INSERT_TAIL(&client->exp->clients, client, next);
-        blk_exp_ref(&client->exp->common);
+        nbd_export_add_client(exp, client);
         rc = 1;
     }
     return rc;
@@ -1554,7 +1648,165 @@ static int coroutine_fn nbd_receive_request(NBDClient *client, NBDRequest *reque
 
 #define MAX_NBD_REQUESTS 16
 
-/* Runs in export AioContext and main loop thread */
+/*
+ * Zero copy read replies
+ *
+ * The data of a large read reply is sent with MSG_ZEROCOPY straight from the
+ * buffer of the request.  The kernel keeps using the buffer until the peer
+ * has acknowledged the data, so when the request completes, the buffer is
+ * queued in NBDZeroCopy instead of being freed.  It is freed once the
+ * completion notifications of all writes queued before it have been
+ * received.  Notifications are polled without blocking whenever a buffer is
+ * queued.
+ */
+
+/*
+ * The locked memory limit is shared with the rest of the process, and with
+ * the other clients.  Writes that still hit it fail with ENOBUFS, and are
+ * copied instead.
+ */
+static size_t nbd_zero_copy_max_pending(void)
+{
+#ifdef CONFIG_POSIX
+    struct rlimit rlim;
+
+    if (getrlimit(RLIMIT_MEMLOCK, &rlim) == 0 &&
+        rlim.rlim_cur != RLIM_INFINITY) {
+        return MIN(NBD_ZERO_COPY_MAX_PENDING, rlim.rlim_cur / 2);
+    }
+#endif
+    return NBD_ZERO_COPY_MAX_PENDING;
+}
+
+/* Context: BQL held */
+static void nbd_client_zero_copy_init(NBDClient *client)
+{
+    NBDZeroCopy *zc;
+    size_t max_pending = nbd_zero_copy_max_pending();
+
+    /* MSG_ZEROCOPY cannot be used below TLS, or with little locked memory */
+    if (client->ioc != QIO_CHANNEL(client->sioc) ||
+        max_pending < NBD_ZERO_COPY_MIN_SIZE ||
+        !qio_channel_socket_enable_zero_copy(client->sioc)) {
+        trace_nbd_zero_copy_unavailable(client->exp->name);
+        return;
+    }
+
+    zc = g_new0(NBDZeroCopy, 1);
+    zc->max_pending = max_pending;
+    zc->sioc = client->sioc;
+    object_ref(OBJECT(zc->sioc));
+    QSIMPLEQ_INIT(&zc->buffers);
+    client->zero_copy = zc;
+}
+
+static bool nbd_client_use_zero_copy(NBDClient *client, uint64_t size)
+{
+    return client->zero_copy && size >= NBD_ZERO_COPY_MIN_SIZE;
+}
+
+/* Frees the buffers that the kernel is done with */
+static int nbd_zero_copy_reap(NBDZeroCopy *zc, Error **errp)
+{
+    NBDZeroCopyBuffer *buf;
+
+    if (qio_channel_socket_poll_zero_copy(zc->sioc, errp) < 0) {
+        return -1;
+    }
+
+    while ((buf = QSIMPLEQ_FIRST(&zc->buffers)) &&
+           buf->seq <= zc->sioc->zero_copy_sent) {
+        QSIMPLEQ_REMOVE_HEAD(&zc->buffers, next);
+        zc->pending -= buf->size;
+        qemu_vfree(buf->data);
+        g_free(buf);
+    }
+    return 0;
+}
+
+/*
+ * Takes ownership of @data, the buffer of a read request whose reply may have
+ * been sent with MSG_ZEROCOPY.
+ *
+ * Runs in client AioContext
+ */
+static void nbd_client_zero_copy_defer_free(NBDClient *client, void *data,
+                                            size_t size)
+{
+    NBDZeroCopy *zc = client->zero_copy;
+    NBDZeroCopyBuffer *buf = g_new(NBDZeroCopyBuffer, 1);
+
+    *buf = (NBDZeroCopyBuffer) {
+        .data = data,
+        .size = size,
+        .seq = zc->sioc->zero_copy_queued,
+    };
+    QSIMPLEQ_INSERT_TAIL(&zc->buffers, buf, next);
+    zc->pending += size;
+
+    /* Errors are reported when the next reply is sent */
+    nbd_zero_copy_reap(zc, NULL);
+}
+
+static void nbd_zero_copy_free(NBDZeroCopy *zc)
+{
+    NBDZeroCopyBuffer *buf, *next;
+
+    QSIMPLEQ_FOREACH_SAFE(buf, &zc->buffers, next, next) {
+        qemu_vfree(buf->data);
+        g_free(buf);
+    }
+    if (zc->timer) {
+        timer_free(zc->timer);
+    }
+    object_unref(OBJECT(zc->sioc));
+    g_free(zc);
+}
+
+static void nbd_zero_copy_timer_cb(void *opaque)
+{
+    NBDZeroCopy *zc = opaque;
+
+    /*
+     * On errors, the connection is broken and nothing more is sent from the
+     * buffers.
+     */
+    if (nbd_zero_copy_reap(zc, NULL) < 0 || QSIMPLEQ_EMPTY(&zc->buffers)) {
+        nbd_zero_copy_free(zc);
+        return;
+    }
+
+    trace_nbd_zero_copy_wait(zc->pending);
+    timer_mod(zc->timer,
+              qemu_clock_get_ms(QEMU_CLOCK_REALTIME) + NBD_ZERO_COPY_POLL_MS);
+}
+
+/*
+ * The last buffers may still be in use after the client is gone, for
+ * example if the peer disconnected without acknowledging all data.  Keep
+ * polling for their completion in the main loop.
+ *
+ * Called by nbd_client_put() when the last reference is dropped.  Request
+ * coroutines hold a reference, so none of them is left in the client
+ * AioContext to touch the buffer list; from here on only the timer does.
+ *
+ * Runs in main loop thread
+ */
+static void nbd_client_zero_copy_cleanup(NBDClient *client)
+{
+    NBDZeroCopy *zc = g_steal_pointer(&client->zero_copy);
+
+    assert(qemu_in_main_thread());
+
+    if (!zc) {
+        return;
+    }
+
+    zc->timer = timer_new_ms(QEMU_CLOCK_REALTIME, nbd_zero_copy_timer_cb, zc);
+    nbd_zero_copy_timer_cb(zc);
+}
+
+/* Runs in client AioContext and main loop thread */
 void nbd_client_get(NBDClient *client)
 {
     qatomic_inc(&client->refcount);
@@ -1570,6 +1822,7 @@ void nbd_client_put(NBDClient *client)
          */
         assert(client->closing);
 
+        nbd_client_zero_copy_cleanup(client);
         object_unref(OBJECT(client->sioc));
         object_unref(OBJECT(client->ioc));
         if (client->tlscreds) {
@@ -1635,7 +1888,7 @@ static void client_close(NBDClient *client, bool negotiated)
     }
 }
 
-/* Runs in export AioContext with client->lock held */
+/* Runs in client AioContext with client->lock held */
 static NBDRequestData *nbd_request_get(NBDClient *client)
 {
     NBDRequestData *req;
@@ -1648,7 +1901,7 @@ static NBDRequestData *nbd_request_get(NBDClient *client)
     return req;
 }
 
-/* Runs in export AioContext with client->lock held */
+/* Runs in client AioContext with client->lock held */
 static void nbd_request_put(NBDRequestData *req)
 {
     NBDClient *client = req->client;
@@ -1727,7 +1980,7 @@ static void nbd_drained_end(void *opaque)
     }
 }
 
-/* Runs in export AioContext */
+/* Runs in client AioContext */
 static void nbd_wake_read_bh(void *opaque)
 {
     NBDClient *client = opaque;
@@ -1748,12 +2001,12 @@ static bool nbd_drained_poll(void *opaque)
                  * If there's a coroutine waiting for a request on nbd_read_eof()
                  * enter it here so we don't depend on the client to wake it up.
                  *
-                 * Schedule a BH in the export AioContext to avoid missing the
+                 * Schedule a BH in the client AioContext to avoid missing the
                  * wake up due to the race between qio_channel_wake_read() and
                  * qio_channel_yield().
                  */
                 if (client->recv_coroutine != NULL && client->read_yielding) {
-                    aio_bh_schedule_oneshot(nbd_export_aio_context(client->exp),
+                    aio_bh_schedule_oneshot(nbd_client_aio_context(client),
                                             nbd_wake_read_bh, client);
                 }
 
@@ -1792,6 +2045,20 @@ static const BlockDevOps nbd_block_ops = {
     .drained_poll = nbd_drained_poll,
 };
 
+static void nbd_export_put_iothreads(NBDExport *exp)
+{
+    size_t i;
+
+    for (i = 0; i < exp->nr_iothreads; i++) {
+        if (exp->iothreads[i]) {
+            object_unref(OBJECT(exp->iothreads[i]));
+        }
+    }
+    g_free(exp->iothreads);
+    exp->iothreads = NULL;
+    exp->nr_iothreads = 0;
+}
+
 static int nbd_export_create(BlockExport *blk_exp, BlockExportOptions *exp_args,
                              Error **errp)
 {
@@ -1803,6 +2070,7 @@ static int nbd_export_create(BlockExport *blk_exp, BlockExportOptions *exp_args,
     uint64_t perm, shared_perm;
     bool readonly = !exp_args->writable;
     BlockDirtyBitmapOrStrList *bitmaps;
+    strList *iothreads;
     size_t i;
     int ret;
 
@@ -1844,6 +2112,24 @@ static int nbd_export_create(BlockExport *blk_exp, BlockExportOptions *exp_args,
         return ret;
     }
 
+    for (iothreads = arg->iothreads; iothreads; iothreads = iothreads->next) {
+        exp->nr_iothreads++;
+    }
+    exp->iothreads = g_new0(IOThread *, exp->nr_iothreads);
+    for (i = 0, iothreads = arg->iothreads; iothreads;
+         i++, iothreads = iothreads->next)
+    {
+        IOThread *iothread = iothread_by_id(iothreads->value);
+
+        if (!iothread) {
+            error_setg(errp, "iothread \"%s\" not found", iothreads->value);
+            nbd_export_put_iothreads(exp);
+            return -EINVAL;
+        }
+        exp->iothreads[i] = iothread;
+        object_ref(OBJECT(iothread));
+    }
+
     QTAILQ_INIT(&exp->clients);
     exp->name = g_strdup(name);
     exp->description = g_strdup(arg->description);
@@ -1931,6 +2217,7 @@ static int nbd_export_create(BlockExport *blk_exp, BlockExportOptions *exp_args,
     }
 
     exp->allocation_depth = arg->allocation_depth;
+    exp->zero_copy = arg->zero_copy;
 
     /*
      * We need to inhibit request queuing in the block layer to ensure we can
@@ -1951,6 +2238,7 @@ static int nbd_export_create(BlockExport *blk_exp, BlockExportOptions *exp_args,
 
 fail:
     bdrv_graph_rdunlock_main_loop();
+    nbd_export_put_iothreads(exp);
     g_free(exp->export_bitmaps);
     g_free(exp->name);
     g_free(exp->description);
@@ -2021,6 +2309,33 @@ static void nbd_export_delete(BlockExport *blk_exp)
     for (i = 0; i < exp->nr_export_bitmaps; i++) {
         bdrv_dirty_bitmap_set_busy(exp->export_bitmaps[i], false);
     }
+
+    nbd_export_put_iothreads(exp);
+}
+
+/* Context: BQL held */
+static BlockExportClientInfoList *nbd_export_query_clients(BlockExport *blk_exp)
+{
+    NBDExport *exp = container_of(blk_exp, NBDExport, common);
+    BlockExportClientInfoList *head = NULL, **tail = &head;
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    NBDClient *client;
+
+    QTAILQ_FOREACH(client, &exp->clients, next) {
+        BlockExportClientInfo *info = g_new0(BlockExportClientInfo, 1);
+
+        *info = (BlockExportClientInfo) {
+            .iothread       = client->iothread ?
+                              iothread_get_id(client->iothread) : NULL,
+            .requests       = stat64_get(&client->requests),
+            .read_bytes     = stat64_get(&client->read_bytes),
+            .written_bytes  = stat64_get(&client->written_bytes),
+            .connected_ns   = now - client->connected_ns,
+        };
+        QAPI_LIST_APPEND(tail, info);
+    }
+
+    return head;
 }
 
 const BlockExportDriver blk_exp_nbd = {
@@ -2030,6 +2345,7 @@ const BlockExportDriver blk_exp_nbd = {
     .create             = nbd_export_create,
     .delete             = nbd_export_delete,
     .request_shutdown   = nbd_export_request_shutdown,
+    .query_clients      = nbd_export_query_clients,
 };
 
 static int coroutine_fn nbd_co_send_iov(NBDClient *client, struct iovec *iov,
@@ -2049,6 +2365,64 @@ static int coroutine_fn nbd_co_send_iov(NBDClient *client, struct iovec *iov,
     return ret;
 }
 
+/*
+ * Like nbd_co_send_iov(), but sends the last element of @iov, the data of a
+ * read reply, with MSG_ZEROCOPY.  The data must be in the buffer of the
+ * request, which nbd_trip() passes to nbd_client_zero_copy_defer_free().
+ */
+static int coroutine_fn nbd_co_send_iov_zero_copy(NBDClient *client,
+                                                  struct iovec *iov,
+                                                  unsigned niov,
+                                                  Error **errp)
+{
+    NBDZeroCopy *zc = client->zero_copy;
+    bool closing;
+    int ret = 0;
+
+    g_assert(qemu_in_coroutine());
+    qemu_co_mutex_lock(&client->send_lock);
+    client->send_coroutine = qemu_coroutine_self();
+
+    /* Limit the amount of memory that is pinned by the kernel */
+    while (zc->pending > zc->max_pending) {
+        if (nbd_zero_copy_reap(zc, errp) < 0) {
+            ret = -EIO;
+            goto out;
+        }
+        if (zc->pending <= zc->max_pending) {
+            break;
+        }
+
+        WITH_QEMU_LOCK_GUARD(&client->lock) {
+            closing = client->closing;
+        }
+        if (closing) {
+            error_setg(errp, "Client is closing");
+            ret = -EIO;
+            goto out;
+        }
+
+        trace_nbd_zero_copy_wait(zc->pending);
+        qemu_co_sleep_ns(QEMU_CLOCK_REALTIME,
+                         NBD_ZERO_COPY_POLL_MS * SCALE_MS);
+    }
+
+    /* The headers are on the stack, copy them */
+    if (qio_channel_writev_all(client->ioc, iov, niov - 1, errp) < 0 ||
+        qio_channel_writev_full_all(client->ioc, &iov[niov - 1], 1, NULL, 0,
+                                    QIO_CHANNEL_WRITE_FLAG_ZERO_COPY |
+                                    QIO_CHANNEL_WRITE_FLAG_ZERO_COPY_FALLBACK,
+                                    errp) < 0) {
+        ret = -EIO;
+    }
+
+out:
+    client->send_coroutine = NULL;
+    qemu_co_mutex_unlock(&client->send_lock);
+
+    return ret;
+}
+
 static inline void set_be_simple_reply(NBDSimpleReply *reply, uint64_t error,
                                        uint64_t cookie)
 {
@@ -2080,6 +2454,9 @@ static int coroutine_fn nbd_co_send_simple_reply(NBDClient *client,
                                    nbd_err_lookup(nbd_err), len);
     set_be_simple_reply(&reply, nbd_err, request->cookie);
 
+    if (request->type == NBD_CMD_READ && nbd_client_use_zero_copy(client, len)) {
+        return nbd_co_send_iov_zero_copy(client, iov, 2, errp);
+    }
     return nbd_co_send_iov(client, iov, 2, errp);
 }
 
@@ -2161,6 +2538,9 @@ static int coroutine_fn nbd_co_send_chunk_read(NBDClient *client,
                  NBD_REPLY_TYPE_OFFSET_DATA, request);
     stq_be_p(&chunk.offset, offset);
 
+    if (nbd_client_use_zero_copy(client, size)) {
+        return nbd_co_send_iov_zero_copy(client, iov, 3, errp);
+    }
     return nbd_co_send_iov(client, iov, 3, errp);
 }
 
@@ -3065,6 +3445,23 @@ static coroutine_fn int nbd_handle_request(NBDClient *client,
     }
 }
 
+/* Updates the statistics of @client after a reply to @request was sent */
+static void nbd_client_account(NBDClient *client, NBDRequest *request)
+{
+    stat64_add(&client->requests, 1);
+
+    switch (request->type) {
+    case NBD_CMD_READ:
+        stat64_add(&client->read_bytes, request->len);
+        break;
+    case NBD_CMD_WRITE:
+        stat64_add(&client->written_bytes, request->len);
+        break;
+    default:
+        break;
+    }
+}
+
 /* Owns a reference to the NBDClient passed as opaque.  */
 static coroutine_fn void nbd_trip(void *opaque)
 {
@@ -3146,6 +3543,14 @@ static coroutine_fn void nbd_trip(void *opaque)
         error_free(export_err);
     } else {
         ret = nbd_handle_request(client, &request, req->data, &local_err);
+        if (ret == 0) {
+            nbd_client_account(client, &request);
+        }
+        if (request.type == NBD_CMD_READ && req->data &&
+            nbd_client_use_zero_copy(client, request.len)) {
+            nbd_client_zero_copy_defer_free(client, req->data, request.len);
+            req->data = NULL;
+        }
     }
     if (request.contexts && request.contexts != &client->contexts) {
         assert(request.type == NBD_CMD_BLOCK_STATUS);
@@ -3195,7 +3600,7 @@ disconnect:
 }
 
 /*
- * Runs in export AioContext and main loop thread. Caller must hold
+ * Runs in client AioContext and main loop thread. Caller must hold
  * client->lock.
  */
 static void nbd_client_receive_next_request(NBDClient *client)
@@ -3207,7 +3612,8 @@ static void nbd_client_receive_next_request(NBDClient *client)
         nbd_client_get(client);
         req = nbd_request_get(client);
         client->recv_coroutine = qemu_coroutine_create(nbd_trip, req);
-        aio_co_schedule(client->exp->common.ctx, client->recv_coroutine);
+        aio_co_schedule(nbd_client_aio_context(client),
+                        client->recv_coroutine);
     }
 }
 
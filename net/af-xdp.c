@@ -16,19 +16,86 @@
 #include <linux/if_link.h>
 #include <linux/if_xdp.h>
 #include <net/if.h>
+#include <sys/ioctl.h>
 #include <xdp/xsk.h>
 
 #include "clients.h"
+#include "block/aio-wait.h"
+#include "exec/cpu-common.h"
+#include "hw/qdev-core.h"
 #include "monitor/monitor.h"
+#include "net/eth.h"
 #include "net/net.h"
 #include "qapi/error.h"
 #include "qemu/cutils.h"
 #include "qemu/error-report.h"
 #include "qemu/iov.h"
+#include "qemu/lockable.h"
 #include "qemu/main-loop.h"
 #include "qemu/memalign.h"
+#include "qemu/sockets.h"
+#include "system/hostmem.h"
+#include "system/iothread.h"
+#include "system/ramblock.h"
+#include "system/stats.h"
+#include "system/system.h"
+#include "trace.h"
 
 
+/*
+ * A guest receive buffer on the fill ring, see af_xdp_fq_post().  The
+ * frame starts XDP_PACKET_HEADROOM bytes in front of the buffer, so that
+ * the kernel writes the packet at the start of the buffer.  It does not
+ * write the headroom itself, unless the XDP program adds metadata or
+ * moves the start of the packet.
+ */
+typedef struct AFXDPRxBuffer {
+    uint64_t             addr;      /* of the frame, the key */
+    NetRxBuffer          buf;
+} AFXDPRxBuffer;
+
+typedef struct AFXDPStats {
+    uint64_t             fill_ring;
+    uint64_t             fill_ring_empty;
+    uint64_t             completion_ring;
+    uint64_t             completion_ring_full;
+    uint64_t             rx_zero_copy;
+} AFXDPStats;
+
+#define AF_XDP_BATCH_SIZE 64
+
+/*
+ * With guest memory, the frames of the pool only keep packets coming while
+ * the guest has no buffers lent to us.  The kernel takes the frames on the
+ * fill ring in order, so there are only a few of them.
+ */
+#define AF_XDP_ZC_POOL_FILL 8
+
+/*
+ * The smallest chunk that the kernel takes.  A frame of guest memory that
+ * crosses a page boundary may not work in zero-copy mode, so frames are
+ * this small unless the MTU of the interface needs more.
+ */
+#define AF_XDP_ZC_FRAME_SIZE 2048
+
+/*
+ * With memdev, the queues of a netdev share a single UMEM, so that the
+ * guest RAM is registered and pinned once.  It is a second mapping of the
+ * RAM followed by the frames of the pools of all the queues.  The socket
+ * of @owner is the one that the UMEM was registered with.
+ */
+typedef struct AFXDPZeroCopy {
+    void                 *area;
+    size_t               area_size;
+    struct xsk_umem      *umem;
+    struct AFXDPState    *owner;
+    unsigned             refs;
+} AFXDPZeroCopy;
+
+/* Number of frames if all 4 queues (rx, tx, cq, fq) are full. */
+#define AF_XDP_N_FRAMES ((XSK_RING_PROD__DEFAULT_NUM_DESCS \
+                          + XSK_RING_CONS__DEFAULT_NUM_DESCS) * 2)
+
 typedef struct AFXDPState {
     NetClientState       nc;
 
@@ -46,26 +113,116 @@ typedef struct AFXDPState {
 
     uint64_t             *pool;
     uint32_t             n_pool;
+    uint32_t             fq_pool;   /* frames of the pool on the fill ring */
     char                 *buffer;
+    size_t               buffer_size;
+    size_t               frame_size;
     struct xsk_umem      *umem;
 
     uint32_t             n_queues;
     uint32_t             xdp_flags;
     bool                 inhibit;
+    bool                 force_copy;
+    bool                 has_mode;
+    AFXDPMode            mode;
+    int                  queue_id;
+
+    /*
+     * The rings are serviced by af_xdp_readable() and af_xdp_writable(),
+     * in @iothread if set, and the packets are delivered to the peer by
+     * af_xdp_deliver() in the main loop.  If the peer runs in @peer_ctx,
+     * both happen there instead, see af_xdp_set_aio_context().  @lock
+     * protects the rings, the pool, the poll state and the statistics;
+     * @rx_batch belongs to af_xdp_deliver() while @rx_tail is not 0.
+     */
+    IOThread             *iothread;
+    AioContext           *peer_ctx;
+    QemuMutex            lock;
+    QEMUBH               *bh;
+    bool                 stopped;
+    bool                 read_handler;
+    bool                 write_handler;
+    bool                 flush_tx;
+    struct xdp_desc      rx_batch[AF_XDP_BATCH_SIZE];
+    uint32_t             rx_head;
+    uint32_t             rx_tail;
+    uint8_t              buf[NET_BUFSIZE];
+
+    /*
+     * With @memdev, @buffer is the shared UMEM of @zc.  It starts with the
+     * guest RAM, @zc_size bytes that are at @zc_host in QEMU.  Guest
+     * buffers must have room for a frame of @rx_frame bytes.
+     */
+    char                 *memdev;
+    Notifier             machine_done;
+    AFXDPZeroCopy        *zc;
+    uint8_t              *zc_host;
+    uint64_t             zc_size;
+    size_t               rx_frame;
+    GHashTable           *rx_posted;
+
+    AFXDPStats           stats;
+    QTAILQ_ENTRY(AFXDPState) next;
 } AFXDPState;
 
-#define AF_XDP_BATCH_SIZE 64
+static QTAILQ_HEAD(, AFXDPState) af_xdp_queues =
+    QTAILQ_HEAD_INITIALIZER(af_xdp_queues);
 
-static void af_xdp_send(void *opaque);
+static void af_xdp_readable(void *opaque);
 static void af_xdp_writable(void *opaque);
+static void af_xdp_deliver(AFXDPState *s);
+static int af_xdp_create(AFXDPState *s, int sock_fd, Error **errp);
 
-/* Set the event-loop handlers for the af-xdp backend. */
+/* Where the rings are serviced, NULL for the main loop */
+static AioContext *af_xdp_ring_context(AFXDPState *s)
+{
+    if (s->peer_ctx) {
+        return s->peer_ctx;
+    }
+    return s->iothread ? iothread_get_aio_context(s->iothread) : NULL;
+}
+
+/* The next queue of the same netdev, NULL for the last one */
+static AFXDPState *af_xdp_next_queue(AFXDPState *s)
+{
+    AFXDPState *q = QTAILQ_NEXT(s, next);
+
+    return q && !strcmp(q->nc.name, s->nc.name) ? q : NULL;
+}
+
+/* Whether the packets are handed to the peer in another thread */
+static bool af_xdp_deliver_in_bh(AFXDPState *s)
+{
+    return s->iothread && !s->peer_ctx;
+}
+
+/*
+ * Set the event-loop handlers for the af-xdp backend.  Reads stop while
+ * a batch of received packets is waiting for af_xdp_deliver().
+ */
 static void af_xdp_update_fd_handler(AFXDPState *s)
 {
-    qemu_set_fd_handler(xsk_socket__fd(s->xsk),
-                        s->read_poll ? af_xdp_send : NULL,
-                        s->write_poll ? af_xdp_writable : NULL,
-                        s);
+    bool read = s->read_poll && !s->rx_tail && !s->stopped;
+    bool write = s->write_poll && !s->stopped;
+    AioContext *ctx = af_xdp_ring_context(s);
+    int fd;
+
+    if (!s->xsk ||
+        (read == s->read_handler && write == s->write_handler)) {
+        return;
+    }
+
+    fd = xsk_socket__fd(s->xsk);
+    if (ctx) {
+        aio_set_fd_handler(ctx, fd, read ? af_xdp_readable : NULL,
+                           write ? af_xdp_writable : NULL,
+                           NULL, NULL, s);
+    } else {
+        qemu_set_fd_handler(fd, read ? af_xdp_readable : NULL,
+                            write ? af_xdp_writable : NULL, s);
+    }
+    s->read_handler = read;
+    s->write_handler = write;
 }
 
 /* Update the read handler. */
@@ -90,6 +247,7 @@ static void af_xdp_poll(NetClientState *nc, bool enable)
 {
     AFXDPState *s = DO_UPCAST(AFXDPState, nc, nc);
 
+    QEMU_LOCK_GUARD(&s->lock);
     if (s->read_poll != enable || s->write_poll != enable) {
         s->write_poll = enable;
         s->read_poll  = enable;
@@ -97,6 +255,54 @@ static void af_xdp_poll(NetClientState *nc, bool enable)
     }
 }
 
+static void af_xdp_noop_bh(void *opaque)
+{
+}
+
+/* Stop servicing the rings, and wait for the iothread to let go of them */
+static void af_xdp_quiesce(AFXDPState *s)
+{
+    AioContext *ctx = af_xdp_ring_context(s);
+
+    WITH_QEMU_LOCK_GUARD(&s->lock) {
+        s->stopped = true;
+        af_xdp_update_fd_handler(s);
+    }
+
+    if (ctx) {
+        aio_wait_bh_oneshot(ctx, af_xdp_noop_bh, NULL);
+    }
+    qemu_bh_cancel(s->bh);
+}
+
+static void af_xdp_resume(AFXDPState *s)
+{
+    QEMU_LOCK_GUARD(&s->lock);
+    s->stopped = false;
+    af_xdp_update_fd_handler(s);
+}
+
+/* The start of the frame of a descriptor */
+static uint64_t af_xdp_frame(AFXDPState *s, uint64_t addr)
+{
+    if (s->zc_size) {
+        return xsk_umem__extract_addr(addr);
+    }
+    return addr & ~(uint64_t)(s->frame_size - 1);
+}
+
+static void *af_xdp_data(AFXDPState *s, uint64_t addr)
+{
+    return xsk_umem__get_data(s->buffer, xsk_umem__add_offset_to_addr(addr));
+}
+
+/* Whether a descriptor is in a guest receive buffer */
+static bool af_xdp_is_guest_frame(AFXDPState *s, uint64_t addr)
+{
+    return xsk_umem__extract_addr(addr) < s->zc_size;
+}
+
+/* Must be called with the lock held. */
 static void af_xdp_complete_tx(AFXDPState *s)
 {
     uint32_t idx = 0;
@@ -105,6 +311,11 @@ static void af_xdp_complete_tx(AFXDPState *s)
 
     done = xsk_ring_cons__peek(&s->cq, XSK_RING_CONS__DEFAULT_NUM_DESCS, &idx);
 
+    s->stats.completion_ring = done;
+    if (done == XSK_RING_CONS__DEFAULT_NUM_DESCS) {
+        s->stats.completion_ring_full++;
+    }
+
     for (i = 0; i < done; i++) {
         addr = (void *) xsk_ring_cons__comp_addr(&s->cq, idx++);
         s->pool[s->n_pool++] = *addr;
@@ -116,6 +327,16 @@ static void af_xdp_complete_tx(AFXDPState *s)
     }
 }
 
+static void af_xdp_bh(void *opaque)
+{
+    AFXDPState *s = opaque;
+
+    if (qatomic_xchg(&s->flush_tx, false)) {
+        qemu_flush_queued_packets(&s->nc);
+    }
+    af_xdp_deliver(s);
+}
+
 /*
  * The fd_write() callback, invoked if the fd is marked as writable
  * after a poll.
@@ -124,19 +345,26 @@ static void af_xdp_writable(void *opaque)
 {
     AFXDPState *s = opaque;
 
-    /* Try to recover buffers that are already sent. */
-    af_xdp_complete_tx(s);
+    WITH_QEMU_LOCK_GUARD(&s->lock) {
+        /* Try to recover buffers that are already sent. */
+        af_xdp_complete_tx(s);
 
-    /*
-     * Unregister the handler, unless we still have packets to transmit
-     * and kernel needs a wake up.
-     */
-    if (!s->outstanding_tx || !xsk_ring_prod__needs_wakeup(&s->tx)) {
-        af_xdp_write_poll(s, false);
+        /*
+         * Unregister the handler, unless we still have packets to transmit
+         * and kernel needs a wake up.
+         */
+        if (!s->outstanding_tx || !xsk_ring_prod__needs_wakeup(&s->tx)) {
+            af_xdp_write_poll(s, false);
+        }
     }
 
     /* Flush any buffered packets. */
-    qemu_flush_queued_packets(&s->nc);
+    if (af_xdp_deliver_in_bh(s)) {
+        qatomic_set(&s->flush_tx, true);
+        qemu_bh_schedule(s->bh);
+    } else {
+        qemu_flush_queued_packets(&s->nc);
+    }
 }
 
 static ssize_t af_xdp_receive(NetClientState *nc,
@@ -147,10 +375,17 @@ static ssize_t af_xdp_receive(NetClientState *nc,
     uint32_t idx;
     void *data;
 
+    QEMU_LOCK_GUARD(&s->lock);
+
+    if (!s->xsk) {
+        /* The socket could not be recreated, see af_xdp_create(). */
+        return size;
+    }
+
     /* Try to recover buffers that are already sent. */
     af_xdp_complete_tx(s);
 
-    if (size > XSK_UMEM__DEFAULT_FRAME_SIZE) {
+    if (size > s->frame_size) {
         /* We can't transmit packet this size... */
         return size;
     }
@@ -182,19 +417,35 @@ static ssize_t af_xdp_receive(NetClientState *nc,
 }
 
 /*
- * Complete a previous send (backend --> guest) and enable the
- * fd_read callback.
+ * Complete a previous send (backend --> guest) and go on with the
+ * batch of received packets.
  */
 static void af_xdp_send_completed(NetClientState *nc, ssize_t len)
 {
     AFXDPState *s = DO_UPCAST(AFXDPState, nc, nc);
 
-    af_xdp_read_poll(s, true);
+    qemu_bh_schedule(s->bh);
 }
 
+/*
+ * Put frames of the pool on the fill ring.  With guest memory, there are
+ * only AF_XDP_ZC_POOL_FILL of them, see af_xdp_fq_post().
+ *
+ * Must be called with the lock held.
+ */
 static void af_xdp_fq_refill(AFXDPState *s, uint32_t n)
 {
-    uint32_t i, idx = 0;
+    uint32_t i, idx = 0, level;
+
+    level = s->fq.size - xsk_prod_nb_free(&s->fq, s->fq.size);
+    s->stats.fill_ring = level;
+    if (!level) {
+        s->stats.fill_ring_empty++;
+    }
+
+    if (s->zc_size) {
+        n = MIN(n, AF_XDP_ZC_POOL_FILL - MIN(s->fq_pool, AF_XDP_ZC_POOL_FILL));
+    }
 
     /* Leave one packet for Tx, just in case. */
     if (s->n_pool < n + 1) {
@@ -209,6 +460,8 @@ static void af_xdp_fq_refill(AFXDPState *s, uint32_t n)
         *xsk_ring_prod__fill_addr(&s->fq, idx++) = s->pool[--s->n_pool];
     }
     xsk_ring_prod__submit(&s->fq, n);
+    s->stats.fill_ring += n;
+    s->fq_pool += n;
 
     if (xsk_ring_prod__needs_wakeup(&s->fq)) {
         /* Receive was blocked by not having enough buffers.  Wake it up. */
@@ -216,26 +469,245 @@ static void af_xdp_fq_refill(AFXDPState *s, uint32_t n)
     }
 }
 
-static void af_xdp_send(void *opaque)
+/*
+ * Put guest receive buffers on the fill ring, or give them back.  They go
+ * behind the few frames of the pool that are there already; a frame of
+ * the pool is only put back once the kernel used it, so that the guest
+ * buffers take nearly all the packets.
+ */
+static void af_xdp_fq_post(AFXDPState *s, NetRxBuffer *bufs, int n)
 {
-    uint32_t i, n_rx, idx = 0;
-    AFXDPState *s = opaque;
+    size_t lens[AF_XDP_BATCH_SIZE] = { 0 };
+    uint32_t i, idx = 0, done = 0;
+
+    WITH_QEMU_LOCK_GUARD(&s->lock) {
+        if (s->xsk) {
+            done = MIN(n, xsk_prod_nb_free(&s->fq, n));
+        }
+        if (!done || !xsk_ring_prod__reserve(&s->fq, done, &idx)) {
+            done = 0;
+            break;
+        }
 
-    n_rx = xsk_ring_cons__peek(&s->rx, AF_XDP_BATCH_SIZE, &idx);
-    if (!n_rx) {
+        for (i = 0; i < done; i++) {
+            AFXDPRxBuffer *b = g_new(AFXDPRxBuffer, 1);
+
+            b->addr = (uint8_t *)bufs[i].data - XDP_PACKET_HEADROOM -
+                      s->zc_host;
+            b->buf = bufs[i];
+            g_hash_table_insert(s->rx_posted, &b->addr, b);
+            *xsk_ring_prod__fill_addr(&s->fq, idx++) = b->addr;
+        }
+        xsk_ring_prod__submit(&s->fq, done);
+        s->stats.fill_ring += done;
+
+        if (xsk_ring_prod__needs_wakeup(&s->fq)) {
+            af_xdp_read_poll(s, true);
+        }
+    }
+
+    if (done < n) {
+        qemu_fill_rx_buffers(&s->nc, bufs + done, lens, n - done);
+    }
+}
+
+/* Borrow receive buffers from the peer, for the kernel to write into */
+static void af_xdp_post_rx_buffers(AFXDPState *s)
+{
+    NetRxBuffer bufs[AF_XDP_BATCH_SIZE];
+    uint32_t room = 0;
+    int n;
+
+    if (!s->zc_size) {
+        return;
+    }
+
+    WITH_QEMU_LOCK_GUARD(&s->lock) {
+        if (s->xsk && !s->stopped) {
+            room = MIN(xsk_prod_nb_free(&s->fq, AF_XDP_BATCH_SIZE),
+                       AF_XDP_BATCH_SIZE);
+        }
+    }
+    if (!room) {
+        return;
+    }
+
+    /* The packets in the frames of the pool come first */
+    n = qemu_post_rx_buffers(&s->nc, bufs, room, XDP_PACKET_HEADROOM,
+                             s->rx_frame, AF_XDP_ZC_POOL_FILL,
+                             s->zc_host, s->zc_size);
+    if (n > 0) {
+        af_xdp_fq_post(s, bufs, n);
+    }
+}
+
+/*
+ * Give back all the buffers borrowed from the peer, unused.  They go back
+ * in a single call, so that the peer can put them back where it took them
+ * from instead of completing them as empty packets.
+ */
+static void af_xdp_return_rx_buffers(AFXDPState *s)
+{
+    g_autofree NetRxBuffer *bufs = NULL;
+    g_autofree size_t *lens = NULL;
+    GHashTableIter iter;
+    AFXDPRxBuffer *b;
+    int n = 0;
+
+    if (!s->rx_posted || !g_hash_table_size(s->rx_posted)) {
         return;
     }
 
-    for (i = 0; i < n_rx; i++) {
-        const struct xdp_desc *desc;
+    if (!s->nc.peer) {
+        g_hash_table_remove_all(s->rx_posted);
+        return;
+    }
+
+    bufs = g_new(NetRxBuffer, g_hash_table_size(s->rx_posted));
+    lens = g_new0(size_t, g_hash_table_size(s->rx_posted));
+    g_hash_table_iter_init(&iter, s->rx_posted);
+    while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&b)) {
+        bufs[n++] = b->buf;
+        g_hash_table_iter_remove(&iter);
+    }
+    qemu_fill_rx_buffers(&s->nc, bufs, lens, n);
+}
+
+/*
+ * Take back the guest buffer of a descriptor.  The packet is at the start
+ * of the buffer, unless the XDP program moved it.  *@len is 0 if it does
+ * not fit the buffer, which can only happen if the MTU of the interface
+ * grew since the buffers were posted; the kernel may then have written
+ * past the buffer.
+ */
+static bool af_xdp_take_rx_buffer(AFXDPState *s, const struct xdp_desc *desc,
+                                  NetRxBuffer *buf, size_t *len)
+{
+    uint64_t addr = xsk_umem__extract_addr(desc->addr);
+    AFXDPRxBuffer *b;
+    void *data;
+
+    b = g_hash_table_lookup(s->rx_posted, &addr);
+    if (!b) {
+        return false;
+    }
+    *buf = b->buf;
+    g_hash_table_remove(s->rx_posted, &addr);
+
+    if (desc->len > buf->size) {
+        error_report_once("af-xdp: %s: a %u byte packet did not fit a %zu "
+                          "byte guest buffer", s->ifname, desc->len,
+                          buf->size);
+        *len = 0;
+        return true;
+    }
+
+    data = af_xdp_data(s, desc->addr);
+    if (data != buf->data) {
+        memmove(buf->data, data, desc->len);
+    }
+    *len = desc->len;
+    s->stats.rx_zero_copy++;
+    return true;
+}
+
+static void af_xdp_fill_rx_buffers(AFXDPState *s, NetRxBuffer *bufs,
+                                   size_t *lens, int n)
+{
+    int kept = qemu_fill_rx_buffers(&s->nc, bufs, lens, n);
+
+    /* The packets were dropped, the buffers can be used again */
+    if (kept) {
+        af_xdp_fq_post(s, bufs, kept);
+    }
+}
+
+/* The NetReadPacket callback for packets that are not in guest memory */
+static ssize_t af_xdp_read_packet(NetClientState *nc,
+                                  const struct iovec *iov, int iovcnt)
+{
+    AFXDPState *s = DO_UPCAST(AFXDPState, nc, nc);
+    const struct xdp_desc *desc;
+
+    if (s->rx_head == s->rx_tail ||
+        af_xdp_is_guest_frame(s, s->rx_batch[s->rx_head].addr)) {
+        return -EAGAIN;
+    }
+
+    desc = &s->rx_batch[s->rx_head++];
+    iov_from_buf(iov, iovcnt, 0, af_xdp_data(s, desc->addr), desc->len);
+    return desc->len;
+}
+
+/* Done with the batch, or waiting for af_xdp_send_completed() */
+static void af_xdp_rx_done(AFXDPState *s)
+{
+    uint32_t i;
+
+    WITH_QEMU_LOCK_GUARD(&s->lock) {
+        if (s->rx_head == s->rx_tail) {
+            for (i = 0; i < s->rx_tail; i++) {
+                if (!af_xdp_is_guest_frame(s, s->rx_batch[i].addr)) {
+                    s->pool[s->n_pool++] = af_xdp_frame(s,
+                                                        s->rx_batch[i].addr);
+                }
+            }
+            s->rx_head = s->rx_tail = 0;
+            af_xdp_fq_refill(s, AF_XDP_BATCH_SIZE);
+        }
+        af_xdp_update_fd_handler(s);
+    }
+
+    af_xdp_post_rx_buffers(s);
+}
+
+/*
+ * Hand the batch of received packets to the peer, in order.  Packets in
+ * guest buffers only need to be given back; the others are copied.
+ */
+static void af_xdp_deliver(AFXDPState *s)
+{
+    NetRxBuffer bufs[AF_XDP_BATCH_SIZE];
+    size_t lens[AF_XDP_BATCH_SIZE];
+    int n = 0;
+
+    WITH_QEMU_LOCK_GUARD(&s->lock) {
+        if (!s->rx_tail) {
+            return;
+        }
+    }
+
+    while (s->rx_head < s->rx_tail) {
+        const struct xdp_desc *desc = &s->rx_batch[s->rx_head];
         struct iovec iov;
+        size_t pending;
 
-        desc = xsk_ring_cons__rx_desc(&s->rx, idx++);
+        if (af_xdp_is_guest_frame(s, desc->addr)) {
+            if (af_xdp_take_rx_buffer(s, desc, &bufs[n], &lens[n])) {
+                n++;
+            }
+            s->rx_head++;
+            continue;
+        }
 
-        iov.iov_base = xsk_umem__get_data(s->buffer, desc->addr);
-        iov.iov_len = desc->len;
+        if (n) {
+            af_xdp_fill_rx_buffers(s, bufs, lens, n);
+            n = 0;
+        }
+
+        if (qemu_receive_direct(&s->nc, af_xdp_read_packet, s->buf,
+                                s->rx_tail - s->rx_head, &pending) > 0) {
+            if (pending &&
+                !qemu_send_packet_async(&s->nc, s->buf, pending,
+                                        af_xdp_send_completed)) {
+                break;
+            }
+            continue;
+        }
 
-        s->pool[s->n_pool++] = desc->addr;
+        iov.iov_base = af_xdp_data(s, desc->addr);
+        iov.iov_len = desc->len;
+        s->rx_head++;
 
         if (!qemu_sendv_packet_async(&s->nc, &iov, 1,
                                      af_xdp_send_completed)) {
@@ -243,37 +715,212 @@ static void af_xdp_send(void *opaque)
              * The peer does not receive anymore.  Packet is queued, stop
              * reading from the backend until af_xdp_send_completed().
              */
-            af_xdp_read_poll(s, false);
-
-            /* Return unused descriptors to not break the ring cache. */
-            xsk_ring_cons__cancel(&s->rx, n_rx - i - 1);
-            n_rx = i + 1;
             break;
         }
     }
 
-    /* Release actually sent descriptors and try to re-fill. */
-    xsk_ring_cons__release(&s->rx, n_rx);
-    af_xdp_fq_refill(s, AF_XDP_BATCH_SIZE);
+    if (n) {
+        af_xdp_fill_rx_buffers(s, bufs, lens, n);
+    }
+    af_xdp_rx_done(s);
 }
 
-/* Flush and close. */
-static void af_xdp_cleanup(NetClientState *nc)
+/*
+ * The fd_read() callback.  Takes a batch of packets from the rx ring, for
+ * af_xdp_deliver() to hand to the peer.
+ */
+static void af_xdp_readable(void *opaque)
 {
-    AFXDPState *s = DO_UPCAST(AFXDPState, nc, nc);
+    uint32_t i, n_rx, idx = 0;
+    AFXDPState *s = opaque;
+    bool pending;
+
+    WITH_QEMU_LOCK_GUARD(&s->lock) {
+        if (!s->rx_tail) {
+            n_rx = xsk_ring_cons__peek(&s->rx, AF_XDP_BATCH_SIZE, &idx);
+            for (i = 0; i < n_rx; i++) {
+                s->rx_batch[i] = *xsk_ring_cons__rx_desc(&s->rx, idx++);
+                if (!af_xdp_is_guest_frame(s, s->rx_batch[i].addr)) {
+                    s->fq_pool--;
+                }
+            }
+            if (n_rx) {
+                xsk_ring_cons__release(&s->rx, n_rx);
+            }
+            s->rx_head = 0;
+            s->rx_tail = n_rx;
+        }
 
-    qemu_purge_queued_packets(nc);
+        af_xdp_fq_refill(s, AF_XDP_BATCH_SIZE);
+
+        pending = s->rx_tail;
+        if (pending && af_xdp_deliver_in_bh(s)) {
+            af_xdp_update_fd_handler(s);
+        }
+    }
 
-    af_xdp_poll(nc, false);
+    if (!pending) {
+        return;
+    }
+    if (af_xdp_deliver_in_bh(s)) {
+        qemu_bh_schedule(s->bh);
+    } else {
+        af_xdp_deliver(s);
+    }
+}
 
+/* Must be called with the rings quiesced. */
+static void af_xdp_destroy(AFXDPState *s)
+{
     xsk_socket__delete(s->xsk);
     s->xsk = NULL;
+    s->read_handler = s->write_handler = false;
+    /* A shared UMEM goes with its last queue, see af_xdp_buffer_free() */
+    if (!s->zc) {
+        xsk_umem__delete(s->umem);
+    }
+    s->umem = NULL;
     g_free(s->pool);
     s->pool = NULL;
-    xsk_umem__delete(s->umem);
-    s->umem = NULL;
-    qemu_vfree(s->buffer);
+    s->n_pool = 0;
+    s->fq_pool = 0;
+    s->outstanding_tx = 0;
+    s->rx_head = s->rx_tail = 0;
+}
+
+static void af_xdp_buffer_alloc(AFXDPState *s)
+{
+    s->frame_size = XSK_UMEM__DEFAULT_FRAME_SIZE;
+    s->buffer_size = (size_t)AF_XDP_N_FRAMES * s->frame_size;
+    s->buffer = qemu_memalign(qemu_real_host_page_size(), s->buffer_size);
+    memset(s->buffer, 0, s->buffer_size);
+}
+
+/* Must be called with the socket destroyed. */
+static void af_xdp_buffer_free(AFXDPState *s)
+{
+    AFXDPZeroCopy *zc = s->zc;
+
+    if (zc) {
+        s->zc = NULL;
+        s->zc_host = NULL;
+        s->zc_size = 0;
+        g_clear_pointer(&s->rx_posted, g_hash_table_destroy);
+        if (!--zc->refs) {
+            xsk_umem__delete(zc->umem);
+            munmap(zc->area, zc->area_size);
+            ram_block_discard_disable(false);
+            g_free(zc);
+        }
+    } else {
+        qemu_vfree(s->buffer);
+    }
     s->buffer = NULL;
+}
+
+/*
+ * Release the receive buffers of the peer, see qemu_post_rx_buffers().
+ * The kernel only forgets the fill ring of a queue with its socket, so
+ * the socket is recreated; the UMEM stays registered.  libxdp cannot bind
+ * the socket that the UMEM was registered with again, though, so if it
+ * is that one, all the queues start over with a new UMEM.
+ */
+static void af_xdp_release_rx_buffers(NetClientState *nc)
+{
+    AFXDPState *s = DO_UPCAST(AFXDPState, nc, nc);
+    AFXDPZeroCopy *zc = s->zc;
+    Error *err = NULL;
+    AFXDPState *q;
+
+    if (!s->rx_posted || !g_hash_table_size(s->rx_posted)) {
+        return;
+    }
+
+    trace_af_xdp_release_rx_buffers(s, nc->queue_index,
+                                    g_hash_table_size(s->rx_posted),
+                                    zc->owner == s);
+
+    if (zc->owner != s) {
+        af_xdp_quiesce(s);
+        af_xdp_destroy(s);
+        af_xdp_return_rx_buffers(s);
+        if (af_xdp_create(s, -1, &err)) {
+            error_report_err(err);
+        }
+        af_xdp_resume(s);
+        return;
+    }
+
+    QTAILQ_FOREACH(q, &af_xdp_queues, next) {
+        if (q->zc == zc) {
+            af_xdp_quiesce(q);
+            af_xdp_destroy(q);
+            af_xdp_return_rx_buffers(q);
+        }
+    }
+
+    xsk_umem__delete(zc->umem);
+    zc->umem = NULL;
+    zc->owner = NULL;
+
+    QTAILQ_FOREACH(q, &af_xdp_queues, next) {
+        if (q->zc == zc) {
+            if (af_xdp_create(q, -1, &err)) {
+                error_report_err(err);
+                err = NULL;
+            }
+            af_xdp_resume(q);
+        }
+    }
+}
+
+/*
+ * Service the rings and deliver the packets in the AioContext of the
+ * peer, so that neither goes through the main loop.
+ */
+static void af_xdp_set_aio_context(NetClientState *nc, AioContext *ctx)
+{
+    AFXDPState *s = DO_UPCAST(AFXDPState, nc, nc);
+
+    if (s->peer_ctx == ctx) {
+        return;
+    }
+
+    af_xdp_quiesce(s);
+    qemu_bh_delete(s->bh);
+    s->peer_ctx = ctx;
+    s->bh = aio_bh_new(ctx ? ctx : iohandler_get_aio_context(), af_xdp_bh, s);
+    af_xdp_resume(s);
+
+    /* A batch may be waiting for the peer */
+    qemu_bh_schedule(s->bh);
+}
+
+/* Flush and close. */
+static void af_xdp_cleanup(NetClientState *nc)
+{
+    AFXDPState *s = DO_UPCAST(AFXDPState, nc, nc);
+
+    qemu_purge_queued_packets(nc);
+
+    af_xdp_quiesce(s);
+    af_xdp_return_rx_buffers(s);
+    af_xdp_destroy(s);
+    af_xdp_buffer_free(s);
+    qemu_bh_delete(s->bh);
+    s->bh = NULL;
+
+    if (s->machine_done.notify) {
+        qemu_remove_machine_init_done_notifier(&s->machine_done);
+    }
+    if (s->iothread) {
+        object_unref(OBJECT(s->iothread));
+        s->iothread = NULL;
+    }
+    g_free(s->memdev);
+    s->memdev = NULL;
+    QTAILQ_REMOVE(&af_xdp_queues, s, next);
+    qemu_mutex_destroy(&s->lock);
 
     /* Remove the program if it's the last open queue. */
     if (!s->inhibit && nc->queue_index == s->n_queues - 1 && s->xdp_flags
@@ -289,52 +936,91 @@ static int af_xdp_umem_create(AFXDPState *s, int sock_fd, Error **errp)
     struct xsk_umem_config config = {
         .fill_size = XSK_RING_PROD__DEFAULT_NUM_DESCS,
         .comp_size = XSK_RING_CONS__DEFAULT_NUM_DESCS,
-        .frame_size = XSK_UMEM__DEFAULT_FRAME_SIZE,
+        .frame_size = s->frame_size,
         .frame_headroom = 0,
     };
-    uint64_t n_descs;
-    uint64_t size;
-    int64_t i;
     int ret;
 
-    /* Number of descriptors if all 4 queues (rx, tx, cq, fq) are full. */
-    n_descs = (XSK_RING_PROD__DEFAULT_NUM_DESCS
-               + XSK_RING_CONS__DEFAULT_NUM_DESCS) * 2;
-    size = n_descs * XSK_UMEM__DEFAULT_FRAME_SIZE;
+    if (s->zc && s->zc->umem) {
+        /* The queues share the UMEM, see af_xdp_enable_zero_copy() */
+        s->umem = s->zc->umem;
+        return 0;
+    }
 
-    s->buffer = qemu_memalign(qemu_real_host_page_size(), size);
-    memset(s->buffer, 0, size);
+    /* Guest buffers are wherever the guest put them */
+    if (s->zc) {
+        config.flags = XDP_UMEM_UNALIGNED_CHUNK_FLAG;
+    }
 
     if (sock_fd < 0) {
-        ret = xsk_umem__create(&s->umem, s->buffer, size,
+        ret = xsk_umem__create(&s->umem, s->buffer, s->buffer_size,
                                &s->fq, &s->cq, &config);
     } else {
-        ret = xsk_umem__create_with_fd(&s->umem, sock_fd, s->buffer, size,
-                                       &s->fq, &s->cq, &config);
+        ret = xsk_umem__create_with_fd(&s->umem, sock_fd, s->buffer,
+                                       s->buffer_size, &s->fq, &s->cq,
+                                       &config);
     }
 
     if (ret) {
-        qemu_vfree(s->buffer);
         error_setg_errno(errp, errno,
                          "failed to create umem for %s queue_index: %d",
                          s->ifname, s->nc.queue_index);
         return -1;
     }
 
-    s->pool = g_new(uint64_t, n_descs);
+    if (s->zc) {
+        s->zc->umem = s->umem;
+    }
+    return 0;
+}
+
+/* Put the frames of the pool of the queue on the fill ring. */
+static void af_xdp_pool_init(AFXDPState *s)
+{
+    uint64_t base = 0;
+    int64_t i;
+
+    /* With guest memory, the pools of the queues follow the RAM */
+    if (s->zc) {
+        base = s->zc_size +
+               (uint64_t)s->nc.queue_index * AF_XDP_N_FRAMES * s->frame_size;
+    }
+
+    s->pool = g_new(uint64_t, AF_XDP_N_FRAMES);
     /* Fill the pool in the opposite order, because it's a LIFO queue. */
-    for (i = n_descs; i >= 0; i--) {
-        s->pool[i] = i * XSK_UMEM__DEFAULT_FRAME_SIZE;
+    for (i = AF_XDP_N_FRAMES - 1; i >= 0; i--) {
+        s->pool[i] = base + i * s->frame_size;
     }
-    s->n_pool = n_descs;
+    s->n_pool = AF_XDP_N_FRAMES;
 
+    QEMU_LOCK_GUARD(&s->lock);
     af_xdp_fq_refill(s, XSK_RING_PROD__DEFAULT_NUM_DESCS);
+}
 
-    return 0;
+/*
+ * The largest frame that @ifname receives, from its MTU with a VLAN tag,
+ * or SIZE_MAX if it cannot be found.
+ */
+static size_t af_xdp_max_frame(const char *ifname)
+{
+    struct ifreq ifr = { 0 };
+    size_t max = SIZE_MAX;
+    int fd;
+
+    fd = qemu_socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0) {
+        return max;
+    }
+
+    pstrcpy(ifr.ifr_name, sizeof(ifr.ifr_name), ifname);
+    if (!ioctl(fd, SIOCGIFMTU, &ifr) && ifr.ifr_mtu > 0) {
+        max = ifr.ifr_mtu + ETH_HLEN + sizeof(struct vlan_header);
+    }
+    close(fd);
+    return max;
 }
 
-static int af_xdp_socket_create(AFXDPState *s,
-                                const NetdevAFXDPOptions *opts, Error **errp)
+static int af_xdp_socket_create(AFXDPState *s, Error **errp)
 {
     struct xsk_socket_config cfg = {
         .rx_size = XSK_RING_CONS__DEFAULT_NUM_DESCS,
@@ -343,42 +1029,51 @@ static int af_xdp_socket_create(AFXDPState *s,
         .bind_flags = XDP_USE_NEED_WAKEUP,
         .xdp_flags = XDP_FLAGS_UPDATE_IF_NOEXIST,
     };
-    int queue_id, error = 0;
+    int error = 0;
 
-    s->inhibit = opts->has_inhibit && opts->inhibit;
     if (s->inhibit) {
         cfg.libxdp_flags |= XSK_LIBXDP_FLAGS__INHIBIT_PROG_LOAD;
     }
 
-    if (opts->has_force_copy && opts->force_copy) {
+    if (s->force_copy) {
         cfg.bind_flags |= XDP_COPY;
     }
 
-    queue_id = s->nc.queue_index;
-    if (opts->has_start_queue && opts->start_queue > 0) {
-        queue_id += opts->start_queue;
-    }
-
-    if (opts->has_mode) {
+    /*
+     * Each queue has its own fill and completion rings, which is what
+     * XDP_SHARED_UMEM needs when the UMEM is shared.
+     */
+    if (s->xdp_flags) {
+        /* Recreating the socket, stay in the same mode. */
+        cfg.xdp_flags = s->xdp_flags;
+        if (xsk_socket__create_shared(&s->xsk, s->ifname, s->queue_id,
+                                      s->umem, &s->rx, &s->tx,
+                                      &s->fq, &s->cq, &cfg)) {
+            error = errno;
+        }
+    } else if (s->has_mode) {
         /* Specific mode requested. */
-        cfg.xdp_flags |= (opts->mode == AFXDP_MODE_NATIVE)
+        cfg.xdp_flags |= (s->mode == AFXDP_MODE_NATIVE)
                          ? XDP_FLAGS_DRV_MODE : XDP_FLAGS_SKB_MODE;
-        if (xsk_socket__create(&s->xsk, s->ifname, queue_id,
-                               s->umem, &s->rx, &s->tx, &cfg)) {
+        if (xsk_socket__create_shared(&s->xsk, s->ifname, s->queue_id,
+                                      s->umem, &s->rx, &s->tx,
+                                      &s->fq, &s->cq, &cfg)) {
             error = errno;
         }
     } else {
         /* No mode requested, try native first. */
         cfg.xdp_flags |= XDP_FLAGS_DRV_MODE;
 
-        if (xsk_socket__create(&s->xsk, s->ifname, queue_id,
-                               s->umem, &s->rx, &s->tx, &cfg)) {
+        if (xsk_socket__create_shared(&s->xsk, s->ifname, s->queue_id,
+                                      s->umem, &s->rx, &s->tx,
+                                      &s->fq, &s->cq, &cfg)) {
             /* Can't use native mode, try skb. */
             cfg.xdp_flags &= ~XDP_FLAGS_DRV_MODE;
             cfg.xdp_flags |= XDP_FLAGS_SKB_MODE;
 
-            if (xsk_socket__create(&s->xsk, s->ifname, queue_id,
-                                   s->umem, &s->rx, &s->tx, &cfg)) {
+            if (xsk_socket__create_shared(&s->xsk, s->ifname, s->queue_id,
+                                          s->umem, &s->rx, &s->tx,
+                                          &s->fq, &s->cq, &cfg)) {
                 error = errno;
             }
         }
@@ -387,7 +1082,7 @@ static int af_xdp_socket_create(AFXDPState *s,
     if (error) {
         error_setg_errno(errp, error,
                          "failed to create AF_XDP socket for %s queue_id: %d",
-                         s->ifname, queue_id);
+                         s->ifname, s->queue_id);
         return -1;
     }
 
@@ -396,15 +1091,297 @@ static int af_xdp_socket_create(AFXDPState *s,
     return 0;
 }
 
+/* Create the umem and the socket, and start receiving. */
+static int af_xdp_create(AFXDPState *s, int sock_fd, Error **errp)
+{
+    if (af_xdp_umem_create(s, sock_fd, errp) ||
+        af_xdp_socket_create(s, errp)) {
+        return -1;
+    }
+
+    if (s->zc) {
+        /* libxdp binds the socket of the UMEM with the first queue */
+        if (!s->zc->owner) {
+            s->zc->owner = s;
+        }
+        s->rx_frame = MIN(af_xdp_max_frame(s->ifname),
+                          s->frame_size - XDP_PACKET_HEADROOM);
+    }
+    af_xdp_pool_init(s);
+
+    QEMU_LOCK_GUARD(&s->lock);
+    s->read_poll = true;
+    af_xdp_update_fd_handler(s);
+    return 0;
+}
+
+/*
+ * Register the guest RAM of @memdev with the sockets of all the queues of
+ * the netdev, @s being the first one, so that the peer can lend its
+ * receive buffers.  The queues share a single UMEM, which must be
+ * contiguous: a second mapping of the RAM followed by the frames of the
+ * pools.
+ */
+static int af_xdp_enable_zero_copy(AFXDPState *s, Error **errp)
+{
+    HostMemoryBackend *backend;
+    MemoryRegion *mr;
+    RAMBlock *rb;
+    AFXDPZeroCopy *zc;
+    AFXDPState *q;
+    size_t pagesize, frame_size, frames, size;
+    uint64_t zc_size;
+    void *area;
+    uint8_t *base;
+    int fd, ret;
+
+    backend = (HostMemoryBackend *)
+        object_resolve_path_type(s->memdev, TYPE_MEMORY_BACKEND, NULL);
+    if (!backend) {
+        error_setg(errp, "memdev '%s' not found", s->memdev);
+        return -1;
+    }
+
+    mr = host_memory_backend_get_memory(backend);
+    rb = mr->ram_block;
+    fd = memory_region_get_fd(mr);
+    if (!rb || fd < 0 || !qemu_ram_is_shared(rb)) {
+        error_setg(errp, "memdev '%s' is not a shared file or memfd backend",
+                   s->memdev);
+        return -1;
+    }
+
+    /*
+     * The kernel pins the pages of the UMEM, a discarded page would stay
+     * pinned and the guest would never see what is received into it.
+     */
+    ret = ram_block_discard_disable(true);
+    if (ret) {
+        error_setg_errno(errp, -ret,
+                         "cannot disable discarding of RAM for memdev '%s'",
+                         s->memdev);
+        return -1;
+    }
+
+    frame_size = XSK_UMEM__DEFAULT_FRAME_SIZE;
+    if (af_xdp_max_frame(s->ifname) <=
+        AF_XDP_ZC_FRAME_SIZE - XDP_PACKET_HEADROOM) {
+        frame_size = AF_XDP_ZC_FRAME_SIZE;
+    }
+
+    pagesize = qemu_ram_pagesize(rb);
+    zc_size = ROUND_UP(memory_region_size(mr), pagesize);
+    frames = (size_t)s->n_queues * AF_XDP_N_FRAMES * frame_size;
+    size = zc_size + frames;
+
+    area = mmap(NULL, size + pagesize, PROT_NONE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (area == MAP_FAILED) {
+        error_setg_errno(errp, errno, "failed to map memdev '%s'", s->memdev);
+        ram_block_discard_disable(false);
+        return -1;
+    }
+    base = QEMU_ALIGN_PTR_UP(area, pagesize);
+    if (mmap(base, zc_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+             fd, rb->fd_offset) == MAP_FAILED ||
+        mmap(base + zc_size, frames, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED) {
+        error_setg_errno(errp, errno, "failed to map memdev '%s'", s->memdev);
+        munmap(area, size + pagesize);
+        ram_block_discard_disable(false);
+        return -1;
+    }
+
+    zc = g_new0(AFXDPZeroCopy, 1);
+    zc->area = area;
+    zc->area_size = size + pagesize;
+
+    for (q = s; q; q = af_xdp_next_queue(q)) {
+        af_xdp_quiesce(q);
+        af_xdp_destroy(q);
+        af_xdp_buffer_free(q);
+
+        q->buffer = (char *)base;
+        q->buffer_size = size;
+        q->frame_size = frame_size;
+        q->zc = zc;
+        q->zc_host = qemu_ram_get_host_addr(rb);
+        q->zc_size = zc_size;
+        q->rx_posted = g_hash_table_new_full(g_int64_hash, g_int64_equal,
+                                             NULL, g_free);
+        zc->refs++;
+    }
+
+    for (q = s; q; q = af_xdp_next_queue(q)) {
+        if (af_xdp_create(q, -1, errp)) {
+            break;
+        }
+    }
+
+    if (q) {
+        /* Go back to copying */
+        for (q = s; q; q = af_xdp_next_queue(q)) {
+            Error *err = NULL;
+
+            af_xdp_destroy(q);
+            af_xdp_buffer_free(q);
+            af_xdp_buffer_alloc(q);
+            if (af_xdp_create(q, -1, &err)) {
+                error_report_err(err);
+            }
+            af_xdp_resume(q);
+        }
+        return -1;
+    }
+
+    trace_af_xdp_zero_copy(s, s->n_queues, zc_size, frame_size);
+    for (q = s; q; q = af_xdp_next_queue(q)) {
+        af_xdp_resume(q);
+    }
+    return 0;
+}
+
+static void af_xdp_machine_done(Notifier *notifier, void *data)
+{
+    AFXDPState *s = container_of(notifier, AFXDPState, machine_done);
+    Error *err = NULL;
+
+    if (af_xdp_enable_zero_copy(s, &err)) {
+        warn_reportf_err(err, "af-xdp: %s copies packets: ", s->nc.name);
+    }
+}
+
 /* NetClientInfo methods. */
 static NetClientInfo net_af_xdp_info = {
     .type = NET_CLIENT_DRIVER_AF_XDP,
     .size = sizeof(AFXDPState),
     .receive = af_xdp_receive,
+    .release_rx_buffers = af_xdp_release_rx_buffers,
     .poll = af_xdp_poll,
+    .set_aio_context = af_xdp_set_aio_context,
     .cleanup = af_xdp_cleanup,
 };
 
+static StatsList *af_xdp_stats_add(StatsList *stats_list, strList *names,
+                                   const char *name, const AFXDPStats *stats,
+                                   size_t offset, int n)
+{
+    Stats *entry;
+
+    if (!apply_str_list_filter(name, names)) {
+        return stats_list;
+    }
+
+    entry = g_new0(Stats, 1);
+    entry->name = g_strdup(name);
+    entry->value = g_new0(StatsValue, 1);
+    if (n == 1) {
+        entry->value->type = QTYPE_QNUM;
+        entry->value->u.scalar = *(uint64_t *)((char *)stats + offset);
+    } else {
+        entry->value->type = QTYPE_QLIST;
+        for (int i = n - 1; i >= 0; i--) {
+            QAPI_LIST_PREPEND(entry->value->u.list,
+                              *(uint64_t *)((char *)&stats[i] + offset));
+        }
+    }
+
+    QAPI_LIST_PREPEND(stats_list, entry);
+    return stats_list;
+}
+
+/* One result per netdev, with a value per queue */
+static void af_xdp_stats_cb(StatsResultList **result, StatsTarget target,
+                            strList *names, strList *targets, Error **errp)
+{
+    AFXDPState *s, *q;
+
+    if (target != STATS_TARGET_NETDEV) {
+        return;
+    }
+
+    QTAILQ_FOREACH(s, &af_xdp_queues, next) {
+        g_autofree AFXDPStats *stats = NULL;
+        StatsList *stats_list = NULL;
+        StatsResult *entry;
+        int i, n = 0;
+
+        if (s->nc.queue_index) {
+            continue;
+        }
+
+        for (q = s; q && !strcmp(q->nc.name, s->nc.name);
+             q = QTAILQ_NEXT(q, next)) {
+            n++;
+        }
+        stats = g_new(AFXDPStats, n);
+        for (i = 0, q = s; i < n; i++, q = QTAILQ_NEXT(q, next)) {
+            WITH_QEMU_LOCK_GUARD(&q->lock) {
+                stats[i] = q->stats;
+            }
+        }
+
+        stats_list = af_xdp_stats_add(stats_list, names, "fill-ring", stats,
+                                      offsetof(AFXDPStats, fill_ring), n);
+        stats_list = af_xdp_stats_add(stats_list, names, "fill-ring-empty",
+                                      stats,
+                                      offsetof(AFXDPStats, fill_ring_empty),
+                                      n);
+        stats_list = af_xdp_stats_add(stats_list, names, "completion-ring",
+                                      stats,
+                                      offsetof(AFXDPStats, completion_ring),
+                                      n);
+        stats_list = af_xdp_stats_add(stats_list, names,
+                                      "completion-ring-full", stats,
+                                      offsetof(AFXDPStats,
+                                               completion_ring_full), n);
+        stats_list = af_xdp_stats_add(stats_list, names, "rx-zero-copy",
+                                      stats,
+                                      offsetof(AFXDPStats, rx_zero_copy), n);
+        if (!stats_list) {
+            continue;
+        }
+
+        entry = g_new0(StatsResult, 1);
+        entry->provider = STATS_PROVIDER_AF_XDP;
+        entry->netdev = g_strdup(s->nc.name);
+        entry->stats = stats_list;
+        QAPI_LIST_PREPEND(*result, entry);
+    }
+}
+
+static StatsSchemaValueList *af_xdp_schema_add(StatsSchemaValueList *list,
+                                               const char *name,
+                                               StatsType type)
+{
+    StatsSchemaValue *value = g_new0(StatsSchemaValue, 1);
+
+    value->name = g_strdup(name);
+    value->type = type;
+    QAPI_LIST_PREPEND(list, value);
+    return list;
+}
+
+static void af_xdp_schemas_cb(StatsSchemaList **result, Error **errp)
+{
+    StatsSchemaValueList *stats_list = NULL;
+
+    /* In the same order as the values of af_xdp_stats_cb() */
+    stats_list = af_xdp_schema_add(stats_list, "fill-ring",
+                                   STATS_TYPE_INSTANT);
+    stats_list = af_xdp_schema_add(stats_list, "fill-ring-empty",
+                                   STATS_TYPE_CUMULATIVE);
+    stats_list = af_xdp_schema_add(stats_list, "completion-ring",
+                                   STATS_TYPE_INSTANT);
+    stats_list = af_xdp_schema_add(stats_list, "completion-ring-full",
+                                   STATS_TYPE_CUMULATIVE);
+    stats_list = af_xdp_schema_add(stats_list, "rx-zero-copy",
+                                   STATS_TYPE_CUMULATIVE);
+
+    add_stats_schema(result, STATS_PROVIDER_AF_XDP, STATS_TARGET_NETDEV,
+                     stats_list);
+}
+
 static int *parse_socket_fds(const char *sock_fds_str,
                              int64_t n_expected, Error **errp)
 {
@@ -434,6 +1411,32 @@ exit:
     return sock_fds;
 }
 
+static IOThread **parse_iothreads(const char *iothreads_str, int *n,
+                                  Error **errp)
+{
+    g_auto(GStrv) ids = g_strsplit(iothreads_str, ":", -1);
+    IOThread **iothreads;
+    int i;
+
+    *n = g_strv_length(ids);
+    if (!*n) {
+        error_setg(errp, "'iothreads' is empty");
+        return NULL;
+    }
+
+    iothreads = g_new(IOThread *, *n);
+    for (i = 0; i < *n; i++) {
+        iothreads[i] = iothread_by_id(ids[i]);
+        if (!iothreads[i]) {
+            error_setg(errp, "iothread '%s' not found", ids[i]);
+            g_free(iothreads);
+            return NULL;
+        }
+    }
+
+    return iothreads;
+}
+
 /*
  * The exported init function.
  *
@@ -442,11 +1445,14 @@ exit:
 int net_init_af_xdp(const Netdev *netdev,
                     const char *name, NetClientState *peer, Error **errp)
 {
+    static bool stats_registered;
     const NetdevAFXDPOptions *opts = &netdev->u.af_xdp;
     NetClientState *nc, *nc0 = NULL;
     unsigned int ifindex;
     uint32_t prog_id = 0;
     g_autofree int *sock_fds = NULL;
+    g_autofree IOThread **iothreads = NULL;
+    int n_iothreads = 0;
     int64_t i, queues;
     Error *err = NULL;
     AFXDPState *s;
@@ -470,6 +1476,12 @@ int net_init_af_xdp(const Netdev *netdev,
         return -1;
     }
 
+    /* The sockets are recreated to take back guest buffers */
+    if (opts->memdev && opts->sock_fds) {
+        error_setg(errp, "'memdev' cannot be used with 'sock-fds'");
+        return -1;
+    }
+
     if (opts->sock_fds) {
         sock_fds = parse_socket_fds(opts->sock_fds, queues, errp);
         if (!sock_fds) {
@@ -477,6 +1489,19 @@ int net_init_af_xdp(const Netdev *netdev,
         }
     }
 
+    if (opts->iothreads) {
+        iothreads = parse_iothreads(opts->iothreads, &n_iothreads, errp);
+        if (!iothreads) {
+            return -1;
+        }
+    }
+
+    if (!stats_registered) {
+        add_stats_callbacks(STATS_PROVIDER_AF_XDP, af_xdp_stats_cb,
+                            af_xdp_schemas_cb);
+        stats_registered = true;
+    }
+
     for (i = 0; i < queues; i++) {
         nc = qemu_new_net_client(&net_af_xdp_info, peer, "af-xdp", name);
         qemu_set_info_str(nc, "af-xdp%"PRIi64" to %s", i, opts->ifname);
@@ -491,9 +1516,25 @@ int net_init_af_xdp(const Netdev *netdev,
         pstrcpy(s->ifname, sizeof(s->ifname), opts->ifname);
         s->ifindex = ifindex;
         s->n_queues = queues;
+        s->inhibit = opts->has_inhibit && opts->inhibit;
+        s->force_copy = opts->has_force_copy && opts->force_copy;
+        s->has_mode = opts->has_mode;
+        s->mode = opts->mode;
+        s->queue_id = i;
+        if (opts->has_start_queue && opts->start_queue > 0) {
+            s->queue_id += opts->start_queue;
+        }
+
+        qemu_mutex_init(&s->lock);
+        s->bh = aio_bh_new(iohandler_get_aio_context(), af_xdp_bh, s);
+        QTAILQ_INSERT_TAIL(&af_xdp_queues, s, next);
+        if (iothreads) {
+            s->iothread = iothreads[i % n_iothreads];
+            object_ref(OBJECT(s->iothread));
+        }
+        af_xdp_buffer_alloc(s);
 
-        if (af_xdp_umem_create(s, sock_fds ? sock_fds[i] : -1, errp)
-            || af_xdp_socket_create(s, opts, errp)) {
+        if (af_xdp_create(s, sock_fds ? sock_fds[i] : -1, errp)) {
             /* Make sure the XDP program will be removed. */
             s->n_queues = i;
             error_propagate(errp, err);
@@ -501,6 +1542,21 @@ int net_init_af_xdp(const Netdev *netdev,
         }
     }
 
+    /* The first queue registers the memory for all of them */
+    if (nc0 && opts->memdev) {
+        s = DO_UPCAST(AFXDPState, nc, nc0);
+        s->memdev = g_strdup(opts->memdev);
+        if (phase_check(PHASE_MACHINE_READY)) {
+            /* Hotplugged, the memory backend must exist already */
+            if (af_xdp_enable_zero_copy(s, errp)) {
+                goto err;
+            }
+        } else {
+            s->machine_done.notify = af_xdp_machine_done;
+            qemu_add_machine_init_done_notifier(&s->machine_done);
+        }
+    }
+
     if (nc0) {
         s = DO_UPCAST(AFXDPState, nc, nc0);
         if (bpf_xdp_query_id(s->ifindex, s->xdp_flags, &prog_id) || !prog_id) {
@@ -511,8 +1567,6 @@ int net_init_af_xdp(const Netdev *netdev,
         }
     }
 
-    af_xdp_read_poll(s, true); /* Initially only poll for reads. */
-
     return 0;
 
 err:
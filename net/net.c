@@ -797,6 +797,18 @@ static ssize_t nc_sendv_compat(NetClientState *nc, const struct iovec *iov,
     return ret;
 }
 
+/*
+ * The reentrancy guard of a NIC is shared by all of its queues, so it is
+ * only used under the BQL.  NIC queues that run in an iothread (see
+ * qemu_set_peer_aio_context()) use a guard of the thread instead.
+ */
+static MemReentrancyGuard *qemu_nic_reentrancy_guard(NetClientState *nc)
+{
+    static __thread MemReentrancyGuard iothread_guard;
+
+    return bql_locked() ? qemu_get_nic(nc)->reentrancy_guard : &iothread_guard;
+}
+
 static ssize_t qemu_deliver_packet_iov(NetClientState *sender,
                                        unsigned flags,
                                        const struct iovec *iov,
@@ -819,10 +831,10 @@ static ssize_t qemu_deliver_packet_iov(NetClientState *sender,
     }
 
     if (nc->info->type != NET_CLIENT_DRIVER_NIC ||
-        qemu_get_nic(nc)->reentrancy_guard->engaged_in_io) {
+        qemu_nic_reentrancy_guard(nc)->engaged_in_io) {
         owned_reentrancy_guard = NULL;
     } else {
-        owned_reentrancy_guard = qemu_get_nic(nc)->reentrancy_guard;
+        owned_reentrancy_guard = qemu_nic_reentrancy_guard(nc);
         owned_reentrancy_guard->engaged_in_io = true;
     }
 
@@ -852,6 +864,127 @@ static ssize_t qemu_deliver_packet_iov(NetClientState *sender,
     return ret;
 }
 
+int qemu_receive_direct(NetClientState *sender, NetReadPacket *read_packet,
+                        uint8_t *buf, int budget, size_t *pending)
+{
+    NetClientState *nc = sender->peer;
+    MemReentrancyGuard *reentrancy_guard;
+    int ret;
+
+    *pending = 0;
+
+    if (!nc || !nc->info->receive_direct ||
+        sender->link_down || nc->link_down) {
+        return -ENOTSUP;
+    }
+
+    /* Filters see every packet, and queued packets go first */
+    if (!QTAILQ_EMPTY(&sender->filters) || !QTAILQ_EMPTY(&nc->filters) ||
+        !qemu_net_queue_empty(nc->incoming_queue) ||
+        !qemu_can_send_packet(sender)) {
+        return -ENOTSUP;
+    }
+
+    reentrancy_guard = qemu_nic_reentrancy_guard(nc);
+    if (reentrancy_guard->engaged_in_io) {
+        return -ENOTSUP;
+    }
+
+    reentrancy_guard->engaged_in_io = true;
+    ret = nc->info->receive_direct(nc, sender, read_packet, buf, budget,
+                                   pending);
+    reentrancy_guard->engaged_in_io = false;
+
+    return ret;
+}
+
+int qemu_post_rx_buffers(NetClientState *sender, NetRxBuffer *bufs, int num,
+                         size_t headroom, size_t size, int reserve,
+                         const void *base, size_t len)
+{
+    NetClientState *nc = sender->peer;
+    MemReentrancyGuard *reentrancy_guard;
+    int ret;
+
+    if (!nc || !nc->info->post_rx_buffers ||
+        sender->link_down || nc->link_down) {
+        return -ENOTSUP;
+    }
+
+    /* As for qemu_receive_direct(), the packets skip the queue */
+    if (!QTAILQ_EMPTY(&sender->filters) || !QTAILQ_EMPTY(&nc->filters) ||
+        !qemu_net_queue_empty(nc->incoming_queue) ||
+        !qemu_can_send_packet(sender)) {
+        return -ENOTSUP;
+    }
+
+    reentrancy_guard = qemu_nic_reentrancy_guard(nc);
+    if (reentrancy_guard->engaged_in_io) {
+        return -ENOTSUP;
+    }
+
+    reentrancy_guard->engaged_in_io = true;
+    ret = nc->info->post_rx_buffers(nc, bufs, num, headroom, size, reserve,
+                                    base, len);
+    reentrancy_guard->engaged_in_io = false;
+
+    return ret;
+}
+
+int qemu_fill_rx_buffers(NetClientState *sender, NetRxBuffer *bufs,
+                         const size_t *lens, int num)
+{
+    NetClientState *nc = sender->peer;
+    MemReentrancyGuard *reentrancy_guard;
+    bool engaged;
+    int ret;
+
+    /* Only a NIC lends buffers, and it gets them back before it goes */
+    assert(nc && nc->info->fill_rx_buffers);
+
+    /*
+     * The NIC may be asking for its buffers back from its own I/O
+     * callbacks, see qemu_release_rx_buffers().
+     */
+    reentrancy_guard = qemu_nic_reentrancy_guard(nc);
+    engaged = reentrancy_guard->engaged_in_io;
+    reentrancy_guard->engaged_in_io = true;
+    ret = nc->info->fill_rx_buffers(nc, bufs, lens, num);
+    reentrancy_guard->engaged_in_io = engaged;
+
+    return ret;
+}
+
+void qemu_release_rx_buffers(NetClientState *nc)
+{
+    NetClientState *peer = nc->peer;
+
+    if (peer && peer->info->release_rx_buffers) {
+        peer->info->release_rx_buffers(peer);
+    }
+}
+
+bool qemu_can_set_peer_aio_context(NetClientState *nc)
+{
+    NetClientState *peer = nc->peer;
+
+    /* Filters run in the main loop */
+    return peer && peer->info->set_aio_context &&
+           QTAILQ_EMPTY(&nc->filters) && QTAILQ_EMPTY(&peer->filters);
+}
+
+void qemu_set_peer_aio_context(NetClientState *nc, AioContext *ctx)
+{
+    NetClientState *peer = nc->peer;
+
+    assert(bql_locked());
+    assert(!ctx || qemu_can_set_peer_aio_context(nc));
+
+    if (peer && peer->info->set_aio_context) {
+        peer->info->set_aio_context(peer, ctx);
+    }
+}
+
 ssize_t qemu_sendv_packet_async(NetClientState *sender,
                                 const struct iovec *iov, int iovcnt,
                                 NetPacketSent *sent_cb)
@@ -259,6 +259,12 @@ void qemu_net_queue_purge(NetQueue *queue, NetClientState *from)
     }
 }
 
+/* Returns true if there are no packets queued or being delivered */
+bool qemu_net_queue_empty(NetQueue *queue)
+{
+    return !queue->delivering && QTAILQ_EMPTY(&queue->packets);
+}
+
 bool qemu_net_queue_flush(NetQueue *queue)
 {
     if (queue->delivering)
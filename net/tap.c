@@ -38,6 +38,7 @@
 #include "monitor/monitor.h"
 #include "system/system.h"
 #include "qapi/error.h"
+#include "block/aio-wait.h"
 #include "qemu/cutils.h"
 #include "qemu/error-report.h"
 #include "qemu/main-loop.h"
@@ -62,6 +63,8 @@ typedef struct TAPState {
     VHostNetState *vhost_net;
     unsigned host_vnet_hdr_len;
     Notifier exit;
+    /* where the fd handlers run, NULL for the main loop */
+    AioContext *ctx;
 } TAPState;
 
 static void launch_script(const char *setup_script, const char *ifname,
@@ -72,10 +75,14 @@ static void tap_writable(void *opaque);
 
 static void tap_update_fd_handler(TAPState *s)
 {
-    qemu_set_fd_handler(s->fd,
-                        s->read_poll && s->enabled ? tap_send : NULL,
-                        s->write_poll && s->enabled ? tap_writable : NULL,
-                        s);
+    IOHandler *read = s->read_poll && s->enabled ? tap_send : NULL;
+    IOHandler *write = s->write_poll && s->enabled ? tap_writable : NULL;
+
+    if (s->ctx) {
+        aio_set_fd_handler(s->ctx, s->fd, read, write, NULL, NULL, s);
+    } else {
+        qemu_set_fd_handler(s->fd, read, write, s);
+    }
 }
 
 static void tap_read_poll(TAPState *s, bool enable)
@@ -156,12 +163,68 @@ static void tap_send_completed(NetClientState *nc, ssize_t len)
     tap_read_poll(s, true);
 }
 
+#ifndef __sun__
+/*
+ * Without a copy per packet, more packets can be processed per tap_send()
+ * callback for the same time spent holding the BQL.
+ */
+#define TAP_DIRECT_BUDGET 256
+
+static ssize_t tap_read_packet_iov(NetClientState *nc,
+                                   const struct iovec *iov, int iovcnt)
+{
+    TAPState *s = DO_UPCAST(TAPState, nc, nc);
+    ssize_t len;
+
+    len = RETRY_ON_EINTR(readv(s->fd, iov, iovcnt));
+    return len < 0 ? -errno : len;
+}
+
+/*
+ * Read packets straight into the receive buffers of the peer, if it
+ * supports it.  Returns false if they must be read into s->buf instead.
+ */
+static bool tap_send_direct(TAPState *s)
+{
+    size_t pending;
+    int ret;
+
+    /* The peer gets the header as it comes from the tap device */
+    if ((s->host_vnet_hdr_len && !s->using_vnet_hdr) ||
+        net_peer_needs_padding(&s->nc)) {
+        return false;
+    }
+
+    ret = qemu_receive_direct(&s->nc, tap_read_packet_iov, s->buf,
+                              TAP_DIRECT_BUDGET, &pending);
+    if (ret < 0) {
+        return false;
+    }
+
+    if (pending &&
+        qemu_send_packet_async(&s->nc, s->buf, pending,
+                               tap_send_completed) == 0) {
+        tap_read_poll(s, false);
+    }
+    return true;
+}
+#else
+static bool tap_send_direct(TAPState *s)
+{
+    return false;
+}
+#endif
+
 static void tap_send(void *opaque)
 {
     TAPState *s = opaque;
     int size;
     int packets = 0;
 
+    if (tap_send_direct(s)) {
+        return;
+    }
+
     while (true) {
         uint8_t *buf = s->buf;
         uint8_t min_pkt[ETH_ZLEN];
@@ -286,10 +349,37 @@ static void tap_exit_notify(Notifier *notifier, void *data)
     }
 }
 
+static void tap_ctx_sync_bh(void *opaque)
+{
+}
+
+static void tap_set_aio_context(NetClientState *nc, AioContext *ctx)
+{
+    TAPState *s = DO_UPCAST(TAPState, nc, nc);
+    AioContext *old_ctx = s->ctx;
+
+    if (old_ctx == ctx) {
+        return;
+    }
+
+    if (old_ctx) {
+        aio_set_fd_handler(old_ctx, s->fd, NULL, NULL, NULL, NULL, NULL);
+        /* Wait for tap_send() and tap_writable() to return */
+        aio_wait_bh_oneshot(old_ctx, tap_ctx_sync_bh, NULL);
+    } else {
+        qemu_set_fd_handler(s->fd, NULL, NULL, NULL);
+    }
+
+    s->ctx = ctx;
+    tap_update_fd_handler(s);
+}
+
 static void tap_cleanup(NetClientState *nc)
 {
     TAPState *s = DO_UPCAST(TAPState, nc, nc);
 
+    tap_set_aio_context(nc, NULL);
+
     if (s->vhost_net) {
         vhost_net_cleanup(s->vhost_net);
         g_free(s->vhost_net);
@@ -347,6 +437,7 @@ static NetClientInfo net_tap_info = {
     .set_vnet_le = tap_set_vnet_le,
     .set_vnet_be = tap_set_vnet_be,
     .set_steering_ebpf = tap_set_steering_ebpf,
+    .set_aio_context = tap_set_aio_context,
 };
 
 static TAPState *net_tap_fd_init(NetClientState *peer,
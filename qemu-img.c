@@ -53,6 +53,7 @@
 #include "crypto/init.h"
 #include "trace/control.h"
 #include "qemu/throttle.h"
+#include "qemu/timer.h"
 #include "block/throttle-groups.h"
 
 #define QEMU_IMG_VERSION "qemu-img version " QEMU_FULL_VERSION \
@@ -86,6 +87,7 @@ enum {
     OPTION_BITMAPS = 275,
     OPTION_FORCE = 276,
     OPTION_SKIP_BROKEN = 277,
+    OPTION_STATS = 278,
 };
 
 typedef enum OutputFormat {
@@ -207,6 +209,8 @@ void help(void)
            "  '-m' specifies how many coroutines work in parallel during the convert\n"
            "       process (defaults to 8)\n"
            "  '-W' allow to write to the target out of order rather than sequential\n"
+           "  '--stats' prints the throughput of the read and write stages once the\n"
+           "       conversion has completed\n"
            "\n"
            "Parameters to snapshot subcommand:\n"
            "  'snapshot' is the name of the snapshot to create, apply or delete\n"
@@ -1667,6 +1671,28 @@ enum ImgConvertBlockStatus {
 #define MAX_COROUTINES 16
 #define CONVERT_THROTTLE_GROUP "img_convert"
 
+enum ImgConvertStage {
+    CONVERT_STAGE_READ,
+    CONVERT_STAGE_WRITE,
+    CONVERT_STAGE_ZERO,
+    CONVERT_STAGE_COPY_RANGE,
+    CONVERT_STAGE__MAX,
+};
+
+static const char *const img_convert_stage_names[CONVERT_STAGE__MAX] = {
+    [CONVERT_STAGE_READ] = "read",
+    [CONVERT_STAGE_WRITE] = "write",
+    [CONVERT_STAGE_ZERO] = "zero",
+    [CONVERT_STAGE_COPY_RANGE] = "copy offload",
+};
+
+typedef struct ImgConvertStageStats {
+    uint64_t bytes;
+    uint64_t requests;
+    /* Sum of the request latencies; exceeds wall time with -m > 1 */
+    int64_t busy_ns;
+} ImgConvertStageStats;
+
 typedef struct ImgConvertState {
     BlockBackend **src;
     int64_t *src_sectors;
@@ -1689,6 +1715,7 @@ typedef struct ImgConvertState {
     bool copy_range;
     bool salvage;
     bool quiet;
+    bool multi_cluster_compressed;
     int min_sparse;
     int alignment;
     size_t cluster_sectors;
@@ -1699,8 +1726,40 @@ typedef struct ImgConvertState {
     int64_t wait_sector_num[MAX_COROUTINES];
     CoMutex lock;
     int ret;
+    ImgConvertStageStats stats[CONVERT_STAGE__MAX];
 } ImgConvertState;
 
+static void convert_account(ImgConvertState *s, enum ImgConvertStage stage,
+                            int nb_sectors, int64_t start_ns)
+{
+    ImgConvertStageStats *st = &s->stats[stage];
+
+    st->bytes += (uint64_t)nb_sectors << BDRV_SECTOR_BITS;
+    st->requests++;
+    st->busy_ns += get_clock() - start_ns;
+}
+
+static void convert_print_stats(ImgConvertState *s, int64_t elapsed_ns)
+{
+    double elapsed = MAX(elapsed_ns, 1) / (double)NANOSECONDS_PER_SECOND;
+    int i;
+
+    printf("Conversion completed in %3.3f seconds.\n", elapsed);
+    for (i = 0; i < CONVERT_STAGE__MAX; i++) {
+        ImgConvertStageStats *st = &s->stats[i];
+        g_autofree char *bytes = NULL, *rate = NULL;
+
+        if (!st->requests) {
+            continue;
+        }
+        bytes = size_to_str(st->bytes);
+        rate = size_to_str(st->bytes / elapsed);
+        printf("%-12s %s in %" PRIu64 " requests, %3.3f seconds busy, "
+               "%s/s\n", img_convert_stage_names[i], bytes, st->requests,
+               st->busy_ns / (double)NANOSECONDS_PER_SECOND, rate);
+    }
+}
+
 static void convert_select_part(ImgConvertState *s, int64_t sector_num,
                                 int *src_cur, int64_t *src_cur_offset)
 {
@@ -1830,7 +1889,7 @@ static int coroutine_fn convert_co_read(ImgConvertState *s, int64_t sector_num,
     while (nb_sectors > 0) {
         BlockBackend *blk;
         int src_cur;
-        int64_t bs_sectors, src_cur_offset;
+        int64_t bs_sectors, src_cur_offset, start_ns;
         uint64_t offset;
 
         /* In the case of compression with multiple source files, we can get a
@@ -1847,6 +1906,7 @@ static int coroutine_fn convert_co_read(ImgConvertState *s, int64_t sector_num,
             n = 1;
         }
 
+        start_ns = get_clock();
         ret = blk_co_pread(blk, offset, n << BDRV_SECTOR_BITS, buf, 0);
         if (ret < 0) {
             if (s->salvage) {
@@ -1863,6 +1923,8 @@ static int coroutine_fn convert_co_read(ImgConvertState *s, int64_t sector_num,
             } else {
                 return ret;
             }
+        } else {
+            convert_account(s, CONVERT_STAGE_READ, n, start_ns);
         }
 
         sector_num += n;
@@ -1874,6 +1936,32 @@ static int coroutine_fn convert_co_read(ImgConvertState *s, int64_t sector_num,
 }
 
 
+/*
+ * Compressed clusters need to be written as a whole, so only complete clusters
+ * can be skipped if they are zero.  Returns true if the first cluster of @buf
+ * contains data, and sets *pnum to the number of sectors in the run of
+ * clusters that are in the same state.
+ */
+static bool is_allocated_clusters(ImgConvertState *s, const uint8_t *buf,
+                                  int n, int *pnum)
+{
+    int i = MIN(n, s->cluster_sectors);
+    bool allocated = !buffer_is_zero(buf, i * BDRV_SECTOR_SIZE);
+
+    while (i < n) {
+        int len = MIN(n - i, s->cluster_sectors);
+
+        if (buffer_is_zero(buf + i * BDRV_SECTOR_SIZE,
+                           len * BDRV_SECTOR_SIZE) == allocated) {
+            break;
+        }
+        i += len;
+    }
+
+    *pnum = i;
+    return allocated;
+}
+
 static int coroutine_fn convert_co_write(ImgConvertState *s, int64_t sector_num,
                                          int nb_sectors, uint8_t *buf,
                                          enum ImgConvertBlockStatus status)
@@ -1882,6 +1970,7 @@ static int coroutine_fn convert_co_write(ImgConvertState *s, int64_t sector_num,
 
     while (nb_sectors > 0) {
         int n = nb_sectors;
+        int64_t start_ns = get_clock();
         BdrvRequestFlags flags = s->compressed ? BDRV_REQ_WRITE_COMPRESSED : 0;
 
         switch (status) {
@@ -1897,20 +1986,20 @@ static int coroutine_fn convert_co_write(ImgConvertState *s, int64_t sector_num,
              * is real non-zero data, we must write it. Otherwise we can treat
              * it as zero sectors.
              * Compressed clusters need to be written as a whole, so in that
-             * case we can only save the write if the buffer is completely
-             * zeroed. */
+             * case we can only save the write for completely zeroed
+             * clusters. */
             if (!s->min_sparse ||
                 (!s->compressed &&
                  is_allocated_sectors_min(buf, n, &n, s->min_sparse,
                                           sector_num, s->alignment)) ||
-                (s->compressed &&
-                 !buffer_is_zero(buf, n * BDRV_SECTOR_SIZE)))
+                (s->compressed && is_allocated_clusters(s, buf, n, &n)))
             {
                 ret = blk_co_pwrite(s->target, sector_num << BDRV_SECTOR_BITS,
                                     n << BDRV_SECTOR_BITS, buf, flags);
                 if (ret < 0) {
                     return ret;
                 }
+                convert_account(s, CONVERT_STAGE_WRITE, n, start_ns);
                 break;
             }
             /* fall-through */
@@ -1927,6 +2016,7 @@ static int coroutine_fn convert_co_write(ImgConvertState *s, int64_t sector_num,
             if (ret < 0) {
                 return ret;
             }
+            convert_account(s, CONVERT_STAGE_ZERO, n, start_ns);
             break;
         }
 
@@ -1946,7 +2036,7 @@ static int coroutine_fn convert_co_copy_range(ImgConvertState *s, int64_t sector
     while (nb_sectors > 0) {
         BlockBackend *blk;
         int src_cur;
-        int64_t bs_sectors, src_cur_offset;
+        int64_t bs_sectors, src_cur_offset, start_ns;
         int64_t offset;
 
         convert_select_part(s, sector_num, &src_cur, &src_cur_offset);
@@ -1956,12 +2046,14 @@ static int coroutine_fn convert_co_copy_range(ImgConvertState *s, int64_t sector
 
         n = MIN(nb_sectors, bs_sectors - (sector_num - src_cur_offset));
 
+        start_ns = get_clock();
         ret = blk_co_copy_range(blk, offset, s->target,
                                 sector_num << BDRV_SECTOR_BITS,
                                 n << BDRV_SECTOR_BITS, 0, 0);
         if (ret < 0) {
             return ret;
         }
+        convert_account(s, CONVERT_STAGE_COPY_RANGE, n, start_ns);
 
         sector_num += n;
         nb_sectors -= n;
@@ -2105,14 +2197,22 @@ static int convert_do_copy(ImgConvertState *s)
         bdrv_graph_rdunlock_main_loop();
     }
 
-    /* Allocate buffer for copied data. For compressed images, only one cluster
-     * can be copied at a time. */
+    /*
+     * Allocate buffer for copied data. For compressed images, only one cluster
+     * can be copied at a time, unless the target compresses the clusters of a
+     * larger write in parallel.
+     */
     if (s->compressed) {
         if (s->cluster_sectors <= 0 || s->cluster_sectors > s->buf_sectors) {
             error_report("invalid cluster size");
             return -EINVAL;
         }
-        s->buf_sectors = s->cluster_sectors;
+        if (s->multi_cluster_compressed) {
+            s->buf_sectors = QEMU_ALIGN_DOWN(s->buf_sectors,
+                                             s->cluster_sectors);
+        } else {
+            s->buf_sectors = s->cluster_sectors;
+        }
     }
 
     while (sector_num < s->total_sectors) {
@@ -2200,7 +2300,7 @@ static int convert_copy_bitmaps(BlockDriverState *src, BlockDriverState *dst,
                                    true, bdrv_dirty_bitmap_granularity(bm),
                                    true, true,
                                    true, !bdrv_dirty_bitmap_enabled(bm),
-                                   &err);
+                                   false, false, &err);
         if (err) {
             error_reportf_err(err, "Failed to create bitmap %s: ", name);
             return -1;
@@ -2253,7 +2353,8 @@ static int img_convert(int argc, char **argv)
     bool explict_min_sparse = false;
     bool bitmaps = false;
     bool skip_broken = false;
-    int64_t rate_limit = 0;
+    bool stats = false;
+    int64_t rate_limit = 0, start_ns, elapsed_ns = -1;
 
     ImgConvertState s = (ImgConvertState) {
         /* Need at least 4k of zeros for sparse detection */
@@ -2275,6 +2376,7 @@ static int img_convert(int argc, char **argv)
             {"target-is-zero", no_argument, 0, OPTION_TARGET_IS_ZERO},
             {"bitmaps", no_argument, 0, OPTION_BITMAPS},
             {"skip-broken-bitmaps", no_argument, 0, OPTION_SKIP_BROKEN},
+            {"stats", no_argument, 0, OPTION_STATS},
             {0, 0, 0, 0}
         };
         c = getopt_long(argc, argv, ":hf:O:B:CcF:o:l:S:pt:T:qnm:WUr:",
@@ -2409,6 +2511,9 @@ static int img_convert(int argc, char **argv)
         case OPTION_SKIP_BROKEN:
             skip_broken = true;
             break;
+        case OPTION_STATS:
+            stats = true;
+            break;
         }
     }
 
@@ -2776,6 +2881,7 @@ static int img_convert(int argc, char **argv)
         }
     } else {
         s.compressed = s.compressed || bdi.needs_compressed_writes;
+        s.multi_cluster_compressed = bdi.multi_cluster_compressed_writes;
         s.cluster_sectors = bdi.cluster_size / BDRV_SECTOR_SIZE;
     }
 
@@ -2783,7 +2889,9 @@ static int img_convert(int argc, char **argv)
         set_rate_limit(s.target, rate_limit);
     }
 
+    start_ns = get_clock();
     ret = convert_do_copy(&s);
+    elapsed_ns = get_clock() - start_ns;
 
     /* Now copy the bitmaps */
     if (bitmaps && ret == 0) {
@@ -2795,6 +2903,9 @@ out:
         qemu_progress_print(100, 0);
     }
     qemu_progress_end();
+    if (stats && !ret && elapsed_ns >= 0 && !s.quiet) {
+        convert_print_stats(&s, elapsed_ns);
+    }
     qemu_opts_del(opts);
     qemu_opts_free(create_opts);
     qobject_unref(open_opts);
@@ -4938,7 +5049,7 @@ static int img_bitmap(int argc, char **argv)
         case BITMAP_ADD:
             qmp_block_dirty_bitmap_add(bs->node_name, bitmap,
                                        !!granularity, granularity, true, true,
-                                       false, false, &err);
+                                       false, false, false, false, &err);
             op = "add";
             break;
         case BITMAP_REMOVE:
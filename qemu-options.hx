@@ -222,13 +222,17 @@ ERST
 DEF("accel", HAS_ARG, QEMU_OPTION_accel,
     "-accel [accel=]accelerator[,prop[=value][,...]]\n"
     "                select accelerator (kvm, xen, hvf, nvmm, whpx or tcg; use 'help' for a list)\n"
+    "                cross-page-chaining=on|off (chain TCG translation blocks across guest pages, default=off)\n"
+    "                dirty-log-size=n (pages each TCG vCPU logs as dirty between dirty log syncs, default=0)\n"
     "                igd-passthru=on|off (enable Xen integrated Intel graphics passthrough, default=off)\n"
     "                kernel-irqchip=on|off|split controls accelerated irqchip support (default=on)\n"
     "                kvm-shadow-mem=size of KVM shadow MMU in bytes\n"
     "                one-insn-per-tb=on|off (one guest instruction per TCG translation block)\n"
     "                split-wx=on|off (enable TCG split w^x mapping)\n"
+    "                superblock-threshold=n (retranslate TCG translation blocks run n times as superblocks, default=0)\n"
     "                tb-size=n (TCG translation block cache size)\n"
     "                dirty-ring-size=n (KVM dirty ring GFN count, default 0)\n"
+    "                dirty-ring-harvest-threads=n (threads harvesting the KVM dirty rings, default 1)\n"
     "                eager-split-size=n (KVM Eager Page Split chunk size, default 0, disabled. ARM only)\n"
     "                notify-vmexit=run|internal-error|disable,notify-window=n (enable notify VM exit and set notify window, x86 only)\n"
     "                thread=single|multi (enable multi-threaded TCG)\n"
@@ -241,6 +245,24 @@ SRST
     specified, the next one is used if the previous one fails to
     initialize.
 
+    ``cross-page-chaining=on|off``
+        Lets the TCG accelerator link a translation block with a direct
+        jump to a translation block on the next guest page, instead of
+        looking up the destination every time the jump is executed.  In
+        system emulation, the block that contains the jump is looked up
+        again if the mapping of either page changes.  This speeds up
+        guests with dense code, such as kernels, but makes more blocks
+        span two pages (default=off).
+
+    ``dirty-log-size=n``
+        While migration or dirty rate measurement tracks dirty memory,
+        makes each TCG vCPU record up to ``n`` pages that it writes for
+        the first time in a private log, instead of updating the dirty
+        memory bitmap on each of those writes.  The logs are merged into
+        the bitmap whenever the dirty log is synced.  When a log is full,
+        further writes update the bitmap directly.  ``n`` can be at
+        most 65536 (default=0, disabled).
+
     ``igd-passthru=on|off``
         When Xen is in use, this option controls whether Intel
         integrated graphics devices can be passed through to the guest
@@ -268,6 +290,17 @@ SRST
         such a case this will default on. On other operating systems, this
         will default off, but one may enable this for testing or debugging.
 
+    ``superblock-threshold=n``
+        Makes the TCG accelerator count how many times each translation
+        block is entered, and translate again the blocks that reach
+        ``n`` as superblocks: the translation follows direct branches
+        within the page and leaves the block through side exits, so
+        that hot loops run as a single block that the TCG optimizer
+        sees as a whole.  Counting delays the chaining of blocks until
+        they reach the threshold.  Only AArch64 guests form superblocks
+        so far, and neither icount nor TCG plugins use them (default=0,
+        disabled).
+
     ``tb-size=n``
         Controls the size (in MiB) of the TCG translation block cache.
 
@@ -289,6 +322,15 @@ SRST
         is disabled (dirty-ring-size=0).  When enabled, KVM will instead
         record dirty pages in a bitmap.
 
+    ``dirty-ring-harvest-threads=n``
+        When the KVM dirty ring is enabled, it controls how many threads
+        collect the dirty pages from the per-vCPU rings.  With more than
+        one thread, the vCPUs are split in groups that are harvested in
+        parallel, which helps keeping up with the dirty rate of guests
+        with many vCPUs during live migration.  The default is 1, the
+        maximum is 64.  The harvest statistics and the number of exits
+        due to a full dirty ring are reported by ``query-stats``.
+
     ``eager-split-size=n``
         KVM implements dirty page logging at the PAGE_SIZE granularity and
         enabling dirty-logging on a huge-page requires breaking it into
@@ -2909,6 +2951,7 @@ DEF("netdev", HAS_ARG, QEMU_OPTION_netdev,
 #ifdef CONFIG_AF_XDP
     "-netdev af-xdp,id=str,ifname=name[,mode=native|skb][,force-copy=on|off]\n"
     "         [,queues=n][,start-queue=m][,inhibit=on|off][,sock-fds=x:y:...:z]\n"
+    "         [,iothreads=x:y:...:z][,memdev=id]\n"
     "                attach to the existing network interface 'name' with AF_XDP socket\n"
     "                use 'mode=MODE' to specify an XDP program attach mode\n"
     "                use 'force-copy=on|off' to force XDP copy mode even if device supports zero-copy (default: off)\n"
@@ -2918,6 +2961,8 @@ DEF("netdev", HAS_ARG, QEMU_OPTION_netdev,
     "                  added to a socket map in XDP program.  One socket per queue.\n"
     "                use 'queues=n' to specify how many queues of a multiqueue interface should be used\n"
     "                use 'start-queue=m' to specify the first queue that should be used\n"
+    "                use 'iothreads' to run the queues in iothreads, round robin\n"
+    "                use 'memdev=id' to receive packets directly into guest memory 'id'\n"
 #endif
 #ifdef CONFIG_POSIX
     "-netdev vhost-user,id=str,chardev=dev[,vhostforce=on|off]\n"
@@ -3610,7 +3655,7 @@ SRST
         # launch QEMU instance
         |qemu_system| linux.img -nic vde,sock=/tmp/myswitch
 
-``-netdev af-xdp,id=str,ifname=name[,mode=native|skb][,force-copy=on|off][,queues=n][,start-queue=m][,inhibit=on|off][,sock-fds=x:y:...:z]``
+``-netdev af-xdp,id=str,ifname=name[,mode=native|skb][,force-copy=on|off][,queues=n][,start-queue=m][,inhibit=on|off][,sock-fds=x:y:...:z][,iothreads=x:y:...:z][,memdev=id]``
     Configure AF_XDP backend to connect to a network interface 'name'
     using AF_XDP socket.  A specific program attach mode for a default
     XDP program can be forced with 'mode', defaults to best-effort,
@@ -3659,6 +3704,39 @@ SRST
         |qemu_system| linux.img -device virtio-net-pci,netdev=n1 \\
             -netdev af-xdp,id=n1,ifname=eth0,queues=3,inhibit=on,sock-fds=15:16:17
 
+    The rings of the queues can be serviced in iothreads instead of the
+    main loop, with 'iothreads' set to a list of iothread IDs.  Queue i
+    uses iothread i modulo the number of iothreads.  Packets are still
+    handed to the guest network card in the main loop.
+
+    With 'memdev', the memory backend that holds the guest RAM is
+    registered with the queues, and packets are received directly into
+    the receive buffers of the guest network card, without a copy.  This
+    requires a virtio-net device, a shared file or memfd memory backend,
+    and receive buffers with room for a frame of the MTU of the
+    interface, plus a VLAN tag, in one piece.  The mergeable and the
+    small receive buffers of Linux guests have room for 1518 bytes,
+    enough for an MTU of 1500; packets are copied as usual otherwise.
+    The MTU must not grow while the guest is running.  The kernel
+    leaves the 256 bytes in front of each buffer alone, so the XDP
+    program must not add metadata or move the start of the packet.
+    The backend is pinned once for all the queues, so the locked memory
+    limit must allow for it, and native zero-copy drivers work best with
+    a hugepage backend.  'memdev' cannot be used with 'sock-fds'.
+
+    .. parsed-literal::
+
+        |qemu_system| linux.img \\
+            -object memory-backend-memfd,id=mem,size=4G,share=on \\
+            -machine memory-backend=mem \\
+            -object iothread,id=io0 -object iothread,id=io1 \\
+            -device virtio-net-pci,netdev=n1,mq=on \\
+            -netdev af-xdp,id=n1,ifname=eth0,queues=2,iothreads=io0:io1,memdev=mem
+
+    The occupancy of the fill and completion rings of each queue, and the
+    number of packets received without a copy, are available with
+    ``query-stats`` for the ``netdev`` target and ``af-xdp`` provider.
+
 ``-netdev vhost-user,chardev=id[,vhostforce=on|off][,queues=n]``
     Establish a vhost-user netdev, backed by a chardev id. The chardev
     should be a unix domain socket backed one. The vhost-user uses a
@@ -38,6 +38,8 @@ void address_space_dispatch_free(AddressSpaceDispatch *d);
 void mtree_print_dispatch(struct AddressSpaceDispatch *d,
                           MemoryRegion *root);
 
+void iommu_translation_caches_flush(void);
+
 /* returns true if end is big endian. */
 static inline bool devend_big_endian(enum device_endian end)
 {
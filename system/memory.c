@@ -22,6 +22,7 @@
 #include "qemu/error-report.h"
 #include "qemu/main-loop.h"
 #include "qemu/qemu-print.h"
+#include "qemu/timer.h"
 #include "qom/object.h"
 #include "trace.h"
 #include "system/ram_addr.h"
@@ -40,6 +41,15 @@
 static unsigned memory_region_transaction_depth;
 static bool memory_region_update_pending;
 static bool ioeventfd_update_pending;
+/*
+ * Parts of the memory map that changed in the current transaction: maps a
+ * MemoryRegion to the AddrRange, relative to the start of the region, that
+ * covers the changes made to it or to its subregions list.  Only the FlatView
+ * ranges that these parts map to are rendered again on commit, unless
+ * memory_region_update_all is set.
+ */
+static GHashTable *memory_region_updates;
+static bool memory_region_update_all;
 unsigned int global_dirty_tracking;
 
 static QTAILQ_HEAD(, MemoryListener) memory_listeners
@@ -740,10 +750,28 @@ static MemoryRegion *memory_region_get_flatview_root(MemoryRegion *mr)
     return NULL;
 }
 
-/* Render a memory topology into a list of disjoint absolute ranges. */
-static FlatView *generate_memory_topology(MemoryRegion *mr)
+static struct {
+    unsigned reused;
+    unsigned updated;
+    unsigned rendered;
+} flatviews_stats;
+
+static void flatview_init_dispatch(FlatView *view)
 {
     int i;
+
+    view->dispatch = address_space_dispatch_new(view);
+    for (i = 0; i < view->nr; i++) {
+        MemoryRegionSection mrs =
+            section_from_flat_range(&view->ranges[i], view);
+        flatview_add_to_dispatch(view, &mrs);
+    }
+    address_space_dispatch_compact(view->dispatch);
+}
+
+/* Render a memory topology into a list of disjoint absolute ranges. */
+static FlatView *flatview_render(MemoryRegion *mr)
+{
     FlatView *view;
 
     view = flatview_new(mr);
@@ -754,19 +782,260 @@ static FlatView *generate_memory_topology(MemoryRegion *mr)
                              false, false, false);
     }
     flatview_simplify(view);
+    return view;
+}
 
-    view->dispatch = address_space_dispatch_new(view);
-    for (i = 0; i < view->nr; i++) {
-        MemoryRegionSection mrs =
-            section_from_flat_range(&view->ranges[i], view);
-        flatview_add_to_dispatch(view, &mrs);
-    }
-    address_space_dispatch_compact(view->dispatch);
+static FlatView *generate_memory_topology(MemoryRegion *mr)
+{
+    FlatView *view;
+
+    view = flatview_render(mr);
+    flatview_init_dispatch(view);
     g_hash_table_replace(flat_views, mr, view);
+    flatviews_stats.rendered++;
 
     return view;
 }
 
+/*
+ * Record that the range [@start, @start + @size) of @mr, relative to the
+ * start of @mr, must be rendered again on the next transaction commit.
+ */
+static void memory_region_update_range(MemoryRegion *mr, Int128 start,
+                                       Int128 size)
+{
+    AddrRange *range;
+    Int128 end;
+
+    memory_region_update_pending = true;
+    if (memory_region_update_all) {
+        return;
+    }
+
+    if (!memory_region_updates) {
+        memory_region_updates = g_hash_table_new_full(g_direct_hash,
+                                                      g_direct_equal,
+                                                      NULL, g_free);
+    }
+
+    range = g_hash_table_lookup(memory_region_updates, mr);
+    if (!range) {
+        range = g_new(AddrRange, 1);
+        *range = addrrange_make(start, size);
+        g_hash_table_insert(memory_region_updates, mr, range);
+        return;
+    }
+
+    end = int128_max(addrrange_end(*range), int128_add(start, size));
+    range->start = int128_min(range->start, start);
+    range->size = int128_sub(end, range->start);
+}
+
+/*
+ * Record that the whole of @mr must be rendered again.  @mr is seen at the
+ * same offset through all the aliases to it, but it may move within its
+ * container before commit: record the range in the container too.
+ */
+static void memory_region_update(MemoryRegion *mr)
+{
+    memory_region_update_range(mr, int128_zero(), mr->size);
+    if (mr->container) {
+        memory_region_update_range(mr->container, int128_make64(mr->addr),
+                                   mr->size);
+    }
+}
+
+/*
+ * Collect the absolute ranges that the recorded updates map to in the
+ * FlatView rendered from @mr.  This walks the tree like
+ * render_memory_region(), but without building any range.
+ */
+static void flatview_collect_updates(GArray *updates, MemoryRegion *mr,
+                                     Int128 base, AddrRange clip)
+{
+    MemoryRegion *subregion;
+    AddrRange *range;
+    AddrRange tmp;
+
+    int128_addto(&base, int128_make64(mr->addr));
+
+    /* Before the checks below: @mr may have been disabled or shrunk */
+    range = g_hash_table_lookup(memory_region_updates, mr);
+    if (range) {
+        tmp = addrrange_shift(*range, base);
+        if (addrrange_intersects(tmp, clip)) {
+            tmp = addrrange_intersection(tmp, clip);
+            g_array_append_val(updates, tmp);
+        }
+    }
+
+    if (!mr->enabled) {
+        return;
+    }
+
+    tmp = addrrange_make(base, mr->size);
+    if (!addrrange_intersects(tmp, clip)) {
+        return;
+    }
+    clip = addrrange_intersection(tmp, clip);
+
+    if (mr->alias) {
+        int128_subfrom(&base, int128_make64(mr->alias->addr));
+        int128_subfrom(&base, int128_make64(mr->alias_offset));
+        flatview_collect_updates(updates, mr->alias, base, clip);
+        return;
+    }
+
+    QTAILQ_FOREACH(subregion, &mr->subregions, subregions_link) {
+        flatview_collect_updates(updates, subregion, base, clip);
+    }
+}
+
+static gint addrrange_compare(gconstpointer a, gconstpointer b)
+{
+    const AddrRange *r1 = a, *r2 = b;
+
+    if (int128_eq(r1->start, r2->start)) {
+        return 0;
+    }
+    return int128_lt(r1->start, r2->start) ? -1 : 1;
+}
+
+/* Sort @updates and merge the ranges that overlap or touch. */
+static void flatview_merge_updates(GArray *updates)
+{
+    AddrRange *r = (AddrRange *)updates->data;
+    unsigned i, n = 0;
+
+    g_array_sort(updates, addrrange_compare);
+    for (i = 1; i < updates->len; i++) {
+        if (int128_le(r[i].start, addrrange_end(r[n]))) {
+            Int128 end = int128_max(addrrange_end(r[n]), addrrange_end(r[i]));
+            r[n].size = int128_sub(end, r[n].start);
+        } else {
+            r[++n] = r[i];
+        }
+    }
+    g_array_set_size(updates, n + 1);
+}
+
+/* Append to @view the parts of @old_view outside the sorted @updates. */
+static void flatview_copy_unchanged(FlatView *view, const FlatView *old_view,
+                                    GArray *updates)
+{
+    AddrRange *r = (AddrRange *)updates->data;
+    unsigned i, j = 0, k;
+
+    for (i = 0; i < old_view->nr; i++) {
+        FlatRange fr = old_view->ranges[i];
+        Int128 start = fr.addr.start;
+        Int128 end = addrrange_end(fr.addr);
+
+        while (j < updates->len && int128_le(addrrange_end(r[j]), start)) {
+            j++;
+        }
+        for (k = j; k < updates->len && int128_lt(r[k].start, end); k++) {
+            if (int128_lt(start, r[k].start)) {
+                fr.offset_in_region = old_view->ranges[i].offset_in_region +
+                    int128_get64(int128_sub(start,
+                                            old_view->ranges[i].addr.start));
+                fr.addr = addrrange_make(start, int128_sub(r[k].start, start));
+                flatview_insert(view, view->nr, &fr);
+            }
+            start = int128_max(start, addrrange_end(r[k]));
+        }
+        if (int128_lt(start, end)) {
+            fr.offset_in_region = old_view->ranges[i].offset_in_region +
+                int128_get64(int128_sub(start, old_view->ranges[i].addr.start));
+            fr.addr = addrrange_make(start, int128_sub(end, start));
+            flatview_insert(view, view->nr, &fr);
+        }
+    }
+}
+
+static bool flatview_equal(const FlatView *a, const FlatView *b)
+{
+    unsigned i;
+
+    if (a->nr != b->nr) {
+        return false;
+    }
+    for (i = 0; i < a->nr; i++) {
+        if (!flatrange_equal(&a->ranges[i], &b->ranges[i]) ||
+            a->ranges[i].dirty_log_mask != b->ranges[i].dirty_log_mask) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * Make the FlatView for the root of @old_view current again, after the
+ * updates recorded in this transaction.  Only the ranges that the updates
+ * map to are rendered again; if they come out the same, @old_view and its
+ * dispatch tree are kept.
+ */
+static void flatview_update(FlatView *old_view)
+{
+    MemoryRegion *mr = old_view->root;
+    g_autoptr(GArray) updates = g_array_new(false, false, sizeof(AddrRange));
+    FlatView *view;
+    unsigned i;
+
+    if (memory_region_updates) {
+        flatview_collect_updates(updates, mr, int128_zero(),
+                                 addrrange_make(int128_zero(),
+                                                int128_2_64()));
+    }
+    if (!updates->len) {
+        goto reuse;
+    }
+    flatview_merge_updates(updates);
+
+    view = flatview_new(mr);
+    flatview_copy_unchanged(view, old_view, updates);
+    for (i = 0; i < updates->len; i++) {
+        render_memory_region(view, mr, int128_zero(),
+                             g_array_index(updates, AddrRange, i),
+                             false, false, false);
+    }
+    flatview_simplify(view);
+
+    if (flatview_equal(view, old_view)) {
+        flatview_destroy(view);
+        goto reuse;
+    }
+
+    flatview_init_dispatch(view);
+    g_hash_table_replace(flat_views, mr, view);
+    flatviews_stats.updated++;
+    return;
+
+reuse:
+    flatview_ref(old_view);
+    g_hash_table_replace(flat_views, mr, old_view);
+    flatviews_stats.reused++;
+}
+
+/*
+ * With --enable-debug-flatview, check each FlatView that was updated or
+ * kept against one rendered from scratch, so that anything changing the
+ * memory map covers the incremental updates; see memory-update-test.
+ */
+static void flatview_check_update(FlatView *view)
+{
+#ifdef CONFIG_DEBUG_FLATVIEW
+    FlatView *ref = flatview_render(view->root);
+
+    if (!flatview_equal(view, ref)) {
+        error_report("memory: updated FlatView of '%s' differs from a "
+                     "rendered one", memory_region_name(view->root));
+        abort();
+    }
+    flatview_destroy(ref);
+#endif
+}
+
 static void address_space_add_del_ioeventfds(AddressSpace *as,
                                              MemoryRegionIoeventfd *fds_new,
                                              unsigned fds_new_nb,
@@ -1075,6 +1344,43 @@ static void flatviews_reset(void)
     }
 }
 
+/*
+ * Like flatviews_reset(), but update the FlatViews of the last commit
+ * rather than rendering them from scratch, if possible.
+ */
+static void flatviews_update(void)
+{
+    GHashTable *old_views = flat_views;
+    AddressSpace *as;
+
+    if (!old_views || memory_region_update_all) {
+        flatviews_reset();
+        return;
+    }
+
+    flat_views = NULL;
+    flatviews_init();
+
+    QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
+        MemoryRegion *physmr = memory_region_get_flatview_root(as->root);
+        FlatView *old_view;
+
+        if (g_hash_table_lookup(flat_views, physmr)) {
+            continue;
+        }
+
+        old_view = g_hash_table_lookup(old_views, physmr);
+        if (old_view) {
+            flatview_update(old_view);
+            flatview_check_update(g_hash_table_lookup(flat_views, physmr));
+        } else {
+            generate_memory_topology(physmr);
+        }
+    }
+
+    g_hash_table_unref(old_views);
+}
+
 static void address_space_set_flatview(AddressSpace *as)
 {
     FlatView *old_view = address_space_to_flatview(as);
@@ -1147,7 +1453,16 @@ void memory_region_transaction_commit(void)
     --memory_region_transaction_depth;
     if (!memory_region_transaction_depth) {
         if (memory_region_update_pending) {
-            flatviews_reset();
+            bool trace = trace_event_get_state_backends(
+                TRACE_MEMORY_REGION_TRANSACTION_COMMIT);
+            int64_t start = trace ? get_clock() : 0;
+
+            flatviews_stats.reused = 0;
+            flatviews_stats.updated = 0;
+            flatviews_stats.rendered = 0;
+            flatviews_update();
+            g_clear_pointer(&memory_region_updates, g_hash_table_unref);
+            memory_region_update_all = false;
 
             MEMORY_LISTENER_CALL_GLOBAL(begin, Forward);
 
@@ -1157,7 +1472,14 @@ void memory_region_transaction_commit(void)
             }
             memory_region_update_pending = false;
             ioeventfd_update_pending = false;
+            iommu_translation_caches_flush();
             MEMORY_LISTENER_CALL_GLOBAL(commit, Forward);
+
+            if (trace) {
+                trace_memory_region_transaction_commit(
+                    flatviews_stats.reused, flatviews_stats.updated,
+                    flatviews_stats.rendered, get_clock() - start);
+            }
         } else if (ioeventfd_update_pending) {
             QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
                 address_space_update_ioeventfds(as);
@@ -1329,6 +1651,16 @@ static void iommu_memory_region_initfn(Object *obj)
     mr->is_iommu = true;
 }
 
+static void iommu_memory_region_finalize(Object *obj)
+{
+    IOMMUMemoryRegion *iommu_mr = IOMMU_MEMORY_REGION(obj);
+
+    /* Drop the translation cache and unregister its notifiers */
+    if (iommu_mr->translation_cache) {
+        memory_region_iommu_set_translation_cache(iommu_mr, 0, &error_abort);
+    }
+}
+
 static uint64_t unassigned_mem_read(void *opaque, hwaddr addr,
                                     unsigned size)
 {
@@ -2240,7 +2572,9 @@ void memory_region_set_log(MemoryRegion *mr, bool log, unsigned client)
 
     memory_region_transaction_begin();
     mr->dirty_log_mask = (mr->dirty_log_mask & ~mask) | (log * mask);
-    memory_region_update_pending |= mr->enabled;
+    if (mr->enabled) {
+        memory_region_update(mr);
+    }
     memory_region_transaction_commit();
 }
 
@@ -2370,7 +2704,9 @@ void memory_region_set_readonly(MemoryRegion *mr, bool readonly)
     if (mr->readonly != readonly) {
         memory_region_transaction_begin();
         mr->readonly = readonly;
-        memory_region_update_pending |= mr->enabled;
+        if (mr->enabled) {
+            memory_region_update(mr);
+        }
         memory_region_transaction_commit();
     }
 }
@@ -2380,7 +2716,9 @@ void memory_region_set_nonvolatile(MemoryRegion *mr, bool nonvolatile)
     if (mr->nonvolatile != nonvolatile) {
         memory_region_transaction_begin();
         mr->nonvolatile = nonvolatile;
-        memory_region_update_pending |= mr->enabled;
+        if (mr->enabled) {
+            memory_region_update(mr);
+        }
         memory_region_transaction_commit();
     }
 }
@@ -2390,7 +2728,9 @@ void memory_region_rom_device_set_romd(MemoryRegion *mr, bool romd_mode)
     if (mr->romd_mode != romd_mode) {
         memory_region_transaction_begin();
         mr->romd_mode = romd_mode;
-        memory_region_update_pending |= mr->enabled;
+        if (mr->enabled) {
+            memory_region_update(mr);
+        }
         memory_region_transaction_commit();
     }
 }
@@ -2628,7 +2968,10 @@ static void memory_region_update_container_subregions(MemoryRegion *subregion)
     }
     QTAILQ_INSERT_TAIL(&mr->subregions, subregion, subregions_link);
 done:
-    memory_region_update_pending |= mr->enabled && subregion->enabled;
+    if (mr->enabled && subregion->enabled) {
+        memory_region_update_range(mr, int128_make64(subregion->addr),
+                                   subregion->size);
+    }
     memory_region_transaction_commit();
 }
 
@@ -2677,8 +3020,11 @@ void memory_region_del_subregion(MemoryRegion *mr,
         assert(alias->mapped_via_alias >= 0);
     }
     QTAILQ_REMOVE(&mr->subregions, subregion, subregions_link);
+    if (mr->enabled && subregion->enabled) {
+        memory_region_update_range(mr, int128_make64(subregion->addr),
+                                   subregion->size);
+    }
     memory_region_unref(subregion);
-    memory_region_update_pending |= mr->enabled && subregion->enabled;
     memory_region_transaction_commit();
 }
 
@@ -2689,7 +3035,7 @@ void memory_region_set_enabled(MemoryRegion *mr, bool enabled)
     }
     memory_region_transaction_begin();
     mr->enabled = enabled;
-    memory_region_update_pending = true;
+    memory_region_update(mr);
     memory_region_transaction_commit();
 }
 
@@ -2704,8 +3050,9 @@ void memory_region_set_size(MemoryRegion *mr, uint64_t size)
         return;
     }
     memory_region_transaction_begin();
+    memory_region_update(mr);
     mr->size = s;
-    memory_region_update_pending = true;
+    memory_region_update(mr);
     memory_region_transaction_commit();
 }
 
@@ -2726,8 +3073,14 @@ static void memory_region_readd_subregion(MemoryRegion *mr)
 void memory_region_set_address(MemoryRegion *mr, hwaddr addr)
 {
     if (addr != mr->addr) {
+        memory_region_transaction_begin();
+        if (mr->container && mr->container->enabled && mr->enabled) {
+            /* The new address is recorded when the region is added back */
+            memory_region_update(mr);
+        }
         mr->addr = addr;
         memory_region_readd_subregion(mr);
+        memory_region_transaction_commit();
     }
 }
 
@@ -2741,7 +3094,9 @@ void memory_region_set_alias_offset(MemoryRegion *mr, hwaddr offset)
 
     memory_region_transaction_begin();
     mr->alias_offset = offset;
-    memory_region_update_pending |= mr->enabled;
+    if (mr->enabled) {
+        memory_region_update(mr);
+    }
     memory_region_transaction_commit();
 }
 
@@ -2753,7 +3108,9 @@ void memory_region_set_unmergeable(MemoryRegion *mr, bool unmergeable)
 
     memory_region_transaction_begin();
     mr->unmergeable = unmergeable;
-    memory_region_update_pending |= mr->enabled;
+    if (mr->enabled) {
+        memory_region_update(mr);
+    }
     memory_region_transaction_commit();
 }
 
@@ -2952,7 +3309,9 @@ bool memory_global_dirty_log_start(unsigned int flags, Error **errp)
         }
 
         memory_region_transaction_begin();
+        /* The dirty log mask of all RAM regions changes */
         memory_region_update_pending = true;
+        memory_region_update_all = true;
         memory_region_transaction_commit();
     }
     return true;
@@ -2968,7 +3327,9 @@ static void memory_global_dirty_log_do_stop(unsigned int flags)
 
     if (!global_dirty_tracking) {
         memory_region_transaction_begin();
+        /* The dirty log mask of all RAM regions changes */
         memory_region_update_pending = true;
+        memory_region_update_all = true;
         memory_region_transaction_commit();
         MEMORY_LISTENER_CALL_GLOBAL(log_global_stop, Reverse);
     }
@@ -3782,6 +4143,7 @@ static const TypeInfo iommu_memory_region_info = {
     .class_size         = sizeof(IOMMUMemoryRegionClass),
     .instance_size      = sizeof(IOMMUMemoryRegion),
     .instance_init      = iommu_memory_region_initfn,
+    .instance_finalize  = iommu_memory_region_finalize,
     .abstract           = true,
 };
 
@@ -26,6 +26,7 @@
 #include "qemu/hbitmap.h"
 #include "qemu/madvise.h"
 #include "qemu/lockable.h"
+#include "qemu/seqlock.h"
 
 #ifdef CONFIG_TCG
 #include "accel/tcg/cpu-ops.h"
@@ -157,6 +158,7 @@ typedef struct subpage_t {
 
 static void io_mem_init(void);
 static void memory_map_init(void);
+static void tcg_log_sync_global(MemoryListener *listener, bool last_stage);
 static void tcg_log_global_after_sync(MemoryListener *listener);
 static void tcg_commit(MemoryListener *listener);
 static bool ram_is_cpr_compatible(RAMBlock *rb);
@@ -364,14 +366,12 @@ static MemoryRegionSection *address_space_lookup_region(AddressSpaceDispatch *d,
 
 /* Called from RCU critical section */
 static MemoryRegionSection *
-address_space_translate_internal(AddressSpaceDispatch *d, hwaddr addr, hwaddr *xlat,
-                                 hwaddr *plen, bool resolve_subpage)
+address_space_translate_section(MemoryRegionSection *section, hwaddr addr,
+                                hwaddr *xlat, hwaddr *plen)
 {
-    MemoryRegionSection *section;
     MemoryRegion *mr;
     Int128 diff;
 
-    section = address_space_lookup_region(d, addr, resolve_subpage);
     /* Compute offset within MemoryRegionSection */
     addr -= section->offset_within_address_space;
 
@@ -398,6 +398,238 @@ address_space_translate_internal(AddressSpaceDispatch *d, hwaddr addr, hwaddr *x
     return section;
 }
 
+/* Called from RCU critical section */
+static MemoryRegionSection *
+address_space_translate_internal(AddressSpaceDispatch *d, hwaddr addr, hwaddr *xlat,
+                                 hwaddr *plen, bool resolve_subpage)
+{
+    MemoryRegionSection *section;
+
+    section = address_space_lookup_region(d, addr, resolve_subpage);
+    return address_space_translate_section(section, addr, xlat, plen);
+}
+
+/*
+ * IOMMU translation cache.  Each entry caches the result of one call to
+ * the IOMMU's translate method for a page-aligned IOVA and, when the whole
+ * page translates to a single RAM section of the target address space,
+ * that section.  Readers are lockless and only ever copy entries out under
+ * @sequence; writers take @lock.  @generation is incremented on every
+ * flush, so that a translation which raced with a flush is not inserted.
+ */
+#define IOMMU_TRANSLATION_CACHE_PAGE_BITS 12
+
+typedef struct IOMMUTranslationCacheEntry {
+    IOMMUTLBEntry iotlb;
+    int iommu_idx;
+    MemoryRegionSection *section;
+} IOMMUTranslationCacheEntry;
+
+typedef struct IOMMUTranslationCacheNotifier {
+    IOMMUNotifier n;
+    IOMMUTranslationCache *cache;
+} IOMMUTranslationCacheNotifier;
+
+struct IOMMUTranslationCache {
+    struct rcu_head rcu;
+    IOMMUMemoryRegion *iommu_mr;
+    QemuSeqLock sequence;
+    QemuSpin lock;
+    unsigned generation;
+    unsigned mask;
+    int num_notifiers;
+    IOMMUTranslationCacheNotifier *notifiers;
+    QLIST_ENTRY(IOMMUTranslationCache) next;
+    IOMMUTranslationCacheEntry entries[];
+};
+
+/* Protected by the BQL.  */
+static QLIST_HEAD(, IOMMUTranslationCache) iommu_translation_caches =
+    QLIST_HEAD_INITIALIZER(iommu_translation_caches);
+
+static inline IOMMUTranslationCacheEntry *
+iommu_translation_cache_entry(IOMMUTranslationCache *cache, hwaddr addr,
+                              int iommu_idx)
+{
+    hwaddr page = addr >> IOMMU_TRANSLATION_CACHE_PAGE_BITS;
+
+    return &cache->entries[(page ^ (page >> 16) ^ iommu_idx) & cache->mask];
+}
+
+/* Called from RCU critical section */
+static bool iommu_translation_cache_lookup(IOMMUTranslationCache *cache,
+                                           hwaddr addr, int iommu_idx,
+                                           bool is_write,
+                                           IOMMUTLBEntry *iotlb,
+                                           MemoryRegionSection **section)
+{
+    IOMMUTranslationCacheEntry *entry, copy;
+    unsigned start;
+
+    entry = iommu_translation_cache_entry(cache, addr, iommu_idx);
+    do {
+        start = seqlock_read_begin(&cache->sequence);
+        copy = *entry;
+    } while (seqlock_read_retry(&cache->sequence, start));
+
+    if (!(copy.iotlb.perm & (1 << is_write)) ||
+        copy.iommu_idx != iommu_idx ||
+        (addr & ~copy.iotlb.addr_mask) != copy.iotlb.iova) {
+        return false;
+    }
+
+    *iotlb = copy.iotlb;
+    *section = copy.section;
+    return true;
+}
+
+/* Called from RCU critical section */
+static void iommu_translation_cache_insert(IOMMUTranslationCache *cache,
+                                           unsigned generation, hwaddr addr,
+                                           int iommu_idx,
+                                           const IOMMUTLBEntry *iotlb,
+                                           MemoryRegionSection *section)
+{
+    IOMMUTranslationCacheEntry *entry;
+    hwaddr start = iotlb->translated_addr & ~iotlb->addr_mask;
+    hwaddr end = start + iotlb->addr_mask;
+
+    /*
+     * Only remember the section if every address of the page resolves
+     * to it; anything else, including subpages and further IOMMUs, goes
+     * through the dispatch tree of the target address space again.
+     */
+    if (!memory_region_is_ram(section->mr) ||
+        start < section->offset_within_address_space ||
+        int128_lt(int128_sub(section->size, int128_one()),
+                  int128_make64(end - section->offset_within_address_space))) {
+        section = NULL;
+    }
+
+    entry = iommu_translation_cache_entry(cache, addr, iommu_idx);
+    seqlock_write_lock(&cache->sequence, &cache->lock);
+    if (cache->generation == generation) {
+        entry->iotlb = *iotlb;
+        entry->iotlb.iova = addr & ~iotlb->addr_mask;
+        entry->iommu_idx = iommu_idx;
+        entry->section = section;
+    }
+    seqlock_write_unlock(&cache->sequence, &cache->lock);
+}
+
+static void iommu_translation_cache_flush_range(IOMMUTranslationCache *cache,
+                                                hwaddr start, hwaddr last)
+{
+    unsigned i;
+
+    seqlock_write_lock(&cache->sequence, &cache->lock);
+    qatomic_set(&cache->generation, cache->generation + 1);
+    for (i = 0; i <= cache->mask; i++) {
+        IOMMUTLBEntry *iotlb = &cache->entries[i].iotlb;
+
+        if (iotlb->perm != IOMMU_NONE &&
+            iotlb->iova <= last && start <= iotlb->iova + iotlb->addr_mask) {
+            iotlb->perm = IOMMU_NONE;
+        }
+    }
+    seqlock_write_unlock(&cache->sequence, &cache->lock);
+}
+
+static void iommu_translation_cache_unmap_notify(IOMMUNotifier *n,
+                                                 IOMMUTLBEntry *iotlb)
+{
+    IOMMUTranslationCacheNotifier *notifier =
+        container_of(n, IOMMUTranslationCacheNotifier, n);
+    IOMMUTranslationCache *cache = notifier->cache;
+    hwaddr start = iotlb->iova & ~iotlb->addr_mask;
+    hwaddr last = start + iotlb->addr_mask;
+
+    trace_iommu_translation_cache_flush(
+        memory_region_name(MEMORY_REGION(cache->iommu_mr)), start, last);
+    iommu_translation_cache_flush_range(cache, start, last);
+}
+
+/*
+ * Cached sections belong to the dispatch tree of a FlatView; drop all of
+ * them once the memory topology has changed.  Called with the BQL held,
+ * after every address space has switched to its new FlatView.
+ */
+void iommu_translation_caches_flush(void)
+{
+    IOMMUTranslationCache *cache;
+
+    QLIST_FOREACH(cache, &iommu_translation_caches, next) {
+        iommu_translation_cache_flush_range(cache, 0, HWADDR_MAX);
+    }
+}
+
+static void iommu_translation_cache_free(IOMMUTranslationCache *cache)
+{
+    int i;
+
+    for (i = 0; i < cache->num_notifiers; i++) {
+        if (cache->notifiers[i].cache) {
+            memory_region_unregister_iommu_notifier(
+                MEMORY_REGION(cache->iommu_mr), &cache->notifiers[i].n);
+        }
+    }
+    g_free(cache->notifiers);
+    qemu_spin_destroy(&cache->lock);
+    g_free_rcu(cache, rcu);
+}
+
+bool memory_region_iommu_set_translation_cache(IOMMUMemoryRegion *iommu_mr,
+                                               unsigned size, Error **errp)
+{
+    IOMMUTranslationCache *old = iommu_mr->translation_cache;
+    IOMMUTranslationCache *cache = NULL;
+    int i;
+
+    assert(bql_locked());
+
+    if (size && !is_power_of_2(size)) {
+        error_setg(errp, "IOMMU translation cache size must be a power of 2");
+        return false;
+    }
+
+    if (size) {
+        cache = g_malloc0(sizeof(*cache) +
+                          size * sizeof(IOMMUTranslationCacheEntry));
+        cache->iommu_mr = iommu_mr;
+        seqlock_init(&cache->sequence);
+        qemu_spin_init(&cache->lock);
+        cache->mask = size - 1;
+        cache->num_notifiers = memory_region_iommu_num_indexes(iommu_mr);
+        cache->notifiers = g_new0(IOMMUTranslationCacheNotifier,
+                                  cache->num_notifiers);
+
+        for (i = 0; i < cache->num_notifiers; i++) {
+            IOMMUTranslationCacheNotifier *notifier = &cache->notifiers[i];
+
+            iommu_notifier_init(&notifier->n,
+                                iommu_translation_cache_unmap_notify,
+                                IOMMU_NOTIFIER_UNMAP, 0, HWADDR_MAX, i);
+            if (memory_region_register_iommu_notifier(MEMORY_REGION(iommu_mr),
+                                                      &notifier->n,
+                                                      errp) < 0) {
+                iommu_translation_cache_free(cache);
+                return false;
+            }
+            notifier->cache = cache;
+        }
+        QLIST_INSERT_HEAD(&iommu_translation_caches, cache, next);
+    }
+
+    qatomic_rcu_set(&iommu_mr->translation_cache, cache);
+    if (old) {
+        QLIST_REMOVE(old, next);
+        iommu_translation_cache_free(old);
+    }
+    trace_iommu_translation_cache_set_size(
+        memory_region_name(MEMORY_REGION(iommu_mr)), size);
+    return true;
+}
+
 /**
  * address_space_translate_iommu - translate an address through an IOMMU
  * memory region and then through the target address space.
@@ -433,8 +665,11 @@ static MemoryRegionSection address_space_translate_iommu(IOMMUMemoryRegion *iomm
     hwaddr page_mask = (hwaddr)-1;
 
     do {
-        hwaddr addr = *xlat;
+        hwaddr iova = *xlat, addr;
         IOMMUMemoryRegionClass *imrc = memory_region_get_iommu_class_nocheck(iommu_mr);
+        IOMMUTranslationCache *cache = qatomic_rcu_read(&iommu_mr->translation_cache);
+        unsigned generation = 0;
+        bool cached;
         int iommu_idx = 0;
         IOMMUTLBEntry iotlb;
 
@@ -442,22 +677,40 @@ static MemoryRegionSection address_space_translate_iommu(IOMMUMemoryRegion *iomm
             iommu_idx = imrc->attrs_to_index(iommu_mr, attrs);
         }
 
-        iotlb = imrc->translate(iommu_mr, addr, is_write ?
-                                IOMMU_WO : IOMMU_RO, iommu_idx);
+        section = NULL;
+        cached = cache &&
+            iommu_translation_cache_lookup(cache, iova, iommu_idx, is_write,
+                                           &iotlb, &section);
+        if (!cached) {
+            if (cache) {
+                generation = qatomic_load_acquire(&cache->generation);
+            }
+            iotlb = imrc->translate(iommu_mr, iova, is_write ?
+                                    IOMMU_WO : IOMMU_RO, iommu_idx);
 
-        if (!(iotlb.perm & (1 << is_write))) {
-            goto unassigned;
+            if (!(iotlb.perm & (1 << is_write))) {
+                goto unassigned;
+            }
         }
 
         addr = ((iotlb.translated_addr & ~iotlb.addr_mask)
-                | (addr & iotlb.addr_mask));
+                | (iova & iotlb.addr_mask));
         page_mask &= iotlb.addr_mask;
         *plen_out = MIN(*plen_out, (addr | iotlb.addr_mask) - addr + 1);
         *target_as = iotlb.target_as;
 
-        section = address_space_translate_internal(
-                address_space_to_dispatch(iotlb.target_as), addr, xlat,
-                plen_out, is_mmio);
+        if (section) {
+            section = address_space_translate_section(section, addr, xlat,
+                                                      plen_out);
+        } else {
+            section = address_space_translate_internal(
+                    address_space_to_dispatch(iotlb.target_as), addr, xlat,
+                    plen_out, is_mmio);
+            if (cache && !cached) {
+                iommu_translation_cache_insert(cache, generation, iova,
+                                               iommu_idx, &iotlb, section);
+            }
+        }
 
         iommu_mr = memory_region_get_iommu(section->mr);
     } while (unlikely(iommu_mr));
@@ -807,6 +1060,7 @@ void cpu_address_space_init(CPUState *cpu, int asidx,
     newas->cpu = cpu;
     newas->as = as;
     if (tcg_enabled()) {
+        newas->tcg_as_listener.log_sync_global = tcg_log_sync_global;
         newas->tcg_as_listener.log_global_after_sync = tcg_log_global_after_sync;
         newas->tcg_as_listener.commit = tcg_commit;
         newas->tcg_as_listener.name = "tcg";
@@ -2720,6 +2974,15 @@ static void do_nothing(CPUState *cpu, run_on_cpu_data d)
 {
 }
 
+static void tcg_log_sync_global(MemoryListener *listener, bool last_stage)
+{
+    CPUAddressSpace *cpuas;
+
+    /* Publish the pages that the CPU logged instead of marking them dirty */
+    cpuas = container_of(listener, CPUAddressSpace, tcg_as_listener);
+    tlb_dirty_log_flush(cpuas->cpu);
+}
+
 static void tcg_log_global_after_sync(MemoryListener *listener)
 {
     CPUAddressSpace *cpuas;
@@ -2728,6 +2728,7 @@ static vaddr aprofile_pointer_wrap(CPUState *cs, int mmu_idx,
 
 static const TCGCPUOps arm_tcg_ops = {
     .mttcg_supported = true,
+    .superblocks = true,
     /* ARM processors have a weak memory model */
     .guest_default_memory_order = 0,
 
@@ -508,6 +508,52 @@ static void gen_goto_tb(DisasContext *s, int n, int64_t diff)
     }
 }
 
+/*
+ * Superblocks (TBs with CF_TRACE) continue translation at the destination
+ * of direct branches, see translator_follow_branch().
+ */
+static bool trace_follow(DisasContext *s, int64_t diff)
+{
+    return !s->ss_active &&
+           translator_follow_branch(&s->base, s->pc_curr + diff);
+}
+
+/*
+ * Leave a superblock for the path of a conditional branch that the trace
+ * does not follow.  This is not expected to happen often, so side exits
+ * leave the goto_tb slots to the exits at the end of the superblock.
+ */
+static void gen_side_exit(DisasContext *s, int64_t diff)
+{
+    gen_a64_update_pc(s, diff);
+    tcg_gen_lookup_and_goto_ptr();
+}
+
+/*
+ * End the TB with a conditional branch to @diff, where @match is the
+ * label branched to when the condition holds.  In a superblock, continue
+ * along the predicted path instead: backward branches usually close a
+ * loop and are predicted taken, forward branches are predicted not taken.
+ */
+static void gen_cond_goto_tb(DisasContext *s, DisasLabel match, int64_t diff)
+{
+    if (diff <= 0 && trace_follow(s, diff)) {
+        gen_side_exit(s, 4);
+        set_disas_label(s, match);
+    } else if (diff > 0 && trace_follow(s, 4)) {
+        DisasLabel skip = gen_disas_label(s);
+
+        tcg_gen_br(skip.label);
+        set_disas_label(s, match);
+        gen_side_exit(s, diff);
+        set_disas_label(s, skip);
+    } else {
+        gen_goto_tb(s, 0, 4);
+        set_disas_label(s, match);
+        gen_goto_tb(s, 1, diff);
+    }
+}
+
 /*
  * Register access functions
  *
@@ -1629,7 +1675,9 @@ static inline void gen_check_sp_alignment(DisasContext *s)
 static bool trans_B(DisasContext *s, arg_i *a)
 {
     reset_btype(s);
-    gen_goto_tb(s, 0, a->imm);
+    if (!trace_follow(s, a->imm)) {
+        gen_goto_tb(s, 0, a->imm);
+    }
     return true;
 }
 
@@ -1637,7 +1685,9 @@ static bool trans_BL(DisasContext *s, arg_i *a)
 {
     gen_pc_plus_diff(s, cpu_reg(s, 30), curr_insn_len(s));
     reset_btype(s);
-    gen_goto_tb(s, 0, a->imm);
+    if (!trace_follow(s, a->imm)) {
+        gen_goto_tb(s, 0, a->imm);
+    }
     return true;
 }
 
@@ -1653,9 +1703,7 @@ static bool trans_CBZ(DisasContext *s, arg_cbz *a)
     match = gen_disas_label(s);
     tcg_gen_brcondi_i64(a->nz ? TCG_COND_NE : TCG_COND_EQ,
                         tcg_cmp, 0, match.label);
-    gen_goto_tb(s, 0, 4);
-    set_disas_label(s, match);
-    gen_goto_tb(s, 1, a->imm);
+    gen_cond_goto_tb(s, match, a->imm);
     return true;
 }
 
@@ -1672,9 +1720,7 @@ static bool trans_TBZ(DisasContext *s, arg_tbz *a)
     match = gen_disas_label(s);
     tcg_gen_brcondi_i64(a->nz ? TCG_COND_NE : TCG_COND_EQ,
                         tcg_cmp, 0, match.label);
-    gen_goto_tb(s, 0, 4);
-    set_disas_label(s, match);
-    gen_goto_tb(s, 1, a->imm);
+    gen_cond_goto_tb(s, match, a->imm);
     return true;
 }
 
@@ -1689,10 +1735,8 @@ static bool trans_B_cond(DisasContext *s, arg_B_cond *a)
         /* genuinely conditional branches */
         DisasLabel match = gen_disas_label(s);
         arm_gen_test_cc(a->cond, match.label);
-        gen_goto_tb(s, 0, 4);
-        set_disas_label(s, match);
-        gen_goto_tb(s, 1, a->imm);
-    } else {
+        gen_cond_goto_tb(s, match, a->imm);
+    } else if (!trace_follow(s, a->imm)) {
         /* 0xe and 0xf are both "always" conditions */
         gen_goto_tb(s, 0, a->imm);
     }
@@ -10182,8 +10226,14 @@ static void aarch64_tr_init_disas_context(DisasContextBase *dcbase,
     dc->pstate_ss = EX_TBFLAG_ANY(tb_flags, PSTATE__SS);
     dc->is_ldex = false;
 
-    /* Bound the number of insns to execute to those left on the page.  */
+    /*
+     * Bound the number of insns to execute to those left on the page.
+     * Superblocks may branch back, translator_loop bounds them instead.
+     */
     bound = -(dc->base.pc_first | TARGET_PAGE_MASK) / 4;
+    if (tb_cflags(dc->base.tb) & CF_TRACE) {
+        bound = dc->base.max_insns;
+    }
 
     /* If architectural single step active, limit to 1.  */
     if (dc->ss_active) {
@@ -10334,7 +10384,7 @@ static void aarch64_tr_tb_stop(DisasContextBase *dcbase, CPUState *cpu)
         switch (dc->base.is_jmp) {
         case DISAS_NEXT:
         case DISAS_TOO_MANY:
-            gen_goto_tb(dc, 1, 4);
+            gen_goto_tb(dc, 1, dc->base.pc_next - dc->pc_curr);
             break;
         default:
         case DISAS_UPDATE_EXIT:
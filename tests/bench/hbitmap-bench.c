@@ -0,0 +1,91 @@
+/*
+ * QEMU hbitmap bulk operations speed benchmark
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * (at your option) any later version.  See the COPYING file in the
+ * top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu/hbitmap.h"
+#include "qemu/units.h"
+
+/* 1 TiB disk with 64 KiB granularity */
+#define BENCH_SIZE  (1 * TiB)
+#define BENCH_GRAN  16
+
+typedef void (*BenchFunc)(HBitmap *a, HBitmap *b, uint8_t *buf, size_t len);
+
+static void bench_finish(HBitmap *a, HBitmap *b, uint8_t *buf, size_t len)
+{
+    /* rebuilds the upper levels and recounts the whole bitmap */
+    hbitmap_deserialize_finish(a);
+}
+
+static void bench_next_zero(HBitmap *a, HBitmap *b, uint8_t *buf, size_t len)
+{
+    hbitmap_next_zero(a, 0, BENCH_SIZE);
+}
+
+static void bench_merge(HBitmap *a, HBitmap *b, uint8_t *buf, size_t len)
+{
+    hbitmap_merge(a, b, b);
+}
+
+static void bench_serialize(HBitmap *a, HBitmap *b, uint8_t *buf, size_t len)
+{
+    hbitmap_serialize_part(a, buf, 0, BENCH_SIZE);
+}
+
+static const struct {
+    const char *name;
+    BenchFunc fn;
+} benchs[] = {
+    { "finish", bench_finish },
+    { "next_zero", bench_next_zero },
+    { "merge", bench_merge },
+    { "serialize", bench_serialize },
+};
+
+static void test(void)
+{
+    HBitmap *a = hbitmap_alloc(BENCH_SIZE, BENCH_GRAN);
+    HBitmap *b = hbitmap_alloc(BENCH_SIZE, BENCH_GRAN);
+    size_t len = hbitmap_serialization_size(a, 0, BENCH_SIZE);
+    uint8_t *buf = g_malloc(len);
+    int accel_index = 0;
+
+    /* all dirty but the last cluster, so that next_zero scans everything */
+    hbitmap_set(a, 0, BENCH_SIZE - (1 << BENCH_GRAN));
+    hbitmap_set(b, 0, BENCH_SIZE / 2);
+
+    do {
+        if (accel_index != 0) {
+            g_test_message("%s", "");  /* gnu_printf Werror for simple "" */
+        }
+        for (int i = 0; i < ARRAY_SIZE(benchs); i++) {
+            double total = 0.0;
+
+            g_test_timer_start();
+            do {
+                benchs[i].fn(a, b, buf, len);
+                total += len;
+            } while (g_test_timer_elapsed() < 0.5);
+
+            total /= MiB;
+            g_test_message("hbitmap #%d: %-9s %8.0f MB/sec", accel_index,
+                           benchs[i].name, total / g_test_timer_last());
+        }
+        accel_index++;
+    } while (test_hbitmap_next_accel());
+
+    g_free(buf);
+    hbitmap_free(a);
+    hbitmap_free(b);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/hbitmap/speed", test);
+    return g_test_run();
+}
@@ -648,6 +648,15 @@ def _filter(_key, value):
         return value
     return filter_qmp(qmsg, _filter)
 
+def filter_qmp_dirty_bitmaps(qmsg):
+    '''Drop the memory use of dirty bitmaps, which depends on the host'''
+    if isinstance(qmsg, list):
+        return [filter_qmp_dirty_bitmaps(v) for v in qmsg]
+    if isinstance(qmsg, dict):
+        return {k: filter_qmp_dirty_bitmaps(v) for k, v in qmsg.items()
+                if not (k == 'memory' and 'granularity' in qmsg)}
+    return qmsg
+
 def filter_virtio_scsi(output: str) -> str:
     return re.sub(r'(virtio-scsi)-(ccw|pci)', r'\1', output)
 
@@ -10,6 +10,9 @@
 
 #include "qemu/osdep.h"
 #include "libqtest.h"
+#include "libqos/pci.h"
+#include "libqos/pci-pc.h"
+#include "hw/pci/pci_regs.h"
 #include "hw/i386/intel_iommu_internal.h"
 
 #define CAP_STAGE_1_FIXED1    (VTD_CAP_FRO | VTD_CAP_NFR | VTD_CAP_ND | \
@@ -17,11 +20,48 @@
 #define ECAP_STAGE_1_FIXED1   (VTD_ECAP_QI |  VTD_ECAP_IR | VTD_ECAP_IRO | \
                               VTD_ECAP_MHMV | VTD_ECAP_SMTS | VTD_ECAP_FLTS)
 
+/* Guest physical addresses of the DMA remapping structures and buffers */
+#define ROOT_TABLE_ADDR       0x100000
+#define CONTEXT_TABLE_ADDR    0x101000
+#define SL_TABLE_ADDR(level)  (0x102000 + ((3 - (level)) << 12))
+#define DMA_SRC_ADDR          0x110000
+#define DMA_DST_ADDR          0x111000
+
+#define DMA_SRC_IOVA          0x200000
+#define DMA_DST_IOVA          0x201000
+
+/* The EDU device copies pages between memory and a buffer in its BAR 0 */
+#define EDU_DEVFN             QPCI_DEVFN(5, 0)
+#define EDU_DMA_SRC           0x80
+#define EDU_DMA_DST           0x88
+#define EDU_DMA_CNT           0x90
+#define EDU_DMA_CMD           0x98
+#define EDU_DMA_RUN           0x1
+#define EDU_DMA_TO_PCI        0x2
+#define EDU_DMA_BUF           0x40000
+
+static inline uint32_t vtd_reg_readl(QTestState *s, uint64_t offset)
+{
+    return qtest_readl(s, Q35_HOST_BRIDGE_IOMMU_ADDR + offset);
+}
+
 static inline uint64_t vtd_reg_readq(QTestState *s, uint64_t offset)
 {
     return qtest_readq(s, Q35_HOST_BRIDGE_IOMMU_ADDR + offset);
 }
 
+static inline void vtd_reg_writel(QTestState *s, uint64_t offset,
+                                  uint32_t val)
+{
+    qtest_writel(s, Q35_HOST_BRIDGE_IOMMU_ADDR + offset, val);
+}
+
+static inline void vtd_reg_writeq(QTestState *s, uint64_t offset,
+                                  uint64_t val)
+{
+    qtest_writeq(s, Q35_HOST_BRIDGE_IOMMU_ADDR + offset, val);
+}
+
 static void test_intel_iommu_stage_1(void)
 {
     uint8_t init_csr[DMAR_REG_SIZE];     /* register values */
@@ -55,10 +95,158 @@ static void test_intel_iommu_stage_1(void)
     qtest_quit(s);
 }
 
+/* Set up the second level page tables for a 39-bit address width */
+static void vtd_map_page(QTestState *s, uint64_t iova, uint64_t addr,
+                         uint64_t perm)
+{
+    uint64_t pte = SL_TABLE_ADDR(3) + ((iova >> 30) & 0x1ff) * 8;
+
+    qtest_writeq(s, pte, SL_TABLE_ADDR(2) | VTD_SL_R | VTD_SL_W);
+    pte = SL_TABLE_ADDR(2) + ((iova >> 21) & 0x1ff) * 8;
+    qtest_writeq(s, pte, SL_TABLE_ADDR(1) | VTD_SL_R | VTD_SL_W);
+    pte = SL_TABLE_ADDR(1) + ((iova >> 12) & 0x1ff) * 8;
+    qtest_writeq(s, pte, addr | perm);
+}
+
+static void vtd_invalidate_iotlb(QTestState *s)
+{
+    vtd_reg_writeq(s, DMAR_IOTLB_REG, VTD_TLB_IVT | VTD_TLB_GLOBAL_FLUSH);
+    g_assert(!(vtd_reg_readq(s, DMAR_IOTLB_REG) & VTD_TLB_IVT));
+}
+
+static void vtd_unmap_page(QTestState *s, uint64_t iova)
+{
+    qtest_writeq(s, SL_TABLE_ADDR(1) + ((iova >> 12) & 0x1ff) * 8, 0);
+    vtd_invalidate_iotlb(s);
+}
+
+static void vtd_enable_translation(QTestState *s, uint8_t devfn)
+{
+    uint64_t ce = CONTEXT_TABLE_ADDR + devfn * 16;
+
+    qtest_memset(s, ROOT_TABLE_ADDR, 0, 5 * VTD_PAGE_SIZE);
+    qtest_writeq(s, ROOT_TABLE_ADDR, CONTEXT_TABLE_ADDR | VTD_ROOT_ENTRY_P);
+    qtest_writeq(s, ce, SL_TABLE_ADDR(3) | VTD_CONTEXT_TT_MULTI_LEVEL |
+                 VTD_CONTEXT_ENTRY_P);
+    /* Domain 1, 3-level page table */
+    qtest_writeq(s, ce + 8, (1 << 8) | 1);
+
+    vtd_reg_writeq(s, DMAR_RTADDR_REG, ROOT_TABLE_ADDR);
+    vtd_reg_writel(s, DMAR_GCMD_REG, VTD_GCMD_SRTP);
+    g_assert(vtd_reg_readl(s, DMAR_GSTS_REG) & VTD_GSTS_RTPS);
+    vtd_reg_writeq(s, DMAR_CCMD_REG, VTD_CCMD_ICC | VTD_CCMD_GLOBAL_INVL);
+    vtd_invalidate_iotlb(s);
+    vtd_reg_writel(s, DMAR_GCMD_REG, VTD_GCMD_TE);
+    g_assert(vtd_reg_readl(s, DMAR_GSTS_REG) & VTD_GSTS_TES);
+}
+
+/* Copy a page through the buffer of the EDU device */
+static void edu_dma_copy(QTestState *s, QPCIDevice *edu, QPCIBar bar,
+                         uint64_t src, uint64_t dst)
+{
+    uint64_t cmd[] = { EDU_DMA_RUN, EDU_DMA_RUN | EDU_DMA_TO_PCI };
+    uint64_t addr[][2] = { { src, EDU_DMA_BUF }, { EDU_DMA_BUF, dst } };
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(cmd); i++) {
+        qpci_io_writeq(edu, bar, EDU_DMA_SRC, addr[i][0]);
+        qpci_io_writeq(edu, bar, EDU_DMA_DST, addr[i][1]);
+        qpci_io_writeq(edu, bar, EDU_DMA_CNT, VTD_PAGE_SIZE);
+        qpci_io_writeq(edu, bar, EDU_DMA_CMD, cmd[i]);
+        qtest_clock_step_next(s);
+        g_assert(!(qpci_io_readq(edu, bar, EDU_DMA_CMD) & EDU_DMA_RUN));
+    }
+}
+
+static bool page_is(QTestState *s, uint64_t addr, uint8_t byte)
+{
+    uint8_t buf[VTD_PAGE_SIZE];
+    int i;
+
+    qtest_memread(s, addr, buf, sizeof(buf));
+    for (i = 0; i < sizeof(buf); i++) {
+        if (buf[i] != byte) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * Cached translations must not outlive an unmap and cached RAM sections
+ * must not outlive a change of the memory map: copy a page from an IOVA
+ * while it is mapped, unmapped, mapped to a BAR, and while the BAR is
+ * disabled.
+ */
+static void test_intel_iommu_translation_cache(void)
+{
+    QTestState *s;
+    QPCIBus *bus;
+    QPCIDevice *edu, *testdev;
+    QPCIBar edu_bar, membar;
+
+    s = qtest_init("-M q35 -device intel-iommu,translation-cache-size=64 "
+                   "-device edu,addr=05.0 "
+                   "-device pci-testdev,addr=06.0,membar=1M,"
+                   "membar-backed=on");
+    bus = qpci_new_pc(s, NULL);
+    edu = qpci_device_find(bus, EDU_DEVFN);
+    testdev = qpci_device_find(bus, QPCI_DEVFN(6, 0));
+    g_assert(edu && testdev);
+    qpci_device_enable(edu);
+    qpci_device_enable(testdev);
+    edu_bar = qpci_iomap(edu, 0, NULL);
+    membar = qpci_iomap(testdev, 2, NULL);
+
+    vtd_enable_translation(s, EDU_DEVFN);
+    vtd_map_page(s, DMA_DST_IOVA, DMA_DST_ADDR, VTD_SL_W);
+
+    /* Mapped */
+    qtest_memset(s, DMA_SRC_ADDR, 0xa5, VTD_PAGE_SIZE);
+    vtd_map_page(s, DMA_SRC_IOVA, DMA_SRC_ADDR, VTD_SL_R);
+    edu_dma_copy(s, edu, edu_bar, DMA_SRC_IOVA, DMA_DST_IOVA);
+    g_assert(page_is(s, DMA_DST_ADDR, 0xa5));
+    g_assert(!(vtd_reg_readl(s, DMAR_FSTS_REG) & VTD_FSTS_PPF));
+
+    /* Unmapped, the read faults and the device gets zeroes */
+    vtd_unmap_page(s, DMA_SRC_IOVA);
+    edu_dma_copy(s, edu, edu_bar, DMA_SRC_IOVA, DMA_DST_IOVA);
+    g_assert(page_is(s, DMA_DST_ADDR, 0));
+    g_assert(vtd_reg_readl(s, DMAR_FSTS_REG) & VTD_FSTS_PPF);
+
+    /* Mapped to RAM behind a BAR */
+    qtest_memset(s, membar.addr, 0x5a, VTD_PAGE_SIZE);
+    vtd_map_page(s, DMA_SRC_IOVA, membar.addr, VTD_SL_R);
+    vtd_invalidate_iotlb(s);
+    edu_dma_copy(s, edu, edu_bar, DMA_SRC_IOVA, DMA_DST_IOVA);
+    g_assert(page_is(s, DMA_DST_ADDR, 0x5a));
+
+    /* The BAR goes away, the translation does not change */
+    qpci_config_writew(testdev, PCI_COMMAND,
+                       qpci_config_readw(testdev, PCI_COMMAND) &
+                       ~PCI_COMMAND_MEMORY);
+    edu_dma_copy(s, edu, edu_bar, DMA_SRC_IOVA, DMA_DST_IOVA);
+    g_assert(!page_is(s, DMA_DST_ADDR, 0x5a));
+
+    /* And comes back */
+    qpci_device_enable(testdev);
+    edu_dma_copy(s, edu, edu_bar, DMA_SRC_IOVA, DMA_DST_IOVA);
+    g_assert(page_is(s, DMA_DST_ADDR, 0x5a));
+
+    g_free(testdev);
+    g_free(edu);
+    qpci_free_pc(bus);
+    qtest_quit(s);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
     qtest_add_func("/q35/intel-iommu/stage-1", test_intel_iommu_stage_1);
+    if (qtest_has_device("edu") && qtest_has_device("pci-testdev")) {
+        qtest_add_func("/q35/intel-iommu/translation-cache",
+                       test_intel_iommu_translation_cache);
+    }
 
     return g_test_run();
 }
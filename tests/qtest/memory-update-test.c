@@ -0,0 +1,194 @@
+/*
+ * QTest testcase for the incremental update of the memory map
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * On each transaction commit, the FlatViews are updated from the ranges
+ * that changed rather than rendered from scratch.  When QEMU is configured
+ * with --enable-debug-flatview, memory.c checks every updated FlatView
+ * against one rendered from scratch and aborts if they differ, so this
+ * test only has to change the memory map in as many ways as possible; in
+ * other builds it only checks that the updates do not crash.  It adds
+ * and removes PCI BARs that overlap RAM, each other and the PAM and SMRAM
+ * areas at different priorities, enables and disables them, and moves
+ * the aliases of the PAM and SMRAM areas and of the windows of a PCI
+ * bridge.  The changes are random; use --seed to reproduce a failure.
+ */
+
+#include "qemu/osdep.h"
+#include "libqtest.h"
+#include "libqos/pci.h"
+#include "libqos/pci-pc.h"
+#include "hw/pci/pci_regs.h"
+#include "hw/pci-host/q35.h"
+
+#define ITERATIONS 500
+
+/* The devices with BARs, the last one is behind the bridge */
+#define N_TESTDEVS 3
+
+typedef struct MemoryUpdateTest {
+    QTestState *qts;
+    QPCIBus *bus;
+    QPCIDevice *mch;
+    QPCIDevice *bridge;
+    QPCIDevice *testdev[N_TESTDEVS];
+} MemoryUpdateTest;
+
+/* Below and across the end of RAM, in the PAM and SMRAM areas, in the hole */
+static const uint32_t mem_addrs[] = {
+    0x000a0000, 0x000c0000, 0x000e0000, 0x07f00000, 0x07ff0000,
+    0xe0000000, 0xe0001000, 0xe0080000, 0xe0100000, 0xe0180000,
+    0xe0200000, 0xe0300000,
+};
+
+static const uint32_t io_addrs[] = {
+    0xc000, 0xc080, 0xc100, 0xd000, 0xd040,
+};
+
+static uint32_t pick(const uint32_t *addrs, size_t n)
+{
+    return addrs[g_test_rand_int_range(0, n)];
+}
+
+static void change_pam(MemoryUpdateTest *t)
+{
+    qpci_config_writeb(t->mch,
+                       MCH_HOST_BRIDGE_PAM0 +
+                       g_test_rand_int_range(0, MCH_HOST_BRIDGE_PAM_NB),
+                       g_test_rand_int() & 0x33);
+}
+
+static void change_smram(MemoryUpdateTest *t)
+{
+    uint8_t bits = MCH_HOST_BRIDGE_SMRAM_D_OPEN |
+                   MCH_HOST_BRIDGE_SMRAM_D_CLS |
+                   MCH_HOST_BRIDGE_SMRAM_G_SMRAME;
+
+    /* Never lock, that would freeze the SMRAM areas */
+    qpci_config_writeb(t->mch, MCH_HOST_BRIDGE_SMRAM,
+                       (g_test_rand_int() & bits) |
+                       MCH_HOST_BRIDGE_SMRAM_C_BASE_SEG);
+}
+
+static void move_bar(MemoryUpdateTest *t)
+{
+    QPCIDevice *dev = t->testdev[g_test_rand_int_range(0, N_TESTDEVS)];
+
+    switch (g_test_rand_int_range(0, 3)) {
+    case 0:
+        qpci_config_writel(dev, PCI_BASE_ADDRESS_0,
+                           pick(mem_addrs, ARRAY_SIZE(mem_addrs)));
+        break;
+    case 1:
+        qpci_config_writel(dev, PCI_BASE_ADDRESS_1,
+                           pick(io_addrs, ARRAY_SIZE(io_addrs)) |
+                           PCI_BASE_ADDRESS_SPACE_IO);
+        break;
+    case 2:
+        /* The 64-bit RAM or container BAR */
+        qpci_config_writel(dev, PCI_BASE_ADDRESS_2,
+                           pick(mem_addrs, ARRAY_SIZE(mem_addrs)) |
+                           PCI_BASE_ADDRESS_MEM_PREFETCH |
+                           PCI_BASE_ADDRESS_MEM_TYPE_64);
+        qpci_config_writel(dev, PCI_BASE_ADDRESS_2 + 4, 0);
+        break;
+    }
+}
+
+static void toggle_command(MemoryUpdateTest *t)
+{
+    int i = g_test_rand_int_range(0, N_TESTDEVS + 1);
+    QPCIDevice *dev = i < N_TESTDEVS ? t->testdev[i] : t->bridge;
+    uint16_t cmd = qpci_config_readw(dev, PCI_COMMAND);
+
+    cmd ^= g_test_rand_bit() ? PCI_COMMAND_MEMORY : PCI_COMMAND_IO;
+    qpci_config_writew(dev, PCI_COMMAND, cmd);
+}
+
+static void move_bridge_window(MemoryUpdateTest *t)
+{
+    uint32_t base = pick(mem_addrs, ARRAY_SIZE(mem_addrs));
+    uint32_t limit = base + g_test_rand_int_range(0, 4) * 0x100000;
+
+    switch (g_test_rand_int_range(0, 4)) {
+    case 0:
+        qpci_config_writew(t->bridge, PCI_MEMORY_BASE, base >> 16);
+        qpci_config_writew(t->bridge, PCI_MEMORY_LIMIT, limit >> 16);
+        break;
+    case 1:
+        qpci_config_writew(t->bridge, PCI_PREF_MEMORY_BASE, base >> 16);
+        qpci_config_writew(t->bridge, PCI_PREF_MEMORY_LIMIT, limit >> 16);
+        break;
+    case 2:
+        qpci_config_writeb(t->bridge, PCI_IO_BASE,
+                           pick(io_addrs, ARRAY_SIZE(io_addrs)) >> 8);
+        qpci_config_writeb(t->bridge, PCI_IO_LIMIT, 0xd0);
+        break;
+    case 3:
+        /* The VGA window aliases the legacy VGA ranges */
+        qpci_config_writew(t->bridge, PCI_BRIDGE_CONTROL,
+                           qpci_config_readw(t->bridge, PCI_BRIDGE_CONTROL) ^
+                           PCI_BRIDGE_CTL_VGA);
+        break;
+    }
+}
+
+static void test_memory_update(void)
+{
+    static void (*const changes[])(MemoryUpdateTest *) = {
+        change_pam, change_smram, move_bar, toggle_command,
+        move_bridge_window,
+    };
+    MemoryUpdateTest t;
+    g_autofree char *mtree = NULL;
+    int i;
+
+    t.qts = qtest_init("-machine q35 -m 128M "
+                       "-device pci-testdev,addr=02.0,membar=2M "
+                       "-device pci-testdev,addr=03.0,membar=1M,"
+                       "membar-backed=on "
+                       "-device pci-bridge,id=br,chassis_nr=1,addr=04.0 "
+                       "-device pci-testdev,bus=br,addr=01.0,membar=1M");
+    t.bus = qpci_new_pc(t.qts, NULL);
+    t.mch = qpci_device_find(t.bus, 0);
+    t.bridge = qpci_device_find(t.bus, QPCI_DEVFN(4, 0));
+    g_assert(t.mch && t.bridge);
+
+    /* Make the device behind the bridge reachable as bus 1 */
+    qpci_config_writeb(t.bridge, PCI_SECONDARY_BUS, 1);
+    qpci_config_writeb(t.bridge, PCI_SUBORDINATE_BUS, 1);
+
+    t.testdev[0] = qpci_device_find(t.bus, QPCI_DEVFN(2, 0));
+    t.testdev[1] = qpci_device_find(t.bus, QPCI_DEVFN(3, 0));
+    t.testdev[2] = qpci_device_find(t.bus, (1 << 8) | QPCI_DEVFN(1, 0));
+    for (i = 0; i < N_TESTDEVS; i++) {
+        g_assert(t.testdev[i]);
+    }
+
+    for (i = 0; i < ITERATIONS; i++) {
+        changes[g_test_rand_int_range(0, ARRAY_SIZE(changes))](&t);
+    }
+
+    /* QEMU would have aborted on a mismatch */
+    mtree = qtest_hmp(t.qts, "info mtree -f");
+    g_assert(strstr(mtree, "FlatView"));
+
+    for (i = 0; i < N_TESTDEVS; i++) {
+        g_free(t.testdev[i]);
+    }
+    g_free(t.bridge);
+    g_free(t.mch);
+    qpci_free_pc(t.bus);
+    qtest_quit(t.qts);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    qtest_add_func("memory/update", test_memory_update);
+
+    return g_test_run();
+}
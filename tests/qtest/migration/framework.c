@@ -263,7 +263,8 @@ int migrate_start(QTestState **from, QTestState **to, const char *uri,
     const gchar *ignore_stderr;
     g_autofree char *shmem_opts = NULL;
     g_autofree char *shmem_path = NULL;
-    const char *kvm_opts = NULL;
+    g_autofree char *kvm_opts = NULL;
+    g_autofree char *accel_opts = NULL;
     const char *arch = qtest_get_arch();
     const char *memory_size;
     const char *machine_alias, *machine_opts = "";
@@ -354,7 +355,21 @@ int migrate_start(QTestState **from, QTestState **to, const char *uri,
     }
 
     if (args->use_dirty_ring) {
-        kvm_opts = ",dirty-ring-size=4096";
+        if (args->dirty_ring_harvest_threads) {
+            kvm_opts = g_strdup_printf(",dirty-ring-size=4096"
+                                       ",dirty-ring-harvest-threads=%u",
+                                       args->dirty_ring_harvest_threads);
+        } else {
+            kvm_opts = g_strdup(",dirty-ring-size=4096");
+        }
+    }
+
+    if (args->use_tcg_dirty_log) {
+        /* Small enough that the guest overflows it between syncs */
+        accel_opts = g_strdup("-accel tcg,dirty-log-size=16");
+    } else {
+        accel_opts = g_strdup_printf("-accel kvm%s -accel tcg",
+                                     kvm_opts ? kvm_opts : "");
     }
 
     if (!qtest_has_machine(machine_alias)) {
@@ -368,13 +383,13 @@ int migrate_start(QTestState **from, QTestState **to, const char *uri,
 
     g_test_message("Using machine type: %s", machine);
 
-    cmd_source = g_strdup_printf("-accel kvm%s -accel tcg "
+    cmd_source = g_strdup_printf("%s "
                                  "-machine %s,%s "
                                  "-name source,debug-threads=on "
                                  "%s "
                                  "-serial file:%s/src_serial "
                                  "%s %s %s %s",
-                                 kvm_opts ? kvm_opts : "",
+                                 accel_opts,
                                  machine, machine_opts,
                                  memory_backend, tmpfs,
                                  arch_opts ? arch_opts : "",
@@ -395,14 +410,14 @@ int migrate_start(QTestState **from, QTestState **to, const char *uri,
      */
     events = args->defer_target_connect ? "-global migration.x-events=on" : "";
 
-    cmd_target = g_strdup_printf("-accel kvm%s -accel tcg "
+    cmd_target = g_strdup_printf("%s "
                                  "-machine %s,%s "
                                  "-name target,debug-threads=on "
                                  "%s "
                                  "-serial file:%s/dest_serial "
                                  "-incoming %s "
                                  "%s %s %s %s %s",
-                                 kvm_opts ? kvm_opts : "",
+                                 accel_opts,
                                  machine, machine_opts,
                                  memory_backend, tmpfs, uri,
                                  events,
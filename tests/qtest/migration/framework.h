@@ -107,6 +107,10 @@ typedef struct {
     bool only_target;
     /* Use dirty ring if true; dirty logging otherwise */
     bool use_dirty_ring;
+    /* Harvest the dirty rings with this many threads, if non-zero */
+    unsigned dirty_ring_harvest_threads;
+    /* Use TCG, with a per-vCPU log of dirty pages */
+    bool use_tcg_dirty_log;
     const char *opts_source;
     const char *opts_target;
     /* suspend the src before migrating to dest. */
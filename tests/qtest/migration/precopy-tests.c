@@ -25,6 +25,7 @@
 #include "qemu/option.h"
 #include "qemu/range.h"
 #include "qemu/sockets.h"
+#include "qemu/units.h"
 
 
 /*
@@ -99,6 +100,45 @@ static void test_precopy_unix_dirty_ring(void)
     test_precopy_common(&args);
 }
 
+static void test_precopy_unix_dirty_ring_harvest_threads(void)
+{
+    g_autofree char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
+    MigrateCommon args = {
+        .start = {
+            .use_dirty_ring = true,
+            .dirty_ring_harvest_threads = 4,
+            /* One ring per vcpu, so that there is something to split */
+            .opts_source = "-smp 4",
+            .opts_target = "-smp 4",
+        },
+        .listen_uri = uri,
+        .connect_uri = uri,
+        /* Harvest the vcpus' rings from several threads at once */
+        .live = true,
+    };
+
+    test_precopy_common(&args);
+}
+
+static void test_precopy_unix_tcg_dirty_log(void)
+{
+    g_autofree char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
+    MigrateCommon args = {
+        .start = {
+            .use_tcg_dirty_log = true,
+        },
+        .listen_uri = uri,
+        .connect_uri = uri,
+        /*
+         * Besides the precopy/unix basic test, cover the pages that TCG
+         * logs per vCPU and those that overflow the log.
+         */
+        .live = true,
+    };
+
+    test_precopy_common(&args);
+}
+
 #ifdef CONFIG_RDMA
 
 #include <sys/resource.h>
@@ -522,6 +562,35 @@ static void test_multifd_tcp_zero_page_legacy(void)
     test_precopy_common(&args);
 }
 
+static void *
+migrate_hook_start_precopy_tcp_multifd_dedup(QTestState *from,
+                                             QTestState *to)
+{
+    migrate_hook_start_precopy_tcp_multifd_common(from, to, "none");
+    /* Small enough that slots are replaced while they are in use */
+    migrate_set_parameter_int(from, "multifd-dedup-cache-size", 1 * MiB);
+    migrate_set_parameter_int(to, "multifd-dedup-cache-size", 1 * MiB);
+    return NULL;
+}
+
+static void test_multifd_tcp_dedup(void)
+{
+    MigrateCommon args = {
+        .listen_uri = "defer",
+        .start_hook = migrate_hook_start_precopy_tcp_multifd_dedup,
+        .start = {
+            .caps[MIGRATION_CAPABILITY_MULTIFD] = true,
+            .caps[MIGRATION_CAPABILITY_MULTIFD_DEDUP] = true,
+        },
+        /*
+         * The guest keeps changing pages that are in the dedup cache,
+         * make sure the caches on both sides stay consistent.
+         */
+        .live = true,
+    };
+    test_precopy_common(&args);
+}
+
 static void test_multifd_tcp_no_zero_page(void)
 {
     MigrateCommon args = {
@@ -1304,11 +1373,19 @@ void migration_test_add_precopy(MigrationTestEnv *env)
                        test_multifd_tcp_zero_page_legacy);
     migration_test_add("/migration/multifd/tcp/plain/zero-page/none",
                        test_multifd_tcp_no_zero_page);
+    migration_test_add("/migration/multifd/tcp/plain/dedup",
+                       test_multifd_tcp_dedup);
+    if (env->has_tcg) {
+        migration_test_add("/migration/precopy/unix/tcg-dirty-log",
+                           test_precopy_unix_tcg_dirty_log);
+    }
     if (g_str_equal(env->arch, "x86_64")
         && env->has_kvm && env->has_dirty_ring) {
 
         migration_test_add("/migration/dirty_ring",
                            test_precopy_unix_dirty_ring);
+        migration_test_add("/migration/dirty_ring/harvest_threads",
+                           test_precopy_unix_dirty_ring_harvest_threads);
         if (qtest_has_machine("pc") && g_test_slow()) {
             migration_test_add("/migration/vcpu_dirty_limit",
                                test_vcpu_dirty_limit);
@@ -0,0 +1,199 @@
+/*
+ * QTest testcase for the handling of translation blocks by TCG
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2
+ * or later. See the COPYING file in the top-level directory.
+ *
+ * The tests run small AArch64 programs on the virt machine with
+ * different options of the TCG accelerator.  The programs store their
+ * results and a completion flag in RAM, which the test compares with
+ * the results computed here and with the statistics of "info jit".
+ */
+
+#include "qemu/osdep.h"
+#include "libqtest.h"
+
+#define CODE_ADDR   0x40000000ULL
+#define DATA_ADDR   0x40010000ULL
+#define RESULT_ADDR DATA_ADDR
+#define DONE_ADDR   (DATA_ADDR + 8)
+
+#define TIMEOUT_SEC 60
+
+/*
+ * Sums i for i in [0, 20000), except that every eighth value is mixed
+ * into the sum with a call instead.  The loop has a forward branch that
+ * is taken, a forward branch that is not, a call and a back edge, so
+ * that a superblock formed from it has both followed branches and side
+ * exits.
+ */
+#define SUPERBLOCK_ITERATIONS 20000
+
+static const uint32_t superblock_code[] = {
+    0xd2a80025,     /*        mov   x5, #0x40010000 */
+    0xd2800000,     /*        mov   x0, #0 */
+    0xd2800001,     /*        mov   x1, #0 */
+    0xd289c402,     /*        mov   x2, #20000 */
+    0x92400823,     /* loop:  and   x3, x1, #7 */
+    0xb4000063,     /*        cbz   x3, skip */
+    0x8b010000,     /*        add   x0, x0, x1 */
+    0x14000002,     /*        b     next */
+    0x94000009,     /* skip:  bl    func */
+    0x91000421,     /* next:  add   x1, x1, #1 */
+    0xeb02003f,     /*        cmp   x1, x2 */
+    0x54ffff21,     /*        b.ne  loop */
+    0xf90000a0,     /*        str   x0, [x5] */
+    0xd2800024,     /*        mov   x4, #1 */
+    0xf90004a4,     /*        str   x4, [x5, #8] */
+    0xd503207f,     /* end:   wfi */
+    0x17ffffff,     /*        b     end */
+    0xca010c00,     /* func:  eor   x0, x0, x1, lsl #3 */
+    0xd65f03c0,     /*        ret */
+};
+
+static uint64_t superblock_expected(void)
+{
+    uint64_t sum = 0, i;
+
+    for (i = 0; i < SUPERBLOCK_ITERATIONS; i++) {
+        if (i & 7) {
+            sum += i;
+        } else {
+            sum ^= i << 3;
+        }
+    }
+    return sum;
+}
+
+/* Start QEMU with @accel_opts, load @code at CODE_ADDR and run it */
+static QTestState *tb_test_start(const char *accel_opts,
+                                 const uint32_t *code, size_t n)
+{
+    QTestState *qts;
+    size_t i;
+
+    qts = qtest_initf("-machine virt -cpu max -accel tcg%s -S "
+                      "-device loader,addr=0x%llx,cpu-num=0",
+                      accel_opts, CODE_ADDR);
+    for (i = 0; i < n; i++) {
+        qtest_writel(qts, CODE_ADDR + i * 4, code[i]);
+    }
+    qtest_qmp_assert_success(qts, "{ 'execute': 'cont' }");
+    return qts;
+}
+
+/* Wait until the guest sets the 64-bit flag at @addr */
+static void tb_test_wait(QTestState *qts, uint64_t addr)
+{
+    gint64 end = g_get_monotonic_time() + TIMEOUT_SEC * G_TIME_SPAN_SECOND;
+
+    while (!qtest_readq(qts, addr)) {
+        g_assert_cmpint(g_get_monotonic_time(), <, end);
+        g_usleep(1000);
+    }
+}
+
+/* Return the number after @name in the output of "info jit" */
+static uint64_t tb_test_jit_stat(QTestState *qts, const char *name)
+{
+    g_autofree char *info = qtest_hmp(qts, "info jit");
+    const char *p = strstr(info, name);
+
+    g_assert(p);
+    return g_ascii_strtoull(p + strlen(name), NULL, 10);
+}
+
+static uint64_t superblock_run(const char *accel_opts, uint64_t *superblocks)
+{
+    QTestState *qts;
+    uint64_t result;
+
+    qts = tb_test_start(accel_opts, superblock_code,
+                        ARRAY_SIZE(superblock_code));
+    tb_test_wait(qts, DONE_ADDR);
+    result = qtest_readq(qts, RESULT_ADDR);
+    *superblocks = tb_test_jit_stat(qts, "TB superblocks");
+    qtest_quit(qts);
+
+    return result;
+}
+
+static void test_superblock(void)
+{
+    uint64_t expected = superblock_expected();
+    uint64_t superblocks;
+
+    /* Without superblocks, as the reference */
+    g_assert_cmphex(superblock_run("", &superblocks), ==, expected);
+    g_assert_cmpint(superblocks, ==, 0);
+
+    /* The loop becomes hot and is retranslated */
+    g_assert_cmphex(superblock_run(",superblock-threshold=16", &superblocks),
+                    ==, expected);
+    g_assert_cmpint(superblocks, >, 0);
+
+    /* Every TB becomes a superblock as soon as it is entered again */
+    g_assert_cmphex(superblock_run(",superblock-threshold=1", &superblocks),
+                    ==, expected);
+    g_assert_cmpint(superblocks, >, 0);
+}
+
+/*
+ * Counts in x0 with a loop whose first TB, at the end of the first page,
+ * jumps to the second page, where the count is stored.  Rewriting the
+ * store in the second page to set the completion flag instead must take
+ * effect even though the jump to it is chained.
+ */
+#define CROSS_PAGE_STORE    (0x1000 / 4)
+
+static const uint32_t cross_page_code[] = {
+    0xd2a80025,     /*        mov   x5, #0x40010000 */
+    0xd2800000,     /*        mov   x0, #0 */
+    0x140003fc,     /*        b     loop */
+    [0xff8 / 4] =
+    0x91000400,     /* loop:  add   x0, x0, #1 */
+    0x14000001,     /*        b     store */
+    [CROSS_PAGE_STORE] =
+    0xf90000a0,     /* store: str   x0, [x5] */
+    0x17fffffd,     /*        b     loop */
+};
+
+#define CROSS_PAGE_STORE_DONE 0xf90004a0 /* str   x0, [x5, #8] */
+
+static void test_cross_page_chaining(void)
+{
+    g_autofree char *info = NULL;
+    const char *p;
+    QTestState *qts;
+
+    qts = tb_test_start(",cross-page-chaining=on", cross_page_code,
+                        ARRAY_SIZE(cross_page_code));
+    tb_test_wait(qts, RESULT_ADDR);
+
+    info = qtest_hmp(qts, "info jit");
+    p = strstr(info, "TB jumps chained");
+    g_assert(p);
+    p = strchr(p, '(');
+    g_assert(p);
+    g_assert_cmpint(g_ascii_strtoull(p + 1, NULL, 10), >, 0);
+
+    /* Invalidate the second page, which unlinks the jump to it */
+    qtest_writel(qts, CODE_ADDR + CROSS_PAGE_STORE * 4,
+                 CROSS_PAGE_STORE_DONE);
+    tb_test_wait(qts, DONE_ADDR);
+
+    qtest_quit(qts);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    if (qtest_has_accel("tcg")) {
+        qtest_add_func("tcg-tb/superblock", test_superblock);
+        qtest_add_func("tcg-tb/cross-page-chaining",
+                       test_cross_page_chaining);
+    }
+
+    return g_test_run();
+}
@@ -16,11 +16,26 @@
 #include "qemu/module.h"
 #include "libqos/qgraph.h"
 #include "libqos/virtio-iommu.h"
+#include "hw/pci/pci_regs.h"
 #include "hw/virtio/virtio-iommu.h"
 
 #define PCI_SLOT_HP             0x06
 #define QVIRTIO_IOMMU_TIMEOUT_US (30 * 1000 * 1000)
 
+/* The EDU device copies pages between memory and a buffer in its BAR 0 */
+#define EDU_DEVFN               QPCI_DEVFN(5, 0)
+#define EDU_DMA_SRC             0x80
+#define EDU_DMA_DST             0x88
+#define EDU_DMA_CNT             0x90
+#define EDU_DMA_CMD             0x98
+#define EDU_DMA_RUN             0x1
+#define EDU_DMA_TO_PCI          0x2
+#define EDU_DMA_BUF             0x40000
+
+#define DMA_PAGE_SIZE           0x1000
+#define DMA_SRC_IOVA            0x200000
+#define DMA_DST_IOVA            0x201000
+
 static QGuestAllocator *alloc;
 
 static void pci_config(void *obj, void *data, QGuestAllocator *t_alloc)
@@ -318,11 +333,140 @@ static void test_map_unmap(void *obj, void *data, QGuestAllocator *t_alloc)
     g_assert_cmpint(ret, ==, VIRTIO_IOMMU_S_INVAL); /* 10-14 still is mapped */
 }
 
+/* Copy a page through the buffer of the EDU device */
+static void edu_dma_copy(QTestState *qts, QPCIDevice *edu, QPCIBar bar,
+                         uint64_t src, uint64_t dst)
+{
+    uint64_t cmd[] = { EDU_DMA_RUN, EDU_DMA_RUN | EDU_DMA_TO_PCI };
+    uint64_t addr[][2] = { { src, EDU_DMA_BUF }, { EDU_DMA_BUF, dst } };
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(cmd); i++) {
+        qpci_io_writeq(edu, bar, EDU_DMA_SRC, addr[i][0]);
+        qpci_io_writeq(edu, bar, EDU_DMA_DST, addr[i][1]);
+        qpci_io_writeq(edu, bar, EDU_DMA_CNT, DMA_PAGE_SIZE);
+        qpci_io_writeq(edu, bar, EDU_DMA_CMD, cmd[i]);
+        qtest_clock_step_next(qts);
+        g_assert(!(qpci_io_readq(edu, bar, EDU_DMA_CMD) & EDU_DMA_RUN));
+    }
+}
+
+static bool page_is(QTestState *qts, uint64_t addr, uint8_t byte)
+{
+    uint8_t buf[DMA_PAGE_SIZE];
+    int i;
+
+    qtest_memread(qts, addr, buf, sizeof(buf));
+    for (i = 0; i < sizeof(buf); i++) {
+        if (buf[i] != byte) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * Cached translations must not outlive an unmap and cached RAM sections
+ * must not outlive a change of the memory map: copy a page from an IOVA
+ * while it is mapped, unmapped, mapped to a BAR, and while the BAR is
+ * disabled.
+ */
+static void test_translation_cache(void *obj, void *data,
+                                   QGuestAllocator *t_alloc)
+{
+    QVirtioIOMMU *v_iommu = obj;
+    QVirtioIOMMUPCI *iommu_pci = container_of(v_iommu, QVirtioIOMMUPCI,
+                                              iommu);
+    QPCIBus *bus = iommu_pci->pci_vdev.pdev->bus;
+    QTestState *qts = global_qtest;
+    QPCIDevice *edu, *testdev;
+    QPCIBar edu_bar, membar;
+    uint64_t src, dst;
+    int ret;
+
+    alloc = t_alloc;
+    src = guest_alloc(alloc, DMA_PAGE_SIZE);
+    dst = guest_alloc(alloc, DMA_PAGE_SIZE);
+
+    edu = qpci_device_find(bus, EDU_DEVFN);
+    testdev = qpci_device_find(bus, QPCI_DEVFN(6, 0));
+    g_assert(edu && testdev);
+    qpci_device_enable(edu);
+    qpci_device_enable(testdev);
+    edu_bar = qpci_iomap(edu, 0, NULL);
+    membar = qpci_iomap(testdev, 2, NULL);
+
+    /* The endpoint ID is the requester ID of the EDU device on bus 0 */
+    ret = send_attach_detach(qts, v_iommu, VIRTIO_IOMMU_T_ATTACH, 1,
+                             EDU_DEVFN);
+    g_assert_cmpint(ret, ==, 0);
+    ret = send_map(qts, v_iommu, 1, DMA_DST_IOVA,
+                   DMA_DST_IOVA + DMA_PAGE_SIZE - 1, dst,
+                   VIRTIO_IOMMU_MAP_F_WRITE);
+    g_assert_cmpint(ret, ==, 0);
+
+    /* Mapped */
+    qtest_memset(qts, src, 0xa5, DMA_PAGE_SIZE);
+    ret = send_map(qts, v_iommu, 1, DMA_SRC_IOVA,
+                   DMA_SRC_IOVA + DMA_PAGE_SIZE - 1, src,
+                   VIRTIO_IOMMU_MAP_F_READ);
+    g_assert_cmpint(ret, ==, 0);
+    edu_dma_copy(qts, edu, edu_bar, DMA_SRC_IOVA, DMA_DST_IOVA);
+    g_assert(page_is(qts, dst, 0xa5));
+
+    /* Unmapped, the read faults and the device gets zeroes */
+    ret = send_unmap(qts, v_iommu, 1, DMA_SRC_IOVA,
+                     DMA_SRC_IOVA + DMA_PAGE_SIZE - 1);
+    g_assert_cmpint(ret, ==, 0);
+    edu_dma_copy(qts, edu, edu_bar, DMA_SRC_IOVA, DMA_DST_IOVA);
+    g_assert(page_is(qts, dst, 0));
+
+    /* Mapped to RAM behind a BAR */
+    qtest_memset(qts, membar.addr, 0x5a, DMA_PAGE_SIZE);
+    ret = send_map(qts, v_iommu, 1, DMA_SRC_IOVA,
+                   DMA_SRC_IOVA + DMA_PAGE_SIZE - 1, membar.addr,
+                   VIRTIO_IOMMU_MAP_F_READ);
+    g_assert_cmpint(ret, ==, 0);
+    edu_dma_copy(qts, edu, edu_bar, DMA_SRC_IOVA, DMA_DST_IOVA);
+    g_assert(page_is(qts, dst, 0x5a));
+
+    /* The BAR goes away, the translation does not change */
+    qpci_config_writew(testdev, PCI_COMMAND,
+                       qpci_config_readw(testdev, PCI_COMMAND) &
+                       ~PCI_COMMAND_MEMORY);
+    edu_dma_copy(qts, edu, edu_bar, DMA_SRC_IOVA, DMA_DST_IOVA);
+    g_assert(!page_is(qts, dst, 0x5a));
+
+    /* And comes back */
+    qpci_device_enable(testdev);
+    edu_dma_copy(qts, edu, edu_bar, DMA_SRC_IOVA, DMA_DST_IOVA);
+    g_assert(page_is(qts, dst, 0x5a));
+
+    ret = send_attach_detach(qts, v_iommu, VIRTIO_IOMMU_T_DETACH, 1,
+                             EDU_DEVFN);
+    g_assert_cmpint(ret, ==, 0);
+    g_free(testdev);
+    g_free(edu);
+    guest_free(alloc, dst);
+    guest_free(alloc, src);
+}
+
 static void register_virtio_iommu_test(void)
 {
+    QOSGraphTestOptions opts = {
+        .edge.extra_device_opts = "translation-cache-size=64",
+        .edge.after_cmd_line = "-device edu,addr=05.0 "
+                               "-device pci-testdev,addr=06.0,membar=1M,"
+                               "membar-backed=on",
+    };
+
     qos_add_test("config", "virtio-iommu", pci_config, NULL);
     qos_add_test("attach_detach", "virtio-iommu", test_attach_detach, NULL);
     qos_add_test("map_unmap", "virtio-iommu", test_map_unmap, NULL);
+    if (qtest_has_device("edu") && qtest_has_device("pci-testdev")) {
+        qos_add_test("translation_cache", "virtio-iommu",
+                     test_translation_cache, &opts);
+    }
 }
 
 libqos_init(register_virtio_iommu_test);
@@ -0,0 +1,504 @@
+/*
+ * QTest testcase for virtio-net with iothread-vq-mapping
+ *
+ * The property is a list, so the devices are created with JSON.  The queue
+ * pairs only move to their iothreads with a peer that can follow them, i.e.
+ * tap; the tap test is skipped unless /dev/net/tun can be used, e.g. when
+ * running as root.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#include "qemu/osdep.h"
+#include "libqtest.h"
+#include "qemu/iov.h"
+#include "qobject/qdict.h"
+#include "libqos/pci-pc.h"
+#include "libqos/malloc-pc.h"
+#include "libqos/virtio-pci.h"
+#include "standard-headers/linux/virtio_net.h"
+
+#include <linux/if_packet.h>
+#include <linux/if_tun.h>
+#include <net/if.h>
+#include <sys/ioctl.h>
+
+#define BASE_MACHINE "-M pc -nodefaults " \
+    "-object iothread,id=io0 -object iothread,id=io1 "
+
+#define PCI_SLOT                0x04
+#define TEST_ETHERTYPE          0x88b5 /* local experimental */
+#define TEST_BUF_SIZE           2048
+#define TEST_PAIRS              2
+#define TIMEOUT_US              (30 * 1000 * 1000)
+#define VNET_HDR_SIZE           sizeof(struct virtio_net_hdr_mrg_rxbuf)
+
+typedef struct TestNet {
+    QTestState *qts;
+    QGuestAllocator alloc;
+    QPCIBus *pcibus;
+    QVirtioPCIDevice *dev;
+    /* rx0, tx0, rx1, tx1, ..., ctrl */
+    QVirtQueue *vqs[TEST_PAIRS * 2 + 1];
+    int nvqs;
+} TestNet;
+
+/* Receive buffers of TEST_BUF_SIZE, one per descriptor from @head on */
+typedef struct TestRxBufs {
+    uint64_t addr;
+    uint32_t head;
+} TestRxBufs;
+
+static void test_net_start(TestNet *t, const char *netdev, bool mq)
+{
+    QPCIAddress addr = { .devfn = QPCI_DEVFN(PCI_SLOT, 0) };
+    uint64_t features;
+
+    t->qts = qtest_initf(BASE_MACHINE "%s "
+                         "-device '{\"driver\": \"virtio-net-pci\", "
+                         "\"netdev\": \"hs0\", \"addr\": \"04.0\", "
+                         "\"mq\": %s, \"tx\": \"bh\", "
+                         "\"iothread-vq-mapping\": "
+                         "[{\"iothread\": \"io0\"}, {\"iothread\": \"io1\"}]}'",
+                         netdev, mq ? "true" : "false");
+
+    pc_alloc_init(&t->alloc, t->qts, 0);
+    t->pcibus = qpci_new_pc(t->qts, &t->alloc);
+    t->dev = virtio_pci_new(t->pcibus, &addr);
+    g_assert_nonnull(t->dev);
+    qvirtio_pci_device_enable(t->dev);
+    qvirtio_start_device(&t->dev->vdev);
+
+    features = qvirtio_get_features(&t->dev->vdev);
+    features &= ~(QVIRTIO_F_BAD_FEATURE |
+                  (1ull << VIRTIO_RING_F_INDIRECT_DESC) |
+                  (1ull << VIRTIO_RING_F_EVENT_IDX) |
+                  (1ull << VIRTIO_NET_F_GUEST_TSO4) |
+                  (1ull << VIRTIO_NET_F_GUEST_TSO6) |
+                  (1ull << VIRTIO_NET_F_GUEST_UFO) |
+                  (1ull << VIRTIO_NET_F_GUEST_CSUM));
+    g_assert(features & (1ull << VIRTIO_NET_F_MRG_RXBUF));
+    g_assert(!!(features & (1ull << VIRTIO_NET_F_MQ)) == mq);
+    qvirtio_set_features(&t->dev->vdev, features);
+
+    t->nvqs = mq ? TEST_PAIRS * 2 + 1 : 2;
+    for (int i = 0; i < t->nvqs; i++) {
+        t->vqs[i] = qvirtqueue_setup(&t->dev->vdev, &t->alloc, i);
+    }
+    qvirtio_set_driver_ok(&t->dev->vdev);
+}
+
+static void test_net_stop(TestNet *t)
+{
+    for (int i = 0; i < t->nvqs; i++) {
+        qvirtqueue_cleanup(t->dev->vdev.bus, t->vqs[i], &t->alloc);
+    }
+    qos_object_destroy(&t->dev->obj);
+    qpci_free_pc(t->pcibus);
+    alloc_destroy(&t->alloc);
+    qtest_quit(t->qts);
+}
+
+static void test_net_stop_cont(TestNet *t)
+{
+    qtest_qmp_assert_success(t->qts, "{ 'execute': 'stop' }");
+    qtest_qmp_eventwait(t->qts, "STOP");
+    qtest_qmp_assert_success(t->qts, "{ 'execute': 'cont' }");
+    qtest_qmp_eventwait(t->qts, "RESUME");
+}
+
+static uint32_t test_net_add_buf(TestNet *t, QVirtQueue *vq, uint64_t addr,
+                                 uint32_t len, bool write)
+{
+    uint32_t head = qvirtqueue_add(t->qts, vq, addr, len, write, false);
+
+    qvirtqueue_kick(t->qts, &t->dev->vdev, vq, head);
+    return head;
+}
+
+/* Fills a test packet of @len bytes, the payload depends on @seq */
+static void test_net_fill(uint8_t *pkt, size_t len, uint8_t seq)
+{
+    static const uint8_t dst[ETH_ALEN] = { 0x52, 0x54, 0x00, 0x12, 0x34, 0x56 };
+    static const uint8_t src[ETH_ALEN] = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x01 };
+
+    memcpy(pkt, dst, ETH_ALEN);
+    memcpy(pkt + ETH_ALEN, src, ETH_ALEN);
+    stw_be_p(pkt + 2 * ETH_ALEN, TEST_ETHERTYPE);
+    pkt[ETH_HLEN] = seq;
+    for (size_t i = ETH_HLEN + 1; i < len; i++) {
+        pkt[i] = seq + i;
+    }
+}
+
+/* Checks a packet filled by test_net_fill() and returns its @seq */
+static uint8_t test_net_check(const uint8_t *pkt, size_t len)
+{
+    uint8_t seq;
+
+    g_assert_cmpint(len, >, ETH_HLEN);
+    seq = pkt[ETH_HLEN];
+    g_assert_cmpint(lduw_be_p(pkt + 2 * ETH_ALEN), ==, TEST_ETHERTYPE);
+    for (size_t i = ETH_HLEN + 1; i < len; i++) {
+        g_assert_cmpint(pkt[i], ==, (uint8_t)(seq + i));
+    }
+    return seq;
+}
+
+/* Sends a packet of @len bytes with @seq through the tx virtqueue @vq */
+static void test_net_tx(TestNet *t, QVirtQueue *vq, size_t len, uint8_t seq)
+{
+    g_autofree uint8_t *buf = g_malloc0(VNET_HDR_SIZE + len);
+    uint64_t addr = guest_alloc(&t->alloc, VNET_HDR_SIZE + len);
+    uint32_t head;
+
+    test_net_fill(buf + VNET_HDR_SIZE, len, seq);
+    qtest_memwrite(t->qts, addr, buf, VNET_HDR_SIZE + len);
+
+    head = test_net_add_buf(t, vq, addr, VNET_HDR_SIZE + len, false);
+    qvirtio_wait_used_elem(t->qts, &t->dev->vdev, vq, head, NULL, TIMEOUT_US);
+    guest_free(&t->alloc, addr);
+}
+
+/* Returns the first used element of the virtqueues in @vqs */
+static QVirtQueue *test_net_wait_used(TestNet *t, QVirtQueue **vqs, int n,
+                                      uint32_t *head, uint32_t *len)
+{
+    gint64 start_time = g_get_monotonic_time();
+
+    for (;;) {
+        for (int i = 0; i < n; i++) {
+            if (qvirtqueue_get_buf(t->qts, vqs[i], head, len)) {
+                return vqs[i];
+            }
+        }
+        g_assert(g_get_monotonic_time() - start_time <= TIMEOUT_US);
+        qtest_clock_step(t->qts, 100);
+        g_usleep(1000);
+    }
+}
+
+/*
+ * Reads @n packets from the rx virtqueues in @vqs, into the buffers that
+ * test_net_rx_bufs() added.  Returns which sequence numbers arrived, as a
+ * bitmap.
+ */
+static uint64_t test_net_rx(TestNet *t, QVirtQueue **vqs, int nvqs,
+                            const TestRxBufs *bufs, int n)
+{
+    uint8_t buf[TEST_BUF_SIZE];
+    struct virtio_net_hdr_mrg_rxbuf *hdr = (void *)buf;
+    uint64_t seen = 0;
+
+    for (int i = 0; i < n; i++) {
+        uint32_t head, len;
+        QVirtQueue *vq = test_net_wait_used(t, vqs, nvqs, &head, &len);
+        int q = 0;
+
+        while (vqs[q] != vq) {
+            q++;
+        }
+        g_assert_cmpint(head - bufs[q].head, <, n);
+        g_assert_cmpint(len, <=, TEST_BUF_SIZE);
+
+        qtest_memread(t->qts,
+                      bufs[q].addr + (head - bufs[q].head) * TEST_BUF_SIZE,
+                      buf, len);
+        g_assert_cmpint(len, >, VNET_HDR_SIZE);
+        g_assert_cmpint(le16_to_cpu(hdr->num_buffers), ==, 1);
+        seen |= 1ull << test_net_check(buf + VNET_HDR_SIZE,
+                                       len - VNET_HDR_SIZE);
+    }
+    return seen;
+}
+
+/* Adds @n receive buffers to each of the rx virtqueues in @vqs */
+static void test_net_rx_bufs(TestNet *t, QVirtQueue **vqs, int nvqs,
+                             TestRxBufs *bufs, int n)
+{
+    for (int q = 0; q < nvqs; q++) {
+        bufs[q].addr = guest_alloc(&t->alloc, n * TEST_BUF_SIZE);
+        for (int i = 0; i < n; i++) {
+            uint32_t head = test_net_add_buf(t, vqs[q],
+                                             bufs[q].addr + i * TEST_BUF_SIZE,
+                                             TEST_BUF_SIZE, true);
+            bufs[q].head = i ? bufs[q].head : head;
+        }
+    }
+}
+
+static void test_net_rx_free(TestNet *t, TestRxBufs *bufs, int nvqs)
+{
+    for (int q = 0; q < nvqs; q++) {
+        guest_free(&t->alloc, bufs[q].addr);
+    }
+}
+
+/* The device needs tx=bh and existing iothreads */
+static void test_errors(void)
+{
+    QTestState *qts = qtest_init(BASE_MACHINE);
+    QDict *resp;
+
+    resp = qtest_qmp(qts, "{ 'execute': 'device_add', 'arguments': {"
+                          "'driver': 'virtio-net-pci', 'tx': 'timer',"
+                          "'iothread-vq-mapping': [{'iothread': 'io0'}] } }");
+    g_assert_cmpstr(qdict_get_str(qdict_get_qdict(resp, "error"), "desc"), ==,
+                    "iothread-vq-mapping requires tx=bh");
+    qobject_unref(resp);
+
+    resp = qtest_qmp(qts, "{ 'execute': 'device_add', 'arguments': {"
+                          "'driver': 'virtio-net-pci',"
+                          "'iothread-vq-mapping': [{'iothread': 'nope'}] } }");
+    g_assert_cmpstr(qdict_get_str(qdict_get_qdict(resp, "error"), "desc"), ==,
+                    "IOThread \"nope\" object does not exist");
+    qobject_unref(resp);
+
+    qtest_quit(qts);
+}
+
+/*
+ * The socket backend cannot follow the queue pair into an iothread, so
+ * the pair stays in the main loop; packets must flow all the same.
+ */
+static void test_socket(void)
+{
+    g_autofree char *netdev = NULL;
+    QVirtQueue *rx;
+    TestNet t;
+    TestRxBufs bufs;
+    uint32_t len;
+    uint8_t pkt[ETH_ZLEN];
+    int sv[2];
+
+    g_assert_cmpint(socketpair(PF_UNIX, SOCK_STREAM, 0, sv), !=, -1);
+    netdev = g_strdup_printf("-netdev socket,fd=%d,id=hs0", sv[1]);
+    test_net_start(&t, netdev, false);
+    rx = t.vqs[0];
+
+    for (int i = 0; i < 2; i++) {
+        struct iovec iov[] = {
+            { .iov_base = &len, .iov_len = sizeof(len) },
+            { .iov_base = pkt, .iov_len = sizeof(pkt) },
+        };
+
+        /* guest to host */
+        test_net_tx(&t, t.vqs[1], sizeof(pkt), i);
+        g_assert_cmpint(recv(sv[0], &len, sizeof(len), MSG_WAITALL), ==,
+                        sizeof(len));
+        g_assert_cmpint(ntohl(len), ==, sizeof(pkt));
+        g_assert_cmpint(recv(sv[0], pkt, sizeof(pkt), MSG_WAITALL), ==,
+                        sizeof(pkt));
+        g_assert_cmpint(test_net_check(pkt, sizeof(pkt)), ==, i);
+
+        /* host to guest */
+        test_net_rx_bufs(&t, &rx, 1, &bufs, 1);
+        test_net_fill(pkt, sizeof(pkt), i);
+        len = htonl(sizeof(pkt));
+        g_assert_cmpint(iov_send(sv[0], iov, 2, 0, sizeof(len) + sizeof(pkt)),
+                        ==, sizeof(len) + sizeof(pkt));
+        g_assert_cmpint(test_net_rx(&t, &rx, 1, &bufs, 1), ==, 1ull << i);
+        test_net_rx_free(&t, &bufs, 1);
+
+        test_net_stop_cont(&t);
+    }
+
+    test_net_stop(&t);
+    close(sv[0]);
+    close(sv[1]);
+}
+
+typedef struct TestTap {
+    int fds[TEST_PAIRS];
+    int pktfd;
+    int ifindex;
+} TestTap;
+
+static void test_tap_close(TestTap *tap)
+{
+    for (int i = 0; i < TEST_PAIRS; i++) {
+        if (tap->fds[i] >= 0) {
+            close(tap->fds[i]);
+        }
+    }
+    if (tap->pktfd >= 0) {
+        close(tap->pktfd);
+    }
+}
+
+/*
+ * Creates a multiqueue tap device that is up, but has no addresses to
+ * send from, and a packet socket that sends and sees all its packets.
+ */
+static bool test_tap_open(TestTap *tap)
+{
+    struct ifreq ifr = {
+        .ifr_flags = IFF_TAP | IFF_NO_PI | IFF_VNET_HDR | IFF_MULTI_QUEUE,
+    };
+    struct sockaddr_ll sll = {
+        .sll_family = AF_PACKET,
+        .sll_protocol = htons(ETH_P_ALL),
+    };
+    g_autofree char *ipv6 = NULL;
+    int sock;
+    bool ok;
+
+    tap->pktfd = -1;
+    for (int i = 0; i < TEST_PAIRS; i++) {
+        tap->fds[i] = open("/dev/net/tun", O_RDWR);
+        if (tap->fds[i] < 0 || ioctl(tap->fds[i], TUNSETIFF, &ifr) < 0) {
+            return false;
+        }
+    }
+
+    /* No neighbor discovery or router solicitations in the way */
+    ipv6 = g_strdup_printf("/proc/sys/net/ipv6/conf/%s/disable_ipv6",
+                           ifr.ifr_name);
+    g_file_set_contents(ipv6, "1", 1, NULL);
+
+    sock = socket(AF_INET, SOCK_DGRAM, 0);
+    ok = sock >= 0 && ioctl(sock, SIOCGIFFLAGS, &ifr) == 0;
+    ifr.ifr_flags |= IFF_UP;
+    ok = ok && ioctl(sock, SIOCSIFFLAGS, &ifr) == 0;
+    if (sock >= 0) {
+        close(sock);
+    }
+
+    tap->ifindex = sll.sll_ifindex = if_nametoindex(ifr.ifr_name);
+    tap->pktfd = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
+    return ok && tap->ifindex && tap->pktfd >= 0 &&
+           bind(tap->pktfd, (struct sockaddr *)&sll, sizeof(sll)) == 0;
+}
+
+static void test_tap_send(TestTap *tap, size_t len, uint8_t seq)
+{
+    struct sockaddr_ll sll = {
+        .sll_family = AF_PACKET,
+        .sll_ifindex = tap->ifindex,
+        .sll_halen = ETH_ALEN,
+    };
+    g_autofree uint8_t *pkt = g_malloc(len);
+
+    test_net_fill(pkt, len, seq);
+    memcpy(sll.sll_addr, pkt, ETH_ALEN);
+    g_assert_cmpint(sendto(tap->pktfd, pkt, len, 0, (struct sockaddr *)&sll,
+                           sizeof(sll)), ==, len);
+}
+
+/* Returns the @seq of the next test packet that the guest sent */
+static uint8_t test_tap_recv(TestTap *tap)
+{
+    uint8_t pkt[TEST_BUF_SIZE];
+    struct sockaddr_ll sll;
+    socklen_t sll_len;
+    ssize_t len;
+
+    for (;;) {
+        sll_len = sizeof(sll);
+        len = recvfrom(tap->pktfd, pkt, sizeof(pkt), 0,
+                       (struct sockaddr *)&sll, &sll_len);
+        g_assert_cmpint(len, >, 0);
+
+        /* Our own packets come back as outgoing */
+        if (sll.sll_pkttype != PACKET_OUTGOING &&
+            len > ETH_HLEN &&
+            lduw_be_p(pkt + 2 * ETH_ALEN) == TEST_ETHERTYPE) {
+            return test_net_check(pkt, len);
+        }
+    }
+}
+
+/* Sets the number of queue pairs through the control virtqueue */
+static void test_net_set_pairs(TestNet *t, uint16_t pairs)
+{
+    QVirtQueue *ctrl = t->vqs[TEST_PAIRS * 2];
+    struct virtio_net_ctrl_hdr hdr = {
+        .class = VIRTIO_NET_CTRL_MQ,
+        .cmd = VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET,
+    };
+    uint64_t addr = guest_alloc(&t->alloc, 8);
+    uint32_t head;
+
+    qtest_memwrite(t->qts, addr, &hdr, sizeof(hdr));
+    qtest_writew(t->qts, addr + 2, pairs);
+    qtest_writeb(t->qts, addr + 4, 0xff);
+
+    head = qvirtqueue_add(t->qts, ctrl, addr, sizeof(hdr), false, true);
+    qvirtqueue_add(t->qts, ctrl, addr + 2, 2, false, true);
+    qvirtqueue_add(t->qts, ctrl, addr + 4, 1, true, false);
+    qvirtqueue_kick(t->qts, &t->dev->vdev, ctrl, head);
+    qvirtio_wait_used_elem(t->qts, &t->dev->vdev, ctrl, head, NULL,
+                           TIMEOUT_US);
+    g_assert_cmpint(qtest_readb(t->qts, addr + 4), ==, VIRTIO_NET_OK);
+    guest_free(&t->alloc, addr);
+}
+
+/*
+ * Packets go through both queue pairs, each in its own iothread, while
+ * the main loop changes the number of pairs and stops and resumes the VM.
+ */
+static void test_tap_mq(void)
+{
+    g_autofree char *netdev = NULL;
+    QVirtQueue *rx[TEST_PAIRS];
+    TestRxBufs bufs[TEST_PAIRS];
+    const int n = 8;
+    TestTap tap;
+    TestNet t;
+
+    if (!test_tap_open(&tap)) {
+        test_tap_close(&tap);
+        g_test_skip("tap device not available");
+        return;
+    }
+
+    netdev = g_strdup_printf("-netdev tap,fds=%d:%d,vhost=off,id=hs0",
+                             tap.fds[0], tap.fds[1]);
+    test_net_start(&t, netdev, true);
+    test_net_set_pairs(&t, TEST_PAIRS);
+    for (int q = 0; q < TEST_PAIRS; q++) {
+        rx[q] = t.vqs[q * 2];
+    }
+
+    for (int round = 0; round < 2; round++) {
+        /* guest to host, on both pairs */
+        for (int i = 0; i < n; i++) {
+            test_net_tx(&t, t.vqs[(i % TEST_PAIRS) * 2 + 1], 60 + i * 100, i);
+            g_assert_cmpint(test_tap_recv(&tap), ==, i);
+        }
+
+        /* host to guest, tap picks the queue */
+        test_net_rx_bufs(&t, rx, TEST_PAIRS, bufs, n);
+        for (int i = 0; i < n; i++) {
+            test_tap_send(&tap, 60 + i * 100, i);
+        }
+        g_assert_cmpint(test_net_rx(&t, rx, TEST_PAIRS, bufs, n), ==,
+                        (1ull << n) - 1);
+        test_net_rx_free(&t, bufs, TEST_PAIRS);
+
+        test_net_stop_cont(&t);
+    }
+
+    /* Back to a single pair */
+    test_net_set_pairs(&t, 1);
+    test_net_tx(&t, t.vqs[1], ETH_ZLEN, 42);
+    g_assert_cmpint(test_tap_recv(&tap), ==, 42);
+    test_net_rx_bufs(&t, rx, 1, bufs, 1);
+    test_tap_send(&tap, ETH_ZLEN, 43);
+    g_assert_cmpint(test_net_rx(&t, rx, 1, bufs, 1), ==, 1ull << 43);
+    test_net_rx_free(&t, bufs, 1);
+
+    test_net_stop(&t);
+    test_tap_close(&tap);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    qtest_add_func("virtio-net-iothread/errors", test_errors);
+    qtest_add_func("virtio-net-iothread/socket", test_socket);
+    qtest_add_func("virtio-net-iothread/tap-mq", test_tap_mq);
+
+    return g_test_run();
+}
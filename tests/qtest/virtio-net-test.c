@@ -12,10 +12,18 @@
 #include "qemu/iov.h"
 #include "qemu/module.h"
 #include "qobject/qdict.h"
+#include "qobject/qlist.h"
 #include "hw/virtio/virtio-net.h"
 #include "libqos/qgraph.h"
 #include "libqos/virtio-net.h"
 
+#ifdef CONFIG_LINUX
+#include <linux/if_packet.h>
+#include <linux/if_tun.h>
+#include <net/if.h>
+#include <sys/ioctl.h>
+#endif
+
 #ifndef ETH_P_RARP
 #define ETH_P_RARP 0x8035
 #endif
@@ -285,6 +293,417 @@ static void *virtio_net_test_setup(GString *cmd_line, void *arg)
     return sv;
 }
 
+#ifdef CONFIG_LINUX
+
+/*
+ * Tests for packets that the tap backend reads straight into the receive
+ * buffers of virtio-net.  They need a real tap device, so they are skipped
+ * unless /dev/net/tun can be used, e.g. when running as root.  The test
+ * sends packets out of the tap interface with a packet socket, and QEMU
+ * reads them from the other end of the tap device.
+ */
+
+#define TAP_TEST_ETHERTYPE 0x88b5 /* local experimental */
+#define TAP_TEST_BUF_SIZE 2048
+
+typedef struct TapTest {
+    int tapfd;
+    int pktfd;
+    int ifindex;
+    uint8_t seq;
+} TapTest;
+
+static void tap_test_send(TapTest *t, size_t len)
+{
+    static const uint8_t dst[ETH_ALEN] = { 0x52, 0x54, 0x00, 0x12, 0x34, 0x56 };
+    static const uint8_t src[ETH_ALEN] = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x01 };
+    struct sockaddr_ll sll = {
+        .sll_family = AF_PACKET,
+        .sll_ifindex = t->ifindex,
+        .sll_halen = ETH_ALEN,
+    };
+    g_autofree uint8_t *pkt = g_malloc(len);
+    ssize_t ret;
+
+    memcpy(sll.sll_addr, dst, ETH_ALEN);
+    memcpy(pkt, dst, ETH_ALEN);
+    memcpy(pkt + ETH_ALEN, src, ETH_ALEN);
+    stw_be_p(pkt + 2 * ETH_ALEN, TAP_TEST_ETHERTYPE);
+    for (size_t i = ETH_HLEN; i < len; i++) {
+        pkt[i] = t->seq + i;
+    }
+    t->seq++;
+
+    ret = sendto(t->pktfd, pkt, len, 0, (struct sockaddr *)&sll, sizeof(sll));
+    g_assert_cmpint(ret, ==, len);
+}
+
+/* Checks a packet sent by tap_test_send(), @seq is its sequence number */
+static void tap_test_check(const uint8_t *pkt, size_t len, uint8_t seq)
+{
+    g_assert_cmpint(lduw_be_p(pkt + 2 * ETH_ALEN), ==, TAP_TEST_ETHERTYPE);
+    for (size_t i = ETH_HLEN; i < len; i++) {
+        g_assert_cmpint(pkt[i], ==, (uint8_t)(seq + i));
+    }
+}
+
+static uint32_t tap_test_add_buf(QVirtioDevice *dev, QVirtQueue *vq,
+                                 uint64_t addr, uint32_t len)
+{
+    QTestState *qts = global_qtest;
+    uint32_t head = qvirtqueue_add(qts, vq, addr, len, true, false);
+
+    qvirtqueue_kick(qts, dev, vq, head);
+    return head;
+}
+
+/* Waits for the next used element, which must be @head */
+static uint32_t tap_test_wait_used(QVirtQueue *vq, uint32_t head)
+{
+    gint64 start_time = g_get_monotonic_time();
+    uint32_t got_head, len;
+
+    while (!qvirtqueue_get_buf(global_qtest, vq, &got_head, &len)) {
+        g_assert(g_get_monotonic_time() - start_time <=
+                 QVIRTIO_NET_TIMEOUT_US);
+        g_usleep(1000);
+    }
+    g_assert_cmpint(got_head, ==, head);
+    return len;
+}
+
+/* Reads the packet in the @n buffers at @addr, starting with @head */
+static void tap_test_recv(QVirtioDevice *dev, QVirtQueue *vq, uint64_t addr,
+                          uint32_t head, int n, size_t pkt_len, uint8_t seq)
+{
+    g_autofree uint8_t *buf = g_malloc(n * TAP_TEST_BUF_SIZE);
+    size_t total = 0;
+
+    for (int i = 0; i < n; i++) {
+        uint32_t len = tap_test_wait_used(vq, head + i);
+
+        memread(addr + i * TAP_TEST_BUF_SIZE, buf + total, len);
+        total += len;
+    }
+
+    g_assert_cmpint(total, ==, VNET_HDR_SIZE + pkt_len);
+    g_assert_cmpint(qvirtio_readw(dev, global_qtest, addr +
+                    offsetof(struct virtio_net_hdr_mrg_rxbuf, num_buffers)),
+                    ==, n);
+    tap_test_check(buf + VNET_HDR_SIZE, pkt_len, seq);
+}
+
+/* A batch of packets, each in its own buffer */
+static void rx_tap_batch(void *obj, void *data, QGuestAllocator *t_alloc)
+{
+    static const size_t sizes[] = { 60, 1514, 128, 999, 64, 1500, 70, 1024 };
+    QVirtioNet *net_if = obj;
+    QVirtioDevice *dev = net_if->vdev;
+    QVirtQueue *rx = net_if->queues[0];
+    TapTest *t = data;
+    uint64_t addr;
+    uint32_t head = 0;
+
+    if (t->tapfd < 0) {
+        g_test_skip("tap device not available");
+        return;
+    }
+
+    addr = guest_alloc(t_alloc, ARRAY_SIZE(sizes) * TAP_TEST_BUF_SIZE);
+    for (int i = 0; i < ARRAY_SIZE(sizes); i++) {
+        uint32_t n = tap_test_add_buf(dev, rx, addr + i * TAP_TEST_BUF_SIZE,
+                                      TAP_TEST_BUF_SIZE);
+        head = i ? head : n;
+    }
+
+    for (int i = 0; i < ARRAY_SIZE(sizes); i++) {
+        tap_test_send(t, sizes[i]);
+    }
+    for (int i = 0; i < ARRAY_SIZE(sizes); i++) {
+        tap_test_recv(dev, rx, addr + i * TAP_TEST_BUF_SIZE, head + i, 1,
+                      sizes[i], i);
+    }
+
+    guest_free(t_alloc, addr);
+}
+
+/* Packets larger than a buffer, merged over several of them */
+static void rx_tap_mergeable(void *obj, void *data, QGuestAllocator *t_alloc)
+{
+    QVirtioNet *net_if = obj;
+    QVirtioDevice *dev = net_if->vdev;
+    QVirtQueue *rx = net_if->queues[0];
+    TapTest *t = data;
+    const uint32_t small = 512;
+    uint64_t addr;
+    uint32_t head = 0;
+
+    if (t->tapfd < 0) {
+        g_test_skip("tap device not available");
+        return;
+    }
+
+    /* Small buffers at TAP_TEST_BUF_SIZE strides, as tap_test_recv() reads */
+    addr = guest_alloc(t_alloc, 6 * TAP_TEST_BUF_SIZE);
+    for (int i = 0; i < 6; i++) {
+        uint32_t n = tap_test_add_buf(dev, rx,
+                                      addr + i * TAP_TEST_BUF_SIZE, small);
+        head = i ? head : n;
+    }
+
+    /* 3 buffers each */
+    tap_test_send(t, 1514);
+    tap_test_send(t, 1100);
+    tap_test_recv(dev, rx, addr, head, 3, 1514, 0);
+    tap_test_recv(dev, rx, addr + 3 * TAP_TEST_BUF_SIZE, head + 3, 3,
+                  1100, 1);
+
+    guest_free(t_alloc, addr);
+}
+
+/*
+ * The guest runs out of buffers in the middle of a packet; it is queued
+ * and delivered when more buffers are added.  The following packets must
+ * come after it.
+ */
+static void rx_tap_no_buffers(void *obj, void *data, QGuestAllocator *t_alloc)
+{
+    QVirtioNet *net_if = obj;
+    QVirtioDevice *dev = net_if->vdev;
+    QVirtQueue *rx = net_if->queues[0];
+    TapTest *t = data;
+    const uint32_t small = 512;
+    uint64_t addr;
+    uint32_t head;
+
+    if (t->tapfd < 0) {
+        g_test_skip("tap device not available");
+        return;
+    }
+
+    addr = guest_alloc(t_alloc, 4 * TAP_TEST_BUF_SIZE);
+    head = tap_test_add_buf(dev, rx, addr, small);
+
+    tap_test_send(t, 1514);
+    tap_test_send(t, 100);
+
+    /* Give QEMU the time to find out there are too few buffers */
+    g_usleep(100 * 1000);
+    g_assert_false(qvirtqueue_get_buf(global_qtest, rx, NULL, NULL));
+
+    for (int i = 1; i < 4; i++) {
+        tap_test_add_buf(dev, rx, addr + i * TAP_TEST_BUF_SIZE, small);
+    }
+
+    tap_test_recv(dev, rx, addr, head, 3, 1514, 0);
+    tap_test_recv(dev, rx, addr + 3 * TAP_TEST_BUF_SIZE, head + 3, 1,
+                  100, 1);
+
+    guest_free(t_alloc, addr);
+}
+
+static void virtio_net_test_cleanup_tap(void *opaque)
+{
+    TapTest *t = opaque;
+
+    qos_invalidate_command_line();
+    if (t->tapfd >= 0) {
+        close(t->tapfd);
+    }
+    if (t->pktfd >= 0) {
+        close(t->pktfd);
+    }
+    g_free(t);
+}
+
+/* Creates a tap device that is up, but has no addresses to send from */
+static bool virtio_net_test_open_tap(TapTest *t)
+{
+    struct ifreq ifr = {
+        .ifr_flags = IFF_TAP | IFF_NO_PI | IFF_VNET_HDR,
+    };
+    g_autofree char *ipv6 = NULL;
+    int sock;
+    bool ok;
+
+    t->tapfd = open("/dev/net/tun", O_RDWR);
+    if (t->tapfd < 0 || ioctl(t->tapfd, TUNSETIFF, &ifr) < 0) {
+        return false;
+    }
+
+    /* No neighbor discovery or router solicitations in the way */
+    ipv6 = g_strdup_printf("/proc/sys/net/ipv6/conf/%s/disable_ipv6",
+                           ifr.ifr_name);
+    g_file_set_contents(ipv6, "1", 1, NULL);
+
+    sock = socket(AF_INET, SOCK_DGRAM, 0);
+    ok = sock >= 0 && ioctl(sock, SIOCGIFFLAGS, &ifr) == 0;
+    ifr.ifr_flags |= IFF_UP;
+    ok = ok && ioctl(sock, SIOCSIFFLAGS, &ifr) == 0;
+    if (sock >= 0) {
+        close(sock);
+    }
+
+    t->ifindex = if_nametoindex(ifr.ifr_name);
+    t->pktfd = socket(AF_PACKET, SOCK_RAW, 0);
+    return ok && t->ifindex && t->pktfd >= 0;
+}
+
+static void *virtio_net_test_setup_tap(GString *cmd_line, void *arg)
+{
+    TapTest *t = g_new0(TapTest, 1);
+
+    t->pktfd = -1;
+    if (virtio_net_test_open_tap(t)) {
+        g_string_append_printf(cmd_line, " -netdev tap,fd=%d,id=hs0 ",
+                               t->tapfd);
+    } else {
+        if (t->tapfd >= 0) {
+            close(t->tapfd);
+            t->tapfd = -1;
+        }
+        g_string_append(cmd_line, " -netdev hubport,hubid=0,id=hs0 ");
+    }
+
+    g_test_queue_destroy(virtio_net_test_cleanup_tap, t);
+    return t;
+}
+
+#ifdef CONFIG_AF_XDP
+
+/*
+ * Packets that the af-xdp backend receives straight into the buffers of
+ * virtio-net, with memdev.  The test needs an interface and root, so it is
+ * skipped unless QTEST_AF_XDP_IFNAME names one end of a veth pair that is
+ * up, e.g. after
+ *
+ *   ip link add qtest0 type veth peer name qtest1
+ *   ip link set qtest0 up && ip link set qtest1 up
+ *
+ * with QTEST_AF_XDP_IFNAME=qtest0.  The test sends packets from the other
+ * end with a packet socket.
+ */
+
+#define AF_XDP_TEST_PACKETS 32
+
+/* The packets received without a copy, from query-stats */
+static int64_t af_xdp_test_zero_copy(void)
+{
+    QDict *rsp, *result, *stat;
+    int64_t value;
+
+    rsp = qmp("{ 'execute': 'query-stats', 'arguments': {"
+              "  'target': 'netdev', 'providers': [ {"
+              "    'provider': 'af-xdp', 'names': [ 'rx-zero-copy' ] } ] } }");
+    result = qobject_to(QDict, qlist_peek(qdict_get_qlist(rsp, "return")));
+    g_assert(result);
+    stat = qobject_to(QDict, qlist_peek(qdict_get_qlist(result, "stats")));
+    g_assert(stat);
+    g_assert_cmpstr(qdict_get_str(stat, "name"), ==, "rx-zero-copy");
+    value = qdict_get_int(stat, "value");
+    qobject_unref(rsp);
+    return value;
+}
+
+/*
+ * Buffers the size of those of Linux take the packets without a copy, but
+ * for the first few, which the kernel puts in frames of the backend before
+ * any buffer is lent.  Their buffers come from the end of the avail ring,
+ * so the used buffers are found from their head.
+ */
+static void rx_af_xdp_zero_copy(void *obj, void *data,
+                                QGuestAllocator *t_alloc)
+{
+    static const size_t sizes[] = { 60, 1514, 128, 999, 64, 1500, 70, 1024 };
+    QVirtioNet *net_if = obj;
+    QVirtioDevice *dev = net_if->vdev;
+    QVirtQueue *rx = net_if->queues[0];
+    TapTest *t = data;
+    const uint32_t buf_size = 1536;
+    uint8_t buf[TAP_TEST_BUF_SIZE];
+    uint64_t addr;
+    uint32_t head = 0;
+
+    if (t->pktfd < 0) {
+        g_test_skip("no veth interface in QTEST_AF_XDP_IFNAME");
+        return;
+    }
+
+    addr = guest_alloc(t_alloc, AF_XDP_TEST_PACKETS * TAP_TEST_BUF_SIZE);
+    for (int i = 0; i < AF_XDP_TEST_PACKETS; i++) {
+        uint32_t n = tap_test_add_buf(dev, rx, addr + i * TAP_TEST_BUF_SIZE,
+                                      buf_size);
+        head = i ? head : n;
+    }
+
+    for (int i = 0; i < AF_XDP_TEST_PACKETS; i++) {
+        size_t size = sizes[i % ARRAY_SIZE(sizes)];
+        gint64 start_time = g_get_monotonic_time();
+        uint32_t got_head, len;
+
+        tap_test_send(t, size);
+        while (!qvirtqueue_get_buf(global_qtest, rx, &got_head, &len)) {
+            g_assert(g_get_monotonic_time() - start_time <=
+                     QVIRTIO_NET_TIMEOUT_US);
+            g_usleep(1000);
+        }
+
+        g_assert_cmpint(got_head - head, <, AF_XDP_TEST_PACKETS);
+        g_assert_cmpint(len, ==, VNET_HDR_SIZE + size);
+        memread(addr + (got_head - head) * TAP_TEST_BUF_SIZE, buf, len);
+        tap_test_check(buf + VNET_HDR_SIZE, size, i);
+    }
+
+    g_assert_cmpint(af_xdp_test_zero_copy(), >=, AF_XDP_TEST_PACKETS / 2);
+
+    guest_free(t_alloc, addr);
+}
+
+static void *virtio_net_test_setup_af_xdp(GString *cmd_line, void *arg)
+{
+    const char *ifname = g_getenv("QTEST_AF_XDP_IFNAME");
+    TapTest *t = g_new0(TapTest, 1);
+    g_autofree char *path = NULL;
+    g_autofree char *iflink = NULL;
+    char peer[IF_NAMESIZE];
+
+    t->tapfd = t->pktfd = -1;
+    if (ifname) {
+        path = g_strdup_printf("/sys/class/net/%s/iflink", ifname);
+        if (g_file_get_contents(path, &iflink, NULL, NULL)) {
+            t->ifindex = atoi(iflink);
+        }
+    }
+
+    if (t->ifindex && if_indextoname(t->ifindex, peer)) {
+        g_autofree char *ipv6 = NULL;
+
+        /* No neighbor discovery or router solicitations in the way */
+        ipv6 = g_strdup_printf("/proc/sys/net/ipv6/conf/%s/disable_ipv6",
+                               peer);
+        g_file_set_contents(ipv6, "1", 1, NULL);
+        t->pktfd = socket(AF_PACKET, SOCK_RAW, 0);
+    }
+
+    if (t->pktfd >= 0) {
+        g_string_append_printf(cmd_line,
+                               " -object memory-backend-memfd,id=afxdp-mem,"
+                               "size=256M,share=on"
+                               " -machine memory-backend=afxdp-mem"
+                               " -netdev af-xdp,id=hs0,ifname=%s,mode=skb,"
+                               "memdev=afxdp-mem ", ifname);
+    } else {
+        g_string_append(cmd_line, " -netdev hubport,hubid=0,id=hs0 ");
+    }
+
+    g_test_queue_destroy(virtio_net_test_cleanup_tap, t);
+    return t;
+}
+
+#endif /* CONFIG_AF_XDP */
+
+#endif /* CONFIG_LINUX */
+
 #endif /* _WIN32 */
 
 static void large_tx(void *obj, void *data, QGuestAllocator *t_alloc)
@@ -328,6 +747,17 @@ static void register_virtio_net_test(void)
     qos_add_test("basic", "virtio-net", send_recv_test, &opts);
     qos_add_test("rx_stop_cont", "virtio-net", stop_cont_test, &opts);
     qos_add_test("announce-self", "virtio-net", announce_self, &opts);
+#ifdef CONFIG_LINUX
+    opts.before = virtio_net_test_setup_tap;
+    qos_add_test("rx_tap/batch", "virtio-net", rx_tap_batch, &opts);
+    qos_add_test("rx_tap/mergeable", "virtio-net", rx_tap_mergeable, &opts);
+    qos_add_test("rx_tap/no_buffers", "virtio-net", rx_tap_no_buffers, &opts);
+#ifdef CONFIG_AF_XDP
+    opts.before = virtio_net_test_setup_af_xdp;
+    qos_add_test("rx_af_xdp/zero_copy", "virtio-net", rx_af_xdp_zero_copy,
+                 &opts);
+#endif
+#endif
 #endif
 
     /* These tests do not need a loopback backend.  */
@@ -26,6 +26,7 @@ typedef struct TestHBitmapData {
     size_t         size;
     size_t         old_size;
     int            granularity;
+    bool           compressed;
 } TestHBitmapData;
 
 
@@ -80,6 +81,7 @@ static void hbitmap_test_init(TestHBitmapData *data,
 {
     size_t n;
     data->hb = hbitmap_alloc(size, granularity);
+    hbitmap_set_compressed(data->hb, data->compressed);
 
     n = DIV_ROUND_UP(size, BITS_PER_LONG);
     if (n == 0) {
@@ -800,6 +802,20 @@ static void hbitmap_test_add(const char *testpath,
                hbitmap_test_teardown);
 }
 
+static void hbitmap_test_setup_compressed(TestHBitmapData *data,
+                                          const void *unused)
+{
+    data->compressed = true;
+}
+
+static void hbitmap_test_add_compressed(const char *testpath,
+                                        void (*test_func)(TestHBitmapData *data,
+                                                          const void *user_data))
+{
+    g_test_add(testpath, TestHBitmapData, NULL, hbitmap_test_setup_compressed,
+               test_func, hbitmap_test_teardown);
+}
+
 static void test_hbitmap_iter_and_reset(TestHBitmapData *data,
                                         const void *unused)
 {
@@ -1042,6 +1058,93 @@ static void test_hbitmap_next_dirty_area_after_truncate(TestHBitmapData *data,
     test_hbitmap_next_dirty_area_check(data, 0, INT64_MAX);
 }
 
+/* Check every implementation of the bulk operations against the shadow */
+static void test_hbitmap_accel(TestHBitmapData *data, const void *unused)
+{
+    HBitmap *other;
+    uint64_t i;
+
+    do {
+        hbitmap_test_init(data, L2 + 7, 0);
+        other = hbitmap_alloc(L2 + 7, 0);
+
+        hbitmap_test_set(data, 3, L1 * 9 + 5);
+        hbitmap_test_set(data, L1 * 20, L1 * 24);
+        hbitmap_test_reset(data, L1 * 31 + 1, 1);
+        hbitmap_test_set(data, L2 - 2, 9);
+        test_hbitmap_next_x_check(data, 0);
+        test_hbitmap_next_x_check(data, L1 * 20);
+        test_hbitmap_next_x_check(data, L1 * 20 + 3);
+        test_hbitmap_next_x_check(data, L1 * 32);
+        test_hbitmap_next_x_check_range(data, L1 * 20, L1 * 11);
+
+        for (i = L1 * 40 + 1; i < L1 * 56; i += 3) {
+            hbitmap_set(other, i, 1);
+            data->bits[i >> LOG_BITS_PER_LONG] |= 1UL << (i & (L1 - 1));
+        }
+        hbitmap_merge(data->hb, other, data->hb);
+        hbitmap_test_check(data, 0);
+        test_hbitmap_next_x_check(data, L1 * 40);
+
+        hbitmap_free(other);
+        hbitmap_test_teardown(data, NULL);
+    } while (test_hbitmap_next_accel());
+}
+
+/* Compressed bitmaps are split in chunks of 65536 bits */
+#define CHUNK (1 << 16)
+
+static void test_hbitmap_compressed_chunks(TestHBitmapData *data,
+                                           const void *unused)
+{
+    HBitmap *other;
+    uint64_t empty;
+    uint64_t i;
+
+    hbitmap_test_init(data, CHUNK * 8 + 13, 0);
+    g_assert_true(hbitmap_is_compressed(data->hb));
+    empty = hbitmap_memory_usage(data->hb);
+
+    /* Whole chunks are stored as a type only, whatever their contents */
+    hbitmap_test_set(data, CHUNK, CHUNK * 3);
+    g_assert_cmpint(hbitmap_memory_usage(data->hb), ==, empty);
+    hbitmap_test_reset(data, CHUNK * 2, CHUNK);
+    g_assert_cmpint(hbitmap_memory_usage(data->hb), ==, empty);
+
+    /* The last chunk is partial and cannot be full */
+    hbitmap_test_set(data, CHUNK * 8, 13);
+    g_assert_cmpint(hbitmap_memory_usage(data->hb), >, empty);
+    hbitmap_test_reset(data, CHUNK * 8, 13);
+    g_assert_cmpint(hbitmap_memory_usage(data->hb), ==, empty);
+
+    /* A few long runs are compressed once the bitmap is compacted */
+    for (i = 0; i < 4; i++) {
+        hbitmap_test_set(data, CHUNK * 5 + i * 4096, 1024);
+    }
+    hbitmap_set_compressed(data->hb, false);
+    g_assert_false(hbitmap_is_compressed(data->hb));
+    hbitmap_test_check(data, 0);
+    hbitmap_set_compressed(data->hb, true);
+    hbitmap_test_check(data, 0);
+    g_assert_cmpint(hbitmap_memory_usage(data->hb), <,
+                    empty + CHUNK / BITS_PER_BYTE);
+
+    /* Merges with an uncompressed bitmap */
+    other = hbitmap_alloc(CHUNK * 8 + 13, 0);
+    hbitmap_set(other, CHUNK * 2 + 100, CHUNK * 6 - 90);
+    hbitmap_merge(data->hb, other, data->hb);
+    hbitmap_test_set(data, CHUNK * 2 + 100, CHUNK * 6 - 90);
+    g_assert_true(hbitmap_is_compressed(data->hb));
+
+    hbitmap_merge(other, data->hb, other);
+    g_assert_false(hbitmap_is_compressed(other));
+    g_assert_cmpint(hbitmap_count(other), ==, hbitmap_count(data->hb));
+    g_assert_cmpint(hbitmap_memory_usage(other), >,
+                    hbitmap_memory_usage(data->hb));
+
+    hbitmap_free(other);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -1113,6 +1216,40 @@ int main(int argc, char **argv)
     hbitmap_test_add("/hbitmap/next_dirty_area/next_dirty_area_after_truncate",
                      test_hbitmap_next_dirty_area_after_truncate);
 
+    hbitmap_test_add("/hbitmap/accel", test_hbitmap_accel);
+
+    hbitmap_test_add_compressed("/hbitmap/compressed/iter/partial",
+                                test_hbitmap_iter_partial);
+    hbitmap_test_add_compressed("/hbitmap/compressed/set/all",
+                                test_hbitmap_set_all);
+    hbitmap_test_add_compressed("/hbitmap/compressed/set/general",
+                                test_hbitmap_set);
+    hbitmap_test_add_compressed("/hbitmap/compressed/set/overlap",
+                                test_hbitmap_set_overlap);
+    hbitmap_test_add_compressed("/hbitmap/compressed/reset/general",
+                                test_hbitmap_reset);
+    hbitmap_test_add_compressed("/hbitmap/compressed/reset/all",
+                                test_hbitmap_reset_all);
+    hbitmap_test_add_compressed("/hbitmap/compressed/truncate/grow/large",
+                                test_hbitmap_truncate_grow_large);
+    hbitmap_test_add_compressed("/hbitmap/compressed/truncate/shrink/large",
+                                test_hbitmap_truncate_shrink_large);
+    hbitmap_test_add_compressed("/hbitmap/compressed/serialize/basic",
+                                test_hbitmap_serialize_basic);
+    hbitmap_test_add_compressed("/hbitmap/compressed/serialize/part",
+                                test_hbitmap_serialize_part);
+    hbitmap_test_add_compressed("/hbitmap/compressed/serialize/zeroes",
+                                test_hbitmap_serialize_zeroes);
+    hbitmap_test_add_compressed("/hbitmap/compressed/next_zero/next_x_0",
+                                test_hbitmap_next_x_0);
+    hbitmap_test_add_compressed("/hbitmap/compressed/next_dirty_area/"
+                                "next_dirty_area_0",
+                                test_hbitmap_next_dirty_area_0);
+    hbitmap_test_add_compressed("/hbitmap/compressed/accel",
+                                test_hbitmap_accel);
+    hbitmap_test_add_compressed("/hbitmap/compressed/chunks",
+                                test_hbitmap_compressed_chunks);
+
     g_test_run();
 
     return 0;
@@ -0,0 +1,211 @@
+/*
+ * Migration page cache unit tests.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qemu/thread.h"
+#include "../migration/page_cache.h"
+
+#define TEST_PAGE_SIZE 64
+#define TEST_THREADS 4
+#define TEST_THREAD_PAGES 256
+#define TEST_THREAD_ROUNDS 64
+
+static void fill_page(uint8_t *page, uint8_t val)
+{
+    memset(page, val, TEST_PAGE_SIZE);
+}
+
+static void test_init_invalid(void)
+{
+    Error *err = NULL;
+
+    g_assert_null(cache_init(16 * TEST_PAGE_SIZE, TEST_PAGE_SIZE, 3, &err));
+    error_free_or_abort(&err);
+
+    g_assert_null(cache_init(16 * TEST_PAGE_SIZE, TEST_PAGE_SIZE,
+                             PAGE_CACHE_MAX_WAYS * 2, &err));
+    error_free_or_abort(&err);
+
+    g_assert_null(cache_init(3 * TEST_PAGE_SIZE, TEST_PAGE_SIZE, 1, &err));
+    error_free_or_abort(&err);
+}
+
+/* a cache with a single set keeps all pages that fit in it */
+static void test_associativity(void)
+{
+    PageCache *cache = cache_init(4 * TEST_PAGE_SIZE, TEST_PAGE_SIZE, 4,
+                                  &error_abort);
+    PageCacheStats stats;
+    uint8_t page[TEST_PAGE_SIZE];
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        fill_page(page, i);
+        g_assert_cmpint(cache_insert(cache, i * TEST_PAGE_SIZE, page, 0),
+                        ==, 0);
+    }
+
+    for (i = 0; i < 4; i++) {
+        g_assert_true(cache_is_cached(cache, i * TEST_PAGE_SIZE, 0));
+        g_assert_cmpint(get_cached_data(cache, i * TEST_PAGE_SIZE)[0],
+                        ==, i);
+    }
+
+    /* all pages of the set are fresh, nothing can be replaced */
+    fill_page(page, 4);
+    g_assert_cmpint(cache_insert(cache, 4 * TEST_PAGE_SIZE, page, 1), ==, -1);
+    g_assert_false(cache_is_cached(cache, 4 * TEST_PAGE_SIZE, 1));
+
+    cache_get_stats(cache, &stats);
+    g_assert_cmpint(stats.hits, ==, 4);
+    g_assert_cmpint(stats.misses, ==, 1);
+    g_assert_cmpint(stats.evictions, ==, 0);
+    g_assert_cmpint(stats.rejected, ==, 1);
+
+    cache_fini(cache);
+}
+
+/* the page that was hit the least often is evicted first */
+static void test_eviction(void)
+{
+    PageCache *cache = cache_init(4 * TEST_PAGE_SIZE, TEST_PAGE_SIZE, 4,
+                                  &error_abort);
+    PageCacheStats stats;
+    uint8_t page[TEST_PAGE_SIZE];
+    int i, j;
+
+    for (i = 0; i < 4; i++) {
+        fill_page(page, i);
+        cache_insert(cache, i * TEST_PAGE_SIZE, page, 0);
+    }
+
+    /* pages 1, 2 and 3 are dirtied often, page 0 only once */
+    for (j = 0; j < 64; j++) {
+        for (i = 1; i < 4; i++) {
+            g_assert_true(cache_is_cached(cache, i * TEST_PAGE_SIZE, 1));
+        }
+    }
+
+    fill_page(page, 4);
+    g_assert_cmpint(cache_insert(cache, 4 * TEST_PAGE_SIZE, page, 3), ==, 0);
+
+    g_assert_null(get_cached_data(cache, 0));
+    for (i = 1; i < 5; i++) {
+        g_assert_cmpint(get_cached_data(cache, i * TEST_PAGE_SIZE)[0],
+                        ==, i);
+    }
+
+    /* page 4 has no hits yet, so it goes before the others */
+    fill_page(page, 5);
+    g_assert_cmpint(cache_insert(cache, 5 * TEST_PAGE_SIZE, page, 5), ==, 0);
+    g_assert_null(get_cached_data(cache, 4 * TEST_PAGE_SIZE));
+
+    cache_get_stats(cache, &stats);
+    g_assert_cmpint(stats.evictions, ==, 2);
+
+    cache_fini(cache);
+}
+
+static void test_exchange(void)
+{
+    PageCache *cache = cache_init(16 * TEST_PAGE_SIZE, TEST_PAGE_SIZE, 4,
+                                  &error_abort);
+    PageCacheStats stats;
+    uint8_t page[TEST_PAGE_SIZE], old[TEST_PAGE_SIZE];
+
+    fill_page(page, 1);
+    fill_page(old, 0xff);
+    g_assert_false(cache_exchange(cache, 0, page, old, 0));
+    g_assert_cmpint(old[0], ==, 0xff);
+    g_assert_cmpint(get_cached_data(cache, 0)[0], ==, 1);
+
+    fill_page(page, 2);
+    g_assert_true(cache_exchange(cache, 0, page, old, 1));
+    g_assert_cmpint(old[0], ==, 1);
+    g_assert_cmpint(old[TEST_PAGE_SIZE - 1], ==, 1);
+    g_assert_cmpint(get_cached_data(cache, 0)[0], ==, 2);
+
+    cache_get_stats(cache, &stats);
+    g_assert_cmpint(stats.hits, ==, 1);
+    g_assert_cmpint(stats.misses, ==, 1);
+
+    cache_fini(cache);
+}
+
+typedef struct TestThread {
+    QemuThread thread;
+    PageCache *cache;
+    int id;
+    int hits;
+} TestThread;
+
+/* every thread owns its pages, so their contents can be checked */
+static void *exchange_thread(void *opaque)
+{
+    TestThread *t = opaque;
+    uint8_t page[TEST_PAGE_SIZE], old[TEST_PAGE_SIZE];
+    int round, i;
+
+    for (round = 0; round < TEST_THREAD_ROUNDS; round++) {
+        for (i = 0; i < TEST_THREAD_PAGES; i++) {
+            uint64_t addr = (uint64_t)(i * TEST_THREADS + t->id) *
+                            TEST_PAGE_SIZE;
+
+            fill_page(page, round);
+            page[0] = t->id;
+            if (cache_exchange(t->cache, addr, page, old, round)) {
+                g_assert_cmpint(old[0], ==, t->id);
+                g_assert_cmpint(old[1], ==, (uint8_t)(round - 1));
+                t->hits++;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+static void test_threads(void)
+{
+    PageCache *cache = cache_init(TEST_THREADS * TEST_THREAD_PAGES *
+                                  TEST_PAGE_SIZE, TEST_PAGE_SIZE, 8,
+                                  &error_abort);
+    TestThread threads[TEST_THREADS];
+    PageCacheStats stats;
+    uint64_t hits = 0;
+    int i;
+
+    for (i = 0; i < TEST_THREADS; i++) {
+        threads[i] = (TestThread) { .cache = cache, .id = i };
+        qemu_thread_create(&threads[i].thread, "page-cache-test",
+                           exchange_thread, &threads[i],
+                           QEMU_THREAD_JOINABLE);
+    }
+
+    for (i = 0; i < TEST_THREADS; i++) {
+        qemu_thread_join(&threads[i].thread);
+        hits += threads[i].hits;
+    }
+
+    cache_get_stats(cache, &stats);
+    g_assert_cmpint(stats.hits, ==, hits);
+    g_assert_cmpint(stats.hits + stats.misses, ==,
+                    TEST_THREADS * TEST_THREAD_PAGES * TEST_THREAD_ROUNDS);
+    g_assert_cmpint(hits, >, 0);
+
+    cache_fini(cache);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/page_cache/init_invalid", test_init_invalid);
+    g_test_add_func("/page_cache/associativity", test_associativity);
+    g_test_add_func("/page_cache/eviction", test_eviction);
+    g_test_add_func("/page_cache/exchange", test_exchange);
+    g_test_add_func("/page_cache/threads", test_threads);
+    return g_test_run();
+}
@@ -134,6 +134,46 @@ static void test_submit_many(void)
     }
 }
 
+static uint64_t histogram_sum(const uint64_t *hist)
+{
+    uint64_t sum = 0;
+    int i;
+
+    for (i = 0; i < THREAD_POOL_LATENCY_BUCKETS; i++) {
+        sum += hist[i];
+    }
+    return sum;
+}
+
+static void test_stats(void)
+{
+    ThreadPoolAio *pool = aio_get_thread_pool(ctx);
+    ThreadPoolStats before, after;
+    WorkerTestData data[100];
+    int i;
+
+    thread_pool_get_stats(pool, &before);
+
+    for (i = 0; i < 100; i++) {
+        data[i].n = 0;
+        data[i].ret = -EINPROGRESS;
+        thread_pool_submit_aio(worker_cb, &data[i], done_cb, &data[i]);
+    }
+
+    active = 100;
+    while (active > 0) {
+        aio_poll(ctx, true);
+    }
+
+    thread_pool_get_stats(pool, &after);
+    g_assert_cmpint(after.requests - before.requests, ==, 100);
+    g_assert_cmpint(after.steals, >=, before.steals);
+    g_assert_cmpint(histogram_sum(after.queue_ns) -
+                    histogram_sum(before.queue_ns), ==, 100);
+    g_assert_cmpint(histogram_sum(after.run_ns) -
+                    histogram_sum(before.run_ns), ==, 100);
+}
+
 static void do_test_cancel(bool sync)
 {
     WorkerTestData data[100];
@@ -240,6 +280,7 @@ int main(int argc, char **argv)
     g_test_add_func("/thread-pool/submit-aio", test_submit_aio);
     g_test_add_func("/thread-pool/submit-co", test_submit_co);
     g_test_add_func("/thread-pool/submit-many", test_submit_many);
+    g_test_add_func("/thread-pool/stats", test_stats);
     g_test_add_func("/thread-pool/cancel", test_cancel);
     g_test_add_func("/thread-pool/cancel-async", test_cancel_async);
 
@@ -173,6 +173,49 @@ static void test_encode_decode(void)
     }
 }
 
+/*
+ * Decode nzruns of every length up to a few vector widths, and check that
+ * the bytes around them keep their old contents.
+ */
+static void test_encode_decode_run_lengths(void)
+{
+    uint8_t *old = g_malloc(XBZRLE_PAGE_SIZE);
+    uint8_t *new = g_malloc(XBZRLE_PAGE_SIZE);
+    uint8_t *compressed = g_malloc(XBZRLE_PAGE_SIZE);
+    uint8_t *test = g_malloc(XBZRLE_PAGE_SIZE);
+    int len, start, i, dlen, rc;
+
+    for (i = 0; i < XBZRLE_PAGE_SIZE; i++) {
+        old[i] = i * 7;
+    }
+
+    for (len = 1; len <= 130; len++) {
+        for (start = 1; start < 40; start += 13) {
+            memcpy(new, old, XBZRLE_PAGE_SIZE);
+            /* two runs separated by a single unchanged byte */
+            for (i = start; i < start + len; i++) {
+                new[i] = ~old[i];
+                new[i + len + 1] = ~old[i + len + 1];
+            }
+
+            dlen = xbzrle_encode_buffer(old, new, XBZRLE_PAGE_SIZE,
+                                        compressed, XBZRLE_PAGE_SIZE);
+            g_assert(dlen > 0);
+
+            memcpy(test, old, XBZRLE_PAGE_SIZE);
+            rc = xbzrle_decode_buffer(compressed, dlen, test,
+                                      XBZRLE_PAGE_SIZE);
+            g_assert(rc == start + 2 * len + 1);
+            g_assert(memcmp(test, new, XBZRLE_PAGE_SIZE) == 0);
+        }
+    }
+
+    g_free(old);
+    g_free(new);
+    g_free(compressed);
+    g_free(test);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -185,6 +228,8 @@ int main(int argc, char **argv)
     g_test_add_func("/xbzrle/encode_decode_overflow",
                     test_encode_decode_overflow);
     g_test_add_func("/xbzrle/encode_decode", test_encode_decode);
+    g_test_add_func("/xbzrle/encode_decode_run_lengths",
+                    test_encode_decode_run_lengths);
 
     return g_test_run();
 }
@@ -438,7 +438,8 @@ GSource *aio_get_g_source(AioContext *ctx)
 ThreadPoolAio *aio_get_thread_pool(AioContext *ctx)
 {
     if (!ctx->thread_pool) {
-        ctx->thread_pool = thread_pool_new_aio(ctx);
+        /* Other threads can read the statistics of the pool */
+        qatomic_store_release(&ctx->thread_pool, thread_pool_new_aio(ctx));
     }
     return ctx->thread_pool;
 }
@@ -606,6 +607,7 @@ AioContext *aio_context_new(Error **errp)
 #endif
 
     ctx->thread_pool = NULL;
+    ctx->thread_create = NULL;
     qemu_rec_mutex_init(&ctx->lock);
     timerlistgroup_init(&ctx->tlg, aio_timerlist_notify, ctx);
 
@@ -758,3 +760,12 @@ void aio_context_set_thread_pool_params(AioContext *ctx, int64_t min,
         thread_pool_update_params(ctx->thread_pool, ctx);
     }
 }
+
+void aio_context_set_thread_create_func(AioContext *ctx,
+                                        AioThreadCreateFunc *fn,
+                                        void *opaque)
+{
+    assert(!ctx->thread_pool);
+    ctx->thread_create = fn;
+    ctx->thread_create_opaque = opaque;
+}
@@ -11,7 +11,10 @@
 
 #include "qemu/osdep.h"
 #include "qemu/hbitmap.h"
+#include "qemu/bitmap.h"
+#include "qemu/cutils.h"
 #include "qemu/host-utils.h"
+#include "host/cpuinfo.h"
 #include "trace.h"
 #include "crypto/hash.h"
 
@@ -52,6 +55,45 @@
  * O(logB n) as in the non-amortized complexity).
  */
 
+/* Compressed bitmaps split the last level in chunks of 2^16 bits, which
+ * are stored in one of four ways, in the spirit of roaring bitmaps.  Chunks
+ * that have no bit set, or all of them, take no memory at all.  The others
+ * are stored as a plain array of words, which makes setting and resetting
+ * bits as cheap as in an uncompressed bitmap, or as a sorted array of runs
+ * of set bits.  Chunks are only turned into runs in bulk, when enough of
+ * them have been made dense since the last time (see hb_compact); a write
+ * to a chunk that is stored as runs first expands it to an array of words.
+ *
+ * The upper levels are never compressed, they are about 1/64th the size
+ * of the last level anyway.
+ */
+#define HB_CHUNK_LOG           16
+#define HB_CHUNK_BITS          (1 << HB_CHUNK_LOG)
+#define HB_CHUNK_WORDS         (HB_CHUNK_BITS / BITS_PER_LONG)
+#define HB_CHUNK_SHIFT         (HB_CHUNK_LOG - BITS_PER_LEVEL)
+
+/* Do not bother compressing chunks until there are this many dense ones */
+#define HB_COMPACT_MIN_DENSE   64
+
+typedef enum HBitmapChunkType {
+    HB_CHUNK_EMPTY,
+    HB_CHUNK_FULL,
+    HB_CHUNK_DENSE,
+    HB_CHUNK_RUNS,
+} HBitmapChunkType;
+
+typedef struct HBitmapChunk {
+    HBitmapChunkType type;
+    /* Number of runs, for HB_CHUNK_RUNS */
+    uint32_t nr_runs;
+    union {
+        /* HB_CHUNK_DENSE: HB_CHUNK_WORDS words */
+        unsigned long *words;
+        /* HB_CHUNK_RUNS: first and last bit of each run, in order */
+        uint16_t *runs;
+    };
+} HBitmapChunk;
+
 struct HBitmap {
     /*
      * Size of the bitmap, as requested in hbitmap_alloc or in hbitmap_truncate.
@@ -99,8 +141,333 @@ struct HBitmap {
 
     /* The length of each levels[] array. */
     uint64_t sizes[HBITMAP_LEVELS];
+
+    /* If non-NULL, the last level is compressed: levels[HBITMAP_LEVELS - 1]
+     * is NULL and the words of the last level are stored in nr_chunks
+     * chunks of HB_CHUNK_WORDS words instead.
+     */
+    HBitmapChunk *chunks;
+    uint64_t nr_chunks;
+
+    /* Number of HB_CHUNK_DENSE chunks, and how many of them trigger the
+     * next attempt to compress them.
+     */
+    uint64_t dense_chunks;
+    uint64_t compact_threshold;
 };
 
+/* Bulk operations on arrays of words, vectorized for the host if possible */
+typedef struct HBitmapAccel {
+    /* Return the number of set bits in the @n words at @p */
+    uint64_t (*count)(const unsigned long *p, size_t n);
+    /* Return the index of the first word at @p that is not all ones, or @n */
+    size_t (*find_not_ones)(const unsigned long *p, size_t n);
+    /* Compute @dst = @a | @b and return the number of set bits in @dst */
+    uint64_t (*merge)(unsigned long *dst, const unsigned long *a,
+                      const unsigned long *b, size_t n);
+} HBitmapAccel;
+
+static uint64_t hb_count_words_int(const unsigned long *p, size_t n)
+{
+    uint64_t count = 0;
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        count += ctpopl(p[i]);
+    }
+    return count;
+}
+
+static size_t hb_find_not_ones_int(const unsigned long *p, size_t n)
+{
+    size_t i;
+
+    for (i = 0; i < n && p[i] == (unsigned long)-1; i++) {
+        /* nothing */
+    }
+    return i;
+}
+
+static uint64_t hb_merge_words_int(unsigned long *dst, const unsigned long *a,
+                                   const unsigned long *b, size_t n)
+{
+    uint64_t count = 0;
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        dst[i] = a[i] | b[i];
+        count += ctpopl(dst[i]);
+    }
+    return count;
+}
+
+#include "host/hbitmap.c.inc"
+
+static const HBitmapAccel *hb_accel;
+static unsigned accel_index;
+
+bool test_hbitmap_next_accel(void)
+{
+    if (accel_index != 0) {
+        hb_accel = &accel_table[--accel_index];
+        return true;
+    }
+    return false;
+}
+
+static void __attribute__((constructor)) init_accel(void)
+{
+    accel_index = best_accel();
+    hb_accel = &accel_table[accel_index];
+}
+
+/* Return word @idx of a chunk that is stored as runs */
+static unsigned long hb_runs_word(const HBitmapChunk *c, size_t idx)
+{
+    unsigned first = idx * BITS_PER_LONG;
+    unsigned last = first + BITS_PER_LONG - 1;
+    unsigned long word = 0;
+    size_t lo = 0, hi = c->nr_runs;
+
+    /* Find the first run that ends at or after @first */
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (c->runs[2 * mid + 1] < first) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    for (; lo < c->nr_runs && c->runs[2 * lo] <= last; lo++) {
+        unsigned start = MAX(c->runs[2 * lo], first) - first;
+        unsigned end = MIN(c->runs[2 * lo + 1], last) - first;
+
+        word |= (2UL << end) - (1UL << start);
+    }
+    return word;
+}
+
+static unsigned long hb_chunk_word(const HBitmap *hb, size_t pos)
+{
+    const HBitmapChunk *c = &hb->chunks[pos >> HB_CHUNK_SHIFT];
+    size_t idx = pos & (HB_CHUNK_WORDS - 1);
+
+    switch (c->type) {
+    case HB_CHUNK_EMPTY:
+        return 0;
+    case HB_CHUNK_FULL:
+        return ~0UL;
+    case HB_CHUNK_DENSE:
+        return c->words[idx];
+    case HB_CHUNK_RUNS:
+        return hb_runs_word(c, idx);
+    }
+    g_assert_not_reached();
+}
+
+/* Read word @pos of @level */
+static inline unsigned long hb_word(const HBitmap *hb, int level, size_t pos)
+{
+    if (level == HBITMAP_LEVELS - 1 && hb->chunks) {
+        return hb_chunk_word(hb, pos);
+    }
+    return hb->levels[level][pos];
+}
+
+/* Return the words of the chunk, or NULL if it is not stored as words */
+static unsigned long *hb_chunk_words(const HBitmap *hb, size_t pos)
+{
+    const HBitmapChunk *c;
+
+    if (!hb->chunks) {
+        return &hb->levels[HBITMAP_LEVELS - 1][pos];
+    }
+
+    c = &hb->chunks[pos >> HB_CHUNK_SHIFT];
+    if (c->type != HB_CHUNK_DENSE) {
+        return NULL;
+    }
+    return &c->words[pos & (HB_CHUNK_WORDS - 1)];
+}
+
+/* Store the first @n words of chunk @c in @words */
+static void hb_chunk_read(const HBitmapChunk *c, unsigned long *words,
+                          size_t n)
+{
+    size_t i;
+
+    switch (c->type) {
+    case HB_CHUNK_EMPTY:
+        memset(words, 0, n * sizeof(unsigned long));
+        break;
+    case HB_CHUNK_FULL:
+        memset(words, 0xff, n * sizeof(unsigned long));
+        break;
+    case HB_CHUNK_DENSE:
+        memcpy(words, c->words, n * sizeof(unsigned long));
+        break;
+    case HB_CHUNK_RUNS:
+        memset(words, 0, n * sizeof(unsigned long));
+        for (i = 0; i < c->nr_runs && c->runs[2 * i] < n * BITS_PER_LONG; i++) {
+            unsigned last = MIN(c->runs[2 * i + 1], n * BITS_PER_LONG - 1);
+            bitmap_set(words, c->runs[2 * i], last - c->runs[2 * i] + 1);
+        }
+        break;
+    }
+}
+
+/* Free the storage of chunk @c, and make it empty or full */
+static void hb_chunk_clear(HBitmap *hb, HBitmapChunk *c,
+                           HBitmapChunkType type)
+{
+    assert(type == HB_CHUNK_EMPTY || type == HB_CHUNK_FULL);
+
+    if (c->type == HB_CHUNK_DENSE) {
+        g_free(c->words);
+        hb->dense_chunks--;
+    } else if (c->type == HB_CHUNK_RUNS) {
+        g_free(c->runs);
+    }
+    c->type = type;
+    c->nr_runs = 0;
+    c->words = NULL;
+}
+
+/* Store chunk @c as an array of words, and return it */
+static unsigned long *hb_chunk_dense(HBitmap *hb, HBitmapChunk *c)
+{
+    unsigned long *words;
+
+    if (c->type == HB_CHUNK_DENSE) {
+        return c->words;
+    }
+
+    words = g_new(unsigned long, HB_CHUNK_WORDS);
+    hb_chunk_read(c, words, HB_CHUNK_WORDS);
+    hb_chunk_clear(hb, c, HB_CHUNK_EMPTY);
+    c->type = HB_CHUNK_DENSE;
+    c->words = words;
+    hb->dense_chunks++;
+    return words;
+}
+
+/* Return a pointer to word @pos of @level, for writing.  In compressed
+ * bitmaps the words that follow are only valid up to the end of the chunk.
+ */
+static unsigned long *hb_words(HBitmap *hb, int level, size_t pos)
+{
+    if (level < HBITMAP_LEVELS - 1 || !hb->chunks) {
+        return &hb->levels[level][pos];
+    }
+    return hb_chunk_dense(hb, &hb->chunks[pos >> HB_CHUNK_SHIFT]) +
+           (pos & (HB_CHUNK_WORDS - 1));
+}
+
+/* Return how many of the @n words from @pos can be accessed through a
+ * single pointer returned by hb_words or hb_chunk_words.
+ */
+static size_t hb_words_span(const HBitmap *hb, size_t pos, size_t n)
+{
+    if (!hb->chunks) {
+        return n;
+    }
+    return MIN(n, HB_CHUNK_WORDS - (pos & (HB_CHUNK_WORDS - 1)));
+}
+
+/* Whether chunk @chunk is entirely within the bitmap, so that it can be
+ * full (bits past the end of the bitmap are always clear).
+ */
+static bool hb_chunk_can_fill(const HBitmap *hb, uint64_t chunk)
+{
+    return ((chunk + 1) << HB_CHUNK_LOG) <= hb->size;
+}
+
+/* Use the upper level to check whether all bits of a chunk are clear */
+static bool hb_chunk_is_zero(const HBitmap *hb, uint64_t chunk)
+{
+    const unsigned long *up = hb->levels[HBITMAP_LEVELS - 2];
+    size_t pos = chunk << HB_CHUNK_SHIFT;
+    size_t end = MIN(pos + HB_CHUNK_WORDS, hb->sizes[HBITMAP_LEVELS - 1]);
+
+    return find_next_bit(up, end, pos) >= end;
+}
+
+/* Store a dense chunk in the most compact form */
+static void hb_chunk_compact(HBitmap *hb, uint64_t chunk)
+{
+    HBitmapChunk *c = &hb->chunks[chunk];
+    unsigned long *words = c->words;
+    unsigned long carry = 0;
+    uint64_t count = 0;
+    uint32_t nr_runs = 0;
+    unsigned long start, end;
+    size_t i;
+
+    if (c->type != HB_CHUNK_DENSE) {
+        return;
+    }
+
+    for (i = 0; i < HB_CHUNK_WORDS; i++) {
+        /* Count the set bits whose predecessor is clear */
+        nr_runs += ctpopl(words[i] & ~((words[i] << 1) | carry));
+        carry = words[i] >> (BITS_PER_LONG - 1);
+        count += ctpopl(words[i]);
+    }
+
+    if (count == 0) {
+        hb_chunk_clear(hb, c, HB_CHUNK_EMPTY);
+        return;
+    }
+    if (count == HB_CHUNK_BITS && hb_chunk_can_fill(hb, chunk)) {
+        hb_chunk_clear(hb, c, HB_CHUNK_FULL);
+        return;
+    }
+
+    /* Keep the words unless runs take at most half the memory */
+    if (nr_runs * 2 * sizeof(uint16_t) >
+        HB_CHUNK_WORDS * sizeof(unsigned long) / 2) {
+        return;
+    }
+
+    c->runs = g_new(uint16_t, 2 * nr_runs);
+    c->nr_runs = nr_runs;
+    c->type = HB_CHUNK_RUNS;
+    hb->dense_chunks--;
+
+    i = 0;
+    start = find_next_bit(words, HB_CHUNK_BITS, 0);
+    while (start < HB_CHUNK_BITS) {
+        end = find_next_zero_bit(words, HB_CHUNK_BITS, start);
+        c->runs[i++] = start;
+        c->runs[i++] = end - 1;
+        start = find_next_bit(words, HB_CHUNK_BITS, end);
+    }
+    assert(i == 2 * nr_runs);
+    g_free(words);
+}
+
+static void hb_compact(HBitmap *hb)
+{
+    uint64_t i;
+
+    for (i = 0; i < hb->nr_chunks; i++) {
+        hb_chunk_compact(hb, i);
+    }
+    hb->compact_threshold = MAX(hb->dense_chunks * 2, HB_COMPACT_MIN_DENSE);
+}
+
+/* Compress the dense chunks once their number has doubled, so that the
+ * cost of compressing them is amortized over the writes that made them
+ * dense.
+ */
+static void hb_maybe_compact(HBitmap *hb)
+{
+    if (hb->chunks && hb->dense_chunks >= hb->compact_threshold) {
+        hb_compact(hb);
+    }
+}
+
 /* Advance hbi to the next nonzero word and return it.  hbi->pos
  * is updated.  Returns zero if we reach the end of the bitmap.
  */
@@ -136,7 +503,7 @@ static unsigned long hbitmap_iter_skip_words(HBitmapIter *hbi)
         hbi->cur[i] = cur & (cur - 1);
 
         /* Set up next level for iteration.  */
-        cur = hb->levels[i + 1][pos];
+        cur = hb_word(hb, i + 1, pos);
     }
 
     hbi->pos = pos;
@@ -149,7 +516,7 @@ static unsigned long hbitmap_iter_skip_words(HBitmapIter *hbi)
 int64_t hbitmap_iter_next(HBitmapIter *hbi)
 {
     unsigned long cur = hbi->cur[HBITMAP_LEVELS - 1] &
-            hbi->hb->levels[HBITMAP_LEVELS - 1][hbi->pos];
+            hb_word(hbi->hb, HBITMAP_LEVELS - 1, hbi->pos);
     int64_t item;
 
     if (cur == 0) {
@@ -182,7 +549,7 @@ void hbitmap_iter_init(HBitmapIter *hbi, const HBitmap *hb, uint64_t first)
         pos >>= BITS_PER_LEVEL;
 
         /* Drop bits representing items before first.  */
-        hbi->cur[i] = hb->levels[i][pos] & ~((1UL << bit) - 1);
+        hbi->cur[i] = hb_word(hb, i, pos) & ~((1UL << bit) - 1);
 
         /* We have already added level i+1, so the lowest set bit has
          * been processed.  Clear it.
@@ -217,11 +584,41 @@ int64_t hbitmap_next_dirty(const HBitmap *hb, int64_t start, int64_t count)
     return MAX(start, first_dirty_off);
 }
 
+/* Return the first word of the last level in [pos, end) that is not all
+ * ones, or @end.
+ */
+static size_t hb_find_not_ones(const HBitmap *hb, size_t pos, size_t end)
+{
+    while (pos < end) {
+        const HBitmapChunk *c = NULL;
+        size_t n = hb_words_span(hb, pos, end - pos);
+        const unsigned long *words = hb_chunk_words(hb, pos);
+
+        if (hb->chunks) {
+            c = &hb->chunks[pos >> HB_CHUNK_SHIFT];
+        }
+
+        if (words) {
+            size_t found = hb_accel->find_not_ones(words, n);
+            if (found < n) {
+                return pos + found;
+            }
+        } else if (c->type != HB_CHUNK_FULL) {
+            for (; n; pos++, n--) {
+                if (hb_chunk_word(hb, pos) != (unsigned long)-1) {
+                    return pos;
+                }
+            }
+        }
+        pos += n;
+    }
+    return end;
+}
+
 int64_t hbitmap_next_zero(const HBitmap *hb, int64_t start, int64_t count)
 {
     size_t pos = (start >> hb->granularity) >> BITS_PER_LEVEL;
-    unsigned long *last_lev = hb->levels[HBITMAP_LEVELS - 1];
-    unsigned long cur = last_lev[pos];
+    unsigned long cur;
     unsigned start_bit_offset;
     uint64_t end_bit, sz;
     int64_t res;
@@ -232,6 +629,8 @@ int64_t hbitmap_next_zero(const HBitmap *hb, int64_t start, int64_t count)
         return -1;
     }
 
+    cur = hb_word(hb, HBITMAP_LEVELS - 1, pos);
+
     end_bit = count > hb->orig_size - start ?
                 hb->size :
                 ((start + count - 1) >> hb->granularity) + 1;
@@ -245,15 +644,12 @@ int64_t hbitmap_next_zero(const HBitmap *hb, int64_t start, int64_t count)
     assert((start >> hb->granularity) < hb->size);
 
     if (cur == (unsigned long)-1) {
-        do {
-            pos++;
-        } while (pos < sz && last_lev[pos] == (unsigned long)-1);
-
+        pos = hb_find_not_ones(hb, pos + 1, sz);
         if (pos >= sz) {
             return -1;
         }
 
-        cur = last_lev[pos];
+        cur = hb_word(hb, HBITMAP_LEVELS - 1, pos);
     }
 
     res = (pos << BITS_PER_LEVEL) + ctol(cur);
@@ -349,63 +745,60 @@ uint64_t hbitmap_count(const HBitmap *hb)
     return hb->count << hb->granularity;
 }
 
-/**
- * hbitmap_iter_next_word:
- * @hbi: HBitmapIter to operate on.
- * @p_cur: Location where to store the next non-zero word.
- *
- * Return the index of the next nonzero word that is set in @hbi's
- * associated HBitmap, and set *p_cur to the content of that word
- * (bits before the index that was passed to hbitmap_iter_init are
- * trimmed on the first call).  Return -1, and set *p_cur to zero,
- * if all remaining words are zero.
- */
-static size_t hbitmap_iter_next_word(HBitmapIter *hbi, unsigned long *p_cur)
+/* Count the number of set bits in @n words of the last level from @pos */
+static uint64_t hb_count_words(const HBitmap *hb, size_t pos, size_t n)
 {
-    unsigned long cur = hbi->cur[HBITMAP_LEVELS - 1];
+    uint64_t count = 0;
 
-    if (cur == 0) {
-        cur = hbitmap_iter_skip_words(hbi);
-        if (cur == 0) {
-            *p_cur = 0;
-            return -1;
+    while (n) {
+        size_t span = hb_words_span(hb, pos, n);
+        const unsigned long *words = hb_chunk_words(hb, pos);
+        const HBitmapChunk *c;
+        size_t i;
+
+        if (words) {
+            count += hb_accel->count(words, span);
+        } else {
+            c = &hb->chunks[pos >> HB_CHUNK_SHIFT];
+            if (c->type == HB_CHUNK_FULL) {
+                count += (uint64_t)span * BITS_PER_LONG;
+            } else if (c->type == HB_CHUNK_RUNS && span == HB_CHUNK_WORDS) {
+                for (i = 0; i < c->nr_runs; i++) {
+                    count += c->runs[2 * i + 1] - c->runs[2 * i] + 1;
+                }
+            } else if (c->type == HB_CHUNK_RUNS) {
+                for (i = 0; i < span; i++) {
+                    count += ctpopl(hb_chunk_word(hb, pos + i));
+                }
+            }
         }
+        pos += span;
+        n -= span;
     }
-
-    /* The next call will resume work from the next word.  */
-    hbi->cur[HBITMAP_LEVELS - 1] = 0;
-    *p_cur = cur;
-    return hbi->pos;
+    return count;
 }
 
-/* Count the number of set bits between start and end, not accounting for
- * the granularity.  Also an example of how to use hbitmap_iter_next_word.
+/* Count the number of set bits between start and last, not accounting for
+ * the granularity.  All callers go on to touch every word of the range
+ * anyway, so there is no point in walking the upper levels to skip the
+ * zero words: just count the bits of the last level in bulk.
  */
 static uint64_t hb_count_between(HBitmap *hb, uint64_t start, uint64_t last)
 {
-    HBitmapIter hbi;
-    uint64_t count = 0;
-    uint64_t end = last + 1;
-    unsigned long cur;
-    size_t pos;
-
-    hbitmap_iter_init(&hbi, hb, start << hb->granularity);
-    for (;;) {
-        pos = hbitmap_iter_next_word(&hbi, &cur);
-        if (pos >= (end >> BITS_PER_LEVEL)) {
-            break;
-        }
-        count += ctpopl(cur);
-    }
+    size_t pos = start >> BITS_PER_LEVEL;
+    size_t lastpos = last >> BITS_PER_LEVEL;
+    unsigned long first_mask = ~0UL << (start & (BITS_PER_LONG - 1));
+    unsigned long last_mask =
+        ~0UL >> (BITS_PER_LONG - 1 - (last & (BITS_PER_LONG - 1)));
+    unsigned long first = hb_word(hb, HBITMAP_LEVELS - 1, pos);
 
-    if (pos == (end >> BITS_PER_LEVEL)) {
-        /* Drop bits representing the END-th and subsequent items.  */
-        int bit = end & (BITS_PER_LONG - 1);
-        cur &= (1UL << bit) - 1;
-        count += ctpopl(cur);
+    if (pos == lastpos) {
+        return ctpopl(first & first_mask & last_mask);
     }
 
-    return count;
+    return ctpopl(first & first_mask) +
+           hb_count_words(hb, pos + 1, lastpos - pos - 1) +
+           ctpopl(hb_word(hb, HBITMAP_LEVELS - 1, lastpos) & last_mask);
 }
 
 /* Setting starts at the last layer and propagates up if an element
@@ -427,30 +820,32 @@ static inline bool hb_set_elem(unsigned long *elem, uint64_t start, uint64_t las
 }
 
 /* The recursive workhorse (the depth is limited to HBITMAP_LEVELS)...
- * Returns true if at least one bit is changed. */
+ * Returns true if at least one bit is changed.  In compressed bitmaps,
+ * the range must not cross a chunk boundary at the last level. */
 static bool hb_set_between(HBitmap *hb, int level, uint64_t start,
                            uint64_t last)
 {
     size_t pos = start >> BITS_PER_LEVEL;
     size_t lastpos = last >> BITS_PER_LEVEL;
+    unsigned long *words = hb_words(hb, level, pos);
     bool changed = false;
     size_t i;
 
     i = pos;
     if (i < lastpos) {
         uint64_t next = (start | (BITS_PER_LONG - 1)) + 1;
-        changed |= hb_set_elem(&hb->levels[level][i], start, next - 1);
+        changed |= hb_set_elem(&words[i - pos], start, next - 1);
         for (;;) {
             start = next;
             next += BITS_PER_LONG;
             if (++i == lastpos) {
                 break;
             }
-            changed |= (hb->levels[level][i] == 0);
-            hb->levels[level][i] = ~0UL;
+            changed |= (words[i - pos] == 0);
+            words[i - pos] = ~0UL;
         }
     }
-    changed |= hb_set_elem(&hb->levels[level][i], start, last);
+    changed |= hb_set_elem(&words[i - pos], start, last);
 
     /* If there was any change in this layer, we may have to update
      * the one above.
@@ -461,6 +856,40 @@ static bool hb_set_between(HBitmap *hb, int level, uint64_t start,
     return changed;
 }
 
+/* Set bits first to last of the last level, a chunk at a time in compressed
+ * bitmaps.  Returns true if at least one bit is changed.
+ */
+static bool hb_set_range(HBitmap *hb, uint64_t first, uint64_t last)
+{
+    bool changed = false;
+
+    if (!hb->chunks) {
+        return hb_set_between(hb, HBITMAP_LEVELS - 1, first, last);
+    }
+
+    while (first <= last) {
+        uint64_t chunk = first >> HB_CHUNK_LOG;
+        uint64_t chunk_last = ((chunk + 1) << HB_CHUNK_LOG) - 1;
+        uint64_t seg_last = MIN(last, chunk_last);
+        HBitmapChunk *c = &hb->chunks[chunk];
+
+        if (c->type == HB_CHUNK_FULL) {
+            /* nothing to do */
+        } else if (first == (chunk << HB_CHUNK_LOG) && seg_last == chunk_last) {
+            hb_chunk_clear(hb, c, HB_CHUNK_FULL);
+            hb_set_between(hb, HBITMAP_LEVELS - 2, first >> BITS_PER_LEVEL,
+                           seg_last >> BITS_PER_LEVEL);
+            changed = true;
+        } else {
+            changed |= hb_set_between(hb, HBITMAP_LEVELS - 1, first, seg_last);
+        }
+        first = seg_last + 1;
+    }
+
+    hb_maybe_compact(hb);
+    return changed;
+}
+
 void hbitmap_set(HBitmap *hb, uint64_t start, uint64_t count)
 {
     /* Compute range in the last layer.  */
@@ -480,7 +909,7 @@ void hbitmap_set(HBitmap *hb, uint64_t start, uint64_t count)
     n = last - first + 1;
 
     hb->count += n - hb_count_between(hb, first, last);
-    if (hb_set_between(hb, HBITMAP_LEVELS - 1, first, last) &&
+    if (hb_set_range(hb, first, last) &&
         hb->meta) {
         hbitmap_set(hb->meta, start, count);
     }
@@ -505,12 +934,15 @@ static inline bool hb_reset_elem(unsigned long *elem, uint64_t start, uint64_t l
 }
 
 /* The recursive workhorse (the depth is limited to HBITMAP_LEVELS)...
- * Returns true if at least one bit is changed. */
+ * Returns true if at least one bit is changed.  In compressed bitmaps,
+ * the range must not cross a chunk boundary at the last level. */
 static bool hb_reset_between(HBitmap *hb, int level, uint64_t start,
                              uint64_t last)
 {
     size_t pos = start >> BITS_PER_LEVEL;
     size_t lastpos = last >> BITS_PER_LEVEL;
+    size_t base = pos;
+    unsigned long *words = hb_words(hb, level, pos);
     bool changed = false;
     size_t i;
 
@@ -523,7 +955,7 @@ static bool hb_reset_between(HBitmap *hb, int level, uint64_t start,
          * unless the lower-level word became entirely zero.  So, remove pos
          * from the upper-level range if bits remain set.
          */
-        if (hb_reset_elem(&hb->levels[level][i], start, next - 1)) {
+        if (hb_reset_elem(&words[i - base], start, next - 1)) {
             changed = true;
         } else {
             pos++;
@@ -535,13 +967,13 @@ static bool hb_reset_between(HBitmap *hb, int level, uint64_t start,
             if (++i == lastpos) {
                 break;
             }
-            changed |= (hb->levels[level][i] != 0);
-            hb->levels[level][i] = 0UL;
+            changed |= (words[i - base] != 0);
+            words[i - base] = 0UL;
         }
     }
 
     /* Same as above, this time for lastpos.  */
-    if (hb_reset_elem(&hb->levels[level][i], start, last)) {
+    if (hb_reset_elem(&words[i - base], start, last)) {
         changed = true;
     } else {
         lastpos--;
@@ -555,6 +987,44 @@ static bool hb_reset_between(HBitmap *hb, int level, uint64_t start,
 
 }
 
+/* Reset bits first to last of the last level, a chunk at a time in
+ * compressed bitmaps.  Returns true if at least one bit is changed.
+ */
+static bool hb_reset_range(HBitmap *hb, uint64_t first, uint64_t last)
+{
+    bool changed = false;
+
+    if (!hb->chunks) {
+        return hb_reset_between(hb, HBITMAP_LEVELS - 1, first, last);
+    }
+
+    while (first <= last) {
+        uint64_t chunk = first >> HB_CHUNK_LOG;
+        uint64_t chunk_last = ((chunk + 1) << HB_CHUNK_LOG) - 1;
+        uint64_t seg_last = MIN(last, chunk_last);
+        HBitmapChunk *c = &hb->chunks[chunk];
+
+        if (c->type == HB_CHUNK_EMPTY) {
+            /* nothing to do */
+        } else if (first == (chunk << HB_CHUNK_LOG) && seg_last == chunk_last) {
+            hb_chunk_clear(hb, c, HB_CHUNK_EMPTY);
+            hb_reset_between(hb, HBITMAP_LEVELS - 2, first >> BITS_PER_LEVEL,
+                             seg_last >> BITS_PER_LEVEL);
+            changed = true;
+        } else {
+            changed |= hb_reset_between(hb, HBITMAP_LEVELS - 1, first,
+                                        seg_last);
+            if (hb_chunk_is_zero(hb, chunk)) {
+                hb_chunk_clear(hb, c, HB_CHUNK_EMPTY);
+            }
+        }
+        first = seg_last + 1;
+    }
+
+    hb_maybe_compact(hb);
+    return changed;
+}
+
 void hbitmap_reset(HBitmap *hb, uint64_t start, uint64_t count)
 {
     /* Compute range in the last layer.  */
@@ -577,7 +1047,7 @@ void hbitmap_reset(HBitmap *hb, uint64_t start, uint64_t count)
     assert(last < hb->size);
 
     hb->count -= hb_count_between(hb, first, last);
-    if (hb_reset_between(hb, HBITMAP_LEVELS - 1, first, last) &&
+    if (hb_reset_range(hb, first, last) &&
         hb->meta) {
         hbitmap_set(hb->meta, start, count);
     }
@@ -589,8 +1059,15 @@ void hbitmap_reset_all(HBitmap *hb)
 
     /* Same as hbitmap_alloc() except for memset() instead of malloc() */
     for (i = HBITMAP_LEVELS; --i >= 1; ) {
-        memset(hb->levels[i], 0, hb->sizes[i] * sizeof(unsigned long));
+        if (hb->levels[i]) {
+            memset(hb->levels[i], 0, hb->sizes[i] * sizeof(unsigned long));
+        }
+    }
+
+    for (i = 0; i < hb->nr_chunks; i++) {
+        hb_chunk_clear(hb, &hb->chunks[i], HB_CHUNK_EMPTY);
     }
+    hb->compact_threshold = HB_COMPACT_MIN_DENSE;
 
     hb->levels[0][0] = 1UL << (BITS_PER_LONG - 1);
     hb->count = 0;
@@ -621,7 +1098,7 @@ bool hbitmap_get(const HBitmap *hb, uint64_t item)
     unsigned long bit = 1UL << (pos & (BITS_PER_LONG - 1));
     assert(pos < hb->size);
 
-    return (hb->levels[HBITMAP_LEVELS - 1][pos >> BITS_PER_LEVEL] & bit) != 0;
+    return (hb_word(hb, HBITMAP_LEVELS - 1, pos >> BITS_PER_LEVEL) & bit) != 0;
 }
 
 uint64_t hbitmap_serialization_align(const HBitmap *hb)
@@ -638,7 +1115,7 @@ uint64_t hbitmap_serialization_align(const HBitmap *hb)
  */
 static void serialization_chunk(const HBitmap *hb,
                                 uint64_t start, uint64_t count,
-                                unsigned long **first_el, uint64_t *el_count)
+                                uint64_t *first_el, uint64_t *el_count)
 {
     uint64_t last = start + count - 1;
     uint64_t gran = hbitmap_serialization_align(hb);
@@ -652,7 +1129,7 @@ static void serialization_chunk(const HBitmap *hb,
     start = (start >> hb->granularity) >> BITS_PER_LEVEL;
     last = (last >> hb->granularity) >> BITS_PER_LEVEL;
 
-    *first_el = &hb->levels[HBITMAP_LEVELS - 1][start];
+    *first_el = start;
     *el_count = last - start + 1;
 }
 
@@ -660,12 +1137,12 @@ uint64_t hbitmap_serialization_size(const HBitmap *hb,
                                     uint64_t start, uint64_t count)
 {
     uint64_t el_count;
-    unsigned long *cur;
+    uint64_t pos;
 
     if (!count) {
         return 0;
     }
-    serialization_chunk(hb, start, count, &cur, &el_count);
+    serialization_chunk(hb, start, count, &pos, &el_count);
 
     return el_count * sizeof(unsigned long);
 }
@@ -674,21 +1151,33 @@ void hbitmap_serialize_part(const HBitmap *hb, uint8_t *buf,
                             uint64_t start, uint64_t count)
 {
     uint64_t el_count;
-    unsigned long *cur, *end;
+    uint64_t pos;
 
     if (!count) {
         return;
     }
-    serialization_chunk(hb, start, count, &cur, &el_count);
-    end = cur + el_count;
+    serialization_chunk(hb, start, count, &pos, &el_count);
+
+    while (el_count) {
+        size_t n = hb_words_span(hb, pos, el_count);
+        const unsigned long *cur = hb_chunk_words(hb, pos);
+        size_t i;
 
-    while (cur != end) {
-        unsigned long el =
-            (BITS_PER_LONG == 32 ? cpu_to_le32(*cur) : cpu_to_le64(*cur));
+        /* The serialized format is the little endian in-memory layout */
+        if (cur && !HOST_BIG_ENDIAN) {
+            memcpy(buf, cur, n * sizeof(unsigned long));
+        } else {
+            for (i = 0; i < n; i++) {
+                unsigned long el = cur ? cur[i] : hb_chunk_word(hb, pos + i);
 
-        memcpy(buf, &el, sizeof(el));
-        buf += sizeof(el);
-        cur++;
+                el = (BITS_PER_LONG == 32 ? cpu_to_le32(el) : cpu_to_le64(el));
+                memcpy(buf + i * sizeof(el), &el, sizeof(el));
+            }
+        }
+
+        buf += n * sizeof(unsigned long);
+        pos += n;
+        el_count -= n;
     }
 }
 
@@ -697,43 +1186,78 @@ void hbitmap_deserialize_part(HBitmap *hb, uint8_t *buf,
                               bool finish)
 {
     uint64_t el_count;
-    unsigned long *cur, *end;
+    uint64_t pos;
 
     if (!count) {
         return;
     }
-    serialization_chunk(hb, start, count, &cur, &el_count);
-    end = cur + el_count;
-
-    while (cur != end) {
-        memcpy(cur, buf, sizeof(*cur));
-
-        if (BITS_PER_LONG == 32) {
-            le32_to_cpus((uint32_t *)cur);
-        } else {
-            le64_to_cpus((uint64_t *)cur);
+    serialization_chunk(hb, start, count, &pos, &el_count);
+
+    while (el_count) {
+        size_t n = hb_words_span(hb, pos, el_count);
+        unsigned long *cur;
+        size_t i;
+
+        /* Do not expand empty chunks just to store zeroes in them */
+        if (!hb->chunks ||
+            hb->chunks[pos >> HB_CHUNK_SHIFT].type != HB_CHUNK_EMPTY ||
+            !buffer_is_zero(buf, n * sizeof(unsigned long))) {
+            cur = hb_words(hb, HBITMAP_LEVELS - 1, pos);
+            memcpy(cur, buf, n * sizeof(unsigned long));
+
+            for (i = 0; HOST_BIG_ENDIAN && i < n; i++) {
+                if (BITS_PER_LONG == 32) {
+                    le32_to_cpus((uint32_t *)&cur[i]);
+                } else {
+                    le64_to_cpus((uint64_t *)&cur[i]);
+                }
+            }
         }
 
-        buf += sizeof(unsigned long);
-        cur++;
+        buf += n * sizeof(unsigned long);
+        pos += n;
+        el_count -= n;
     }
     if (finish) {
         hbitmap_deserialize_finish(hb);
     }
 }
 
-void hbitmap_deserialize_zeroes(HBitmap *hb, uint64_t start, uint64_t count,
-                                bool finish)
+static void hb_deserialize_fill(HBitmap *hb, uint64_t start, uint64_t count,
+                                HBitmapChunkType type)
 {
     uint64_t el_count;
-    unsigned long *first;
+    uint64_t pos;
 
+    serialization_chunk(hb, start, count, &pos, &el_count);
+
+    while (el_count) {
+        size_t n = hb_words_span(hb, pos, el_count);
+        uint64_t chunk = pos >> HB_CHUNK_SHIFT;
+
+        if (hb->chunks && hb->chunks[chunk].type == type) {
+            /* nothing to do */
+        } else if (hb->chunks && n == HB_CHUNK_WORDS &&
+                   (type == HB_CHUNK_EMPTY || hb_chunk_can_fill(hb, chunk))) {
+            hb_chunk_clear(hb, &hb->chunks[chunk], type);
+        } else {
+            memset(hb_words(hb, HBITMAP_LEVELS - 1, pos),
+                   type == HB_CHUNK_FULL ? 0xff : 0,
+                   n * sizeof(unsigned long));
+        }
+
+        pos += n;
+        el_count -= n;
+    }
+}
+
+void hbitmap_deserialize_zeroes(HBitmap *hb, uint64_t start, uint64_t count,
+                                bool finish)
+{
     if (!count) {
         return;
     }
-    serialization_chunk(hb, start, count, &first, &el_count);
-
-    memset(first, 0, el_count * sizeof(unsigned long));
+    hb_deserialize_fill(hb, start, count, HB_CHUNK_EMPTY);
     if (finish) {
         hbitmap_deserialize_finish(hb);
     }
@@ -742,15 +1266,10 @@ void hbitmap_deserialize_zeroes(HBitmap *hb, uint64_t start, uint64_t count,
 void hbitmap_deserialize_ones(HBitmap *hb, uint64_t start, uint64_t count,
                               bool finish)
 {
-    uint64_t el_count;
-    unsigned long *first;
-
     if (!count) {
         return;
     }
-    serialization_chunk(hb, start, count, &first, &el_count);
-
-    memset(first, 0xff, el_count * sizeof(unsigned long));
+    hb_deserialize_fill(hb, start, count, HB_CHUNK_FULL);
     if (finish) {
         hbitmap_deserialize_finish(hb);
     }
@@ -770,7 +1289,7 @@ void hbitmap_deserialize_finish(HBitmap *bitmap)
         memset(bitmap->levels[lev], 0, size * sizeof(unsigned long));
 
         for (i = 0; i < prev_size; ++i) {
-            if (bitmap->levels[lev + 1][i]) {
+            if (hb_word(bitmap, lev + 1, i)) {
                 bitmap->levels[lev][i >> BITS_PER_LEVEL] |=
                     1UL << (i & (BITS_PER_LONG - 1));
             }
@@ -779,6 +1298,93 @@ void hbitmap_deserialize_finish(HBitmap *bitmap)
 
     bitmap->levels[0][0] |= 1UL << (BITS_PER_LONG - 1);
     bitmap->count = hb_count_between(bitmap, 0, bitmap->size - 1);
+
+    if (bitmap->chunks) {
+        hb_compact(bitmap);
+    }
+}
+
+/* Resize the chunk array after a change of sizes[HBITMAP_LEVELS - 1] */
+static void hb_truncate_chunks(HBitmap *hb)
+{
+    uint64_t nr_chunks = DIV_ROUND_UP(hb->sizes[HBITMAP_LEVELS - 1],
+                                      HB_CHUNK_WORDS);
+    uint64_t i;
+
+    for (i = nr_chunks; i < hb->nr_chunks; i++) {
+        hb_chunk_clear(hb, &hb->chunks[i], HB_CHUNK_EMPTY);
+    }
+    hb->chunks = g_renew(HBitmapChunk, hb->chunks, nr_chunks);
+    for (i = hb->nr_chunks; i < nr_chunks; i++) {
+        hb->chunks[i] = (HBitmapChunk) { .type = HB_CHUNK_EMPTY };
+    }
+    hb->nr_chunks = nr_chunks;
+}
+
+void hbitmap_set_compressed(HBitmap *hb, bool compressed)
+{
+    uint64_t words = hb->sizes[HBITMAP_LEVELS - 1];
+    uint64_t i;
+
+    if (compressed == !!hb->chunks) {
+        return;
+    }
+
+    if (compressed) {
+        unsigned long *lev = hb->levels[HBITMAP_LEVELS - 1];
+
+        hb->nr_chunks = DIV_ROUND_UP(words, HB_CHUNK_WORDS);
+        hb->chunks = g_new0(HBitmapChunk, hb->nr_chunks);
+        for (i = 0; i < hb->nr_chunks; i++) {
+            uint64_t pos = i * HB_CHUNK_WORDS;
+            uint64_t n = MIN(HB_CHUNK_WORDS, words - pos);
+            unsigned long *chunk_words = hb_chunk_dense(hb, &hb->chunks[i]);
+
+            memcpy(chunk_words, lev + pos, n * sizeof(unsigned long));
+            hb_chunk_compact(hb, i);
+        }
+        hb->compact_threshold = MAX(hb->dense_chunks * 2,
+                                    HB_COMPACT_MIN_DENSE);
+        g_free(lev);
+        hb->levels[HBITMAP_LEVELS - 1] = NULL;
+    } else {
+        unsigned long *lev = g_new(unsigned long, words);
+
+        for (i = 0; i < hb->nr_chunks; i++) {
+            uint64_t pos = i * HB_CHUNK_WORDS;
+
+            hb_chunk_read(&hb->chunks[i], lev + pos,
+                          MIN(HB_CHUNK_WORDS, words - pos));
+            hb_chunk_clear(hb, &hb->chunks[i], HB_CHUNK_EMPTY);
+        }
+        g_clear_pointer(&hb->chunks, g_free);
+        hb->nr_chunks = 0;
+        hb->levels[HBITMAP_LEVELS - 1] = lev;
+    }
+}
+
+bool hbitmap_is_compressed(const HBitmap *hb)
+{
+    return hb->chunks != NULL;
+}
+
+uint64_t hbitmap_memory_usage(const HBitmap *hb)
+{
+    uint64_t bytes = sizeof(*hb);
+    uint64_t i;
+
+    for (i = 0; i < HBITMAP_LEVELS; i++) {
+        if (hb->levels[i]) {
+            bytes += hb->sizes[i] * sizeof(unsigned long);
+        }
+    }
+
+    bytes += hb->nr_chunks * sizeof(HBitmapChunk);
+    bytes += hb->dense_chunks * HB_CHUNK_WORDS * sizeof(unsigned long);
+    for (i = 0; i < hb->nr_chunks; i++) {
+        bytes += hb->chunks[i].nr_runs * 2 * sizeof(uint16_t);
+    }
+    return bytes;
 }
 
 void hbitmap_free(HBitmap *hb)
@@ -788,6 +1394,10 @@ void hbitmap_free(HBitmap *hb)
     for (i = HBITMAP_LEVELS; i-- > 0; ) {
         g_free(hb->levels[i]);
     }
+    for (i = 0; i < hb->nr_chunks; i++) {
+        hb_chunk_clear(hb, &hb->chunks[i], HB_CHUNK_EMPTY);
+    }
+    g_free(hb->chunks);
     g_free(hb);
 }
 
@@ -862,6 +1472,10 @@ void hbitmap_truncate(HBitmap *hb, uint64_t size)
         }
         old = hb->sizes[i];
         hb->sizes[i] = size;
+        if (!hb->levels[i]) {
+            hb_truncate_chunks(hb);
+            continue;
+        }
         hb->levels[i] = g_renew(unsigned long, hb->levels[i], size);
         if (!shrink) {
             memset(&hb->levels[i][old], 0x00,
@@ -892,6 +1506,58 @@ static void hbitmap_sparse_merge(HBitmap *dst, const HBitmap *src)
     }
 }
 
+/* Merge the last levels of @a and @b into @result, one chunk at a time,
+ * and return the number of bits set in @result.
+ */
+static uint64_t hb_merge_last(const HBitmap *a, const HBitmap *b,
+                              HBitmap *result)
+{
+    uint64_t words = result->sizes[HBITMAP_LEVELS - 1];
+    unsigned tail = result->size & (BITS_PER_LONG - 1);
+    uint64_t count = 0;
+    uint64_t pos;
+
+    for (pos = 0; pos < words; pos += HB_CHUNK_WORDS) {
+        size_t n = MIN(HB_CHUNK_WORDS, words - pos);
+        uint64_t chunk = pos >> HB_CHUNK_SHIFT;
+        HBitmapChunkType ta = a->chunks ? a->chunks[chunk].type : HB_CHUNK_DENSE;
+        HBitmapChunkType tb = b->chunks ? b->chunks[chunk].type : HB_CHUNK_DENSE;
+        const unsigned long *pa, *pb;
+        unsigned long *dst;
+        size_t i;
+
+        if (result->chunks && (ta == HB_CHUNK_FULL || tb == HB_CHUNK_FULL)) {
+            hb_chunk_clear(result, &result->chunks[chunk], HB_CHUNK_FULL);
+            count += HB_CHUNK_BITS;
+            continue;
+        }
+        if (result->chunks && ta == HB_CHUNK_EMPTY && tb == HB_CHUNK_EMPTY) {
+            hb_chunk_clear(result, &result->chunks[chunk], HB_CHUNK_EMPTY);
+            continue;
+        }
+
+        /* Expand the destination first, in case it is also a source */
+        dst = hb_words(result, HBITMAP_LEVELS - 1, pos);
+        pa = hb_chunk_words(a, pos);
+        pb = hb_chunk_words(b, pos);
+        if (pa && pb) {
+            count += hb_accel->merge(dst, pa, pb, n);
+            continue;
+        }
+        for (i = 0; i < n; i++) {
+            dst[i] = hb_word(a, HBITMAP_LEVELS - 1, pos + i) |
+                     hb_word(b, HBITMAP_LEVELS - 1, pos + i);
+            count += ctpopl(dst[i]);
+        }
+    }
+
+    /* Do not count the bits past the end of the bitmap, if any */
+    if (tail) {
+        count -= ctpopl(hb_word(result, HBITMAP_LEVELS - 1, words - 1) >> tail);
+    }
+    return count;
+}
+
 /**
  * Given HBitmaps A and B, let R := A (BITOR) B.
  * Bitmaps A and B will not be modified,
@@ -901,7 +1567,6 @@ static void hbitmap_sparse_merge(HBitmap *dst, const HBitmap *src)
 void hbitmap_merge(const HBitmap *a, const HBitmap *b, HBitmap *result)
 {
     int i;
-    uint64_t j;
 
     assert(a->orig_size == result->orig_size);
     assert(b->orig_size == result->orig_size);
@@ -932,16 +1597,45 @@ void hbitmap_merge(const HBitmap *a, const HBitmap *b, HBitmap *result)
     /* This merge is O(size), as BITS_PER_LONG and HBITMAP_LEVELS are constant.
      * It may be possible to improve running times for sparsely populated maps
      * by using hbitmap_iter_next, but this is suboptimal for dense maps.
+     * The dirty count is recomputed in the same pass over the last level.
      */
     assert(a->size == b->size);
-    for (i = HBITMAP_LEVELS - 1; i >= 0; i--) {
-        for (j = 0; j < a->sizes[i]; j++) {
-            result->levels[i][j] = a->levels[i][j] | b->levels[i][j];
+    result->count = hb_merge_last(a, b, result);
+    for (i = HBITMAP_LEVELS - 2; i >= 0; i--) {
+        hb_accel->merge(result->levels[i], a->levels[i], b->levels[i],
+                        a->sizes[i]);
+    }
+    hb_maybe_compact(result);
+}
+
+/* Hash a compressed bitmap as if it was not */
+static char *hb_chunks_sha256(const HBitmap *bitmap, Error **errp)
+{
+    g_autoptr(QCryptoHash) hash = qcrypto_hash_new(QCRYPTO_HASH_ALGO_SHA256,
+                                                   errp);
+    g_autofree unsigned long *buf = g_new(unsigned long, HB_CHUNK_WORDS);
+    uint64_t words = bitmap->sizes[HBITMAP_LEVELS - 1];
+    char *digest = NULL;
+    uint64_t i;
+
+    if (!hash) {
+        return NULL;
+    }
+
+    for (i = 0; i < bitmap->nr_chunks; i++) {
+        size_t n = MIN(HB_CHUNK_WORDS, words - i * HB_CHUNK_WORDS);
+
+        hb_chunk_read(&bitmap->chunks[i], buf, n);
+        if (qcrypto_hash_update(hash, (char *)buf,
+                                n * sizeof(unsigned long), errp) < 0) {
+            return NULL;
         }
     }
 
-    /* Recompute the dirty count */
-    result->count = hb_count_between(result, 0, result->size - 1);
+    if (qcrypto_hash_finalize_digest(hash, &digest, errp) < 0) {
+        return NULL;
+    }
+    return digest;
 }
 
 char *hbitmap_sha256(const HBitmap *bitmap, Error **errp)
@@ -949,6 +1643,10 @@ char *hbitmap_sha256(const HBitmap *bitmap, Error **errp)
     size_t size = bitmap->sizes[HBITMAP_LEVELS - 1] * sizeof(unsigned long);
     char *data = (char *)bitmap->levels[HBITMAP_LEVELS - 1];
     char *hash = NULL;
+
+    if (bitmap->chunks) {
+        return hb_chunks_sha256(bitmap, errp);
+    }
     qcrypto_hash_digest(QCRYPTO_HASH_ALGO_SHA256, data, size, &hash, errp);
 
     return hash;
@@ -16,16 +16,29 @@
  */
 #include "qemu/osdep.h"
 #include "qemu/defer-call.h"
+#include "qemu/host-utils.h"
 #include "qemu/queue.h"
+#include "qemu/stats64.h"
 #include "qemu/thread.h"
+#include "qemu/timer.h"
 #include "qemu/coroutine.h"
 #include "trace.h"
 #include "block/thread-pool.h"
 #include "qemu/main-loop.h"
 
+/*
+ * Requests are spread over several queues, each with its own lock, so
+ * that the worker threads do not all contend on a single lock.  Each
+ * worker takes requests from its own queue first and steals them from
+ * the other queues when its queue is empty.
+ */
+#define THREAD_POOL_MAX_QUEUES          8
+#define THREAD_POOL_THREADS_PER_QUEUE   8
+
 static void do_spawn_thread(ThreadPoolAio *pool);
 
 typedef struct ThreadPoolElementAio ThreadPoolElementAio;
+typedef struct ThreadPoolQueue ThreadPoolQueue;
 
 enum ThreadState {
     THREAD_QUEUED,
@@ -39,61 +52,232 @@ struct ThreadPoolElementAio {
     ThreadPoolFunc *func;
     void *arg;
 
-    /* Moving state out of THREAD_QUEUED is protected by lock.  After
-     * that, only the worker thread can write to it.  Reads and writes
-     * of state and ret are ordered with memory barriers.
+    /* Queue the request was submitted to, and when.  */
+    ThreadPoolQueue *queue;
+    int64_t submit_ns;
+
+    /* Moving state out of THREAD_QUEUED is protected by queue->lock.
+     * After that, only the worker thread can write to it.  Reads and
+     * writes of state and ret are ordered with memory barriers.
      */
     enum ThreadState state;
     int ret;
 
-    /* Access to this list is protected by lock.  */
+    /* Access to this list is protected by queue->lock.  */
     QTAILQ_ENTRY(ThreadPoolElementAio) reqs;
 
     /* This list is only written by the thread pool's mother thread.  */
     QLIST_ENTRY(ThreadPoolElementAio) all;
 };
 
+struct ThreadPoolQueue {
+    QemuMutex lock;
+    QemuCond request_cond;
+
+    /* The following variables are protected by lock.  */
+    QTAILQ_HEAD(, ThreadPoolElementAio) request_list;
+    int idle_threads;   /* also read without the lock by the submitter */
+
+    /* Statistics of the worker threads whose home is this queue */
+    Stat64 requests;
+    Stat64 steals;
+    Stat64 queue_ns[THREAD_POOL_LATENCY_BUCKETS];
+    Stat64 run_ns[THREAD_POOL_LATENCY_BUCKETS];
+} QEMU_ALIGNED(64);
+
 struct ThreadPoolAio {
     AioContext *ctx;
     QEMUBH *completion_bh;
     QemuMutex lock;
     QemuCond worker_stopped;
-    QemuCond request_cond;
     QEMUBH *new_thread_bh;
 
     /* The following variables are only accessed from one AioContext. */
     QLIST_HEAD(, ThreadPoolElementAio) head;
+    unsigned next_queue; /* next queue for submission */
 
-    /* The following variables are protected by lock.  */
-    QTAILQ_HEAD(, ThreadPoolElementAio) request_list;
+    /* Number of requests in all queues, changed under the queue locks. */
+    int queued;
+
+    /* The following variables are protected by lock.  cur_threads and
+     * max_threads are also read by the worker threads without the lock.
+     */
     int cur_threads;
-    int idle_threads;
     int new_threads;     /* backlog of threads we need to create */
     int pending_threads; /* threads created but not running yet */
     int min_threads;
     int max_threads;
+    unsigned next_home;  /* home queue of the next worker thread */
+
+    /*
+     * Queues that new requests are submitted to, recomputed with lock
+     * taken when max_threads changes.  Requests may still be queued in
+     * and workers may still wait on the first used_queues queues, which
+     * never shrinks.  Both are also read without the lock.
+     */
+    int num_queues;
+    int used_queues;
+    ThreadPoolQueue queues[THREAD_POOL_MAX_QUEUES];
 };
 
+static void thread_pool_account(Stat64 *hist, int64_t ns)
+{
+    int bucket = ns > 0 ? 64 - clz64(ns) : 0;
+
+    stat64_add(&hist[MIN(bucket, THREAD_POOL_LATENCY_BUCKETS - 1)], 1);
+}
+
+static bool thread_pool_too_many_threads(ThreadPoolAio *pool)
+{
+    return qatomic_read(&pool->cur_threads) > qatomic_read(&pool->max_threads);
+}
+
+/*
+ * Decide whether the calling worker thread exits, because there are more
+ * threads than max_threads or because it timed out and there are more
+ * than min_threads.  Runs with lock taken; if it returns true, the
+ * worker must not access the pool after releasing the lock.
+ */
+static bool thread_pool_worker_exit(ThreadPoolAio *pool, ThreadPoolQueue *home,
+                                    bool timed_out)
+{
+    if (pool->cur_threads <= pool->max_threads &&
+        (!timed_out || pool->cur_threads <= pool->min_threads)) {
+        return false;
+    }
+
+    qatomic_set(&pool->cur_threads, pool->cur_threads - 1);
+
+    /*
+     * Write cur_threads before reading queued.  A request submitted after
+     * the worker last looked at the queues either shows up here, or its
+     * submitter finds cur_threads below max_threads and spawns a thread;
+     * it checks cur_threads with the lock taken, too.
+     */
+    smp_mb();
+    if (timed_out && qatomic_read(&pool->queued)) {
+        qatomic_set(&pool->cur_threads, pool->cur_threads + 1);
+        return false;
+    }
+
+    qemu_cond_signal(&pool->worker_stopped);
+
+    /*
+     * Wake up another thread, in case we got a wakeup but decided
+     * to exit due to pool->cur_threads > pool->max_threads.
+     */
+    WITH_QEMU_LOCK_GUARD(&home->lock) {
+        qemu_cond_signal(&home->request_cond);
+    }
+    return true;
+}
+
+/* Wake up all worker threads, e.g. so that they check whether to exit. */
+static void thread_pool_kick_all(ThreadPoolAio *pool)
+{
+    for (int i = 0; i < qatomic_read(&pool->used_queues); i++) {
+        ThreadPoolQueue *q = &pool->queues[i];
+
+        WITH_QEMU_LOCK_GUARD(&q->lock) {
+            qemu_cond_broadcast(&q->request_cond);
+        }
+    }
+}
+
+/*
+ * Take the first request of @home, or else steal one from the other
+ * queues.
+ */
+static ThreadPoolElementAio *thread_pool_get_request(ThreadPoolAio *pool,
+                                                     ThreadPoolQueue *home)
+{
+    int first = home - pool->queues;
+    int n = qatomic_read(&pool->used_queues);
+
+    for (int i = 0; i < n; i++) {
+        ThreadPoolQueue *q = &pool->queues[(first + i) % n];
+        ThreadPoolElementAio *req;
+
+        WITH_QEMU_LOCK_GUARD(&q->lock) {
+            req = QTAILQ_FIRST(&q->request_list);
+            if (req) {
+                QTAILQ_REMOVE(&q->request_list, req, reqs);
+                req->state = THREAD_ACTIVE;
+                qatomic_dec(&pool->queued);
+            }
+        }
+
+        if (req) {
+            if (q != home) {
+                stat64_add(&home->steals, 1);
+            }
+            return req;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Wait for requests on @home after finding all queues empty.  Returns
+ * true if the worker thread should exit because it stayed idle.
+ */
+static bool thread_pool_worker_wait(ThreadPoolAio *pool, ThreadPoolQueue *home)
+{
+    bool timed_out = false;
+
+    qemu_mutex_lock(&home->lock);
+    qatomic_set(&home->idle_threads, home->idle_threads + 1);
+
+    /*
+     * Write idle_threads before reading queued; pairs with the
+     * qatomic_inc() in thread_pool_submit_aio(), so that either this
+     * thread sees the request or the submitter sees this thread idle.
+     */
+    smp_mb();
+    if (!qatomic_read(&pool->queued) && !thread_pool_too_many_threads(pool)) {
+        timed_out = !qemu_cond_timedwait(&home->request_cond, &home->lock,
+                                         10000);
+    }
+
+    qatomic_set(&home->idle_threads, home->idle_threads - 1);
+    qemu_mutex_unlock(&home->lock);
+
+    if (timed_out && !qatomic_read(&pool->queued)) {
+        /* Timed out + no work to do + no need for warm threads = exit.  */
+        QEMU_LOCK_GUARD(&pool->lock);
+        return thread_pool_worker_exit(pool, home, true);
+    }
+
+    return false;
+}
+
 static void *worker_thread(void *opaque)
 {
     ThreadPoolAio *pool = opaque;
+    ThreadPoolQueue *home;
 
     qemu_mutex_lock(&pool->lock);
     pool->pending_threads--;
+    home = &pool->queues[pool->next_home++ % pool->num_queues];
     do_spawn_thread(pool);
+    qemu_mutex_unlock(&pool->lock);
 
-    while (pool->cur_threads <= pool->max_threads) {
+    for (;;) {
         ThreadPoolElementAio *req;
+        int64_t start;
         int ret;
 
-        if (QTAILQ_EMPTY(&pool->request_list)) {
-            pool->idle_threads++;
-            ret = qemu_cond_timedwait(&pool->request_cond, &pool->lock, 10000);
-            pool->idle_threads--;
-            if (ret == 0 &&
-                QTAILQ_EMPTY(&pool->request_list) &&
-                pool->cur_threads > pool->min_threads) {
-                /* Timed out + no work to do + no need for warm threads = exit.  */
+        if (thread_pool_too_many_threads(pool)) {
+            QEMU_LOCK_GUARD(&pool->lock);
+            if (thread_pool_worker_exit(pool, home, false)) {
+                break;
+            }
+        }
+
+        req = thread_pool_get_request(pool, home);
+        if (!req) {
+            if (thread_pool_worker_wait(pool, home)) {
                 break;
             }
             /*
@@ -103,37 +287,29 @@ static void *worker_thread(void *opaque)
             continue;
         }
 
-        req = QTAILQ_FIRST(&pool->request_list);
-        QTAILQ_REMOVE(&pool->request_list, req, reqs);
-        req->state = THREAD_ACTIVE;
-        qemu_mutex_unlock(&pool->lock);
+        start = get_clock();
+        thread_pool_account(home->queue_ns, start - req->submit_ns);
 
         ret = req->func(req->arg);
 
+        thread_pool_account(home->run_ns, get_clock() - start);
+        stat64_add(&home->requests, 1);
+
         req->ret = ret;
         /* Write ret before state.  */
         smp_wmb();
         req->state = THREAD_DONE;
 
         qemu_bh_schedule(pool->completion_bh);
-        qemu_mutex_lock(&pool->lock);
     }
 
-    pool->cur_threads--;
-    qemu_cond_signal(&pool->worker_stopped);
-
-    /*
-     * Wake up another thread, in case we got a wakeup but decided
-     * to exit due to pool->cur_threads > pool->max_threads.
-     */
-    qemu_cond_signal(&pool->request_cond);
-    qemu_mutex_unlock(&pool->lock);
     return NULL;
 }
 
 static void do_spawn_thread(ThreadPoolAio *pool)
 {
     QemuThread t;
+    AioContext *ctx = pool->ctx;
 
     /* Runs with lock taken.  */
     if (!pool->new_threads) {
@@ -143,7 +319,19 @@ static void do_spawn_thread(ThreadPoolAio *pool)
     pool->new_threads--;
     pool->pending_threads++;
 
-    qemu_thread_create(&t, "worker", worker_thread, pool, QEMU_THREAD_DETACHED);
+    if (ctx->thread_create) {
+        /*
+         * This can wait for another thread, e.g. a thread context that
+         * gives the new thread its CPU affinity; don't hold the lock.
+         */
+        qemu_mutex_unlock(&pool->lock);
+        ctx->thread_create(ctx->thread_create_opaque, &t, "worker",
+                           worker_thread, pool, QEMU_THREAD_DETACHED);
+        qemu_mutex_lock(&pool->lock);
+    } else {
+        qemu_thread_create(&t, "worker", worker_thread, pool,
+                           QEMU_THREAD_DETACHED);
+    }
 }
 
 static void spawn_thread_bh_fn(void *opaque)
@@ -157,7 +345,7 @@ static void spawn_thread_bh_fn(void *opaque)
 
 static void spawn_thread(ThreadPoolAio *pool)
 {
-    pool->cur_threads++;
+    qatomic_set(&pool->cur_threads, pool->cur_threads + 1);
     pool->new_threads++;
     /* If there are threads being created, they will spawn new workers, so
      * we don't spend time creating many threads in a loop holding a mutex or
@@ -222,9 +410,10 @@ static void thread_pool_cancel(BlockAIOCB *acb)
 
     trace_thread_pool_cancel_aio(elem, elem->common.opaque);
 
-    QEMU_LOCK_GUARD(&pool->lock);
+    QEMU_LOCK_GUARD(&elem->queue->lock);
     if (elem->state == THREAD_QUEUED) {
-        QTAILQ_REMOVE(&pool->request_list, elem, reqs);
+        QTAILQ_REMOVE(&elem->queue->request_list, elem, reqs);
+        qatomic_dec(&pool->queued);
         qemu_bh_schedule(pool->completion_bh);
 
         elem->state = THREAD_DONE;
@@ -238,12 +427,52 @@ static const AIOCBInfo thread_pool_aiocb_info = {
     .cancel_async       = thread_pool_cancel,
 };
 
+/*
+ * Pick the queue for a new request: one with idle worker threads if
+ * possible, otherwise the next one in round robin order.
+ */
+static ThreadPoolQueue *thread_pool_pick_queue(ThreadPoolAio *pool)
+{
+    int num_queues = qatomic_read(&pool->num_queues);
+
+    for (int i = 0; i < num_queues; i++) {
+        unsigned n = pool->next_queue + i;
+        ThreadPoolQueue *q = &pool->queues[n % num_queues];
+
+        if (qatomic_read(&q->idle_threads)) {
+            pool->next_queue = n + 1;
+            return q;
+        }
+    }
+
+    return &pool->queues[pool->next_queue++ % num_queues];
+}
+
+/* Wake up an idle worker thread of any queue.  Returns false if none.  */
+static bool thread_pool_wake_idle(ThreadPoolAio *pool)
+{
+    for (int i = 0; i < qatomic_read(&pool->used_queues); i++) {
+        ThreadPoolQueue *q = &pool->queues[i];
+
+        if (qatomic_read(&q->idle_threads)) {
+            WITH_QEMU_LOCK_GUARD(&q->lock) {
+                qemu_cond_signal(&q->request_cond);
+            }
+            return true;
+        }
+    }
+
+    return false;
+}
+
 BlockAIOCB *thread_pool_submit_aio(ThreadPoolFunc *func, void *arg,
                                    BlockCompletionFunc *cb, void *opaque)
 {
     ThreadPoolElementAio *req;
     AioContext *ctx = qemu_get_current_aio_context();
     ThreadPoolAio *pool = aio_get_thread_pool(ctx);
+    ThreadPoolQueue *q;
+    bool idle;
 
     /* Assert that the thread submitting work is the same running the pool */
     assert(pool->ctx == qemu_get_current_aio_context());
@@ -253,18 +482,36 @@ BlockAIOCB *thread_pool_submit_aio(ThreadPoolFunc *func, void *arg,
     req->arg = arg;
     req->state = THREAD_QUEUED;
     req->pool = pool;
+    req->submit_ns = get_clock();
 
     QLIST_INSERT_HEAD(&pool->head, req, all);
 
     trace_thread_pool_submit_aio(pool, req, arg);
 
-    qemu_mutex_lock(&pool->lock);
-    if (pool->idle_threads == 0 && pool->cur_threads < pool->max_threads) {
-        spawn_thread(pool);
+    q = thread_pool_pick_queue(pool);
+    req->queue = q;
+
+    qemu_mutex_lock(&q->lock);
+    QTAILQ_INSERT_TAIL(&q->request_list, req, reqs);
+    /* Pairs with smp_mb() in thread_pool_worker_wait().  */
+    qatomic_inc(&pool->queued);
+    idle = q->idle_threads;
+    qemu_mutex_unlock(&q->lock);
+
+    if (idle) {
+        qemu_cond_signal(&q->request_cond);
+    } else if (!thread_pool_wake_idle(pool)) {
+        /*
+         * Decide with the lock taken, after incrementing queued, so that
+         * this cannot race with thread_pool_worker_exit(): either a worker
+         * that is about to exit sees the request, or we see it gone.
+         */
+        WITH_QEMU_LOCK_GUARD(&pool->lock) {
+            if (pool->cur_threads < pool->max_threads) {
+                spawn_thread(pool);
+            }
+        }
     }
-    QTAILQ_INSERT_TAIL(&pool->request_list, req, reqs);
-    qemu_mutex_unlock(&pool->lock);
-    qemu_cond_signal(&pool->request_cond);
     return &req->common;
 }
 
@@ -295,7 +542,19 @@ void thread_pool_update_params(ThreadPoolAio *pool, AioContext *ctx)
     qemu_mutex_lock(&pool->lock);
 
     pool->min_threads = ctx->thread_pool_min;
-    pool->max_threads = ctx->thread_pool_max;
+    qatomic_set(&pool->max_threads, ctx->thread_pool_max);
+
+    /*
+     * All queues are initialized, so this only changes where new requests
+     * and new worker threads go; the home queue of existing workers stays
+     * in the used queues, which requests are still taken from.
+     */
+    qatomic_set(&pool->num_queues,
+                MIN(DIV_ROUND_UP(pool->max_threads,
+                                 THREAD_POOL_THREADS_PER_QUEUE),
+                    THREAD_POOL_MAX_QUEUES));
+    qatomic_set(&pool->used_queues,
+                MAX(pool->used_queues, pool->num_queues));
 
     /*
      * We either have to:
@@ -310,8 +569,8 @@ void thread_pool_update_params(ThreadPoolAio *pool, AioContext *ctx)
         spawn_thread(pool);
     }
 
-    for (int i = pool->cur_threads; i > pool->max_threads; i--) {
-        qemu_cond_signal(&pool->request_cond);
+    if (pool->cur_threads > pool->max_threads) {
+        thread_pool_kick_all(pool);
     }
 
     qemu_mutex_unlock(&pool->lock);
@@ -328,18 +587,25 @@ static void thread_pool_init_one(ThreadPoolAio *pool, AioContext *ctx)
     pool->completion_bh = aio_bh_new(ctx, thread_pool_completion_bh, pool);
     qemu_mutex_init(&pool->lock);
     qemu_cond_init(&pool->worker_stopped);
-    qemu_cond_init(&pool->request_cond);
     pool->new_thread_bh = aio_bh_new(ctx, spawn_thread_bh_fn, pool);
 
     QLIST_INIT(&pool->head);
-    QTAILQ_INIT(&pool->request_list);
+
+    for (int i = 0; i < THREAD_POOL_MAX_QUEUES; i++) {
+        ThreadPoolQueue *q = &pool->queues[i];
+
+        qemu_mutex_init(&q->lock);
+        qemu_cond_init(&q->request_cond);
+        QTAILQ_INIT(&q->request_list);
+    }
 
     thread_pool_update_params(pool, ctx);
 }
 
 ThreadPoolAio *thread_pool_new_aio(AioContext *ctx)
 {
-    ThreadPoolAio *pool = g_new(ThreadPoolAio, 1);
+    ThreadPoolAio *pool = qemu_memalign(__alignof__(ThreadPoolAio),
+                                        sizeof(ThreadPoolAio));
     thread_pool_init_one(pool, ctx);
     return pool;
 }
@@ -356,12 +622,12 @@ void thread_pool_free_aio(ThreadPoolAio *pool)
 
     /* Stop new threads from spawning */
     qemu_bh_delete(pool->new_thread_bh);
-    pool->cur_threads -= pool->new_threads;
+    qatomic_set(&pool->cur_threads, pool->cur_threads - pool->new_threads);
     pool->new_threads = 0;
 
     /* Wait for worker threads to terminate */
-    pool->max_threads = 0;
-    qemu_cond_broadcast(&pool->request_cond);
+    qatomic_set(&pool->max_threads, 0);
+    thread_pool_kick_all(pool);
     while (pool->cur_threads > 0) {
         qemu_cond_wait(&pool->worker_stopped, &pool->lock);
     }
@@ -369,10 +635,32 @@ void thread_pool_free_aio(ThreadPoolAio *pool)
     qemu_mutex_unlock(&pool->lock);
 
     qemu_bh_delete(pool->completion_bh);
-    qemu_cond_destroy(&pool->request_cond);
+    for (int i = 0; i < THREAD_POOL_MAX_QUEUES; i++) {
+        ThreadPoolQueue *q = &pool->queues[i];
+
+        assert(QTAILQ_EMPTY(&q->request_list));
+        qemu_cond_destroy(&q->request_cond);
+        qemu_mutex_destroy(&q->lock);
+    }
     qemu_cond_destroy(&pool->worker_stopped);
     qemu_mutex_destroy(&pool->lock);
-    g_free(pool);
+    qemu_vfree(pool);
+}
+
+void thread_pool_get_stats(ThreadPoolAio *pool, ThreadPoolStats *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+
+    for (int i = 0; i < qatomic_read(&pool->used_queues); i++) {
+        ThreadPoolQueue *q = &pool->queues[i];
+
+        stats->requests += stat64_get(&q->requests);
+        stats->steals += stat64_get(&q->steals);
+        for (int j = 0; j < THREAD_POOL_LATENCY_BUCKETS; j++) {
+            stats->queue_ns[j] += stat64_get(&q->queue_ns[j]);
+            stats->run_ns[j] += stat64_get(&q->run_ns[j]);
+        }
+    }
 }
 
 struct ThreadPool {